@@ -0,0 +1,248 @@
+#include "NDSession.hpp"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A burst of clients connecting to one server at once. The server keeps a
+// backlog of connectors with their QPs ready, accepts every client
+// concurrently and serves all of them from one CQ and one shared receive
+// queue of fixed depth, refilled at low water however many clients there are;
+// each client then sends a few messages that the server attributes to its
+// connection. Clients run as threads of this process unless -s and -c
+// split the two sides into separate processes.
+
+constexpr char TEST_PORT[] = "54325";
+constexpr ULONG MESSAGE_SIZE = 64;
+constexpr ULONG MESSAGES_PER_CLIENT = 8;
+constexpr ULONG DEFAULT_CLIENTS = 32;
+constexpr ULONG DEFAULT_BACKLOG = 16;
+constexpr ULONG SRQ_DEPTH = 64;
+constexpr ULONG SRQ_LOW_WATER = SRQ_DEPTH / 4;
+
+void ShowUsage() {
+    printf("accept_burst [options] [local_ip]\n"
+           "Options:\n"
+           "\t-n <clients>  - Clients in the burst (default: %u)\n"
+           "\t-b <backlog>  - Connectors kept waiting by the server (default: %u)\n"
+           "\t-s            - Run only the server\n"
+           "\t-c            - Run only the clients\n"
+           "Without -s or -c both sides run in this process (default address 127.0.0.1).\n",
+           DEFAULT_CLIENTS, DEFAULT_BACKLOG);
+}
+
+// Messages carry the client index and their sequence number.
+struct BurstMessage {
+    UINT32 Client;
+    UINT32 Sequence;
+};
+
+// MARK: BurstServer
+class BurstServer : public NDSessionServerBase {
+public:
+    bool Setup(char* localAddr, ULONG clients, ULONG backlog) {
+        if (!Initialize(localAddr)) return false;
+        if (FAILED(CreateCQ(SRQ_DEPTH + 1024))) return false;
+
+        // Receive memory stays the same for any number of clients; senders
+        // that find the queue empty wait for the refill.
+        HRESULT hr = CreateSRQ(SRQ_DEPTH, MESSAGE_SIZE, SRQ_LOW_WATER, [this](const ND2_RESULT& result, const NDBuffer& buffer) {
+            OnMessage(result, buffer);
+        });
+        if (FAILED(hr)) return false;
+        if (FAILED(CreateListener())) return false;
+
+        m_Options.Backlog = backlog;
+        m_Options.InitiatorDepth = 4;
+        // Tells every client how large its messages may be.
+        m_Options.Handshake = MakeHandshake(nullptr, 0, 0, MESSAGES_PER_CLIENT, MESSAGE_SIZE);
+
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%s", localAddr, TEST_PORT);
+        if (FAILED(Listen(fullAddress, m_Options))) return false;
+
+        m_Clients = clients;
+        return true;
+    }
+
+    bool Run() {
+        HRESULT hr = StartAccepting(m_Options, [this](std::unique_ptr<NDConnection> pConnection) {
+            if (m_Connections.empty()) m_FirstAccept = std::chrono::steady_clock::now();
+            pConnection->Context = reinterpret_cast<void*>(static_cast<uintptr_t>(m_Connections.size()));
+            m_Connections.push_back(std::move(pConnection));
+        });
+        if (FAILED(hr)) return false;
+        std::cout << "[server] Accepting with " << m_Options.Backlog << " connectors ready." << std::endl;
+
+        auto start = std::chrono::steady_clock::now();
+        while (m_Connections.size() < m_Clients) DispatchAccepts();
+        auto accepted = std::chrono::steady_clock::now();
+        StopAccepting();
+
+        double burstSeconds = std::chrono::duration<double>(accepted - m_FirstAccept).count();
+        std::cout << "[server] Accepted " << m_Connections.size() << " clients in "
+                  << std::chrono::duration<double, std::milli>(accepted - start).count() << " ms, "
+                  << (burstSeconds > 0 ? (m_Connections.size() - 1) / burstSeconds : 0) << " accepts/s once the burst began."
+                  << std::endl;
+
+        while (m_Received + m_Failed < m_Clients * MESSAGES_PER_CLIENT) DispatchCompletions();
+        std::cout << "[server] Received " << m_Received << "/" << m_Clients * MESSAGES_PER_CLIENT << " messages, "
+                  << m_Misrouted << " attributed to the wrong connection." << std::endl;
+
+        m_Connections.clear();
+        return m_Failed == 0 && m_Misrouted == 0;
+    }
+
+private:
+    // The first message on a connection tells which client it is; every
+    // later one must come from the same client, in order.
+    void OnMessage(const ND2_RESULT& result, const NDBuffer& buffer) {
+        if (FAILED(result.Status) || result.BytesTransferred != sizeof(BurstMessage)) {
+            m_Failed++;
+            return;
+        }
+        NDConnection* pConnection = NDConnection::FromResult(result);
+        BurstMessage message;
+        std::memcpy(&message, buffer.Data, sizeof(message));
+
+        size_t index = reinterpret_cast<uintptr_t>(pConnection->Context);
+        if (m_Seen.size() <= index) m_Seen.resize(index + 1, { UINT32_MAX, 0 });
+        BurstMessage& seen = m_Seen[index];
+        if (seen.Client == UINT32_MAX) seen.Client = message.Client;
+        if (seen.Client != message.Client || seen.Sequence != message.Sequence) m_Misrouted++;
+        seen.Sequence = message.Sequence + 1;
+        m_Received++;
+    }
+
+    ULONG m_Clients = 0;
+    AcceptOptions m_Options;
+    std::vector<std::unique_ptr<NDConnection>> m_Connections;
+    std::vector<BurstMessage> m_Seen;
+    std::chrono::steady_clock::time_point m_FirstAccept;
+    ULONG m_Received = 0;
+    ULONG m_Failed = 0;
+    ULONG m_Misrouted = 0;
+};
+
+// MARK: BurstClient
+class BurstClient : public NDSessionClientBase {
+public:
+    bool Run(char* localAddr, const char* serverAddr, UINT32 index) {
+        if (!Initialize(localAddr)) return false;
+        if (FAILED(CreateCQ(64))) return false;
+        if (FAILED(CreateQP(MESSAGES_PER_CLIENT, 1))) return false;
+        if (FAILED(CreateMR())) return false;
+        if (FAILED(RegisterDataBuffer(MESSAGES_PER_CLIENT * sizeof(BurstMessage), ND_MR_FLAG_ALLOW_LOCAL_WRITE))) return false;
+        if (FAILED(CreateConnector())) return false;
+
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%s", serverAddr, TEST_PORT);
+        NDHandshake server;
+        if (FAILED(Connect(localAddr, fullServerAddress, 0, 0, MakeHandshake(nullptr, 0, 0), &server, 0))) return false;
+        if (FAILED(CompleteConnect())) return false;
+        if (server.MaxMessageSize < sizeof(BurstMessage) || server.ReceiveCredits < MESSAGES_PER_CLIENT) return false;
+
+        ULONG completed = 0;
+        ULONG failed = 0;
+        BurstMessage* pMessages = static_cast<BurstMessage*>(m_Buf);
+        for (UINT32 i = 0; i < MESSAGES_PER_CLIENT; i++) {
+            pMessages[i] = { index, i };
+            ND2_SGE sge = { &pMessages[i], sizeof(BurstMessage), m_pMr->GetLocalToken() };
+            HRESULT hr = Send(&sge, 1, 0, [&completed, &failed](const ND2_RESULT& result) {
+                SUCCEEDED(result.Status) ? completed++ : failed++;
+            });
+            if (FAILED(hr)) return false;
+        }
+        while (completed + failed < MESSAGES_PER_CLIENT) DispatchCompletions();
+
+        Shutdown();
+        return failed == 0;
+    }
+};
+
+static bool RunClients(char* localAddr, ULONG clients) {
+    std::vector<std::thread> threads;
+    std::unique_ptr<bool[]> results(new bool[clients]());
+    for (ULONG i = 0; i < clients; i++) {
+        threads.emplace_back([&, i]() {
+            BurstClient client;
+            results[i] = client.Run(localAddr, localAddr, i);
+        });
+    }
+    ULONG succeeded = 0;
+    for (ULONG i = 0; i < clients; i++) {
+        threads[i].join();
+        if (results[i]) succeeded++;
+    }
+    std::cout << "[client] " << succeeded << "/" << clients << " clients connected and sent." << std::endl;
+    return succeeded == clients;
+}
+
+int main(int argc, char* argv[]) {
+    ULONG clients = DEFAULT_CLIENTS;
+    ULONG backlog = DEFAULT_BACKLOG;
+    bool runServer = true;
+    bool runClients = true;
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = defaultAddr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) {
+            clients = std::stoul(argv[++i]);
+        } else if (arg == "-b" && i + 1 < argc) {
+            backlog = std::stoul(argv[++i]);
+        } else if (arg == "-s") {
+            runClients = false;
+        } else if (arg == "-c") {
+            runServer = false;
+        } else if (arg[0] != '-') {
+            localAddr = argv[i];
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    if (clients == 0 || backlog == 0 || (!runServer && !runClients)) {
+        ShowUsage();
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    bool ok = true;
+    {
+        BurstServer server;
+        if (runServer && !server.Setup(localAddr, clients, backlog)) {
+            std::cerr << "Server setup failed." << std::endl;
+            ok = false;
+        } else if (runServer && runClients) {
+            bool serverOk = false;
+            std::thread serverThread([&]() { serverOk = server.Run(); });
+            bool clientsOk = RunClients(localAddr, clients);
+            serverThread.join();
+            ok = serverOk && clientsOk;
+        } else {
+            ok = runServer ? server.Run() : RunClients(localAddr, clients);
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    std::cout << (ok ? "Accept burst passed." : "Accept burst FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+#include "NDSession.hpp"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Many connections served from a single thread. Every server and client
+// session is attached to one NDEventLoop, and each connection is a pair of
+// coroutines: the client connects and then plays ping-pong, the server accepts
+// and echoes every message back. Every co_await suspends its coroutine and the
+// loop resumes it when its completion arrives, so all the connections make
+// progress at once without a thread or a blocking wait each. Servers and
+// clients share the one thread unless -s and -c split them into separate
+// processes.
+
+constexpr USHORT BASE_PORT = 54400;     // connection i uses BASE_PORT + i
+constexpr ULONG MESSAGE_SIZE = 64;
+constexpr ULONG DEFAULT_CONNECTIONS = 32;
+constexpr ULONG DEFAULT_ROUNDS = 2000;
+constexpr ULONG MAX_CONNECTIONS = 1024;
+
+void ShowUsage() {
+    printf("coroutines [options] [local_ip]\n"
+           "Options:\n"
+           "\t-n <connections>  - Connections driven at once, at most %u (default: %u)\n"
+           "\t-r <rounds>       - Round trips per connection (default: %u)\n"
+           "\t-s                - Run only the servers\n"
+           "\t-c                - Run only the clients\n"
+           "Without -s or -c both sides run in this process (default address 127.0.0.1).\n",
+           MAX_CONNECTIONS, DEFAULT_CONNECTIONS, DEFAULT_ROUNDS);
+}
+
+// MARK: EchoPeer
+// A session with one receive slot and one send slot of MESSAGE_SIZE each.
+template <typename Session>
+class EchoPeer : public Session {
+    public:
+    ULONG Rounds() const { return m_Rounds; }
+
+    protected:
+    bool SetupPeer(char* localAddr) {
+        if (!this->Initialize(localAddr)) return false;
+        if (FAILED(this->CreateCQ(16))) return false;
+        if (FAILED(this->CreateQP(2, 1))) return false;
+        if (FAILED(this->CreateMR())) return false;
+        if (FAILED(this->RegisterDataBuffer(2 * MESSAGE_SIZE, ND_MR_FLAG_ALLOW_LOCAL_WRITE))) return false;
+        if (FAILED(this->CreateConnector())) return false;
+
+        UINT32 token = this->m_pMr->GetLocalToken();
+        m_ReceiveSge = { this->m_Buf, MESSAGE_SIZE, token };
+        m_SendSge = { static_cast<char*>(this->m_Buf) + MESSAGE_SIZE, MESSAGE_SIZE, token };
+        return true;
+    }
+
+    NDHandshake LocalHandshake() const {
+        return NDSessionBase::MakeHandshake(nullptr, 0, 0, 1, MESSAGE_SIZE);
+    }
+
+    // A receive that is still posted must not be left behind with its
+    // awaitable gone, so failures flush the QP and wait for it first.
+    NDTask<HRESULT> Abandon(NDCompletion& receive, HRESULT hr) {
+        this->FlushQP();
+        co_await receive;
+        co_return hr;
+    }
+
+    UINT32 Sequence(const ND2_RESULT& received) const {
+        UINT32 sequence = UINT32_MAX;
+        if (received.BytesTransferred == MESSAGE_SIZE) std::memcpy(&sequence, m_ReceiveSge.Buffer, sizeof(sequence));
+        return sequence;
+    }
+
+    ND2_SGE m_ReceiveSge = {};
+    ND2_SGE m_SendSge = {};
+    ULONG m_Rounds = 0;
+};
+
+// MARK: EchoServer
+class EchoServer : public EchoPeer<NDSessionServerBase> {
+    public:
+    bool Setup(char* localAddr, USHORT port) {
+        if (!SetupPeer(localAddr)) return false;
+        if (FAILED(CreateListener())) return false;
+
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%u", localAddr, port);
+        return SUCCEEDED(Listen(fullAddress));
+    }
+
+    // Echoes rounds messages. The next receive is always posted before the
+    // echo goes out, since the echo is what lets the client send again.
+    NDTask<HRESULT> Serve(ULONG rounds) {
+        NDHandshake client;
+        HRESULT hr = co_await GetConnectionRequestAsync(&client);
+        if (FAILED(hr)) co_return hr;
+
+        NDCompletion first = PostReceiveAsync(&m_ReceiveSge, 1);
+        hr = co_await AcceptAsync(0, 0, LocalHandshake());
+        if (FAILED(hr)) co_return co_await Abandon(first, hr);
+
+        ND2_RESULT received = co_await first;
+        for (;;) {
+            if (FAILED(received.Status)) co_return received.Status;
+            std::memcpy(m_SendSge.Buffer, m_ReceiveSge.Buffer, MESSAGE_SIZE);
+            if (Sequence(received) != m_Rounds) co_return ND_INVALID_BUFFER_SIZE;
+            if (++m_Rounds == rounds) break;
+
+            NDCompletion next = PostReceiveAsync(&m_ReceiveSge, 1);
+            ND2_RESULT sent = co_await SendAsync(&m_SendSge, 1, 0);
+            if (FAILED(sent.Status)) co_return co_await Abandon(next, sent.Status);
+            received = co_await next;
+        }
+
+        ND2_RESULT sent = co_await SendAsync(&m_SendSge, 1, 0);
+        DisconnectConnector();
+        co_return sent.Status;
+    }
+};
+
+// MARK: EchoClient
+class EchoClient : public EchoPeer<NDSessionClientBase> {
+    public:
+    bool Setup(char* localAddr) {
+        return SetupPeer(localAddr);
+    }
+
+    NDTask<HRESULT> Run(char* localAddr, const char* serverAddr, USHORT port, ULONG rounds) {
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%u", serverAddr, port);
+
+        NDHandshake server;
+        HRESULT hr = co_await ConnectAsync(localAddr, fullServerAddress, 0, 0, LocalHandshake(), &server, 0);
+        if (FAILED(hr)) co_return hr;
+        hr = co_await CompleteConnectAsync();
+        if (FAILED(hr)) co_return hr;
+
+        for (UINT32 sequence = 0; sequence < rounds; sequence++) {
+            std::memcpy(m_SendSge.Buffer, &sequence, sizeof(sequence));
+            NDCompletion reply = PostReceiveAsync(&m_ReceiveSge, 1);
+            ND2_RESULT sent = co_await SendAsync(&m_SendSge, 1, 0);
+            if (FAILED(sent.Status)) co_return co_await Abandon(reply, sent.Status);
+
+            ND2_RESULT received = co_await reply;
+            if (FAILED(received.Status)) co_return received.Status;
+            if (Sequence(received) != sequence) co_return ND_INVALID_BUFFER_SIZE;
+            m_Rounds++;
+        }
+
+        DisconnectConnector();
+        co_return ND_SUCCESS;
+    }
+};
+
+// Counts the tasks that fail, since spawned tasks' results are discarded.
+static NDTask<HRESULT> Counted(NDTask<HRESULT> task, ULONG* pFailed) {
+    HRESULT hr = co_await task;
+    if (FAILED(hr)) {
+        std::cerr << "Connection failed: " << std::hex << hr << std::dec << std::endl;
+        (*pFailed)++;
+    }
+    co_return hr;
+}
+
+int main(int argc, char* argv[]) {
+    ULONG connections = DEFAULT_CONNECTIONS;
+    ULONG rounds = DEFAULT_ROUNDS;
+    bool runServers = true;
+    bool runClients = true;
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = defaultAddr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) {
+            connections = std::stoul(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            rounds = std::stoul(argv[++i]);
+        } else if (arg == "-s") {
+            runClients = false;
+        } else if (arg == "-c") {
+            runServers = false;
+        } else if (arg[0] != '-') {
+            localAddr = argv[i];
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    if (connections == 0 || connections > MAX_CONNECTIONS || rounds == 0 || (!runServers && !runClients)) {
+        ShowUsage();
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    bool ok = true;
+    {
+        NDEventLoop loop;
+        std::vector<std::unique_ptr<EchoServer>> servers;
+        std::vector<std::unique_ptr<EchoClient>> clients;
+        for (ULONG i = 0; ok && i < connections; i++) {
+            USHORT port = static_cast<USHORT>(BASE_PORT + i);
+            if (runServers) {
+                auto pServer = std::make_unique<EchoServer>();
+                ok = pServer->Setup(localAddr, port) && SUCCEEDED(loop.Attach(*pServer));
+                servers.push_back(std::move(pServer));
+            }
+            if (ok && runClients) {
+                auto pClient = std::make_unique<EchoClient>();
+                ok = pClient->Setup(localAddr) && SUCCEEDED(loop.Attach(*pClient));
+                clients.push_back(std::move(pClient));
+            }
+        }
+        if (!ok) std::cerr << "Setup failed." << std::endl;
+
+        ULONG failed = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (ULONG i = 0; ok && i < connections; i++) {
+            USHORT port = static_cast<USHORT>(BASE_PORT + i);
+            if (runServers) loop.Spawn(Counted(servers[i]->Serve(rounds), &failed));
+            if (runClients) loop.Spawn(Counted(clients[i]->Run(localAddr, localAddr, port, rounds), &failed));
+        }
+        loop.Run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (ok) {
+            UINT64 completed = 0;
+            for (const auto& pServer : servers) completed += pServer->Rounds();
+            for (const auto& pClient : clients) completed += pClient->Rounds();
+            if (runServers && runClients) completed /= 2;
+            std::cout << connections << " connections on one thread completed " << completed << " round trips of "
+                      << MESSAGE_SIZE << " bytes in " << seconds * 1000 << " ms ("
+                      << completed / seconds / 1000 << " k round trips/s), " << failed << " failed." << std::endl;
+            ok = failed == 0 && completed == static_cast<UINT64>(connections) * rounds;
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    std::cout << (ok ? "Coroutines passed." : "Coroutines FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,250 @@
+#include "NDSession.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Both sides stream numbered messages at each other as fast as they can
+// through a credit channel with only a few receives posted. Neither ever
+// sends into an empty receive queue: sends wait for credits instead, and the
+// receive depths are learned from the connection handshake. Once the small
+// backlog is full, the stream dispatches completions until credits return. Both sides run as
+// threads of this process unless -s and -c split them into separate processes.
+
+constexpr char TEST_PORT[] = "54326";
+constexpr ULONG DEFAULT_MESSAGES = 100000;
+constexpr ULONG DEFAULT_MESSAGE_SIZE = 1024;
+constexpr ULONG DEFAULT_DEPTH = 8;
+constexpr ULONG DEFAULT_BACKLOG = 1;
+constexpr ULONG MAX_DEPTH = 256;   // initiator depth, so the most credits a peer may offer
+
+void ShowUsage() {
+    printf("credit_channel [options] [local_ip]\n"
+           "Options:\n"
+           "\t-n <messages>  - Messages each side sends (default: %u)\n"
+           "\t-m <bytes>     - Message size, at least 4 (default: %u)\n"
+           "\t-d <depth>     - Receives each side keeps posted, 3 to %u (default: %u)\n"
+           "\t-b <credits>   - Credits owed before an explicit update, at least 2 (default: depth / 4)\n"
+           "\t-q <messages>  - Sends that may wait for credits (default: %u)\n"
+           "\t-s             - Run only the server\n"
+           "\t-c             - Run only the client\n"
+           "Without -s or -c both sides run in this process (default address 127.0.0.1).\n",
+           DEFAULT_MESSAGES, DEFAULT_MESSAGE_SIZE, MAX_DEPTH, DEFAULT_DEPTH, DEFAULT_BACKLOG);
+}
+
+struct StreamOptions {
+    ULONG Messages = DEFAULT_MESSAGES;
+    ULONG MessageSize = DEFAULT_MESSAGE_SIZE;
+    ULONG Depth = DEFAULT_DEPTH;
+    ULONG CreditBatch = 0;
+    ULONG Backlog = DEFAULT_BACKLOG;
+};
+
+// MARK: ChannelPeer
+// What the server and the client share: the channel and the stream itself.
+template <typename Session>
+class ChannelPeer : public Session {
+protected:
+    bool SetupPeer(char* localAddr, const StreamOptions& options) {
+        m_Options = options;
+        if (!this->Initialize(localAddr)) return false;
+        if (FAILED(this->CreateCQ(options.Depth * 4 + 64))) return false;
+        if (FAILED(this->CreateQP(options.Depth, MAX_DEPTH, 1, 1))) return false;
+        if (FAILED(this->CreateConnector())) return false;
+        return true;
+    }
+
+    NDHandshake LocalHandshake() const {
+        return NDSessionBase::MakeHandshake(nullptr, 0, 0, m_Options.Depth, m_Options.MessageSize);
+    }
+
+    // Credits are only right if they match what the peer really posts, so a
+    // peer offering more than the QP can have sends in flight is refused.
+    HRESULT OpenChannel(const NDHandshake& peer) {
+        if (peer.MaxMessageSize < m_Options.MessageSize) {
+            std::cerr << "Peer takes messages of at most " << peer.MaxMessageSize << " bytes." << std::endl;
+            return ND_INVALID_BUFFER_SIZE;
+        }
+        if (peer.ReceiveCredits > MAX_DEPTH) {
+            std::cerr << "Peer keeps " << peer.ReceiveCredits << " receives posted, more than " << MAX_DEPTH << "." << std::endl;
+            return ND_INVALID_PARAMETER;
+        }
+        typename Session::ChannelOptions channel;
+        channel.Depth = m_Options.Depth;
+        channel.PeerDepth = peer.ReceiveCredits;
+        channel.MessageSize = m_Options.MessageSize;
+        channel.CreditBatch = m_Options.CreditBatch;
+        channel.Backlog = m_Options.Backlog;
+        return this->CreateChannel(channel, [this](const void* pData, ULONG length) { OnMessage(pData, length); });
+    }
+
+    bool Stream(const char* role) {
+        std::vector<char> payload(m_Options.MessageSize, 0x5A);
+        ULONG sent = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        while (m_Received < m_Options.Messages || sent < m_Options.Messages || this->ChannelBacklog() > 0) {
+            // Send until the channel pushes back; the rest waits until credits return.
+            while (sent < m_Options.Messages) {
+                UINT32 sequence = sent;
+                std::memcpy(payload.data(), &sequence, sizeof(sequence));
+                HRESULT hr = this->ChannelSend(payload.data(), m_Options.MessageSize);
+                if (hr == ND_INSUFFICIENT_RESOURCES) break;
+                if (FAILED(hr)) return false;
+                sent++;
+            }
+            if (m_Received < m_Options.Messages || sent < m_Options.Messages || this->ChannelBacklog() > 0) this->DispatchCompletions();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const auto& stats = this->GetChannelStats();
+        std::cout << "[" << role << "] Sent " << stats.Sent << " and received " << m_Received << " messages of "
+                  << m_Options.MessageSize << " bytes in " << seconds * 1000 << " ms ("
+                  << (m_Received + stats.Sent) / seconds / 1e6 << " Mmsg/s), " << m_OutOfOrder << " out of order, "
+                  << stats.Queued << " sends queued for credits, " << stats.CreditUpdates << " explicit credit updates."
+                  << std::endl;
+        return m_OutOfOrder == 0;
+    }
+
+private:
+    void OnMessage(const void* pData, ULONG length) {
+        UINT32 sequence = UINT32_MAX;
+        if (length >= sizeof(sequence)) std::memcpy(&sequence, pData, sizeof(sequence));
+        if (length != m_Options.MessageSize || sequence != m_Received) m_OutOfOrder++;
+        m_Received++;
+    }
+
+    StreamOptions m_Options;
+    ULONG m_Received = 0;
+    ULONG m_OutOfOrder = 0;
+};
+
+// MARK: ChannelServer
+class ChannelServer : public ChannelPeer<NDSessionServerBase> {
+public:
+    bool Setup(char* localAddr, const StreamOptions& options) {
+        if (!SetupPeer(localAddr, options)) return false;
+        if (FAILED(CreateListener())) return false;
+
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%s", localAddr, TEST_PORT);
+        return SUCCEEDED(Listen(fullAddress));
+    }
+
+    bool Run() {
+        NDHandshake client;
+        if (FAILED(GetConnectionRequest(&client))) return false;
+        std::cout << "[server] Client keeps " << client.ReceiveCredits << " receives posted." << std::endl;
+
+        // The client may send as soon as the accept completes.
+        if (FAILED(OpenChannel(client))) return false;
+        if (FAILED(Accept(0, 0, LocalHandshake()))) return false;
+
+        bool ok = Stream("server");
+        DisconnectConnector();
+        return ok;
+    }
+};
+
+// MARK: ChannelClient
+class ChannelClient : public ChannelPeer<NDSessionClientBase> {
+public:
+    bool Setup(char* localAddr, const StreamOptions& options) {
+        return SetupPeer(localAddr, options);
+    }
+
+    bool Run(char* localAddr, const char* serverAddr) {
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%s", serverAddr, TEST_PORT);
+
+        NDHandshake server;
+        if (FAILED(Connect(localAddr, fullServerAddress, 0, 0, LocalHandshake(), &server, 0))) return false;
+        std::cout << "[client] Server keeps " << server.ReceiveCredits << " receives posted." << std::endl;
+
+        // The server may send as soon as CompleteConnect reaches it.
+        if (FAILED(OpenChannel(server))) return false;
+        if (FAILED(CompleteConnect())) return false;
+
+        bool ok = Stream("client");
+        DisconnectConnector();
+        return ok;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    StreamOptions options;
+    bool runServer = true;
+    bool runClient = true;
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = defaultAddr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) {
+            options.Messages = std::stoul(argv[++i]);
+        } else if (arg == "-m" && i + 1 < argc) {
+            options.MessageSize = std::stoul(argv[++i]);
+        } else if (arg == "-d" && i + 1 < argc) {
+            options.Depth = std::stoul(argv[++i]);
+        } else if (arg == "-b" && i + 1 < argc) {
+            options.CreditBatch = std::stoul(argv[++i]);
+        } else if (arg == "-q" && i + 1 < argc) {
+            options.Backlog = std::stoul(argv[++i]);
+        } else if (arg == "-s") {
+            runClient = false;
+        } else if (arg == "-c") {
+            runServer = false;
+        } else if (arg[0] != '-') {
+            localAddr = argv[i];
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    if (options.MessageSize < sizeof(UINT32) || options.Depth < 3 || options.Depth > MAX_DEPTH || (!runServer && !runClient)) {
+        ShowUsage();
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    bool ok = true;
+    {
+        ChannelServer server;
+        ChannelClient client;
+        if (runServer && !server.Setup(localAddr, options)) {
+            std::cerr << "Server setup failed." << std::endl;
+            ok = false;
+        } else if (runClient && !client.Setup(localAddr, options)) {
+            std::cerr << "Client setup failed." << std::endl;
+            ok = false;
+        } else if (runServer && runClient) {
+            bool serverOk = false;
+            std::thread serverThread([&]() { serverOk = server.Run(); });
+            bool clientOk = client.Run(localAddr, localAddr);
+            serverThread.join();
+            ok = serverOk && clientOk;
+        } else {
+            ok = runServer ? server.Run() : client.Run(localAddr, localAddr);
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    std::cout << (ok ? "Credit channel passed." : "Credit channel FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
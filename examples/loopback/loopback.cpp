@@ -0,0 +1,286 @@
+#include "NDSession.hpp"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <utility>
+
+// Runs a server and a client session in one process over a single adapter
+// address. With the software provider this exercises the whole NDv2 path
+// (connection setup, Send/Receive, RDMA Write/Read) without an RDMA NIC.
+
+constexpr ULONG TEST_BUFFER_SIZE = 64 * 1024;
+constexpr ULONG RMA_OFFSET = TEST_BUFFER_SIZE / 2;
+constexpr ULONG RMA_SIZE = 16 * 1024;
+constexpr ULONG PING_SIZE = 64;
+constexpr int PING_ITERATIONS = 10000;
+constexpr int BURST_SIZE = 64;
+constexpr ULONG BURST_MAX_MESSAGE = 2048;
+constexpr char TEST_PORT[] = "54321";
+
+#define RECV_CTXT ((void*)0x1000)
+#define SEND_CTXT ((void*)0x2000)
+#define READ_CTXT ((void*)0x3000)
+#define WRITE_CTXT ((void*)0x4000)
+
+struct PeerInfo {
+    UINT64 remoteAddr;
+    UINT32 remoteToken;
+};
+
+void ShowUsage() {
+    printf("loopback [local_ip]\n"
+           "\tRuns server and client in one process (default 127.0.0.1)\n");
+}
+
+static void FillPattern(char* pBuf, ULONG length, char seed) {
+    for (ULONG i = 0; i < length; i++) pBuf[i] = static_cast<char>(seed + i * 7);
+}
+
+static bool CheckPattern(const char* pBuf, ULONG length, char seed) {
+    for (ULONG i = 0; i < length; i++) {
+        if (pBuf[i] != static_cast<char>(seed + i * 7)) return false;
+    }
+    return true;
+}
+
+// Burst messages vary from 16 bytes to BURST_MAX_MESSAGE and carry their index as a seed
+static ULONG BurstMessageSize(int index) {
+    return 16UL << (index % 8);
+}
+
+// MARK: LoopbackServer
+class LoopbackServer : public NDSessionServerBase {
+public:
+    bool Setup(char* localAddr) {
+        if (!Initialize(localAddr)) return false;
+
+        ND2_ADAPTER_INFO info = GetAdapterInfo();
+        if (info.AdapterId == 0) return false;
+
+        if (FAILED(CreateCQ(1024))) return false;
+        if (FAILED(CreateQP(256, 1))) return false;
+        if (FAILED(CreateMR())) return false;
+
+        ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_READ | ND_MR_FLAG_ALLOW_REMOTE_WRITE;
+        if (FAILED(RegisterDataBuffer(TEST_BUFFER_SIZE, flags))) return false;
+        if (FAILED(CreateMW())) return false;
+        if (FAILED(CreateBufferPool())) return false;
+        if (FAILED(CreateListener())) return false;
+        if (FAILED(CreateConnector())) return false;
+
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%s", localAddr, TEST_PORT);
+        return SUCCEEDED(Listen(fullAddress));
+    }
+
+    bool Run() {
+        ND2_SGE sge = { m_Buf, RMA_OFFSET, m_pMr->GetLocalToken() };
+        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) return false;
+
+        if (FAILED(GetConnectionRequest())) return false;
+        if (FAILED(Accept(1, 1, nullptr, 0))) return false;
+        std::cout << "[server] Connection accepted." << std::endl;
+
+        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) return false;
+        std::cout << "[server] Received: '" << static_cast<char*>(m_Buf) << "'" << std::endl;
+
+        // Expose the RMA half of the buffer to the client
+        char* pRma = static_cast<char*>(m_Buf) + RMA_OFFSET;
+        FillPattern(pRma, RMA_SIZE, 'S');
+        if (!std::holds_alternative<ND2_RESULT>(Bind(pRma, RMA_SIZE, ND_OP_FLAG_ALLOW_READ | ND_OP_FLAG_ALLOW_WRITE))) {
+            return false;
+        }
+
+        PeerInfo* pInfo = static_cast<PeerInfo*>(m_Buf);
+        pInfo->remoteAddr = reinterpret_cast<UINT64>(pRma);
+        pInfo->remoteToken = m_pMw->GetRemoteToken();
+        sge = { m_Buf, sizeof(PeerInfo), m_pMr->GetLocalToken() };
+        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) return false;
+        if (FAILED(Send(&sge, 1, 0, SEND_CTXT))) return false;
+        if (!WaitForCompletionAndCheckContext(SEND_CTXT)) return false;
+
+        // The client reads our pattern, overwrites it, then tells us it is done
+        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) return false;
+        bool written = CheckPattern(pRma, RMA_SIZE, 'C');
+        std::cout << "[server] RDMA Write from client " << (written ? "verified." : "MISMATCH.") << std::endl;
+
+        // Echo ping-pong messages until the client stops
+        sge = { m_Buf, PING_SIZE, m_pMr->GetLocalToken() };
+        for (int i = 0; i < PING_ITERATIONS; i++) {
+            if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) return false;
+            if (!WaitForCompletionAndCheckContext(RECV_CTXT)) return false;
+            if (FAILED(Send(&sge, 1, 0, SEND_CTXT))) return false;
+            if (!WaitForCompletionAndCheckContext(SEND_CTXT)) return false;
+        }
+
+        // A burst of receives outstanding at once, each into its own pool
+        // buffer, completed through handlers
+        int received = 0;
+        int failed = 0;
+        for (int i = 0; i < BURST_SIZE; i++) {
+            NDBuffer buffer = m_BufferPool.Allocate(BURST_MAX_MESSAGE);
+            if (!buffer) return false;
+            ND2_SGE burstSge = buffer.Sge();
+            HRESULT hr = PostReceive(&burstSge, 1, [this, pData = static_cast<char*>(buffer.Data), &received, &failed](const ND2_RESULT& result) {
+                int index = static_cast<unsigned char>(pData[0]);
+                bool valid = SUCCEEDED(result.Status) && result.BytesTransferred == BurstMessageSize(index) &&
+                    CheckPattern(pData, result.BytesTransferred, static_cast<char>(index));
+                valid ? received++ : failed++;
+                m_BufferPool.Free(pData);
+            });
+            if (FAILED(hr)) return false;
+        }
+        while (received + failed < BURST_SIZE) DispatchCompletions();
+        std::cout << "[server] Burst of " << received << "/" << BURST_SIZE << " receives completed." << std::endl;
+
+        Shutdown();
+        return written && failed == 0;
+    }
+};
+
+// MARK: LoopbackClient
+class LoopbackClient : public NDSessionClientBase {
+public:
+    bool Setup(char* localAddr) {
+        if (!Initialize(localAddr)) return false;
+
+        ND2_ADAPTER_INFO info = GetAdapterInfo();
+        if (info.AdapterId == 0) return false;
+
+        if (FAILED(CreateCQ(1024))) return false;
+        if (FAILED(CreateQP(256, 1))) return false;
+        if (FAILED(CreateMR())) return false;
+
+        ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE;
+        if (FAILED(RegisterDataBuffer(TEST_BUFFER_SIZE, flags))) return false;
+        if (FAILED(CreateBufferPool())) return false;
+        return SUCCEEDED(CreateConnector());
+    }
+
+    bool Run(const char* localAddr, const char* serverAddr) {
+        ND2_SGE sge = { m_Buf, RMA_OFFSET, m_pMr->GetLocalToken() };
+        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) return false;
+
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%s", serverAddr, TEST_PORT);
+        if (FAILED(Connect(localAddr, fullServerAddress, 1, 1))) return false;
+        if (FAILED(CompleteConnect())) return false;
+        std::cout << "[client] Connected to " << fullServerAddress << "." << std::endl;
+
+        const char* message = "Hello from client.";
+        char* pSend = static_cast<char*>(m_Buf) + RMA_OFFSET;
+        strcpy_s(pSend, RMA_SIZE, message);
+        ND2_SGE sendSge = { pSend, static_cast<ULONG>(strlen(message) + 1), m_pMr->GetLocalToken() };
+        if (FAILED(Send(&sendSge, 1, 0, SEND_CTXT))) return false;
+        if (!WaitForCompletionAndCheckContext(SEND_CTXT)) return false;
+
+        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) return false;
+        PeerInfo peer = *static_cast<PeerInfo*>(m_Buf);
+
+        // Read the server's pattern into our RMA half
+        char* pRma = static_cast<char*>(m_Buf) + RMA_OFFSET;
+        ND2_SGE rmaSge = { pRma, RMA_SIZE, m_pMr->GetLocalToken() };
+        if (FAILED(Read(&rmaSge, 1, peer.remoteAddr, peer.remoteToken, 0, READ_CTXT))) return false;
+        if (!WaitForCompletionAndCheckContext(READ_CTXT)) return false;
+        bool read = CheckPattern(pRma, RMA_SIZE, 'S');
+        std::cout << "[client] RDMA Read from server " << (read ? "verified." : "MISMATCH.") << std::endl;
+
+        // Write it back as one request split into 1KB pieces, four in flight
+        FillPattern(pRma, RMA_SIZE, 'C');
+        size_t maxPerTransfer = std::exchange(m_MaxPerTransfer, 1024);
+        HRESULT writeStatus = ND_PENDING;
+        HRESULT hr = WriteLarge(pRma, RMA_SIZE, m_pMr->GetLocalToken(), peer.remoteAddr, peer.remoteToken,
+            [&writeStatus](const ND2_RESULT& result) { writeStatus = result.Status; }, 4);
+        if (FAILED(hr)) return false;
+        while (writeStatus == ND_PENDING) DispatchCompletions();
+        std::cout << "[client] RDMA Write in " << LargePieces(RMA_SIZE) << " pieces "
+                  << (SUCCEEDED(writeStatus) ? "completed." : "FAILED.") << std::endl;
+        m_MaxPerTransfer = maxPerTransfer;
+        if (FAILED(writeStatus)) return false;
+
+        sendSge = { m_Buf, 1, m_pMr->GetLocalToken() };
+        if (FAILED(Send(&sendSge, 1, 0, SEND_CTXT))) return false;
+        if (!WaitForCompletionAndCheckContext(SEND_CTXT)) return false;
+
+        // Send/Receive round trips
+        sge = { m_Buf, PING_SIZE, m_pMr->GetLocalToken() };
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < PING_ITERATIONS; i++) {
+            if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) return false;
+            if (FAILED(Send(&sge, 1, 0, SEND_CTXT))) return false;
+            if (!WaitForCompletionAndCheckContext(SEND_CTXT)) return false;
+            if (!WaitForCompletionAndCheckContext(RECV_CTXT)) return false;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start);
+        std::cout << "[client] " << PING_ITERATIONS << " round trips of " << PING_SIZE << " bytes, average RTT "
+                  << static_cast<double>(elapsed.count()) / PING_ITERATIONS / 1000.0 << " us" << std::endl;
+
+        // A read and a burst of variable-size sends in flight together,
+        // completing in any order. Every send owns a pool buffer until it completes.
+        int completed = 0;
+        int failed = 0;
+        auto onComplete = [&completed, &failed](const ND2_RESULT& result) {
+            SUCCEEDED(result.Status) ? completed++ : failed++;
+        };
+        if (FAILED(Read(&rmaSge, 1, peer.remoteAddr, peer.remoteToken, 0, onComplete))) return false;
+        for (int i = 0; i < BURST_SIZE; i++) {
+            NDBuffer buffer = m_BufferPool.Allocate(BurstMessageSize(i));
+            if (!buffer) return false;
+            FillPattern(static_cast<char*>(buffer.Data), BurstMessageSize(i), static_cast<char>(i));
+            ND2_SGE burstSge = buffer.Sge(BurstMessageSize(i));
+            HRESULT hr = Send(&burstSge, 1, 0, [this, pData = buffer.Data, &onComplete](const ND2_RESULT& result) {
+                m_BufferPool.Free(pData);
+                onComplete(result);
+            });
+            if (FAILED(hr)) return false;
+        }
+        while (completed + failed < BURST_SIZE + 1) DispatchCompletions();
+        std::cout << "[client] Burst of " << completed << "/" << BURST_SIZE + 1 << " requests completed." << std::endl;
+
+        Shutdown();
+        return read && failed == 0;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc > 2) {
+        ShowUsage();
+        return 1;
+    }
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = argc == 2 ? argv[1] : defaultAddr;
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    bool serverOk = false;
+    bool clientOk = false;
+    {
+        LoopbackServer server;
+        LoopbackClient client;
+        if (!server.Setup(localAddr) || !client.Setup(localAddr)) {
+            std::cerr << "Setup failed." << std::endl;
+        } else {
+            std::thread serverThread([&]() { serverOk = server.Run(); });
+            clientOk = client.Run(localAddr, localAddr);
+            serverThread.join();
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    bool ok = serverOk && clientOk;
+    std::cout << (ok ? "Loopback test passed." : "Loopback test FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,1028 @@
+#include "NDSession.hpp"
+#include "LatencyHistogram.hpp"
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#undef max
+#undef min
+
+constexpr char TEST_PORT[] = "54322";
+
+#define RECV_CTXT ((void*)0x1000)
+#define SEND_CTXT ((void*)0x2000)
+#define READ_CTXT ((void*)0x3000)
+#define WRITE_CTXT ((void*)0x4000)
+
+// Room for the handshake messages, whatever the message sizes
+constexpr ULONG CONTROL_SIZE = 4096;
+constexpr ULONG CONTROL_SLOT = 64;
+
+constexpr ULONG MAX_RECEIVE_DEPTH = 512;
+constexpr uint64_t MAX_MESSAGE_SIZE = 1ULL << 30;
+constexpr uint64_t LATENCY_WARMUP = 100;
+
+enum PerfOperation : UINT32 {
+    PerfSend = 0,
+    PerfRead = 1,
+    PerfWrite = 2,
+};
+
+const char* OperationName(UINT32 operation) {
+    switch (operation) {
+        case PerfSend: return "send";
+        case PerfRead: return "read";
+        case PerfWrite: return "write";
+        default: return "unknown";
+    }
+}
+
+enum PerfInline : UINT32 {
+    InlineAuto = 0,     // NDSession inlines what fits under the adapter's threshold
+    InlineAlways = 1,   // every message up to MaxInlineDataSize
+    InlineNever = 2,
+};
+
+const char* InlineName(UINT32 mode) {
+    switch (mode) {
+        case InlineAuto: return "auto";
+        case InlineAlways: return "on";
+        case InlineNever: return "off";
+        default: return "unknown";
+    }
+}
+
+// Where the client's messages come from
+enum PerfUserBuffers : UINT32 {
+    UserBuffersOff = 0,         // the session's pre-registered buffer
+    UserBuffersCached = 1,      // application buffers through the registration cache
+    UserBuffersUncached = 2,    // application buffers registered for every operation
+};
+
+const char* UserBuffersName(UINT32 mode) {
+    switch (mode) {
+        case UserBuffersOff: return "off";
+        case UserBuffersCached: return "cached";
+        case UserBuffersUncached: return "uncached";
+        default: return "unknown";
+    }
+}
+
+constexpr ULONG USER_BUFFER_COUNT = 16;
+
+// How a striped transfer is split over its lanes
+enum PerfStripe : UINT32 {
+    StripeRoundRobin = 0,
+    StripeBySize = 1,
+};
+
+const char* StripeName(UINT32 policy) {
+    switch (policy) {
+        case StripeRoundRobin: return "rr";
+        case StripeBySize: return "size";
+        default: return "unknown";
+    }
+}
+
+// Sent by the client as the first message, so the server follows its sweep
+struct PerfOptions {
+    UINT32 Operation = PerfSend;
+    UINT32 Latency = 0;
+    UINT64 MinSize = 65536;
+    UINT64 MaxSize = 65536;
+    UINT64 Iterations = 1000;   // per size point, unused when DurationMs is set
+    UINT32 DurationMs = 0;
+    UINT32 Depth = 128;
+    UINT32 Sge = 1;
+    UINT32 Inline = InlineAuto;
+    UINT32 UserBuffers = UserBuffersOff;
+    UINT32 Lanes = 0;           // extra QPs for striped reads and writes
+    UINT32 Stripe = StripeRoundRobin;
+    UINT32 SignalInterval = 1;  // operations per completion in bandwidth tests
+};
+
+// The server's reply: where its buffer is and how many receives it keeps posted
+struct PeerInfo {
+    UINT64 remoteAddr;
+    UINT32 remoteToken;
+    UINT32 receiveDepth;
+};
+
+// One row of the report
+struct PointResult {
+    uint64_t Bytes = 0;
+    ULONG Lanes = 0;
+    uint64_t Iterations = 0;
+    uint64_t Nanoseconds = 0;
+    LatencyHistogram Latency;
+};
+
+double CalculateGbps(uint64_t bytes, uint64_t nanoseconds) {
+    return (static_cast<double>(bytes) * 8.0) / (static_cast<double>(nanoseconds) / 1e9) / 1e9;
+}
+
+double CalculateLatencyMicroseconds(uint64_t nanoseconds) {
+    return static_cast<double>(nanoseconds) / 1000.0;
+}
+
+// Accepts a K, M or G suffix
+uint64_t ParseSize(const char* value) {
+    char* end = nullptr;
+    uint64_t size = strtoull(value, &end, 10);
+    switch (end != nullptr ? *end : '\0') {
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+        default: break;
+    }
+    return size;
+}
+
+// Power-of-two steps from MinSize up to MaxSize
+std::vector<uint64_t> SweepSizes(const PerfOptions& options) {
+    std::vector<uint64_t> sizes;
+    for (uint64_t size = options.MinSize; size <= options.MaxSize; size *= 2) {
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+// Lane counts for a striped sweep: powers of two up to Lanes, and Lanes itself
+std::vector<ULONG> SweepLanes(const PerfOptions& options) {
+    std::vector<ULONG> lanes;
+    for (ULONG count = 1; count < options.Lanes; count *= 2) {
+        lanes.push_back(count);
+    }
+    lanes.push_back(options.Lanes);
+    return lanes;
+}
+
+// Splits one message evenly over up to nSge consecutive pieces of the buffer
+ULONG SplitSge(ND2_SGE* pSge, ULONG nSge, void* pBuf, uint64_t size, UINT32 token) {
+    if (size == 0) return 0;
+    ULONG count = static_cast<ULONG>(std::min<uint64_t>(nSge, size));
+    ULONG piece = static_cast<ULONG>(size / count);
+    char* pCursor = static_cast<char*>(pBuf);
+    for (ULONG i = 0; i < count; i++) {
+        pSge[i].Buffer = pCursor;
+        pSge[i].BufferLength = (i + 1 == count) ? static_cast<ULONG>(size - piece * i) : piece;
+        pSge[i].MemoryRegionToken = token;
+        pCursor += pSge[i].BufferLength;
+    }
+    return count;
+}
+
+void ShowUsage() {
+    printf("perftest [options]\n"
+           "Options:\n"
+           "\t-s <local_ip>             - Start as server; it follows the client's settings\n"
+           "\t-c <local_ip> <server_ip> - Start as client\n"
+           "Client options:\n"
+           "\t-t <send|read|write>      - Operation (default: send)\n"
+           "\t-l                        - Measure latency instead of bandwidth\n"
+           "\t-m <bytes>                - Smallest message size, K/M/G suffixes allowed (default: 64K)\n"
+           "\t-M <bytes>                - Largest message size; sizes double from -m (default: -m)\n"
+           "\t-a                        - Sweep all sizes from 2 bytes to 8MB\n"
+           "\t-d <depth>                - Operations in flight for bandwidth tests (default: 128)\n"
+           "\t-g <sge>                  - Scatter/gather entries per message (default: 1)\n"
+           "\t-I <auto|on|off>          - Inline small messages as NDSession decides, up to the\n"
+           "\t                            adapter's limit, or never (default: auto)\n"
+           "\t-U <cached|uncached>      - Send from %u application buffers, registered through the\n"
+           "\t                            registration cache or once per operation\n"
+           "\t-Q <lanes>                - Stripe each read or write over 1, 2, 4 .. <lanes> extra QPs,\n"
+           "\t                            one transfer at a time\n"
+           "\t-S <rr|size>              - Split striped transfers round-robin or into one share\n"
+           "\t                            per lane (default: rr)\n"
+           "\t-N <interval>             - Ask for a completion on only every <interval>th operation\n"
+           "\t                            of a bandwidth test, at most -d (default: 1)\n"
+           "\t-n <iterations>           - Iterations per size (default: 1000)\n"
+           "\t-D <seconds>              - Run each size for a duration instead of -n\n"
+           "\t-o <file.json|file.csv>   - Also write the results to a file\n"
+           "\nSend latency is half the round trip, as ib_send_lat reports it. Read and write\n"
+           "latency is the time from posting one operation to its completion. With -Q, -d is\n"
+           "the number of pieces in flight on each lane.\n",
+           USER_BUFFER_COUNT);
+}
+
+// MARK: PerfServer
+class PerfServer : public NDSessionServerBase {
+public:
+    bool Setup(char* localAddr) {
+        if (!Initialize(localAddr)) return false;
+
+        m_Info = GetAdapterInfo();
+        if (m_Info.AdapterId == 0) return false;
+        // Polls from the cores next to the adapter when it says which they are.
+        if (NDMemory::BindCurrentThread(GetAdapterLocality())) {
+            std::cout << "Bound to the cores of NUMA node " << GetAdapterLocality().NumaNode << "." << std::endl;
+        }
+
+        m_ReceiveDepth = std::min(m_Info.MaxReceiveQueueDepth, MAX_RECEIVE_DEPTH);
+        ULONG depth = std::min(m_Info.MaxReceiveQueueDepth, m_Info.MaxInitiatorQueueDepth);
+        ULONG nSge = std::min(m_Info.MaxReceiveSge, m_Info.MaxInitiatorSge);
+
+        if (FAILED(CreateCQ(m_Info.MaxCompletionQueueDepth))) return false;
+        if (FAILED(CreateQP(depth, nSge))) return false;
+        if (FAILED(CreateMR())) return false;
+
+        // Resized once the client's options arrive
+        if (FAILED(RegisterDataBuffer(CONTROL_SIZE, ND_MR_FLAG_ALLOW_LOCAL_WRITE))) return false;
+
+        if (FAILED(CreateListener())) return false;
+        if (FAILED(CreateConnector())) return false;
+
+        return true;
+    }
+
+    void Run(const char* localAddr) {
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%s", localAddr, TEST_PORT);
+        std::cout << "Listening on " << fullAddress << "..." << std::endl;
+        if (FAILED(Listen(fullAddress))) return;
+
+        if (FAILED(GetConnectionRequest())) {
+            std::cout << "GetConnectionRequest failed. Reason: " << std::hex << GetResult() << std::endl;
+            return;
+        }
+
+        ND2_SGE sge = { m_Buf, sizeof(PerfOptions), m_pMr->GetLocalToken() };
+        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
+            std::cerr << "PostReceive for options failed." << std::endl;
+            return;
+        }
+
+        if (FAILED(Accept(m_Info.MaxInboundReadLimit, m_Info.MaxOutboundReadLimit, nullptr, 0))) return;
+        std::cout << "Connection established. Waiting for the client's options..." << std::endl;
+
+        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
+            std::cerr << "WaitForCompletion for options failed." << std::endl;
+            return;
+        }
+        PerfOptions options = *reinterpret_cast<PerfOptions*>(m_Buf);
+        m_AutoInline = options.Inline == InlineAuto;
+        if (options.MinSize == 0 || options.MaxSize > MAX_MESSAGE_SIZE) {
+            std::cerr << "Invalid message sizes from client." << std::endl;
+            return;
+        }
+
+        ULONG bufferSize = static_cast<ULONG>(std::max<uint64_t>(options.MaxSize, CONTROL_SIZE));
+        ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE | ND_MR_FLAG_ALLOW_REMOTE_READ;
+        if (FAILED(RegisterDataBuffer(bufferSize, flags, NDMemory::LargePages | NDMemory::Prefault))) {
+            std::cerr << "Failed to register " << bufferSize << " bytes." << std::endl;
+            return;
+        }
+
+        CreateMW();
+        Bind(m_Buf, bufferSize, ND_OP_FLAG_ALLOW_WRITE | ND_OP_FLAG_ALLOW_READ);
+
+        if (options.Lanes > 0 && FAILED(CreateStripes(options.Lanes, std::max<UINT32>(options.Depth, 1)))) return;
+
+        // Receives must be in place before the client learns where to send
+        sge = { m_Buf, bufferSize, m_pMr->GetLocalToken() };
+        ULONG receives = options.Operation == PerfSend ? m_ReceiveDepth : 1;
+        for (ULONG i = 0; i < receives; i++) {
+            if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
+                std::cerr << "PostReceive failed." << std::endl;
+                return;
+            }
+        }
+
+        PeerInfo* myInfo = reinterpret_cast<PeerInfo*>(static_cast<char*>(m_Buf) + CONTROL_SLOT);
+        myInfo->remoteAddr = reinterpret_cast<UINT64>(m_Buf);
+        myInfo->remoteToken = m_pMw->GetRemoteToken();
+        myInfo->receiveDepth = m_ReceiveDepth;
+        ND2_SGE infoSge = { myInfo, sizeof(PeerInfo), m_pMr->GetLocalToken() };
+        if (FAILED(Send(&infoSge, 1, 0, SEND_CTXT))) {
+            std::cerr << "Send of PeerInfo failed." << std::endl;
+            return;
+        }
+        // Its completion may come after the client's first message
+        m_SendsOutstanding = 1;
+
+        // The lanes target the same window, so the server only has to accept them
+        if (options.Lanes > 0) {
+            if (FAILED(AcceptStripes(m_Info.MaxInboundReadLimit, m_Info.MaxOutboundReadLimit))) return;
+            std::cout << options.Lanes << " stripe lanes connected." << std::endl;
+        }
+
+        std::cout << "Running " << OperationName(options.Operation) << (options.Latency ? " latency" : " bandwidth")
+                  << " test for the client..." << std::endl;
+
+        if (options.Operation == PerfSend) {
+            for (uint64_t size : SweepSizes(options)) {
+                if (!ServeUntilMarker(options, sge, size)) return;
+            }
+        } else if (!ServeUntilMarker(options, sge, 0)) {
+            // Reads and writes need nothing from the server until the client is done
+            return;
+        }
+
+        std::cout << "Client finished." << std::endl;
+        Shutdown();
+    }
+
+private:
+    // Keeps the receive queue full until the client's zero-byte end marker,
+    // echoing each message back in latency mode, then acknowledges the marker.
+    bool ServeUntilMarker(const PerfOptions& options, const ND2_SGE& receiveSge, uint64_t size) {
+        std::array<ND2_RESULT, 64> results;
+        ULONG& sendsOutstanding = m_SendsOutstanding;
+        bool ended = false;
+        ULONG echoFlags = (options.Inline == InlineAlways && size <= m_Info.MaxInlineDataSize) ? ND_OP_FLAG_INLINE : 0;
+
+        while (!ended) {
+            ULONG n = WaitForCompletions(results, CompletionWait::SpinThenBlock);
+            for (ULONG i = 0; i < n; i++) {
+                if (results[i].Status != ND_SUCCESS) {
+                    std::cerr << "Operation failed with status: " << std::hex << results[i].Status << std::endl;
+                    return false;
+                }
+                if (results[i].RequestContext == SEND_CTXT) {
+                    sendsOutstanding--;
+                    continue;
+                }
+
+                if (FAILED(PostReceive(&receiveSge, 1, RECV_CTXT))) {
+                    std::cerr << "PostReceive failed." << std::endl;
+                    return false;
+                }
+                if (results[i].BytesTransferred == 0) {
+                    if (FAILED(Send(nullptr, 0, 0, SEND_CTXT))) {
+                        std::cerr << "Send of acknowledgement failed." << std::endl;
+                        return false;
+                    }
+                    sendsOutstanding++;
+                    ended = true;
+                } else if (options.Latency) {
+                    ND2_SGE echo = { m_Buf, results[i].BytesTransferred, m_pMr->GetLocalToken() };
+                    if (FAILED(Send(&echo, 1, echoFlags, SEND_CTXT))) {
+                        std::cerr << "Send of echo failed." << std::endl;
+                        return false;
+                    }
+                    sendsOutstanding++;
+                }
+            }
+        }
+
+        while (sendsOutstanding > 0) {
+            ULONG n = WaitForCompletions(std::span(results).first(std::min<ULONG>(sendsOutstanding, 64)),
+                CompletionWait::SpinThenBlock);
+            for (ULONG i = 0; i < n; i++) {
+                if (results[i].Status != ND_SUCCESS) return false;
+            }
+            sendsOutstanding -= n;
+        }
+        return true;
+    }
+
+    ND2_ADAPTER_INFO m_Info = {};
+    ULONG m_ReceiveDepth = 0;
+    ULONG m_SendsOutstanding = 0;
+};
+
+// MARK: PerfClient
+class PerfClient : public NDSessionClientBase {
+public:
+    explicit PerfClient(const PerfOptions& options) : m_Options(options) {}
+
+    ~PerfClient() {
+        // The cache must forget the user buffers before they are freed.
+        for (const auto& pBuffer : m_UserBuffers) m_RegistrationCache.Invalidate(pBuffer.get(), m_BufferSize);
+    }
+
+    bool Setup(char* localAddr) {
+        if (!Initialize(localAddr)) return false;
+
+        m_Info = GetAdapterInfo();
+        if (m_Info.AdapterId == 0) return false;
+        // Polls from the cores next to the adapter when it says which they are.
+        if (NDMemory::BindCurrentThread(GetAdapterLocality())) {
+            std::cout << "Bound to the cores of NUMA node " << GetAdapterLocality().NumaNode << "." << std::endl;
+        }
+
+        ULONG depth = std::min(m_Info.MaxReceiveQueueDepth, m_Info.MaxInitiatorQueueDepth);
+        ULONG nSge = std::min(m_Info.MaxReceiveSge, m_Info.MaxInitiatorSge);
+
+        if (FAILED(CreateCQ(m_Info.MaxCompletionQueueDepth))) return false;
+        if (FAILED(CreateQP(depth, nSge))) return false;
+        if (FAILED(CreateMR())) return false;
+
+        m_BufferSize = static_cast<ULONG>(std::max<uint64_t>(m_Options.MaxSize, CONTROL_SIZE));
+        if (FAILED(RegisterDataBuffer(m_BufferSize, ND_MR_FLAG_ALLOW_LOCAL_WRITE, NDMemory::LargePages | NDMemory::Prefault))) return false;
+        if (FAILED(CreateConnector())) return false;
+
+        m_AutoInline = m_Options.Inline == InlineAuto;
+        if (m_Options.UserBuffers == UserBuffersCached && FAILED(CreateRegistrationCache())) return false;
+        if (m_Options.UserBuffers != UserBuffersOff) {
+            for (ULONG i = 0; i < USER_BUFFER_COUNT; i++) m_UserBuffers.push_back(std::make_unique<char[]>(m_BufferSize));
+        }
+        m_Options.Sge = std::clamp<UINT32>(m_Options.Sge, 1, m_Info.MaxInitiatorSge);
+        m_Options.Depth = std::clamp<UINT32>(m_Options.Depth, 1, m_Info.MaxInitiatorQueueDepth);
+        if (m_Options.Operation == PerfRead && m_Info.MaxOutboundReadLimit > 0) {
+            m_Options.Depth = std::min<UINT32>(m_Options.Depth, m_Info.MaxOutboundReadLimit);
+        }
+        if (m_Options.Lanes > 0 && FAILED(CreateStripes(m_Options.Lanes, m_Options.Depth))) return false;
+        return true;
+    }
+
+    void Run(const char* localAddr, const char* serverAddr) {
+        ND2_SGE sge = { m_Buf, sizeof(PeerInfo), m_pMr->GetLocalToken() };
+        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
+            std::cerr << "PostReceive for PeerInfo failed." << std::endl;
+            return;
+        }
+
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%s", serverAddr, TEST_PORT);
+        std::cout << "Connecting from " << localAddr << " to " << fullServerAddress << "..." << std::endl;
+        if (FAILED(Connect(localAddr, fullServerAddress, m_Info.MaxInboundReadLimit, m_Info.MaxOutboundReadLimit, nullptr, 0))) {
+            std::cerr << "Connect failed." << std::endl;
+            return;
+        }
+        if (FAILED(CompleteConnect())) {
+            std::cerr << "CompleteConnect failed." << std::endl;
+            return;
+        }
+
+        PerfOptions* pOptions = reinterpret_cast<PerfOptions*>(static_cast<char*>(m_Buf) + CONTROL_SLOT);
+        *pOptions = m_Options;
+        sge = { pOptions, sizeof(PerfOptions), m_pMr->GetLocalToken() };
+        // The options send and the server's reply complete in either order
+        if (FAILED(Send(&sge, 1, 0, SEND_CTXT)) || !Drain(2)) {
+            std::cerr << "Exchange of options failed." << std::endl;
+            return;
+        }
+        m_Remote = *reinterpret_cast<PeerInfo*>(m_Buf);
+
+        if (m_Options.Lanes > 0 &&
+            FAILED(ConnectStripes(localAddr, fullServerAddress, m_Info.MaxInboundReadLimit, m_Info.MaxOutboundReadLimit))) {
+            return;
+        }
+
+        // Leave a receive for every message the server sends back, and keep
+        // data sends below its receive depth so none of them arrive unexpected.
+        if (m_Options.Operation == PerfSend) {
+            m_Options.Depth = std::min<UINT32>(m_Options.Depth, std::max<UINT32>(m_Remote.receiveDepth, 2) - 1);
+        }
+        // Silent operations hold their queue slots until a signaled one completes.
+        m_Options.SignalInterval = std::min(m_Options.SignalInterval, m_Options.Depth);
+        SetSignalInterval(m_Options.SignalInterval);
+        sge = { m_Buf, m_BufferSize, m_pMr->GetLocalToken() };
+        if (FAILED(PostReceive(&sge, 1, RECV_CTXT)) || FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
+            std::cerr << "PostReceive failed." << std::endl;
+            return;
+        }
+
+        PrintHeader();
+        m_NsPerTick = Tsc::Calibrate();
+        for (uint64_t size : SweepSizes(m_Options)) {
+            if (m_Options.Lanes > 0) {
+                for (ULONG lanes : SweepLanes(m_Options)) {
+                    PointResult point;
+                    point.Bytes = size;
+                    point.Lanes = lanes;
+                    if (!RunStripedPoint(point)) return;
+                    PrintPoint(point);
+                    m_Results.push_back(std::move(point));
+                }
+                continue;
+            }
+
+            PointResult point;
+            point.Bytes = size;
+            bool ok = m_Options.Latency ? RunLatencyPoint(point) : RunBandwidthPoint(point);
+            if (!ok) return;
+            if (m_Options.Operation == PerfSend && !Synchronize()) return;
+            PrintPoint(point);
+            m_Results.push_back(std::move(point));
+        }
+
+        if (m_Options.Operation != PerfSend && !Synchronize()) return;
+
+        if (m_RegistrationCache.IsInitialized()) {
+            const NDRegistrationCache::Stats& stats = m_RegistrationCache.GetStats();
+            std::cout << "\nRegistration cache: " << stats.Hits << " hits, " << stats.Misses << " misses, " << stats.Evictions
+                      << " evictions, " << stats.Merges << " merges, " << stats.RegisteredBytes << " bytes registered" << std::endl;
+        }
+
+        Shutdown();
+    }
+
+    const std::vector<PointResult>& Results() const { return m_Results; }
+    const PerfOptions& Options() const { return m_Options; }
+
+private:
+    // last marks the final operation of a point, which always asks for a completion.
+    HRESULT Post(uint64_t size, bool last = false) {
+        void* pBuf = m_Buf;
+        UINT32 token = m_pMr->GetLocalToken();
+        void* requestContext = nullptr;
+        if (m_Options.UserBuffers != UserBuffersOff) {
+            pBuf = m_UserBuffers[m_NextUserBuffer++ % USER_BUFFER_COUNT].get();
+            HRESULT hr = Pin(pBuf, size, &token, &requestContext);
+            if (FAILED(hr)) return hr;
+        }
+
+        std::array<ND2_SGE, 32> sges;
+        ULONG nSge = SplitSge(sges.data(), std::min<ULONG>(m_Options.Sge, static_cast<ULONG>(sges.size())), pBuf, size, token);
+        ULONG flags = (m_Options.Inline == InlineAlways && size <= m_Info.MaxInlineDataSize) ? ND_OP_FLAG_INLINE : 0;
+
+        HRESULT hr;
+        if (m_Options.SignalInterval > 1) {
+            hr = PostSelective(sges.data(), nSge, flags, requestContext, last);
+            if (FAILED(hr) && requestContext != nullptr) Unpin(requestContext);
+            return hr;
+        }
+        switch (m_Options.Operation) {
+            case PerfRead:
+                hr = Read(sges.data(), nSge, m_Remote.remoteAddr, m_Remote.remoteToken, 0, requestContext ? requestContext : READ_CTXT);
+                break;
+            case PerfWrite:
+                hr = Write(sges.data(), nSge, m_Remote.remoteAddr, m_Remote.remoteToken, flags, requestContext ? requestContext : WRITE_CTXT);
+                break;
+            default:
+                hr = Send(sges.data(), nSge, flags, requestContext ? requestContext : SEND_CTXT);
+                break;
+        }
+        if (FAILED(hr) && requestContext != nullptr) Unpin(requestContext);
+        return hr;
+    }
+
+    // Selectively signaled operations complete through handlers, which pass
+    // each one to Complete as if it had completed with its own context.
+    HRESULT PostSelective(const ND2_SGE* sges, ULONG nSge, ULONG flags, void* requestContext, bool last) {
+        auto onComplete = [this, requestContext](const ND2_RESULT& result) {
+            ND2_RESULT plain = result;
+            plain.RequestContext = requestContext;
+            Complete(std::span(&plain, 1)) ? m_SelectiveCompleted++ : m_SelectiveFailures++;
+        };
+        switch (m_Options.Operation) {
+            case PerfRead:
+                return ReadSelective(sges, nSge, m_Remote.remoteAddr, m_Remote.remoteToken, 0, onComplete, last);
+            case PerfWrite:
+                return WriteSelective(sges, nSge, m_Remote.remoteAddr, m_Remote.remoteToken, flags, onComplete, last);
+            default:
+                return SendSelective(sges, nSge, flags, onComplete, last);
+        }
+    }
+
+    // Registers an application buffer for one operation. The registration
+    // rides in the RequestContext and is released when the operation completes.
+    HRESULT Pin(void* pBuf, uint64_t size, UINT32* pToken, void** pRequestContext) {
+        if (m_Options.UserBuffers == UserBuffersCached) {
+            NDRegistrationCache::Handle handle;
+            HRESULT hr = m_RegistrationCache.Acquire(pBuf, static_cast<SIZE_T>(size), &handle);
+            if (FAILED(hr)) return hr;
+            *pToken = handle.Token();
+            *pRequestContext = NDRegistrationCache::ToContext(handle);
+            return hr;
+        }
+
+        IND2MemoryRegion* pMr = nullptr;
+        HRESULT hr = m_pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion, m_hAdapterFile, reinterpret_cast<void**>(&pMr));
+        if (FAILED(hr)) return hr;
+        hr = pMr->Register(pBuf, static_cast<SIZE_T>(size), ND_MR_FLAG_ALLOW_LOCAL_WRITE, &m_Ov);
+        if (hr == ND_PENDING) hr = pMr->GetOverlappedResult(&m_Ov, true);
+        if (FAILED(hr)) {
+            pMr->Release();
+            return hr;
+        }
+        *pToken = pMr->GetLocalToken();
+        *pRequestContext = pMr;
+        return hr;
+    }
+
+    void Unpin(void* requestContext) {
+        if (m_Options.UserBuffers == UserBuffersCached) {
+            NDRegistrationCache::Handle handle = NDRegistrationCache::FromContext(requestContext);
+            m_RegistrationCache.Release(handle);
+            return;
+        }
+
+        IND2MemoryRegion* pMr = static_cast<IND2MemoryRegion*>(requestContext);
+        if (pMr->Deregister(&m_Ov) == ND_PENDING) pMr->GetOverlappedResult(&m_Ov, true);
+        pMr->Release();
+    }
+
+    // Checks the status of each completion and releases the registrations
+    // of operations posted from application buffers.
+    bool Complete(std::span<const ND2_RESULT> results) {
+        for (const ND2_RESULT& result : results) {
+            if (result.Status != ND_SUCCESS) {
+                std::cerr << "Operation failed with status: " << std::hex << result.Status << std::endl;
+                return false;
+            }
+            if (m_Options.UserBuffers != UserBuffersOff && result.RequestContext != RECV_CTXT && result.RequestContext != SEND_CTXT) {
+                Unpin(result.RequestContext);
+            }
+        }
+        return true;
+    }
+
+    // Harvests exactly count completions, in whatever order they arrive
+    bool Drain(ULONG count) {
+        std::array<ND2_RESULT, 64> results;
+        while (count > 0) {
+            ULONG n = WaitForCompletions(std::span(results).first(std::min<ULONG>(count, 64)), CompletionWait::SpinThenBlock);
+            if (!Complete(std::span(results).first(n))) return false;
+            count -= n;
+        }
+        return true;
+    }
+
+    // Keeps Depth operations in flight until the iteration count or duration is reached
+    bool RunBandwidthPoint(PointResult& point) {
+        using Clock = std::chrono::steady_clock;
+        uint64_t target = m_Options.DurationMs != 0 ? UINT64_MAX : m_Options.Iterations;
+        Clock::time_point start = Clock::now();
+        Clock::time_point deadline = start + std::chrono::milliseconds(m_Options.DurationMs);
+        uint64_t posted = 0;
+        uint64_t completed = 0;
+        std::array<ND2_RESULT, 64> results;
+        bool selective = m_Options.SignalInterval > 1;
+        m_SelectiveCompleted = 0;
+        m_SelectiveFailures = 0;
+
+        while (completed < posted || posted < target) {
+            while (posted < target && posted - completed < m_Options.Depth) {
+                if (FAILED(Post(point.Bytes, posted + 1 == target))) {
+                    std::cerr << "Post failed at " << point.Bytes << " bytes." << std::endl;
+                    return false;
+                }
+                posted++;
+            }
+
+            if (selective) {
+                DispatchCompletions(CompletionWait::SpinThenBlock);
+                if (m_SelectiveFailures > 0) return false;
+                completed = m_SelectiveCompleted;
+            } else {
+                ULONG n = WaitForCompletions(results, CompletionWait::SpinThenBlock);
+                if (!Complete(std::span(results).first(n))) return false;
+                completed += n;
+            }
+            // A selective stream ends with one more operation, signaled, so
+            // the silent ones before it complete.
+            if (m_Options.DurationMs != 0 && target == UINT64_MAX && Clock::now() >= deadline) {
+                target = selective ? posted + 1 : posted;
+            }
+        }
+
+        point.Iterations = completed;
+        point.Nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        return true;
+    }
+
+    // One striped transfer at a time over point.Lanes lanes, each with Depth pieces in flight
+    bool RunStripedPoint(PointResult& point) {
+        using Clock = std::chrono::steady_clock;
+        StripeOptions stripe;
+        stripe.Policy = m_Options.Stripe == StripeBySize ? StripePolicy::BySize : StripePolicy::RoundRobin;
+        stripe.Depth = m_Options.Depth;
+        stripe.Lanes = point.Lanes;
+
+        Clock::time_point start = Clock::now();
+        Clock::time_point deadline = start + std::chrono::milliseconds(m_Options.DurationMs);
+        uint64_t completed = 0;
+        while (m_Options.DurationMs != 0 ? Clock::now() < deadline : completed < m_Options.Iterations) {
+            bool done = false;
+            HRESULT status = ND_SUCCESS;
+            auto onComplete = [&done, &status](const ND2_RESULT& result) {
+                status = result.Status;
+                done = true;
+            };
+            HRESULT hr = m_Options.Operation == PerfRead
+                ? ReadStriped(m_Buf, point.Bytes, m_pMr->GetLocalToken(), m_Remote.remoteAddr, m_Remote.remoteToken, onComplete, stripe)
+                : WriteStriped(m_Buf, point.Bytes, m_pMr->GetLocalToken(), m_Remote.remoteAddr, m_Remote.remoteToken, onComplete, stripe);
+            if (FAILED(hr)) {
+                std::cerr << "Striped transfer failed to start at " << point.Bytes << " bytes: " << std::hex << hr << std::endl;
+                return false;
+            }
+            while (!done) DispatchStripes(CompletionWait::SpinThenBlock);
+            if (status != ND_SUCCESS) {
+                std::cerr << "Striped transfer failed with status: " << std::hex << status << std::endl;
+                return false;
+            }
+            completed++;
+        }
+
+        point.Iterations = completed;
+        point.Nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        return true;
+    }
+
+    // One operation at a time, timed with the TSC
+    bool RunLatencyPoint(PointResult& point) {
+        using Clock = std::chrono::steady_clock;
+        bool isSend = m_Options.Operation == PerfSend;
+        ND2_SGE receiveSge = { m_Buf, m_BufferSize, m_pMr->GetLocalToken() };
+
+        for (uint64_t i = 0; i < LATENCY_WARMUP; i++) {
+            if (FAILED(Post(point.Bytes)) || !Drain(isSend ? 2 : 1)) return false;
+            if (isSend && FAILED(PostReceive(&receiveSge, 1, RECV_CTXT))) return false;
+        }
+
+        Clock::time_point start = Clock::now();
+        Clock::time_point deadline = start + std::chrono::milliseconds(m_Options.DurationMs);
+        for (uint64_t i = 0; m_Options.DurationMs != 0 || i < m_Options.Iterations; i++) {
+            if (m_Options.DurationMs != 0 && (i & 63) == 0 && Clock::now() >= deadline) break;
+
+            uint64_t begin = Tsc::Now();
+            if (FAILED(Post(point.Bytes)) || !Drain(isSend ? 2 : 1)) {
+                std::cerr << "Operation failed at " << point.Bytes << " bytes." << std::endl;
+                return false;
+            }
+            uint64_t ticks = Tsc::Now() - begin;
+            if (isSend) ticks /= 2;
+            point.Latency.Record(static_cast<uint64_t>(static_cast<double>(ticks) * m_NsPerTick));
+
+            if (isSend && FAILED(PostReceive(&receiveSge, 1, RECV_CTXT))) {
+                std::cerr << "PostReceive failed." << std::endl;
+                return false;
+            }
+        }
+
+        point.Iterations = point.Latency.Count();
+        point.Nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        return true;
+    }
+
+    // The zero-byte marker tells the server the size point (or, for reads and
+    // writes, the whole run) is over; its acknowledgement means every data
+    // message has been received.
+    bool Synchronize() {
+        ND2_SGE receiveSge = { m_Buf, m_BufferSize, m_pMr->GetLocalToken() };
+        if (FAILED(Send(nullptr, 0, 0, SEND_CTXT)) || !Drain(2)) {
+            std::cerr << "End of size point failed." << std::endl;
+            return false;
+        }
+        return SUCCEEDED(PostReceive(&receiveSge, 1, RECV_CTXT));
+    }
+
+    void PrintHeader() const {
+        std::cout << "\n " << OperationName(m_Options.Operation) << (m_Options.Latency ? " latency" : " bandwidth")
+                  << ", depth " << (m_Options.Latency ? 1 : m_Options.Depth) << ", " << m_Options.Sge << " SGE"
+                  << ", inline " << InlineName(m_Options.Inline) << ", user buffers " << UserBuffersName(m_Options.UserBuffers);
+        if (m_Options.Lanes > 0) std::cout << ", striped " << StripeName(m_Options.Stripe);
+        if (m_Options.SignalInterval > 1) std::cout << ", signaled every " << m_Options.SignalInterval;
+        std::cout << std::endl;
+        if (m_Options.Latency) {
+            std::cout << std::setw(12) << "#bytes" << std::setw(14) << "#iterations" << std::setw(12) << "t_min[us]"
+                      << std::setw(12) << "t_avg[us]" << std::setw(12) << "t_p50[us]" << std::setw(12) << "t_p99[us]"
+                      << std::setw(14) << "t_p99.9[us]" << std::setw(12) << "t_max[us]" << std::endl;
+        } else {
+            std::cout << std::setw(12) << "#bytes";
+            if (m_Options.Lanes > 0) std::cout << std::setw(8) << "#lanes";
+            std::cout << std::setw(14) << "#iterations" << std::setw(16) << "BW[Gbps]"
+                      << std::setw(16) << "MsgRate[Mpps]" << std::endl;
+        }
+    }
+
+    void PrintPoint(const PointResult& point) const {
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << std::setw(12) << point.Bytes;
+        if (m_Options.Lanes > 0) std::cout << std::setw(8) << point.Lanes;
+        std::cout << std::setw(14) << point.Iterations;
+        if (m_Options.Latency) {
+            const LatencyHistogram& h = point.Latency;
+            std::cout << std::setw(12) << CalculateLatencyMicroseconds(h.Min())
+                      << std::setw(12) << CalculateLatencyMicroseconds(static_cast<uint64_t>(h.Mean()))
+                      << std::setw(12) << CalculateLatencyMicroseconds(h.Percentile(50.0))
+                      << std::setw(12) << CalculateLatencyMicroseconds(h.Percentile(99.0))
+                      << std::setw(14) << CalculateLatencyMicroseconds(h.Percentile(99.9))
+                      << std::setw(12) << CalculateLatencyMicroseconds(h.Max()) << std::endl;
+        } else {
+            double seconds = static_cast<double>(point.Nanoseconds) / 1e9;
+            std::cout << std::setw(16) << CalculateGbps(point.Bytes * point.Iterations, point.Nanoseconds)
+                      << std::setw(16) << (static_cast<double>(point.Iterations) / seconds / 1e6) << std::endl;
+        }
+    }
+
+    PerfOptions m_Options;
+    std::vector<std::unique_ptr<char[]>> m_UserBuffers;
+    ULONG m_NextUserBuffer = 0;
+    ND2_ADAPTER_INFO m_Info = {};
+    PeerInfo m_Remote = {};
+    ULONG m_BufferSize = 0;
+    double m_NsPerTick = 1.0;
+    std::vector<PointResult> m_Results;
+    uint64_t m_SelectiveCompleted = 0;
+    uint64_t m_SelectiveFailures = 0;
+};
+
+// MARK: Export
+void WriteCsv(std::ostream& out, const PerfOptions& options, const std::vector<PointResult>& results) {
+    out << "operation,mode,depth,sge,inline,user_buffers,lanes,bytes,iterations,seconds,gbps,mpps";
+    for (const auto& [name, percentile] : LatencyHistogram::ReportedPercentiles) out << "," << name << "_ns";
+    out << ",min_ns,mean_ns,max_ns\n";
+
+    for (const PointResult& point : results) {
+        double seconds = static_cast<double>(point.Nanoseconds) / 1e9;
+        out << OperationName(options.Operation) << "," << (options.Latency ? "lat" : "bw") << ","
+            << (options.Latency ? 1 : options.Depth) << "," << options.Sge << "," << InlineName(options.Inline) << ","
+            << UserBuffersName(options.UserBuffers) << "," << point.Lanes << ","
+            << point.Bytes << "," << point.Iterations << "," << seconds << ",";
+        if (options.Latency) {
+            out << ",";
+            for (const auto& [name, percentile] : LatencyHistogram::ReportedPercentiles) out << "," << point.Latency.Percentile(percentile);
+            out << "," << point.Latency.Min() << "," << point.Latency.Mean() << "," << point.Latency.Max() << "\n";
+        } else {
+            out << CalculateGbps(point.Bytes * point.Iterations, point.Nanoseconds) << ","
+                << (static_cast<double>(point.Iterations) / seconds / 1e6);
+            for (size_t i = 0; i < LatencyHistogram::ReportedPercentiles.size(); i++) out << ",";
+            out << ",,,\n";
+        }
+    }
+}
+
+void WriteJson(std::ostream& out, const PerfOptions& options, const std::vector<PointResult>& results) {
+    out << "{\n";
+    out << "  \"operation\": \"" << OperationName(options.Operation) << "\",\n";
+    out << "  \"mode\": \"" << (options.Latency ? "lat" : "bw") << "\",\n";
+    out << "  \"depth\": " << (options.Latency ? 1 : options.Depth) << ",\n";
+    out << "  \"sge\": " << options.Sge << ",\n";
+    out << "  \"inline\": \"" << InlineName(options.Inline) << "\",\n";
+    out << "  \"user_buffers\": \"" << UserBuffersName(options.UserBuffers) << "\",\n";
+    if (options.Lanes > 0) out << "  \"stripe\": \"" << StripeName(options.Stripe) << "\",\n";
+    if (options.SignalInterval > 1) out << "  \"signal_interval\": " << options.SignalInterval << ",\n";
+    out << "  \"points\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const PointResult& point = results[i];
+        double seconds = static_cast<double>(point.Nanoseconds) / 1e9;
+        out << (i == 0 ? "\n" : ",\n") << "    { \"bytes\": " << point.Bytes;
+        if (options.Lanes > 0) out << ", \"lanes\": " << point.Lanes;
+        out << ", \"iterations\": " << point.Iterations
+            << ", \"seconds\": " << seconds;
+        if (options.Latency) {
+            out << ", \"min_ns\": " << point.Latency.Min() << ", \"mean_ns\": " << point.Latency.Mean();
+            for (const auto& [name, percentile] : LatencyHistogram::ReportedPercentiles) {
+                out << ", \"" << name << "_ns\": " << point.Latency.Percentile(percentile);
+            }
+            out << ", \"max_ns\": " << point.Latency.Max() << " }";
+        } else {
+            out << ", \"gbps\": " << CalculateGbps(point.Bytes * point.Iterations, point.Nanoseconds)
+                << ", \"mpps\": " << (static_cast<double>(point.Iterations) / seconds / 1e6) << " }";
+        }
+    }
+    out << "\n  ]\n}\n";
+}
+
+void ExportResults(const PerfOptions& options, const std::vector<PointResult>& results, const char* path) {
+    std::string name(path);
+    bool csv = name.size() >= 4 && name.compare(name.size() - 4, 4, ".csv") == 0;
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Could not open " << path << " for writing." << std::endl;
+        return;
+    }
+    if (csv) {
+        WriteCsv(out, options, results);
+    } else {
+        WriteJson(out, options, results);
+    }
+    std::cout << "Results written to " << path << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        ShowUsage();
+        return 1;
+    }
+
+    bool isServer = false;
+    int nAddresses = 0;
+    if (strcmp(argv[1], "-s") == 0) {
+        isServer = true;
+        nAddresses = 1;
+    } else if (strcmp(argv[1], "-c") == 0 && argc >= 4) {
+        nAddresses = 2;
+    } else {
+        ShowUsage();
+        return 1;
+    }
+
+    PerfOptions options;
+    const char* outputPath = nullptr;
+    bool maxSizeSet = false;
+    for (int i = 2 + nAddresses; i < argc; i++) {
+        const char* option = argv[i];
+        const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if (strcmp(option, "-l") == 0) {
+            options.Latency = 1;
+        } else if (strcmp(option, "-a") == 0) {
+            options.MinSize = 2;
+            options.MaxSize = 8ULL << 20;
+            maxSizeSet = true;
+        } else if (value == nullptr) {
+            ShowUsage();
+            return 1;
+        } else if (strcmp(option, "-t") == 0) {
+            if (strcmp(value, "send") == 0) options.Operation = PerfSend;
+            else if (strcmp(value, "read") == 0) options.Operation = PerfRead;
+            else if (strcmp(value, "write") == 0) options.Operation = PerfWrite;
+            else { ShowUsage(); return 1; }
+            i++;
+        } else if (strcmp(option, "-I") == 0) {
+            if (strcmp(value, "auto") == 0) options.Inline = InlineAuto;
+            else if (strcmp(value, "on") == 0) options.Inline = InlineAlways;
+            else if (strcmp(value, "off") == 0) options.Inline = InlineNever;
+            else { ShowUsage(); return 1; }
+            i++;
+        } else if (strcmp(option, "-U") == 0) {
+            if (strcmp(value, "cached") == 0) options.UserBuffers = UserBuffersCached;
+            else if (strcmp(value, "uncached") == 0) options.UserBuffers = UserBuffersUncached;
+            else { ShowUsage(); return 1; }
+            i++;
+        } else if (strcmp(option, "-S") == 0) {
+            if (strcmp(value, "rr") == 0) options.Stripe = StripeRoundRobin;
+            else if (strcmp(value, "size") == 0) options.Stripe = StripeBySize;
+            else { ShowUsage(); return 1; }
+            i++;
+        } else if (strcmp(option, "-N") == 0) {
+            options.SignalInterval = std::max<UINT32>(static_cast<UINT32>(strtoul(value, nullptr, 10)), 1);
+            i++;
+        } else if (strcmp(option, "-Q") == 0) {
+            options.Lanes = static_cast<UINT32>(strtoul(value, nullptr, 10));
+            i++;
+        } else if (strcmp(option, "-m") == 0) {
+            options.MinSize = ParseSize(value);
+            i++;
+        } else if (strcmp(option, "-M") == 0) {
+            options.MaxSize = ParseSize(value);
+            maxSizeSet = true;
+            i++;
+        } else if (strcmp(option, "-d") == 0) {
+            options.Depth = static_cast<UINT32>(strtoul(value, nullptr, 10));
+            i++;
+        } else if (strcmp(option, "-g") == 0) {
+            options.Sge = static_cast<UINT32>(strtoul(value, nullptr, 10));
+            i++;
+        } else if (strcmp(option, "-n") == 0) {
+            options.Iterations = strtoull(value, nullptr, 10);
+            i++;
+        } else if (strcmp(option, "-D") == 0) {
+            options.DurationMs = static_cast<UINT32>(strtod(value, nullptr) * 1000.0);
+            i++;
+        } else if (strcmp(option, "-o") == 0) {
+            outputPath = value;
+            i++;
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    if (!maxSizeSet) options.MaxSize = options.MinSize;
+    if (options.MinSize == 0 || options.MinSize > options.MaxSize || options.MaxSize > MAX_MESSAGE_SIZE) {
+        std::cerr << "Message sizes must satisfy 0 < min <= max <= 1GB." << std::endl;
+        return 1;
+    }
+    if (options.Lanes > 0 && (options.Operation == PerfSend || options.Latency || options.UserBuffers != UserBuffersOff)) {
+        std::cerr << "Striping (-Q) applies to read and write bandwidth from the session's buffer only." << std::endl;
+        return 1;
+    }
+
+    if (options.SignalInterval > 1 && (options.Latency || options.Lanes > 0)) {
+        std::cerr << "Selective signaling (-N) applies to bandwidth tests on the main QP only." << std::endl;
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    if (isServer) {
+        PerfServer server;
+        if (server.Setup(argv[2])) {
+            server.Run(argv[2]);
+        } else {
+            std::cerr << "Server setup failed." << std::endl;
+        }
+    } else { // Client
+        PerfClient client(options);
+        if (client.Setup(argv[2])) {
+            client.Run(argv[2], argv[3]);
+            if (outputPath != nullptr && !client.Results().empty()) {
+                ExportResults(client.Options(), client.Results(), outputPath);
+            }
+        } else {
+            std::cerr << "Client setup failed." << std::endl;
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+    return 0;
+}
@@ -0,0 +1,321 @@
+#include "NDSession.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Many connections served by a few threads. Every server and client session
+// owns its CQ, and the sessions are shared out over one NDReactor per thread,
+// which sleeps on a single wait for all of its CQs. Each connection then plays
+// callback-driven ping-pong: the client's receive handler sends the next
+// message and the server's echoes it back. The connections are set up from
+// one thread beforehand by an NDEventLoop. Servers and clients share the
+// reactors unless -s and -c split them into separate processes.
+
+constexpr USHORT BASE_PORT = 54800;     // connection i uses BASE_PORT + i
+constexpr ULONG MESSAGE_SIZE = 64;
+constexpr ULONG DEFAULT_CONNECTIONS = 64;
+constexpr ULONG DEFAULT_ROUNDS = 2000;
+constexpr ULONG MAX_CONNECTIONS = 1024;
+
+void ShowUsage() {
+    printf("reactor [options] [local_ip]\n"
+           "Options:\n"
+           "\t-n <connections>  - Connections, at most %u (default: %u)\n"
+           "\t-r <rounds>       - Round trips per connection (default: %u)\n"
+           "\t-t <threads>      - Reactor threads (default: one per core)\n"
+           "\t-s                - Run only the servers\n"
+           "\t-c                - Run only the clients\n"
+           "Without -s or -c both sides run in this process (default address 127.0.0.1).\n",
+           MAX_CONNECTIONS, DEFAULT_CONNECTIONS, DEFAULT_ROUNDS);
+}
+
+// What the handlers report back to the main thread.
+struct Progress {
+    std::atomic<ULONG> Finished{ 0 };
+    std::atomic<ULONG> Failed{ 0 };
+};
+
+// MARK: PingPongPeer
+// A session with one receive slot and one send slot of MESSAGE_SIZE each.
+template <typename Session>
+class PingPongPeer : public Session {
+    public:
+    ULONG Rounds() const { return m_Rounds; }
+
+    protected:
+    bool SetupPeer(char* localAddr, ULONG rounds, Progress* pProgress) {
+        m_Target = rounds;
+        m_pProgress = pProgress;
+        if (!this->Initialize(localAddr)) return false;
+        if (FAILED(this->CreateCQ(16))) return false;
+        if (FAILED(this->CreateQP(2, 1))) return false;
+        if (FAILED(this->CreateMR())) return false;
+        if (FAILED(this->RegisterDataBuffer(2 * MESSAGE_SIZE, ND_MR_FLAG_ALLOW_LOCAL_WRITE))) return false;
+        if (FAILED(this->CreateConnector())) return false;
+
+        UINT32 token = this->m_pMr->GetLocalToken();
+        m_ReceiveSge = { this->m_Buf, MESSAGE_SIZE, token };
+        m_SendSge = { static_cast<char*>(this->m_Buf) + MESSAGE_SIZE, MESSAGE_SIZE, token };
+        return true;
+    }
+
+    NDHandshake LocalHandshake() const {
+        return NDSessionBase::MakeHandshake(nullptr, 0, 0, 1, MESSAGE_SIZE);
+    }
+
+    HRESULT PostNextReceive() {
+        return this->PostReceive(&m_ReceiveSge, 1, [this](const ND2_RESULT& result) { OnReceive(result); });
+    }
+
+    HRESULT SendSlot() {
+        return this->Send(&m_SendSge, 1, 0, [this](const ND2_RESULT& result) {
+            if (FAILED(result.Status)) Finish(false);
+        });
+    }
+
+    UINT32 Sequence(const ND2_RESULT& received) const {
+        UINT32 sequence = UINT32_MAX;
+        if (received.BytesTransferred == MESSAGE_SIZE) std::memcpy(&sequence, m_ReceiveSge.Buffer, sizeof(sequence));
+        return sequence;
+    }
+
+    void Finish(bool ok) {
+        if (m_Finished) return;
+        m_Finished = true;
+        if (!ok) m_pProgress->Failed.fetch_add(1, std::memory_order_relaxed);
+        m_pProgress->Finished.fetch_add(1, std::memory_order_release);
+    }
+
+    virtual void OnReceive(const ND2_RESULT& result) = 0;
+
+    ND2_SGE m_ReceiveSge = {};
+    ND2_SGE m_SendSge = {};
+    ULONG m_Rounds = 0;
+    ULONG m_Target = 0;
+
+    private:
+    Progress* m_pProgress = nullptr;
+    bool m_Finished = false;
+};
+
+// MARK: PingPongServer
+class PingPongServer : public PingPongPeer<NDSessionServerBase> {
+    public:
+    bool Setup(char* localAddr, USHORT port, ULONG rounds, Progress* pProgress) {
+        if (!SetupPeer(localAddr, rounds, pProgress)) return false;
+        if (FAILED(CreateListener())) return false;
+
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%u", localAddr, port);
+        return SUCCEEDED(Listen(fullAddress));
+    }
+
+    // The first receive goes up before the accept, since the client may send
+    // as soon as it is connected.
+    NDTask<HRESULT> Accept() {
+        NDHandshake client;
+        HRESULT hr = co_await GetConnectionRequestAsync(&client);
+        if (FAILED(hr)) co_return hr;
+        hr = PostNextReceive();
+        if (FAILED(hr)) co_return hr;
+        co_return co_await AcceptAsync(0, 0, LocalHandshake());
+    }
+
+    private:
+    // The next receive is posted before the echo, which lets the client send again.
+    void OnReceive(const ND2_RESULT& result) override {
+        if (FAILED(result.Status) || Sequence(result) != m_Rounds) return Finish(false);
+        std::memcpy(m_SendSge.Buffer, m_ReceiveSge.Buffer, MESSAGE_SIZE);
+        if (++m_Rounds < m_Target && FAILED(PostNextReceive())) return Finish(false);
+        if (FAILED(SendSlot())) return Finish(false);
+        if (m_Rounds == m_Target) Finish(true);
+    }
+};
+
+// MARK: PingPongClient
+class PingPongClient : public PingPongPeer<NDSessionClientBase> {
+    public:
+    bool Setup(char* localAddr, ULONG rounds, Progress* pProgress) {
+        return SetupPeer(localAddr, rounds, pProgress);
+    }
+
+    NDTask<HRESULT> Connect(char* localAddr, const char* serverAddr, USHORT port) {
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%u", serverAddr, port);
+
+        NDHandshake server;
+        HRESULT hr = co_await ConnectAsync(localAddr, fullServerAddress, 0, 0, LocalHandshake(), &server, 0);
+        if (FAILED(hr)) co_return hr;
+        co_return co_await CompleteConnectAsync();
+    }
+
+    // Sends the first message; the receive handler sends every later one.
+    void Start() {
+        if (FAILED(SendNext())) Finish(false);
+    }
+
+    private:
+    HRESULT SendNext() {
+        HRESULT hr = PostNextReceive();
+        if (FAILED(hr)) return hr;
+        UINT32 sequence = m_Rounds;
+        std::memcpy(m_SendSge.Buffer, &sequence, sizeof(sequence));
+        return SendSlot();
+    }
+
+    void OnReceive(const ND2_RESULT& result) override {
+        if (FAILED(result.Status) || Sequence(result) != m_Rounds) return Finish(false);
+        if (++m_Rounds == m_Target) return Finish(true);
+        if (FAILED(SendNext())) Finish(false);
+    }
+};
+
+// Counts the setup tasks that fail, since spawned tasks' results are discarded.
+static NDTask<HRESULT> Counted(NDTask<HRESULT> task, ULONG* pFailed) {
+    HRESULT hr = co_await task;
+    if (FAILED(hr)) {
+        std::cerr << "Connection setup failed: " << std::hex << hr << std::dec << std::endl;
+        (*pFailed)++;
+    }
+    co_return hr;
+}
+
+int main(int argc, char* argv[]) {
+    ULONG connections = DEFAULT_CONNECTIONS;
+    ULONG rounds = DEFAULT_ROUNDS;
+    ULONG threads = std::max(1u, std::thread::hardware_concurrency());
+    bool runServers = true;
+    bool runClients = true;
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = defaultAddr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) {
+            connections = std::stoul(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            rounds = std::stoul(argv[++i]);
+        } else if (arg == "-t" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (arg == "-s") {
+            runClients = false;
+        } else if (arg == "-c") {
+            runServers = false;
+        } else if (arg[0] != '-') {
+            localAddr = argv[i];
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    if (connections == 0 || connections > MAX_CONNECTIONS || rounds == 0 || threads == 0 || (!runServers && !runClients)) {
+        ShowUsage();
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    bool ok = true;
+    {
+        // Declared first so they outlive the sessions registered with them.
+        std::vector<std::unique_ptr<NDReactor>> reactors;
+        for (ULONG i = 0; i < threads; i++) reactors.push_back(std::make_unique<NDReactor>());
+        NDEventLoop loop;
+
+        Progress progress;
+        std::vector<std::unique_ptr<PingPongServer>> servers;
+        std::vector<std::unique_ptr<PingPongClient>> clients;
+        for (ULONG i = 0; ok && i < connections; i++) {
+            USHORT port = static_cast<USHORT>(BASE_PORT + i);
+            if (runServers) {
+                auto pServer = std::make_unique<PingPongServer>();
+                ok = pServer->Setup(localAddr, port, rounds, &progress) && SUCCEEDED(loop.Attach(*pServer));
+                servers.push_back(std::move(pServer));
+            }
+            if (ok && runClients) {
+                auto pClient = std::make_unique<PingPongClient>();
+                ok = pClient->Setup(localAddr, rounds, &progress) && SUCCEEDED(loop.Attach(*pClient));
+                clients.push_back(std::move(pClient));
+            }
+        }
+
+        ULONG setupFailures = 0;
+        for (ULONG i = 0; ok && i < connections; i++) {
+            USHORT port = static_cast<USHORT>(BASE_PORT + i);
+            if (runServers) loop.Spawn(Counted(servers[i]->Accept(), &setupFailures));
+            if (runClients) loop.Spawn(Counted(clients[i]->Connect(localAddr, localAddr, port), &setupFailures));
+        }
+        if (ok) loop.Run();
+        ok = ok && setupFailures == 0;
+        if (!ok) std::cerr << "Setup failed." << std::endl;
+
+        // The loop hands the sessions over; a connection's two ends land on
+        // different reactors whenever there is more than one.
+        for (ULONG i = 0; ok && i < connections; i++) {
+            if (runServers) {
+                loop.Detach(*servers[i]);
+                ok = SUCCEEDED(reactors[i % threads]->Register(*servers[i]));
+            }
+            if (ok && runClients) {
+                loop.Detach(*clients[i]);
+                ok = SUCCEEDED(reactors[(i + 1) % threads]->Register(*clients[i]));
+            }
+        }
+
+        if (ok) {
+            for (const auto& pClient : clients) pClient->Start();
+
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> reactorThreads;
+            for (const auto& pReactor : reactors) reactorThreads.emplace_back([&pReactor]() { pReactor->Run(); });
+
+            ULONG sessions = static_cast<ULONG>(servers.size() + clients.size());
+            while (progress.Finished.load(std::memory_order_acquire) < sessions) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            for (const auto& pReactor : reactors) pReactor->Stop();
+            for (std::thread& thread : reactorThreads) thread.join();
+
+            UINT64 completed = 0;
+            for (const auto& pServer : servers) completed += pServer->Rounds();
+            for (const auto& pClient : clients) completed += pClient->Rounds();
+            if (runServers && runClients) completed /= 2;
+            std::cout << connections << " connections on " << threads << " reactor threads completed " << completed
+                      << " round trips of " << MESSAGE_SIZE << " bytes in " << seconds * 1000 << " ms ("
+                      << completed / seconds / 1000 << " k round trips/s)." << std::endl;
+            for (ULONG i = 0; i < threads; i++) {
+                const NDReactor::Stats& stats = reactors[i]->GetStats();
+                std::cout << "  reactor " << i << ": " << reactors[i]->Sessions() << " sessions, " << stats.Wakeups
+                          << " wakeups, " << stats.Completions << " completions ("
+                          << (stats.Wakeups > 0 ? static_cast<double>(stats.Completions) / stats.Wakeups : 0)
+                          << " per wakeup)" << std::endl;
+            }
+            ULONG failed = progress.Failed.load();
+            if (failed > 0) std::cerr << failed << " sessions failed." << std::endl;
+            ok = failed == 0 && completed == static_cast<UINT64>(connections) * rounds;
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    std::cout << (ok ? "Reactor passed." : "Reactor FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <iomanip>
 
 constexpr char TEST_PORT[] = "54321";
 
@@ -14,7 +15,7 @@ constexpr char TEST_PORT[] = "54321";
 #undef min
 
 constexpr size_t CHUNK_SIZE = 536870912ULL;
-constexpr size_t TEST_BUFFER_SIZE = std::max(536870912ULL, CHUNK_SIZE); // At least 512MB or chunk size
+constexpr size_t TEST_BUFFER_SIZE = std::max<size_t>(536870912ULL, CHUNK_SIZE); // At least 512MB or chunk size
 
 static size_t maxSge = 32; // Temporary value for deciding test size
 static size_t THROUGHPUT_TEST_SIZE = CHUNK_SIZE * maxSge;
@@ -47,12 +48,6 @@ double CalculateLatencyMicroseconds(uint64_t nanoseconds) {
     return static_cast<double>(nanoseconds) / 1000.0;
 }
 
-struct PeerInfo {
-    UINT64 remoteAddr;
-    UINT32 remoteToken;
-};
-
-
 void ShowUsage() {
     printf("rdma.exe [options]\n"
            "Options:\n"
@@ -81,15 +76,10 @@ public:
         if (FAILED(CreateQP(info.MaxReceiveQueueDepth, info.MaxInitiatorQueueDepth, info.MaxReceiveSge, info.MaxInitiatorSge))) return false;
         if (FAILED(CreateMR())) return false;
 
-        ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE;
+        // The peer both writes to and reads from this buffer.
+        ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE | ND_MR_FLAG_ALLOW_REMOTE_READ;
         if (FAILED(RegisterDataBuffer(TEST_BUFFER_SIZE, flags))) return false;
 
-        ND2_SGE sge = { 0 };
-        sge.Buffer = m_Buf;
-        sge.BufferLength = TEST_BUFFER_SIZE;
-        sge.MemoryRegionToken = m_pMr->GetLocalToken();
-        // Do not bind here, it leads to QP failure
-
         if (FAILED(CreateListener())) return false;
         if (FAILED(CreateConnector())) return false;
 
@@ -103,73 +93,26 @@ public:
         if (FAILED(Listen(fullAddress))) return;
 
         std::cout << "Waiting for connection request..." << std::endl;
-        if (FAILED(GetConnectionRequest())) {
+        NDHandshake remoteInfo;
+        if (FAILED(GetConnectionRequest(&remoteInfo))) {
             std::cout << "GetConnectionRequest failed. Reason: " << std::hex << GetResult() << std::endl;
             return;
         }
+        std::cout << "Client's buffer: remoteAddr = " << remoteInfo.BufferAddress
+                  << ", remoteToken = " << remoteInfo.BufferToken << std::endl;
 
-        std::cout << "Accepting connection..." << std::endl;
-        if (FAILED(Accept(1, 1, nullptr, 0))) return;
-        
-        CreateMW();
-        Bind(m_Buf, TEST_BUFFER_SIZE, ND_OP_FLAG_ALLOW_WRITE | ND_OP_FLAG_ALLOW_READ);
-
-        std::cout << "Connection established. Waiting for client's PeerInfo..." << std::endl;
-        std::cout << "My address: " << reinterpret_cast<UINT64>(m_Buf) << ", token: " << m_pMw->GetRemoteToken() << std::endl;
-        
-        ND2_SGE sge = { 0 };
-        sge.Buffer = m_Buf;
-        sge.BufferLength = sizeof(PeerInfo);
-        sge.MemoryRegionToken = m_pMr->GetLocalToken();
-
-        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
-            std::cerr << "PostReceive for PeerInfo failed." << std::endl;
-            return;
-        }
-        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
-            std::cerr << "WaitForCompletion for PeerInfo failed." << std::endl;
-            return;
-        }
-        
-        PeerInfo* receivedInfo = reinterpret_cast<PeerInfo*>(m_Buf);
-        std::cout << "Received PeerInfo from client: remoteAddr = " << receivedInfo->remoteAddr
-                  << ", remoteToken = " << receivedInfo->remoteToken << std::endl;
-
-        sge = { m_Buf, sizeof(PeerInfo), m_pMr->GetLocalToken() };
-
-        PeerInfo remoteInfo;
-        remoteInfo.remoteAddr = receivedInfo->remoteAddr;
-        remoteInfo.remoteToken = receivedInfo->remoteToken;
-
-        ZeroMemory(m_Buf, TEST_BUFFER_SIZE);
-        
-        PeerInfo* myInfo = reinterpret_cast<PeerInfo*>(m_Buf);
-        myInfo->remoteAddr = reinterpret_cast<UINT64>(m_Buf);
-        myInfo->remoteToken = m_pMw->GetRemoteToken();
-
-        sge.BufferLength = sizeof(PeerInfo);
-
-        std::this_thread::sleep_for(std::chrono::seconds(1)); // Give time for client to prepare
-
-        if (FAILED(Send(&sge, 1, 0, SEND_CTXT))) {
-            std::cerr << "Send of my PeerInfo failed." << std::endl;
-            return;
-        }
-        if (!WaitForCompletionAndCheckContext(SEND_CTXT)) {
-            std::cerr << "WaitForCompletion for my PeerInfo send failed." << std::endl;
-            return;
-        }
-
-        // Get client's notification
+        // Posted before accepting, so it is in place whenever the client finishes.
         if (FAILED(PostReceive(nullptr, 0, RECV_CTXT))) {
-            std::cerr << "PostReceive for notification failed." << std::endl;
+            std::cerr << "PostReceive for client's RMA operations failed." << std::endl;
             return;
         }
 
-        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
-            std::cerr << "WaitForCompletion for notification failed." << std::endl;
-            return;
-        }
+        // The buffer is advertised under the MR's remote token, which exists
+        // before the connection does.
+        std::cout << "Accepting connection..." << std::endl;
+        std::cout << "My address: " << reinterpret_cast<UINT64>(m_Buf) << ", token: " << m_pMr->GetRemoteToken() << std::endl;
+        if (FAILED(Accept(1, 1, MakeHandshake(m_Buf, TEST_BUFFER_SIZE, m_pMr->GetRemoteToken(), 1)))) return;
+        std::cout << "Connection established." << std::endl;
 
         std::cout << "TEST: Wrtie throughput test (Server -> Client)" << std::endl;
         std::cout << "Writing " << NUM_CHUNKS << " chunks of " << FormatBytes(CHUNK_SIZE)
@@ -183,7 +126,7 @@ public:
         for (int chunk = 0; chunk < NUM_CHUNKS; chunk++) {
             ND2_SGE sge = { m_Buf, static_cast<ULONG>(CHUNK_SIZE), m_pMr->GetLocalToken() };
 
-            if (FAILED(Write(&sge, 1, remoteInfo.remoteAddr, remoteInfo.remoteToken, 0, WRITE_CTXT))) {
+            if (FAILED(Write(&sge, 1, remoteInfo.BufferAddress, remoteInfo.BufferToken, 0, WRITE_CTXT))) {
                 std::cerr << "Write failed for chunk " << (chunk + 1) << "." << std::endl;
                 return;
             }
@@ -216,7 +159,7 @@ public:
 
         for (int chunk = 0; chunk < NUM_CHUNKS; chunk++) {
             ND2_SGE sge = { m_Buf, static_cast<ULONG>(CHUNK_SIZE), m_pMr->GetLocalToken() };
-            if (FAILED(Read(&sge, 1, remoteInfo.remoteAddr, remoteInfo.remoteToken, 0, READ_CTXT))) {
+            if (FAILED(Read(&sge, 1, remoteInfo.BufferAddress, remoteInfo.BufferToken, 0, READ_CTXT))) {
                 std::cerr << "Read failed for chunk " << (chunk + 1) << "." << std::endl;
                 return;
             }
@@ -250,10 +193,6 @@ public:
         }
 
         // Wait for client to finish
-        if (FAILED(PostReceive(nullptr, 0, RECV_CTXT))) {
-            std::cerr << "PostReceive for client's RMA operations failed." << std::endl;
-            return;
-        }
         if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
             std::cerr << "WaitForCompletion for client's RMA operations failed." << std::endl;
             return;
@@ -276,10 +215,8 @@ public:
         if (FAILED(CreateQP(info.MaxReceiveQueueDepth, info.MaxInitiatorQueueDepth, info.MaxReceiveSge, info.MaxInitiatorSge))) return false;
         if (FAILED(CreateMR())) return false;
 
-        // This flag does not limit remote to read the memory region.
-        // Guess write is super-permission of read.
-        // It's different for MemoryWindow, see line 305.
-        ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE;
+        // The peer both writes to and reads from this buffer.
+        ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE | ND_MR_FLAG_ALLOW_REMOTE_READ;
         if (FAILED(RegisterDataBuffer(TEST_BUFFER_SIZE, flags))) return false;
         if (FAILED(CreateConnector())) return false;
 
@@ -287,11 +224,8 @@ public:
     }
 
     void Run(const char* localAddr, const char* serverAddr) {
-        ND2_SGE sge = { 0 };
-        sge.Buffer = m_Buf;
-        sge.BufferLength = TEST_BUFFER_SIZE;
-        sge.MemoryRegionToken = m_pMr->GetLocalToken();
-        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
+        // Posted before connecting, so it is in place whenever the server finishes.
+        if (FAILED(PostReceive(nullptr, 0, RECV_CTXT))) {
             std::cerr << "PostReceive failed." << std::endl;
             return;
         }
@@ -300,7 +234,10 @@ public:
         sprintf_s(fullServerAddress, "%s:%s", serverAddr, TEST_PORT);
 
         std::cout << "Connecting from " << localAddr << " to " << fullServerAddress << "..." << std::endl;
-        if (FAILED(Connect(localAddr, fullServerAddress, 1, 1, nullptr, 0))) {
+        std::cout << "My address: " << reinterpret_cast<UINT64>(m_Buf) << ", token: " << m_pMr->GetRemoteToken() << std::endl;
+        NDHandshake remoteInfo;
+        if (FAILED(Connect(localAddr, fullServerAddress, 1, 1, MakeHandshake(m_Buf, TEST_BUFFER_SIZE, m_pMr->GetRemoteToken(), 1),
+            &remoteInfo))) {
              std::cerr << "Connect failed." << std::endl;
              return;
         }
@@ -309,77 +246,10 @@ public:
             std::cerr << "CompleteConnect failed." << std::endl;
             return;
         }
-        std::cout << "Connection established." << std::endl;
-
-        CreateMW();
-        // However, MemoryWindow should be specified to allow both read and write separately.
-        Bind(m_Buf, TEST_BUFFER_SIZE, ND_OP_FLAG_ALLOW_WRITE | ND_OP_FLAG_ALLOW_READ);
-
-        PeerInfo* myInfo = reinterpret_cast<PeerInfo*>(m_Buf);
-        myInfo->remoteAddr = reinterpret_cast<UINT64>(m_Buf);
-        myInfo->remoteToken = m_pMw->GetRemoteToken();
-
-        std::cout << "My address: " << myInfo->remoteAddr << ", token: " << myInfo->remoteToken << std::endl;
-
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-
-        sge = { m_Buf, sizeof(PeerInfo), m_pMr->GetLocalToken() };
-        if (FAILED(Send(&sge, 1, 0, SEND_CTXT))) {
-            std::cerr << "Send failed." << std::endl;
-            return;
-        }
-        if (!WaitForCompletionAndCheckContext(SEND_CTXT)) {
-            std::cerr << "WaitForCompletion for send failed." << std::endl;
-            return;
-        }
-
-        std::cout << "Peer information sent. Waiting for server's PeerInfo..." << std::endl;
-
-        memset(m_Buf, 0, TEST_BUFFER_SIZE);
-
-        sge = { m_Buf, sizeof(PeerInfo), m_pMr->GetLocalToken() };
-
-        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
-            std::cerr << "PostReceive for server's PeerInfo failed." << std::endl;
-            return;
-        }
-        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
-            std::cerr << "WaitForCompletion for server's PeerInfo failed." << std::endl;
-            return;
-        }
-
-        std::cout << "Received PeerInfo from server: remoteAddr = " 
-                  << reinterpret_cast<PeerInfo*>(m_Buf)->remoteAddr
-                  << ", remoteToken = " << reinterpret_cast<PeerInfo*>(m_Buf)->remoteToken << std::endl;
-
-        PeerInfo remoteInfo;
-        remoteInfo.remoteAddr = reinterpret_cast<PeerInfo*>(m_Buf)->remoteAddr;
-        remoteInfo.remoteToken = reinterpret_cast<PeerInfo*>(m_Buf)->remoteToken;
-
-        memset(m_Buf, 0, TEST_BUFFER_SIZE);
-
-        // Notify Server
-
-        auto now = GetCurrentTimestamp();
-        while (GetCurrentTimestamp() - now < 1000000) {
-            continue;
-        }
-
-        if (FAILED(Send(nullptr, 0, 0, SEND_CTXT))) {
-            std::cerr << "Send notification to server failed." << std::endl;
-            return;
-        }
-
-        if (!WaitForCompletionAndCheckContext(SEND_CTXT)) {
-            std::cerr << "WaitForCompletion for notification send failed." << std::endl;
-            return;
-        }
+        std::cout << "Connection established. Server's buffer: remoteAddr = " << remoteInfo.BufferAddress
+                  << ", remoteToken = " << remoteInfo.BufferToken << std::endl;
 
         // Wait until server runs RMA operations
-        if (FAILED(PostReceive(nullptr, 0, RECV_CTXT))) {
-            std::cerr << "PostReceive for server's RMA operations failed." << std::endl;
-            return;
-        }
         if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
             std::cerr << "WaitForCompletion for server's RMA operations failed." << std::endl;
             return;
@@ -395,7 +265,7 @@ public:
 
         for (int chunk = 0; chunk < NUM_CHUNKS; chunk++) {
             ND2_SGE sge = { m_Buf, static_cast<ULONG>(CHUNK_SIZE), m_pMr->GetLocalToken() };
-            if (FAILED(Write(&sge, 1, remoteInfo.remoteAddr, remoteInfo.remoteToken, 0, WRITE_CTXT))) {
+            if (FAILED(Write(&sge, 1, remoteInfo.BufferAddress, remoteInfo.BufferToken, 0, WRITE_CTXT))) {
                 std::cerr << "Write failed for chunk " << (chunk + 1) << "." << std::endl;
                 return;
             }
@@ -428,7 +298,7 @@ public:
         startTime = std::chrono::high_resolution_clock::now();
         for (int chunk = 0; chunk < NUM_CHUNKS; chunk++) {
             ND2_SGE sge = { m_Buf, static_cast<ULONG>(CHUNK_SIZE), m_pMr->GetLocalToken() };
-            if (FAILED(Read(&sge, 1, remoteInfo.remoteAddr, remoteInfo.remoteToken, 0, READ_CTXT))) {
+            if (FAILED(Read(&sge, 1, remoteInfo.BufferAddress, remoteInfo.BufferToken, 0, READ_CTXT))) {
                 std::cerr << "Read failed for chunk " << (chunk + 1) << "." << std::endl;
                 return;
             }
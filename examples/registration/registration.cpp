@@ -0,0 +1,200 @@
+#include "NDSession.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Registration time against buffer size and thread count. One buffer of the
+// largest size is allocated and faulted in up front, so only registration is
+// timed. For every size from 64 MB upwards it is registered once as a single
+// memory region and then as an NDSegmentedRegion from 1, 2, 4, ... threads;
+// each time is the best of a few runs. Every segmented registration is also
+// checked: the pieces of a range must follow the segment boundaries and carry
+// the token of the segment they lie in.
+
+constexpr UINT64 MB = 1024 * 1024;
+constexpr UINT64 MIN_SIZE = 64 * MB;
+constexpr ULONG DEFAULT_MAX_SIZE_MB = 1024;
+constexpr ULONG DEFAULT_SEGMENT_SIZE_MB = 64;
+constexpr ULONG DEFAULT_REPEATS = 3;
+
+void ShowUsage() {
+    printf("registration [options] [local_ip]\n"
+           "Options:\n"
+           "\t-m <MB>       - Largest buffer, at least %llu (default: %u)\n"
+           "\t-g <MB>       - Segment size (default: %u)\n"
+           "\t-t <threads>  - Most registration threads (default: one per core)\n"
+           "\t-r <runs>     - Runs per measurement; the best counts (default: %u)\n"
+           "Registers on the adapter at local_ip (default 127.0.0.1).\n",
+           static_cast<unsigned long long>(MIN_SIZE / MB), DEFAULT_MAX_SIZE_MB, DEFAULT_SEGMENT_SIZE_MB, DEFAULT_REPEATS);
+}
+
+// MARK: RegistrationBench
+class RegistrationBench : public NDSessionClientBase {
+public:
+    ~RegistrationBench() {
+        NDMemory::Free(m_pBuffer, m_Length, Allocation);
+    }
+
+    bool Setup(char* localAddr, UINT64 length) {
+        if (!Initialize(localAddr)) return false;
+        if (FAILED(CreateMR())) return false;
+
+        m_Length = length;
+        m_pBuffer = NDMemory::Allocate(length, GetAdapterLocality().NumaNode, Allocation);
+        if (m_pBuffer == nullptr) {
+            std::cerr << "Failed to allocate " << length / MB << " MB." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Milliseconds to register length bytes as one region, or a negative
+    // value when the adapter refuses.
+    double RegisterWhole(UINT64 length) {
+        auto start = std::chrono::steady_clock::now();
+        HRESULT hr = RegisterDataBuffer(m_pBuffer, static_cast<SIZE_T>(length), Flags);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (FAILED(hr)) return -1;
+
+        hr = m_pMr->Deregister(&m_Ov);
+        if (hr == ND_PENDING) m_pMr->GetOverlappedResult(&m_Ov, true);
+        return ms;
+    }
+
+    // Milliseconds to register length bytes in segments from threads
+    // threads, or a negative value on failure or a wrong mapping.
+    double RegisterSegmented(UINT64 length, SIZE_T segmentSize, ULONG threads) {
+        NDSegmentedRegion region;
+        auto start = std::chrono::steady_clock::now();
+        HRESULT hr = NDSessionBase::RegisterSegmented(&region, m_pBuffer, length, Flags, segmentSize, threads);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (FAILED(hr)) return -1;
+        return CheckMapping(region) ? ms : -1;
+    }
+
+private:
+    static constexpr ULONG Flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE;
+    static constexpr ULONG Allocation = NDMemory::LargePages | NDMemory::Prefault;
+
+    // A range straddling each boundary, and the whole buffer.
+    static bool CheckMapping(const NDSegmentedRegion& region) {
+        std::vector<NDSegmentedRegion::Piece> pieces(region.SegmentCount());
+        ULONG count = region.Map(0, region.Length(), pieces.data(), region.SegmentCount());
+        UINT64 covered = 0;
+        for (ULONG i = 0; i < count; i++) {
+            const NDSegmentedRegion::Segment& segment = region.GetSegment(i);
+            if (!segment.Registered || pieces[i].pAddress != segment.pBase || pieces[i].Length != segment.Length ||
+                pieces[i].LocalToken != segment.LocalToken || pieces[i].RemoteToken != segment.RemoteToken) {
+                return false;
+            }
+            covered += pieces[i].Length;
+        }
+        if (count != region.SegmentCount() || covered != region.Length()) return false;
+
+        for (ULONG i = 1; i < region.SegmentCount(); i++) {
+            ND2_SGE sges[2];
+            UINT64 boundary = static_cast<UINT64>(i) * region.SegmentSize();
+            if (region.BuildSges(boundary - 100, 200, sges, 2) != 2) return false;
+            if (sges[0].MemoryRegionToken != region.GetSegment(i - 1).LocalToken || sges[0].BufferLength != 100) return false;
+            if (sges[1].MemoryRegionToken != region.GetSegment(i).LocalToken || sges[1].Buffer != region.GetSegment(i).pBase) return false;
+            // Two segments cannot fit in one SGE.
+            if (region.BuildSges(boundary - 100, 200, sges, 1) != 0) return false;
+        }
+        return true;
+    }
+
+    void* m_pBuffer = nullptr;
+    UINT64 m_Length = 0;
+};
+
+int main(int argc, char* argv[]) {
+    UINT64 maxSize = DEFAULT_MAX_SIZE_MB * MB;
+    SIZE_T segmentSize = DEFAULT_SEGMENT_SIZE_MB * MB;
+    ULONG maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    ULONG repeats = DEFAULT_REPEATS;
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = defaultAddr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-m" && i + 1 < argc) {
+            maxSize = std::stoull(argv[++i]) * MB;
+        } else if (arg == "-g" && i + 1 < argc) {
+            segmentSize = static_cast<SIZE_T>(std::stoull(argv[++i]) * MB);
+        } else if (arg == "-t" && i + 1 < argc) {
+            maxThreads = std::stoul(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            repeats = std::stoul(argv[++i]);
+        } else if (arg[0] != '-') {
+            localAddr = argv[i];
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    if (maxSize < MIN_SIZE || segmentSize == 0 || maxThreads == 0 || repeats == 0) {
+        ShowUsage();
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    bool ok = true;
+    {
+        RegistrationBench bench;
+        ok = bench.Setup(localAddr, maxSize);
+
+        std::vector<ULONG> threadCounts;
+        for (ULONG threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+        threadCounts.push_back(maxThreads);
+
+        if (ok) {
+            std::cout << "Registration time in ms, best of " << repeats << ", " << segmentSize / MB << " MB segments" << std::endl;
+            printf("%10s %10s", "MB", "1 region");
+            for (ULONG threads : threadCounts) printf(" %8u thr", threads);
+            printf("\n");
+        }
+
+        for (UINT64 size = MIN_SIZE; ok; size = std::min(size * 2, maxSize)) {
+            // The single region is not checked: an adapter may cap its size.
+            double whole = -1;
+            std::vector<double> segmented(threadCounts.size(), -1);
+            for (ULONG run = 0; run < repeats; run++) {
+                double ms = bench.RegisterWhole(size);
+                if (ms >= 0 && (whole < 0 || ms < whole)) whole = ms;
+                for (size_t i = 0; i < threadCounts.size(); i++) {
+                    ms = bench.RegisterSegmented(size, segmentSize, threadCounts[i]);
+                    if (ms < 0) ok = false;
+                    else if (segmented[i] < 0 || ms < segmented[i]) segmented[i] = ms;
+                }
+            }
+
+            printf("%10llu ", static_cast<unsigned long long>(size / MB));
+            if (whole >= 0) printf("%10.2f", whole);
+            else printf("%10s", "-");
+            for (double ms : segmented) printf(" %12.2f", ms);
+            printf("\n");
+            if (size == maxSize) break;
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    std::cout << (ok ? "Registration passed." : "Registration FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
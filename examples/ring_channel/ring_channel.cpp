@@ -0,0 +1,328 @@
+#include "NDSession.hpp"
+#include "LatencyHistogram.hpp"
+#include <array>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Ping-pong latency of the same messages over the same connection, first with
+// Send and Receive, then through the RDMA-write rings. The Send side polls its
+// CQ without ever sleeping, so the difference is what the receives, their
+// completions and the CQ itself cost. The rings are advertised in the
+// connection handshake. Both sides run as threads of this process unless -s
+// and -c split them into separate processes.
+
+constexpr char TEST_PORT[] = "54327";
+constexpr ULONG DEFAULT_ITERATIONS = 10000;
+constexpr ULONG DEFAULT_MESSAGE_SIZE = 64;
+constexpr ULONG DEFAULT_RING_SIZE = 64 * 1024;
+constexpr ULONG WARMUP = 100;
+
+#define RECV_CTXT ((void*)0x1000)
+#define SEND_CTXT ((void*)0x2000)
+
+// Between polls. Spinning only pays off when the peer can make progress on
+// another core; on a single one it has to be let run.
+static void Relax() {
+    static const bool canSpin = std::thread::hardware_concurrency() > 1;
+    if (!canSpin) std::this_thread::yield();
+}
+
+void ShowUsage() {
+    printf("ring_channel [options] [local_ip]\n"
+           "Options:\n"
+           "\t-n <iterations> - Round trips per transport (default: %u)\n"
+           "\t-m <bytes>      - Message size, 1 to a quarter of the ring less 64 (default: %u)\n"
+           "\t-r <bytes>      - Ring size, a power of two of at least 1024 (default: %u)\n"
+           "\t-s              - Run only the server\n"
+           "\t-c              - Run only the client\n"
+           "Without -s or -c both sides run in this process (default address 127.0.0.1);\n"
+           "with them, give both sides the same -m.\n"
+           "Latency is half the round trip, as perftest reports it for sends.\n",
+           DEFAULT_ITERATIONS, DEFAULT_MESSAGE_SIZE, DEFAULT_RING_SIZE);
+}
+
+struct PingOptions {
+    ULONG Iterations = DEFAULT_ITERATIONS;
+    ULONG MessageSize = DEFAULT_MESSAGE_SIZE;
+    ULONG RingSize = DEFAULT_RING_SIZE;
+};
+
+// MARK: RingPeer
+// What the server and the client share. A zero-byte message ends each phase
+// and is echoed like any other.
+template <typename Session>
+class RingPeer : public Session {
+protected:
+    bool SetupPeer(char* localAddr, const PingOptions& options) {
+        m_Options = options;
+        if (!this->Initialize(localAddr)) return false;
+        if (FAILED(this->CreateCQ(64))) return false;
+        if (FAILED(this->CreateQP(4, 1))) return false;
+        if (FAILED(this->CreateMR())) return false;
+        if (FAILED(this->RegisterDataBuffer(options.MessageSize, ND_MR_FLAG_ALLOW_LOCAL_WRITE))) return false;
+        if (FAILED(this->CreateRing(options.RingSize))) return false;
+        if (FAILED(this->CreateConnector())) return false;
+        return true;
+    }
+
+    HRESULT AttachPeer(const NDHandshake& peer) {
+        if (peer.MaxMessageSize < m_Options.MessageSize) {
+            std::cerr << "Peer's ring takes messages of at most " << peer.MaxMessageSize << " bytes." << std::endl;
+            return ND_INVALID_BUFFER_SIZE;
+        }
+        return this->AttachRing(peer);
+    }
+
+    HRESULT PostMessageReceive() {
+        ND2_SGE sge = { this->m_Buf, m_Options.MessageSize, this->m_pMr->GetLocalToken() };
+        return this->PostReceive(&sge, 1, RECV_CTXT);
+    }
+
+    HRESULT SendMessage(ULONG length) {
+        ND2_SGE sge = { this->m_Buf, length, this->m_pMr->GetLocalToken() };
+        HRESULT hr = this->Send(&sge, 1, 0, SEND_CTXT);
+        if (SUCCEEDED(hr)) m_SendsOutstanding++;
+        return hr;
+    }
+
+    // Polls until the next message arrives, or with expectMessage false until
+    // every send has completed. Reposts the receive and returns the message's
+    // length, or -1 on failure.
+    LONG WaitForMessage(bool expectMessage = true) {
+        std::array<ND2_RESULT, 4> results;
+        LONG received = -2;
+        while (expectMessage ? received == -2 : m_SendsOutstanding > 0) {
+            ULONG n = this->WaitForCompletions(results, NDSessionBase::CompletionWait::Poll);
+            if (n == 0) Relax();
+            for (ULONG i = 0; i < n; i++) {
+                if (results[i].Status != ND_SUCCESS) {
+                    std::cerr << "Operation failed with status: " << std::hex << results[i].Status << std::endl;
+                    return -1;
+                }
+                if (results[i].RequestContext == SEND_CTXT) {
+                    m_SendsOutstanding--;
+                } else {
+                    received = static_cast<LONG>(results[i].BytesTransferred);
+                }
+            }
+        }
+        if (!expectMessage) return 0;
+        return SUCCEEDED(PostMessageReceive()) ? received : -1;
+    }
+
+    // The ring writes complete through DispatchCompletions, which stops at
+    // the first plain completion, so the Send phase has to leave none behind.
+    bool DrainSends() {
+        return WaitForMessage(false) == 0;
+    }
+
+    // Spins on the ring until the next record, whose length it returns.
+    ULONG WaitForRecord() {
+        ULONG length = 0;
+        while (this->PollRing([&length](const void*, ULONG n) { length = n; }) == 0) Relax();
+        return length;
+    }
+
+    HRESULT RingSendWhenFree(const void* pData, ULONG length) {
+        HRESULT hr;
+        while ((hr = this->RingSend(pData, length)) == ND_INSUFFICIENT_RESOURCES) Relax();
+        return hr;
+    }
+
+    PingOptions m_Options;
+    ULONG m_SendsOutstanding = 0;
+};
+
+// MARK: RingServer
+class RingServer : public RingPeer<NDSessionServerBase> {
+public:
+    bool Setup(char* localAddr, const PingOptions& options) {
+        if (!SetupPeer(localAddr, options)) return false;
+        if (FAILED(CreateListener())) return false;
+
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%s", localAddr, TEST_PORT);
+        return SUCCEEDED(Listen(fullAddress));
+    }
+
+    bool Run() {
+        NDHandshake client;
+        if (FAILED(GetConnectionRequest(&client))) return false;
+        if (FAILED(AttachPeer(client))) return false;
+        if (FAILED(PostMessageReceive())) return false;
+        if (FAILED(Accept(0, 0, RingHandshake()))) return false;
+
+        // Send and Receive: echo until the end marker.
+        for (;;) {
+            LONG length = WaitForMessage();
+            if (length < 0 || FAILED(SendMessage(length))) return false;
+            if (length == 0) break;
+        }
+        if (!DrainSends()) return false;
+
+        // The rings: the echo goes out from inside the handler.
+        bool ended = false;
+        HRESULT hr = ND_SUCCESS;
+        while (!ended && SUCCEEDED(hr)) {
+            ULONG n = PollRing([&](const void* pData, ULONG length) {
+                if (SUCCEEDED(hr)) hr = RingSendWhenFree(pData, length);
+                if (length == 0) ended = true;
+            });
+            if (n == 0) Relax();
+        }
+        if (FAILED(hr)) {
+            std::cerr << "Ring echo failed: " << std::hex << hr << std::endl;
+            return false;
+        }
+
+        const RingStats& stats = GetRingStats();
+        std::cout << "[server] Echoed " << stats.Received << " ring messages with " << stats.FeedbackWrites
+                  << " head updates." << std::endl;
+        DisconnectConnector();
+        return true;
+    }
+};
+
+// MARK: RingClient
+class RingClient : public RingPeer<NDSessionClientBase> {
+public:
+    bool Setup(char* localAddr, const PingOptions& options) {
+        return SetupPeer(localAddr, options);
+    }
+
+    bool Run(char* localAddr, const char* serverAddr) {
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%s", serverAddr, TEST_PORT);
+
+        if (FAILED(PostMessageReceive())) return false;
+        NDHandshake server;
+        if (FAILED(Connect(localAddr, fullServerAddress, 0, 0, RingHandshake(), &server, 0))) return false;
+        if (FAILED(AttachPeer(server))) return false;
+        if (FAILED(CompleteConnect())) return false;
+
+        double nsPerTick = Tsc::Calibrate();
+        LatencyHistogram sendLatency;
+        LatencyHistogram ringLatency;
+
+        for (ULONG i = 0; i < WARMUP + m_Options.Iterations; i++) {
+            uint64_t begin = Tsc::Now();
+            if (FAILED(SendMessage(m_Options.MessageSize)) || WaitForMessage() != static_cast<LONG>(m_Options.MessageSize)) {
+                std::cerr << "Send round trip failed." << std::endl;
+                return false;
+            }
+            if (i >= WARMUP) sendLatency.Record(static_cast<uint64_t>((Tsc::Now() - begin) * nsPerTick / 2));
+        }
+        if (FAILED(SendMessage(0)) || WaitForMessage() != 0 || !DrainSends()) return false;
+
+        std::vector<char> payload(m_Options.MessageSize, 0x5A);
+        for (ULONG i = 0; i < WARMUP + m_Options.Iterations; i++) {
+            uint64_t begin = Tsc::Now();
+            if (FAILED(RingSendWhenFree(payload.data(), m_Options.MessageSize)) || WaitForRecord() != m_Options.MessageSize) {
+                std::cerr << "Ring round trip failed." << std::endl;
+                return false;
+            }
+            if (i >= WARMUP) ringLatency.Record(static_cast<uint64_t>((Tsc::Now() - begin) * nsPerTick / 2));
+        }
+        if (FAILED(RingSendWhenFree(nullptr, 0)) || WaitForRecord() != 0) return false;
+
+        std::cout << "\n " << m_Options.MessageSize << " bytes, " << m_Options.Iterations << " round trips, "
+                  << m_Options.RingSize << " byte rings" << std::endl;
+        std::cout << std::setw(12) << "transport" << std::setw(12) << "t_min[us]" << std::setw(12) << "t_avg[us]";
+        for (const auto& [name, percentile] : LatencyHistogram::ReportedPercentiles) {
+            std::cout << std::setw(14) << (std::string("t_") + name + "[us]");
+        }
+        std::cout << std::setw(12) << "t_max[us]" << std::endl;
+        PrintRow("send", sendLatency);
+        PrintRow("ring", ringLatency);
+
+        DisconnectConnector();
+        return true;
+    }
+
+private:
+    static void PrintRow(const char* transport, const LatencyHistogram& latency) {
+        std::cout << std::fixed << std::setprecision(2) << std::setw(12) << transport << std::setw(12) << latency.Min() / 1000.0
+                  << std::setw(12) << latency.Mean() / 1000.0;
+        for (const auto& [name, percentile] : LatencyHistogram::ReportedPercentiles) {
+            std::cout << std::setw(14) << latency.Percentile(percentile) / 1000.0;
+        }
+        std::cout << std::setw(12) << latency.Max() / 1000.0 << std::endl;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    PingOptions options;
+    bool runServer = true;
+    bool runClient = true;
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = defaultAddr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) {
+            options.Iterations = std::stoul(argv[++i]);
+        } else if (arg == "-m" && i + 1 < argc) {
+            options.MessageSize = std::stoul(argv[++i]);
+        } else if (arg == "-r" && i + 1 < argc) {
+            options.RingSize = std::stoul(argv[++i]);
+        } else if (arg == "-s") {
+            runClient = false;
+        } else if (arg == "-c") {
+            runServer = false;
+        } else if (arg[0] != '-') {
+            localAddr = argv[i];
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    // A record may take up to a quarter of the ring.
+    bool ringOk = options.RingSize >= 1024 && (options.RingSize & (options.RingSize - 1)) == 0 &&
+        options.MessageSize <= options.RingSize / 4 - 64;
+    if (options.MessageSize == 0 || !ringOk || (!runServer && !runClient)) {
+        ShowUsage();
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    bool ok = true;
+    {
+        RingServer server;
+        RingClient client;
+        if (runServer && !server.Setup(localAddr, options)) {
+            std::cerr << "Server setup failed." << std::endl;
+            ok = false;
+        } else if (runClient && !client.Setup(localAddr, options)) {
+            std::cerr << "Client setup failed." << std::endl;
+            ok = false;
+        } else if (runServer && runClient) {
+            bool serverOk = false;
+            std::thread serverThread([&]() { serverOk = server.Run(); });
+            bool clientOk = client.Run(localAddr, localAddr);
+            serverThread.join();
+            ok = serverOk && clientOk;
+        } else {
+            ok = runServer ? server.Run() : client.Run(localAddr, localAddr);
+        }
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    std::cout << (ok ? "Ring channel passed." : "Ring channel FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
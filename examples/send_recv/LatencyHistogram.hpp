@@ -0,0 +1,147 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// MARK: Tsc
+// Cycle-counter timestamps for timing loops without a clock call per sample.
+// Falls back to steady_clock where there is no TSC.
+namespace Tsc {
+    inline uint64_t Now() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    // Nanoseconds per tick, measured against steady_clock. Assumes an
+    // invariant TSC, which every x86 CPU of the last decade has.
+    inline double Calibrate(std::chrono::milliseconds window = std::chrono::milliseconds(50)) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startTicks = Now();
+        while (std::chrono::steady_clock::now() - start < window) {}
+        uint64_t ticks = Now() - startTicks;
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        return ticks != 0 ? static_cast<double>(elapsed.count()) / static_cast<double>(ticks) : 1.0;
+    }
+}
+
+// MARK: LatencyHistogram
+// Log-linear histogram of nanosecond samples: every power of two is split into
+// SubBuckets linear buckets, so any recorded value is reported within 1/128
+// (< 0.8%) of itself while the whole 64-bit range fits in a fixed array.
+class LatencyHistogram {
+    public:
+    static constexpr unsigned SubBucketBits = 7;
+    static constexpr uint64_t SubBuckets = 1ULL << SubBucketBits;
+    static constexpr size_t BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+    void Record(uint64_t value) {
+        m_Counts[IndexOf(value)]++;
+        m_Count++;
+        m_Sum += value;
+        m_Min = std::min(m_Min, value);
+        m_Max = std::max(m_Max, value);
+    }
+
+    void Reset() { *this = LatencyHistogram(); }
+
+    uint64_t Count() const { return m_Count; }
+    uint64_t Min() const { return m_Count != 0 ? m_Min : 0; }
+    uint64_t Max() const { return m_Max; }
+    double Mean() const { return m_Count != 0 ? static_cast<double>(m_Sum) / static_cast<double>(m_Count) : 0.0; }
+
+    // Highest value equivalent to the sample at the given percentile, clamped
+    // to the exact maximum.
+    uint64_t Percentile(double percentile) const {
+        if (m_Count == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(m_Count)));
+        rank = std::clamp<uint64_t>(rank, 1, m_Count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BucketCount; i++) {
+            seen += m_Counts[i];
+            if (seen >= rank) return std::min(UpperBound(i), m_Max);
+        }
+        return m_Max;
+    }
+
+    // One object with the summary and every non-empty bucket.
+    void WriteJson(std::ostream& out) const {
+        out << "{\n";
+        out << "  \"unit\": \"ns\",\n";
+        out << "  \"count\": " << m_Count << ",\n";
+        out << "  \"min\": " << Min() << ",\n";
+        out << "  \"mean\": " << Mean() << ",\n";
+        for (const auto& [name, percentile] : ReportedPercentiles) {
+            out << "  \"" << name << "\": " << Percentile(percentile) << ",\n";
+        }
+        out << "  \"max\": " << m_Max << ",\n";
+        out << "  \"buckets\": [";
+        bool first = true;
+        for (size_t i = 0; i < BucketCount; i++) {
+            if (m_Counts[i] == 0) continue;
+            out << (first ? "\n" : ",\n") << "    [" << LowerBound(i) << ", " << UpperBound(i) << ", " << m_Counts[i] << "]";
+            first = false;
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    // A header and one summary row, so runs from several builds can be appended.
+    void WriteCsv(std::ostream& out, bool header = true) const {
+        if (header) {
+            out << "count,min_ns,mean_ns";
+            for (const auto& [name, percentile] : ReportedPercentiles) out << "," << name << "_ns";
+            out << ",max_ns\n";
+        }
+        out << m_Count << "," << Min() << "," << Mean();
+        for (const auto& [name, percentile] : ReportedPercentiles) out << "," << Percentile(percentile);
+        out << "," << m_Max << "\n";
+    }
+
+    struct NamedPercentile {
+        const char* Name;
+        double Value;
+    };
+    static constexpr std::array<NamedPercentile, 5> ReportedPercentiles = { {
+        { "p50", 50.0 }, { "p90", 90.0 }, { "p99", 99.0 }, { "p99.9", 99.9 }, { "p99.99", 99.99 },
+    } };
+
+    private:
+    static size_t IndexOf(uint64_t value) {
+        if (value < SubBuckets) return static_cast<size_t>(value);
+        unsigned group = static_cast<unsigned>(std::bit_width(value)) - SubBucketBits;
+        return static_cast<size_t>(group * SubBuckets + ((value >> (group - 1)) - SubBuckets));
+    }
+
+    static uint64_t LowerBound(size_t index) {
+        uint64_t group = index / SubBuckets;
+        uint64_t sub = index % SubBuckets;
+        return group == 0 ? sub : (sub + SubBuckets) << (group - 1);
+    }
+
+    static uint64_t UpperBound(size_t index) {
+        uint64_t group = index / SubBuckets;
+        return LowerBound(index) + (group == 0 ? 0 : (1ULL << (group - 1)) - 1);
+    }
+
+    std::array<uint64_t, BucketCount> m_Counts{};
+    uint64_t m_Count = 0;
+    uint64_t m_Sum = 0;
+    uint64_t m_Min = UINT64_MAX;
+    uint64_t m_Max = 0;
+};
+
+#endif // LATENCY_HISTOGRAM_HPP
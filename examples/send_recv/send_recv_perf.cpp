@@ -1,4 +1,6 @@
 ﻿#include "NDSession.hpp"
+#include "LatencyHistogram.hpp"
+#include <fstream>
 #include <iostream>
 #include <chrono>
 #include <vector>
@@ -14,14 +16,34 @@ constexpr char TEST_PORT[] = "54321";
 
 // Performance test constants
 constexpr size_t CHUNK_SIZE = 655350000;
-constexpr size_t TEST_BUFFER_SIZE = std::max(536870912ULL, CHUNK_SIZE); // At least 512MB or chunk size
+constexpr size_t TEST_BUFFER_SIZE = std::max<size_t>(536870912ULL, CHUNK_SIZE); // At least 512MB or chunk size
 
 constexpr size_t maxSge = 32; // Temporary value for deciding test size
 constexpr size_t THROUGHPUT_TEST_SIZE = CHUNK_SIZE * maxSge;
 
 constexpr int NUM_CHUNKS = static_cast<int>(THROUGHPUT_TEST_SIZE / CHUNK_SIZE);  // 20 chunks
 constexpr size_t RTT_TEST_SIZE = 1;  // Small size for RTT test
-constexpr int RTT_TEST_ITERATIONS = 10;  // Number of ping-pong iterations
+
+// Pipelined test: many messages in flight, limited by the send window. The
+// server posts its receives first and then sends a PipelineReady with how
+// many it posted; the client never has more sends outstanding than that.
+constexpr ULONG PIPELINE_MESSAGE_SIZE = 64 * 1024;
+constexpr uint64_t PIPELINE_MESSAGES = 100000;
+ULONG g_PipelineWindow = 0; // 0 = the adapter's MaxInitiatorQueueDepth
+
+struct PipelineReady {
+    ULONG ReceiveDepth;
+};
+
+// The client sends RTT_STOP instead of a ping to end the server's echo loop
+constexpr unsigned char RTT_PING = 0xEF;
+constexpr unsigned char RTT_STOP = 0x00;
+uint64_t g_RttIterations = 1000000;
+const char* g_RttOutput = nullptr; // .csv for CSV, anything else for JSON
+
+uint64_t RttWarmupIterations() {
+    return std::max<uint64_t>(1000, g_RttIterations / 100);
+}
 
 #define RECV_CTXT ((void*)0x1000)
 #define SEND_CTXT ((void*)0x2000)
@@ -60,20 +82,50 @@ std::string FormatBytes(uint64_t bytes) {
     }
 }
 
+void PrintPipelineResults(uint64_t messages, uint64_t nanoseconds) {
+    uint64_t bytes = messages * PIPELINE_MESSAGE_SIZE;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "  Results - Messages: " << messages << " (" << FormatBytes(bytes) << ")" << std::endl;
+    std::cout << "  Duration: " << (nanoseconds / 1e9) << " seconds" << std::endl;
+    std::cout << "  Throughput: " << CalculateGbps(bytes, nanoseconds) << " Gbps" << std::endl;
+    std::cout << "  Message rate: " << (static_cast<double>(messages) / (nanoseconds / 1e9) / 1e6) << " Mmsg/s" << std::endl;
+}
+
+void ExportHistogram(const LatencyHistogram& histogram, const char* path) {
+    std::string name(path);
+    bool csv = name.size() >= 4 && name.compare(name.size() - 4, 4, ".csv") == 0;
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Could not open " << path << " for writing." << std::endl;
+        return;
+    }
+    if (csv) {
+        histogram.WriteCsv(out);
+    } else {
+        histogram.WriteJson(out);
+    }
+    std::cout << "  Histogram written to " << path << std::endl;
+}
+
 void ShowUsage() {
     printf("rdma_perf.exe [options]\n"
            "Options:\n"
            "\t-s <local_ip>           - Start as server\n"
            "\t-c <local_ip> <server_ip> - Start as client\n"
+           "\t-w <window>             - Most sends in flight for the pipelined test (default: the server's receive depth)\n"
+           "\t-n <iterations>         - Timed RTT iterations, after a 1%% warm-up (default: 1000000)\n"
+           "\t-o <file.json|file.csv> - Write the RTT histogram to a file (client only)\n"
            "\nThe program automatically runs all performance tests:\n"
            "\t1. Basic connectivity test (existing)\n"
            "\t2. Throughput Send Test (client->server, %dx%lluGB chunks)\n"
            "\t3. Throughput Receive Test (server->client, %dx%lluGB chunks)\n"
-           "\t4. Round-Trip Time Test (%d iterations)\n"
+           "\t4. Pipelined Test (client->server, %llu messages of %luKB)\n"
+           "\t5. Round-Trip Time Test (%llu iterations, p50 to p99.99)\n"
            "\nBuffer size: %lluMB static allocation\n",
            NUM_CHUNKS, CHUNK_SIZE / (1024ULL*1024*1024),
            NUM_CHUNKS, CHUNK_SIZE / (1024ULL*1024*1024),
-           RTT_TEST_ITERATIONS,
+           static_cast<unsigned long long>(PIPELINE_MESSAGES), static_cast<unsigned long>(PIPELINE_MESSAGE_SIZE / 1024),
+           static_cast<unsigned long long>(g_RttIterations),
            TEST_BUFFER_SIZE / (1024ULL*1024));
 }
 
@@ -93,9 +145,15 @@ public:
         if (FAILED(CreateCQ(info.MaxCompletionQueueDepth))) return false;
         if (FAILED(CreateQP(info.MaxReceiveQueueDepth, info.MaxInitiatorQueueDepth, info.MaxReceiveSge, info.MaxInitiatorSge))) return false;
         if (FAILED(CreateMR())) return false;
+        m_ReceiveDepth = info.MaxReceiveQueueDepth;
 
         ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE;
-        if (FAILED(RegisterDataBuffer(static_cast<DWORD>(TEST_BUFFER_SIZE), flags))) return false;
+        // No Prefault: the memset before the first test faults the pages in.
+        auto registerStart = std::chrono::high_resolution_clock::now();
+        if (FAILED(RegisterDataBuffer(TEST_BUFFER_SIZE, flags, NDMemory::LargePages))) return false;
+        std::cout << "Allocated and registered " << FormatBytes(TEST_BUFFER_SIZE) << " in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - registerStart).count()
+                  << " ms" << std::endl;
 
         if (FAILED(CreateListener())) return false;
         if (FAILED(CreateConnector())) return false;
@@ -211,14 +269,17 @@ public:
         std::cout << "  Results - Sent: " << totalSent << " bytes (" << (totalSent / (1024*1024*1024)) << " GB)" << std::endl;
         std::cout << "  Duration: " << (duration.count() / 1e9) << " seconds" << std::endl;
         std::cout << "  Throughput: " << gbps << " Gbps" << std::endl;
+
+        // Test 3: Pipelined Test (Client -> Server)
+        std::cout << "TEST 3: Pipelined Test (Client -> Server)" << std::endl;
+        if (!ReceivePipelined()) return;
         #endif // TEST_THROUGHPUT
 
-        // Test 3: RTT Test (Server responds to pings)
-        std::cout << "\nTEST 3: Round-Trip Time Test (Server responding to pings)" << std::endl;
-        std::cout << "Responding to " << RTT_TEST_ITERATIONS << " ping-pong iterations..." << std::endl;
+        // Test 4: RTT Test (Server responds to pings)
+        std::cout << "\nTEST 4: Round-Trip Time Test (Server responding to pings)" << std::endl;
+        std::cout << "Echoing pings until the client stops..." << std::endl;
 
         // Two postreceives to create some room
-
         sge = { m_Buf, static_cast<ULONG>(RTT_TEST_SIZE), m_pMr->GetLocalToken() };
         HRESULT one = PostReceive(&sge, 1, RECV_CTXT);
         HRESULT two = PostReceive(&sge, 1, RECV_CTXT);
@@ -226,25 +287,20 @@ public:
             std::cerr << "PostReceive failed in RTT test." << std::endl;
             return;
         }
-        
-        for (uint32_t i = 0; i < RTT_TEST_ITERATIONS; i++) {
-            std::cout << "  Waiting for ping " << (i + 1) << "/" << RTT_TEST_ITERATIONS << "..." << std::endl;
-            
-            // Receive ping from client
-            sge = { m_Buf, static_cast<ULONG>(RTT_TEST_SIZE), m_pMr->GetLocalToken() };
-            
-            if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
-                std::cerr << "PostReceive failed in RTT test." << std::endl;
-                return;
-            }
+
+        // No I/O in here: the client times every round trip.
+        uint64_t pings = 0;
+        for (;;) {
             if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
                 std::cerr << "WaitForCompletion failed in RTT test." << std::endl;
                 return;
             }
-            
-            //std::cout << "  Received ping " << (i + 1) << ", sending pong back..." << std::endl;
-            
-            // Send pong back to client
+            if (static_cast<unsigned char*>(m_Buf)[0] == RTT_STOP) break;
+
+            if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
+                std::cerr << "PostReceive failed in RTT test." << std::endl;
+                return;
+            }
             if (FAILED(Send(&sge, 1, ND_OP_FLAG_INLINE, SEND_CTXT))) {
                 std::cerr << "Send failed in RTT test." << std::endl;
                 return;
@@ -253,10 +309,10 @@ public:
                 std::cerr << "WaitForCompletion failed in RTT test." << std::endl;
                 return;
             }
-            
-            std::cout << "  Ping-pong " << (i + 1) << " completed." << std::endl;
+            pings++;
         }
-        
+
+        std::cout << "  Echoed " << pings << " pings" << std::endl;
         std::cout << "  RTT test completed on server side" << std::endl;
 
         std::cout << "\n================================================" << std::endl;
@@ -265,6 +321,66 @@ public:
 
         Shutdown();
     }
+
+    private:
+    // Keeps the receive queue full and reposts as messages land. The client
+    // starts once the first batch is posted and it has been told the depth.
+    bool ReceivePipelined() {
+        std::cout << "Receiving " << PIPELINE_MESSAGES << " messages of " << FormatBytes(PIPELINE_MESSAGE_SIZE)
+                  << " with up to " << m_ReceiveDepth << " receives posted..." << std::endl;
+
+        ND2_SGE sge = { m_Buf, PIPELINE_MESSAGE_SIZE, m_pMr->GetLocalToken() };
+        uint64_t posted = 0;
+        uint64_t completed = 0;
+        bool failed = false;
+        auto onComplete = [&completed, &failed](const ND2_RESULT& result) {
+            if (FAILED(result.Status)) failed = true;
+            completed++;
+        };
+        auto postReceives = [&]() {
+            while (posted < PIPELINE_MESSAGES && posted - completed < m_ReceiveDepth) {
+                HRESULT hr = PostReceive(&sge, 1, onComplete);
+                if (hr == ND_NO_MORE_ENTRIES || hr == ND_INSUFFICIENT_RESOURCES) break;
+                if (FAILED(hr)) {
+                    std::cerr << "PostReceive failed in pipelined test: " << std::hex << hr << std::dec << std::endl;
+                    return false;
+                }
+                posted++;
+            }
+            return true;
+        };
+
+        if (!postReceives()) return false;
+        if (posted == 0) {
+            std::cerr << "No receives could be posted for the pipelined test." << std::endl;
+            return false;
+        }
+
+        // Sent from past the receive area, so no landing message overwrites it.
+        PipelineReady* pReady = reinterpret_cast<PipelineReady*>(static_cast<char*>(m_Buf) + PIPELINE_MESSAGE_SIZE);
+        pReady->ReceiveDepth = static_cast<ULONG>(posted);
+        ND2_SGE readySge = { pReady, sizeof(PipelineReady), m_pMr->GetLocalToken() };
+        if (FAILED(Send(&readySge, 1, 0, SEND_CTXT)) || !WaitForCompletionAndCheckContext(SEND_CTXT)) {
+            std::cerr << "Send of ready message failed in pipelined test." << std::endl;
+            return false;
+        }
+
+        auto startTime = std::chrono::high_resolution_clock::now();
+        while (completed < PIPELINE_MESSAGES && !failed) {
+            DispatchCompletions(CompletionWait::SpinThenBlock);
+            if (!failed && !postReceives()) return false;
+        }
+        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - startTime);
+
+        if (failed) {
+            std::cerr << "A receive failed in pipelined test." << std::endl;
+            return false;
+        }
+        PrintPipelineResults(completed, duration.count());
+        return true;
+    }
+
+    ULONG m_ReceiveDepth = 0;
 };
 
 // MARK: TestClient
@@ -279,9 +395,15 @@ public:
         if (FAILED(CreateCQ(info.MaxCompletionQueueDepth))) return false;
         if (FAILED(CreateQP(info.MaxReceiveQueueDepth, info.MaxInitiatorQueueDepth, info.MaxReceiveSge, info.MaxInitiatorSge))) return false;
         if (FAILED(CreateMR())) return false;
+        m_Window = g_PipelineWindow != 0 ? std::min(g_PipelineWindow, info.MaxInitiatorQueueDepth) : info.MaxInitiatorQueueDepth;
 
         ULONG flags = ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE;
-        if (FAILED(RegisterDataBuffer(static_cast<DWORD>(TEST_BUFFER_SIZE), flags))) return false;
+        // No Prefault: the memset before the first test faults the pages in.
+        auto registerStart = std::chrono::high_resolution_clock::now();
+        if (FAILED(RegisterDataBuffer(TEST_BUFFER_SIZE, flags, NDMemory::LargePages))) return false;
+        std::cout << "Allocated and registered " << FormatBytes(TEST_BUFFER_SIZE) << " in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - registerStart).count()
+                  << " ms" << std::endl;
         if (FAILED(CreateConnector())) return false;
 
         return true;
@@ -378,6 +500,10 @@ public:
             }
         }
 
+        // The server sends the pipelined test's ready message as soon as this
+        // test ends, so its receive has to be in place before then.
+        if (!PostReadyReceive()) return;
+
         // Second loop: Wait for all completions
         for (int chunk = 0; chunk < NUM_CHUNKS; chunk++) {
             if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
@@ -394,14 +520,15 @@ public:
         std::cout << "  Results - Received: " << THROUGHPUT_TEST_SIZE << " bytes (" << (THROUGHPUT_TEST_SIZE / (1024*1024*1024)) << " GB)" << std::endl;
         std::cout << "  Duration: " << (duration.count() / 1e9) << " seconds" << std::endl;
         std::cout << "  Throughput: " << gbps << " Gbps" << std::endl;
+
+        // Test 3: Pipelined Test (Client -> Server)
+        std::cout << "TEST 3: Pipelined Test (Client -> Server)" << std::endl;
+        if (!SendPipelined()) return;
         #endif // TEST_THROUGHPUT
 
-        // Test 3: RTT Test (Client initiates pings)
-        std::cout << "\nTEST 3: Round-Trip Time Test (Client initiating pings)" << std::endl;
-        std::cout << "Running " << RTT_TEST_ITERATIONS << " ping-pong iterations..." << std::endl;
-        
-        std::vector<uint64_t> rttMeasurements;
-        rttMeasurements.reserve(RTT_TEST_ITERATIONS);
+        // Test 4: RTT Test (Client initiates pings)
+        std::cout << "\nTEST 4: Round-Trip Time Test (Client initiating pings)" << std::endl;
+        std::cout << "Running " << RttWarmupIterations() << " warm-up and " << g_RttIterations << " timed ping-pong iterations..." << std::endl;
 
         // PostReceive twice to create some room
         sge = { m_Buf, static_cast<ULONG>(RTT_TEST_SIZE), m_pMr->GetLocalToken() };
@@ -412,76 +539,128 @@ public:
             return;
         }
 
-        // Hold 100ms
-        auto now = std::chrono::high_resolution_clock::now();
-        while (std::chrono::high_resolution_clock::now() - now < std::chrono::milliseconds(100)) {
-            _mm_pause();
+        double nsPerTick = Tsc::Calibrate();
+        LatencyHistogram histogram;
+        memset(m_Buf, RTT_PING, RTT_TEST_SIZE);
+
+        if (!PingPong(RttWarmupIterations(), nsPerTick, nullptr)) return;
+        ResetWaitStats();
+        if (!PingPong(g_RttIterations, nsPerTick, &histogram)) return;
+
+        // Tell the server to stop echoing
+        static_cast<unsigned char*>(m_Buf)[0] = RTT_STOP;
+        if (FAILED(Send(&sge, 1, ND_OP_FLAG_INLINE, SEND_CTXT)) || !WaitForCompletionAndCheckContext(SEND_CTXT)) {
+            std::cerr << "Send of stop message failed in RTT test." << std::endl;
+            return;
         }
-        
-        for (uint32_t i = 0; i < RTT_TEST_ITERATIONS; i++) {
-            std::cout << "  Starting ping-pong " << (i + 1) << "/" << RTT_TEST_ITERATIONS << "..." << std::endl;
-            
-            // Fill buffer with test pattern
-            memset(m_Buf, 0xEF, RTT_TEST_SIZE);
-            sge = { m_Buf, static_cast<ULONG>(RTT_TEST_SIZE), m_pMr->GetLocalToken() };
-            
-            auto rttStart = std::chrono::high_resolution_clock::now();
-            
-            // Send ping to server
+
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << "  Results - Iterations: " << histogram.Count() << std::endl;
+        std::cout << "  Min RTT: " << CalculateLatencyMicroseconds(histogram.Min()) << " μs" << std::endl;
+        std::cout << "  Average RTT: " << CalculateLatencyMicroseconds(static_cast<uint64_t>(histogram.Mean())) << " μs" << std::endl;
+        for (const auto& [name, percentile] : LatencyHistogram::ReportedPercentiles) {
+            std::cout << "  " << name << " RTT: " << CalculateLatencyMicroseconds(histogram.Percentile(percentile)) << " μs" << std::endl;
+        }
+        std::cout << "  Max RTT: " << CalculateLatencyMicroseconds(histogram.Max()) << " μs" << std::endl;
+        if (g_RttOutput != nullptr) ExportHistogram(histogram, g_RttOutput);
+
+        WaitStats waitStats = GetWaitStats();
+        std::cout << "  Waits satisfied by spinning: " << waitStats.SpinHits << ", by event: " << waitStats.EventWaits
+                  << " (spin budget " << waitStats.SpinBudget.count() / 1000.0 << " μs)" << std::endl;
+
+        std::cout << "\n================================================" << std::endl;
+        std::cout << "ALL PERFORMANCE TESTS COMPLETED - CLIENT SIDE" << std::endl;
+        std::cout << "================================================" << std::endl;
+
+        Shutdown();
+    }
+
+    private:
+    // Times each round trip with the TSC. Nothing in the loop does I/O or allocates.
+    bool PingPong(uint64_t iterations, double nsPerTick, LatencyHistogram* pHistogram) {
+        ND2_SGE sge = { m_Buf, static_cast<ULONG>(RTT_TEST_SIZE), m_pMr->GetLocalToken() };
+        for (uint64_t i = 0; i < iterations; i++) {
+            uint64_t start = Tsc::Now();
             if (FAILED(Send(&sge, 1, ND_OP_FLAG_INLINE, SEND_CTXT))) {
                 std::cerr << "Send failed in RTT test." << std::endl;
-                return;
+                return false;
             }
             if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
-              std::cerr << "PostReceive failed in RTT test." << std::endl;
-              return;
+                std::cerr << "PostReceive failed in RTT test." << std::endl;
+                return false;
             }
-            if (!WaitForCompletionAndCheckContext(SEND_CTXT)) {
+            if (!WaitForCompletionAndCheckContext(SEND_CTXT) || !WaitForCompletionAndCheckContext(RECV_CTXT)) {
                 std::cerr << "WaitForCompletion failed in RTT test." << std::endl;
-                return;
+                return false;
             }
-            
-            //std::cout << "  Ping " << (i + 1) << " sent, waiting for pong..." << std::endl;
-            
-            // Receive pong from server
+            uint64_t ticks = Tsc::Now() - start;
+            if (pHistogram) pHistogram->Record(static_cast<uint64_t>(static_cast<double>(ticks) * nsPerTick));
+        }
+        return true;
+    }
 
-            if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
-                std::cerr << "WaitForCompletion failed in RTT test." << std::endl;
-                return;
-            }
-            
-            auto rttEnd = std::chrono::high_resolution_clock::now();
-            auto rttTime = std::chrono::duration_cast<std::chrono::nanoseconds>(rttEnd - rttStart);
-            rttMeasurements.push_back(rttTime.count());
-            
-            std::cout << "  Ping-pong " << (i + 1) << " completed. RTT: " << CalculateLatencyMicroseconds(rttTime.count()) << " μs." << std::endl;
+    PipelineReady* ReadyMessage() const {
+        return reinterpret_cast<PipelineReady*>(static_cast<char*>(m_Buf) + PIPELINE_MESSAGE_SIZE);
+    }
+
+    bool PostReadyReceive() {
+        ND2_SGE sge = { ReadyMessage(), sizeof(PipelineReady), m_pMr->GetLocalToken() };
+        if (FAILED(PostReceive(&sge, 1, RECV_CTXT))) {
+            std::cerr << "PostReceive of ready message failed." << std::endl;
+            return false;
         }
-        
-        // Calculate RTT statistics
-        double totalRTT = 0;
-        uint64_t minRTT = UINT64_MAX;
-        uint64_t maxRTT = 0;
-        
-        for (uint64_t rtt : rttMeasurements) {
-            totalRTT += rtt;
-            minRTT = std::min(minRTT, rtt);
-            maxRTT = std::max(maxRTT, rtt);
+        return true;
+    }
+
+    // Waits for the server's receives to be posted, then keeps up to as many
+    // sends outstanding as it posted and refills as they complete, so the
+    // result reflects link bandwidth rather than per-message latency.
+    bool SendPipelined() {
+        if (!WaitForCompletionAndCheckContext(RECV_CTXT)) {
+            std::cerr << "Did not receive the ready message for the pipelined test." << std::endl;
+            return false;
         }
-        
-        double avgRTT = totalRTT / rttMeasurements.size();
-        
-        std::cout << std::fixed << std::setprecision(2);
-        std::cout << "  Results - Iterations: " << RTT_TEST_ITERATIONS << std::endl;
-        std::cout << "  Average RTT: " << CalculateLatencyMicroseconds(avgRTT) << " μs" << std::endl;
-        std::cout << "  Min RTT: " << CalculateLatencyMicroseconds(minRTT) << " μs" << std::endl;
-        std::cout << "  Max RTT: " << CalculateLatencyMicroseconds(maxRTT) << " μs" << std::endl;
+        ULONG window = std::min(m_Window, ReadyMessage()->ReceiveDepth);
+        if (window == 0) {
+            std::cerr << "The server posted no receives for the pipelined test." << std::endl;
+            return false;
+        }
+        std::cout << "Sending " << PIPELINE_MESSAGES << " messages of " << FormatBytes(PIPELINE_MESSAGE_SIZE)
+                  << " with a window of " << window << "..." << std::endl;
+
+        ND2_SGE sge = { m_Buf, PIPELINE_MESSAGE_SIZE, m_pMr->GetLocalToken() };
+        uint64_t posted = 0;
+        uint64_t completed = 0;
+        bool failed = false;
+        auto onComplete = [&completed, &failed](const ND2_RESULT& result) {
+            if (FAILED(result.Status)) failed = true;
+            completed++;
+        };
 
-        std::cout << "\n================================================" << std::endl;
-        std::cout << "ALL PERFORMANCE TESTS COMPLETED - CLIENT SIDE" << std::endl;
-        std::cout << "================================================" << std::endl;
+        auto startTime = std::chrono::high_resolution_clock::now();
+        while (completed < PIPELINE_MESSAGES && !failed) {
+            while (posted < PIPELINE_MESSAGES && posted - completed < window) {
+                HRESULT hr = Send(&sge, 1, 0, onComplete);
+                if (hr == ND_NO_MORE_ENTRIES || hr == ND_INSUFFICIENT_RESOURCES) break;
+                if (FAILED(hr)) {
+                    std::cerr << "Send failed in pipelined test: " << std::hex << hr << std::dec << std::endl;
+                    return false;
+                }
+                posted++;
+            }
+            DispatchCompletions(CompletionWait::SpinThenBlock);
+        }
+        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - startTime);
 
-        Shutdown();
+        if (failed) {
+            std::cerr << "A send failed in pipelined test." << std::endl;
+            return false;
+        }
+        PrintPipelineResults(completed, duration.count());
+        return true;
     }
+
+    ULONG m_Window = 0; // the local limit; the server's depth may lower it
 };
 
 // NOTE: This function appears to be unused in the main flow but keeping for potential future use
@@ -535,11 +714,27 @@ int main(int argc, char* argv[]) {
     }
 
     bool isServer = false;
+    // Trailing options come in pairs after the addresses
+    int nArgs = argc;
+    while (nArgs >= 5) {
+        const char* option = argv[nArgs - 2];
+        const char* value = argv[nArgs - 1];
+        if (strcmp(option, "-w") == 0) {
+            g_PipelineWindow = static_cast<ULONG>(strtoul(value, nullptr, 10));
+        } else if (strcmp(option, "-n") == 0) {
+            g_RttIterations = strtoull(value, nullptr, 10);
+        } else if (strcmp(option, "-o") == 0) {
+            g_RttOutput = value;
+        } else {
+            break;
+        }
+        nArgs -= 2;
+    }
     if (strcmp(argv[1], "-s") == 0) {
-        if (argc != 3) { ShowUsage(); return 1; }
+        if (nArgs != 3) { ShowUsage(); return 1; }
         isServer = true;
     } else if (strcmp(argv[1], "-c") == 0) {
-        if (argc != 4) { ShowUsage(); return 1; }
+        if (nArgs != 4) { ShowUsage(); return 1; }
         isServer = false;
     } else {
         ShowUsage();
@@ -560,7 +755,7 @@ int main(int argc, char* argv[]) {
 
     std::cout << "RDMA Performance Test Suite" << std::endl;
     std::cout << "Throughput test: " << NUM_CHUNKS << " chunks of " << (CHUNK_SIZE / (1024ULL*1024*1024)) << "GB each (total: " << (THROUGHPUT_TEST_SIZE / (1024ULL*1024*1024)) << " GB)" << std::endl;
-    std::cout << "RTT test: " << RTT_TEST_ITERATIONS << " iterations, " << RTT_TEST_SIZE << " bytes per message\n" << std::endl;
+    std::cout << "RTT test: " << g_RttIterations << " iterations (+" << RttWarmupIterations() << " warm-up), " << RTT_TEST_SIZE << " bytes per message\n" << std::endl;
 
     if (isServer) {
         TestServer server;
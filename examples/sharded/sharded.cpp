@@ -0,0 +1,277 @@
+#include "NDShard.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Scaling benchmark for NDShardedServer. For 1, 2, 4, ... shards up to the
+// number of cores it starts an echo server with that many shards, connects
+// a fixed number of clients per shard and lets each client keep a window of
+// messages in flight for a fixed time. Each shard echoes from its own send
+// pool, and the clients are driven by as many NDReactor threads as there are
+// shards. The message rate at every step shows how far the server scales with
+// its cores; on a single core there is only the one step.
+
+constexpr USHORT BASE_PORT = 55200;     // step i listens on BASE_PORT + i
+constexpr ULONG MESSAGE_SIZE = 64;
+constexpr ULONG DEFAULT_CONNECTIONS_PER_SHARD = 4;
+constexpr ULONG DEFAULT_WINDOW = 16;
+constexpr ULONG DEFAULT_DURATION_MS = 1000;
+constexpr ULONG MAX_WINDOW = 256;
+
+void ShowUsage() {
+    printf("sharded [options] [local_ip]\n"
+           "Options:\n"
+           "\t-p <connections>  - Client connections per shard (default: %u)\n"
+           "\t-w <window>       - Messages each client keeps in flight, at most %u (default: %u)\n"
+           "\t-d <ms>           - Duration of each step (default: %u)\n"
+           "\t-m <shards>       - Largest shard count (default: one per core)\n"
+           "Clients and server run in this process (default address 127.0.0.1).\n",
+           DEFAULT_CONNECTIONS_PER_SHARD, MAX_WINDOW, DEFAULT_WINDOW, DEFAULT_DURATION_MS);
+}
+
+// MARK: WindowClient
+// Keeps window messages in flight: window receive slots after one send slot,
+// and every reply reposts its slot and sends the next message.
+class WindowClient : public NDSessionClientBase {
+    public:
+    bool Setup(char* localAddr, ULONG window, const std::atomic<bool>* pRunning) {
+        m_Window = window;
+        m_pRunning = pRunning;
+        if (!Initialize(localAddr)) return false;
+        if (FAILED(CreateCQ(2 * window + 2))) return false;
+        if (FAILED(CreateQP(window, window, 1, 1))) return false;
+        if (FAILED(CreateMR())) return false;
+        if (FAILED(RegisterDataBuffer((window + 1) * MESSAGE_SIZE, ND_MR_FLAG_ALLOW_LOCAL_WRITE))) return false;
+        return SUCCEEDED(CreateConnector());
+    }
+
+    HRESULT Connect(char* localAddr, const char* serverAddr, USHORT port) {
+        char fullServerAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullServerAddress, "%s:%u", serverAddr, port);
+
+        NDHandshake server;
+        NDHandshake local = MakeHandshake(nullptr, 0, 0, m_Window, MESSAGE_SIZE);
+        HRESULT hr = NDSessionClientBase::Connect(localAddr, fullServerAddress, 0, 0, local, &server, 0);
+        if (FAILED(hr)) return hr;
+        return CompleteConnect();
+    }
+
+    HRESULT Start() {
+        UINT32 token = m_pMr->GetLocalToken();
+        m_SendSge = { m_Buf, MESSAGE_SIZE, token };
+        std::memset(m_Buf, 0x5A, MESSAGE_SIZE);
+
+        m_ReceiveSges.resize(m_Window);
+        for (ULONG i = 0; i < m_Window; i++) {
+            m_ReceiveSges[i] = { static_cast<char*>(m_Buf) + (i + 1) * MESSAGE_SIZE, MESSAGE_SIZE, token };
+            HRESULT hr = PostSlot(&m_ReceiveSges[i]);
+            if (FAILED(hr)) return hr;
+        }
+        for (ULONG i = 0; i < m_Window; i++) {
+            HRESULT hr = SendNext();
+            if (FAILED(hr)) return hr;
+        }
+        return ND_SUCCESS;
+    }
+
+    UINT64 Replies() const { return m_Replies; }
+    bool Failed() const { return m_Failed; }
+
+    private:
+    HRESULT PostSlot(const ND2_SGE* pSge) {
+        return PostReceive(pSge, 1, [this, pSge](const ND2_RESULT& result) { OnReply(pSge, result); });
+    }
+
+    HRESULT SendNext() {
+        return Send(&m_SendSge, 1, 0, [this](const ND2_RESULT& result) {
+            if (FAILED(result.Status)) m_Failed = true;
+        });
+    }
+
+    void OnReply(const ND2_SGE* pSge, const ND2_RESULT& result) {
+        if (FAILED(result.Status)) {
+            m_Failed = true;
+            return;
+        }
+        m_Replies++;
+        if (!m_pRunning->load(std::memory_order_relaxed)) return;
+        if (FAILED(PostSlot(pSge)) || FAILED(SendNext())) m_Failed = true;
+    }
+
+    ULONG m_Window = 0;
+    const std::atomic<bool>* m_pRunning = nullptr;
+    ND2_SGE m_SendSge = {};
+    std::vector<ND2_SGE> m_ReceiveSges;
+    UINT64 m_Replies = 0;
+    bool m_Failed = false;
+};
+
+// Echoes each message from the shard's own send pool; the buffer goes back
+// when the send completes.
+static void Echo(NDShard& shard, NDConnection& connection, const ND2_RESULT& result, const NDBuffer& buffer) {
+    if (FAILED(result.Status)) return;
+    NDBuffer reply = shard.AllocateBuffer(result.BytesTransferred);
+    if (!reply) {
+        std::cerr << "Shard " << shard.Index() << " ran out of send buffers." << std::endl;
+        return;
+    }
+    std::memcpy(reply.Data, buffer.Data, result.BytesTransferred);
+
+    ND2_SGE sge = reply.Sge(result.BytesTransferred);
+    HRESULT hr = shard.Send(connection, &sge, 1, 0, [pShard = &shard, pData = reply.Data](const ND2_RESULT&) {
+        pShard->FreeBuffer(pData);
+    });
+    if (FAILED(hr)) shard.FreeBuffer(reply.Data);
+}
+
+struct StepResult {
+    double Rate = 0;
+    bool Ok = false;
+};
+
+// One step of the benchmark: a server with the given shard count and
+// perShard clients for each shard.
+static StepResult RunStep(char* localAddr, USHORT port, ULONG shards, ULONG perShard, ULONG window, ULONG durationMs) {
+    StepResult step;
+    ULONG connections = shards * perShard;
+
+    NDShardOptions options;
+    options.Shards = shards;
+    options.MessageSize = MESSAGE_SIZE;
+    options.ReceiveDepth = std::max<ULONG>(256, 2 * perShard * window);
+    options.SendBuffers = std::max<ULONG>(256, 2 * perShard * window);
+    options.InitiatorDepth = window;
+    NDHandshake handshake;
+    handshake.ReceiveCredits = options.ReceiveDepth;
+    handshake.MaxMessageSize = MESSAGE_SIZE;
+    options.Handshake = handshake;
+
+    // Each new connection is announced to the next shard over the queues
+    // between shards, which the step checks at the end.
+    NDShardedServer server;
+    auto announce = [shards](NDShard& shard, NDConnection&) {
+        if (shards > 1 && !shard.Post((shard.Index() + 1) % shards, [](NDShard&) {})) {
+            std::cerr << "Shard " << shard.Index() << " could not reach its neighbour." << std::endl;
+        }
+    };
+    if (FAILED(server.Start(localAddr, port, options, announce, Echo))) return step;
+
+    std::atomic<bool> running{ true };
+    // Declared first so they outlive the sessions registered with them.
+    std::vector<std::unique_ptr<NDReactor>> reactors;
+    for (ULONG i = 0; i < shards; i++) reactors.push_back(std::make_unique<NDReactor>());
+    std::vector<std::unique_ptr<WindowClient>> clients;
+
+    bool ok = true;
+    for (ULONG i = 0; ok && i < connections; i++) {
+        auto pClient = std::make_unique<WindowClient>();
+        ok = pClient->Setup(localAddr, window, &running) && SUCCEEDED(pClient->Connect(localAddr, localAddr, port)) &&
+            SUCCEEDED(reactors[i % shards]->Register(*pClient));
+        clients.push_back(std::move(pClient));
+    }
+    if (!ok) {
+        std::cerr << "Client setup failed." << std::endl;
+        return step;
+    }
+
+    for (const auto& pClient : clients) ok = ok && SUCCEEDED(pClient->Start());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> reactorThreads;
+    for (const auto& pReactor : reactors) reactorThreads.emplace_back([&pReactor]() { pReactor->Run(); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(durationMs));
+    running.store(false, std::memory_order_relaxed);
+    for (const auto& pReactor : reactors) pReactor->Stop();
+    for (std::thread& thread : reactorThreads) thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    UINT64 replies = 0;
+    for (const auto& pClient : clients) {
+        replies += pClient->Replies();
+        ok = ok && !pClient->Failed();
+    }
+    server.Stop();
+
+    step.Rate = replies / seconds;
+    std::cout << "  " << shards << " shards, " << connections << " connections: " << step.Rate / 1000 << " k msgs/s (per shard:";
+    UINT64 announced = 0;
+    for (ULONG i = 0; i < shards; i++) {
+        const NDShard::Stats& stats = server.Shard(i).GetStats();
+        std::cout << " " << stats.Messages << (stats.Accepted == perShard ? "" : "*");
+        announced += stats.Tasks;
+    }
+    std::cout << ")" << std::endl;
+
+    step.Ok = ok && replies > 0 && server.Rejected() == 0 && announced == (shards > 1 ? connections : 0);
+    return step;
+}
+
+int main(int argc, char* argv[]) {
+    ULONG perShard = DEFAULT_CONNECTIONS_PER_SHARD;
+    ULONG window = DEFAULT_WINDOW;
+    ULONG durationMs = DEFAULT_DURATION_MS;
+    ULONG maxShards = NDShardedServer::CoreCount();
+    char defaultAddr[] = "127.0.0.1";
+    char* localAddr = defaultAddr;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-p" && i + 1 < argc) {
+            perShard = std::stoul(argv[++i]);
+        } else if (arg == "-w" && i + 1 < argc) {
+            window = std::stoul(argv[++i]);
+        } else if (arg == "-d" && i + 1 < argc) {
+            durationMs = std::stoul(argv[++i]);
+        } else if (arg == "-m" && i + 1 < argc) {
+            maxShards = std::stoul(argv[++i]);
+        } else if (arg[0] != '-') {
+            localAddr = argv[i];
+        } else {
+            ShowUsage();
+            return 1;
+        }
+    }
+    if (perShard == 0 || window == 0 || window > MAX_WINDOW || durationMs == 0 || maxShards == 0) {
+        ShowUsage();
+        return 1;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed." << std::endl;
+        return 1;
+    }
+
+    if (FAILED(NdStartup())) {
+        std::cerr << "NdStartup failed." << std::endl;
+        WSACleanup();
+        return 1;
+    }
+
+    std::vector<ULONG> steps;
+    for (ULONG shards = 1; shards < maxShards; shards *= 2) steps.push_back(shards);
+    steps.push_back(maxShards);
+
+    std::cout << "Echoing " << MESSAGE_SIZE << "-byte messages, " << perShard << " connections per shard, window "
+              << window << ", " << durationMs << " ms per step, " << NDShardedServer::CoreCount() << " cores." << std::endl;
+    bool ok = true;
+    double baseline = 0;
+    for (size_t i = 0; ok && i < steps.size(); i++) {
+        StepResult step = RunStep(localAddr, static_cast<USHORT>(BASE_PORT + i), steps[i], perShard, window, durationMs);
+        ok = step.Ok;
+        if (i == 0) baseline = step.Rate;
+        if (ok && baseline > 0) std::cout << "    speedup over 1 shard: " << step.Rate / baseline << "x" << std::endl;
+    }
+
+    NdCleanup();
+    WSACleanup();
+
+    std::cout << (ok ? "Sharded passed." : "Sharded FAILED.") << std::endl;
+    return ok ? 0 : 1;
+}
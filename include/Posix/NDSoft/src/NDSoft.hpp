@@ -0,0 +1,621 @@
+#ifndef NDSOFT_HPP
+#define NDSOFT_HPP
+#pragma once
+
+// Software implementation of the NDv2 service provider interfaces. Every
+// adapter opened in a process attaches to one shared fabric; queue pairs
+// connected through it move data with memcpy on the posting thread, so two
+// NDSession objects can connect and exchange Send/Receive and RDMA Read/Write
+// traffic without an RDMA NIC. Peers in the same process share the fabric
+// directly; peers in other processes on the host are reached through shared
+// memory (see NDSoftShm.hpp).
+
+#include <ndspi.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include <vector>
+
+namespace NDSoft {
+
+class Adapter;
+class CompletionQueue;
+class Connector;
+class Link;
+class Listener;
+class MemoryRegion;
+class MemoryWindow;
+class QueuePair;
+class SharedReceiveQueue;
+
+namespace Shm {
+struct ReceiveEntry;
+struct SharedReceives;
+struct TokenEntry;
+}
+
+// Limits reported through IND2Adapter::Query.
+constexpr ULONG MaxSge = 16;
+constexpr ULONG MaxTransferLength = 1UL << 30;
+constexpr ULONG MaxInlineDataSize = 256;
+constexpr ULONG MaxReadLimit = 128;
+constexpr ULONG MaxQueueDepth = 16384;
+constexpr ULONG MaxCompletionQueueDepth = 65536;
+constexpr ULONG MaxCallerData = 56;
+constexpr ULONG MaxCalleeData = 148;
+
+// MARK: Overlapped helpers
+// Status lives in OVERLAPPED::Internal, as on Windows. Asynchronous completions
+// also signal hEvent; synchronous ones only record the status.
+HRESULT SetOverlappedResult(OVERLAPPED* pOv, HRESULT hr);
+HRESULT CompleteOverlapped(OVERLAPPED* pOv, HRESULT hr);
+HRESULT WaitOverlapped(OVERLAPPED* pOv, BOOL wait);
+
+// MARK: Unknown
+// Reference counting and QueryInterface shared by every provider object.
+template <typename Interface, const IID& InterfaceId>
+class Unknown : public Interface {
+    public:
+    HRESULT QueryInterface(REFIID riid, LPVOID* ppvObj) override {
+        if (ppvObj == nullptr) return E_POINTER;
+        bool overlapped = std::is_base_of_v<IND2Overlapped, Interface> && riid == IID_IND2Overlapped;
+        if (riid == IID_IUnknown || riid == InterfaceId || overlapped) {
+            AddRef();
+            *ppvObj = static_cast<Interface*>(this);
+            return S_OK;
+        }
+        *ppvObj = nullptr;
+        return E_NOINTERFACE;
+    }
+
+    ULONG AddRef() override {
+        return m_nRef.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    ULONG Release() override {
+        ULONG nRef = m_nRef.fetch_sub(1, std::memory_order_acq_rel) - 1;
+        if (nRef == 0) delete this;
+        return nRef;
+    }
+
+    // Takes a reference only if the object is not already being destroyed.
+    bool TryAddRef() {
+        ULONG nRef = m_nRef.load(std::memory_order_relaxed);
+        while (nRef != 0) {
+            if (m_nRef.compare_exchange_weak(nRef, nRef + 1, std::memory_order_acquire)) return true;
+        }
+        return false;
+    }
+
+    protected:
+    virtual ~Unknown() = default;
+
+    private:
+    std::atomic<ULONG> m_nRef{ 1 };
+};
+
+// MARK: Fabric
+enum : ULONG {
+    AccessLocalWrite  = 0x1,
+    AccessRemoteRead  = 0x2,
+    AccessRemoteWrite = 0x4,
+};
+
+struct Region {
+    const char* Base = nullptr;
+    SIZE_T Length = 0;
+    ULONG Access = 0;
+};
+
+struct SockAddr {
+    sockaddr_storage Storage = {};
+    ULONG Length = 0;
+
+    bool Set(const sockaddr* pAddr, SIZE_T cbAddr);
+    const sockaddr* Get() const { return reinterpret_cast<const sockaddr*>(&Storage); }
+    USHORT Port() const;
+    void SetPort(USHORT port);
+    HRESULT CopyTo(sockaddr* pAddr, ULONG* pcbAddr) const;
+};
+
+bool IsLocalAddress(const sockaddr* pAddr);
+
+// Process-wide state every adapter shares: memory tokens, listening endpoints
+// and the shared-memory segments backing registered buffers.
+class Fabric {
+    public:
+    static Fabric& Instance();
+
+    UINT32 AllocateToken(const Region& region);
+    void UpdateToken(UINT32 token, const Region& region);
+    void FreeToken(UINT32 token);
+    // True if [pAddr, pAddr + length) lies inside the token's region and the
+    // region grants every bit of access.
+    bool CheckAccess(UINT32 token, const void* pAddr, SIZE_T length, ULONG access) const;
+    // The token table as seen by peers in other processes, or -1 if shared
+    // memory is unavailable.
+    int GetTokenTableFd() const { return m_TokenTableFd; }
+
+    // Moves the whole pages of a registered buffer onto shared segments and
+    // announces them to connected peers. Unshare drops the region's reference.
+    void ShareRegion(const Region& region);
+    void UnshareRegion(const Region& region);
+    // Sends a link every current segment and keeps it informed of changes.
+    void AttachLink(const std::shared_ptr<Link>& pLink);
+    void DetachLink(const Link* pLink);
+
+    HRESULT AddListener(const SockAddr& addr, Listener* pListener);
+    void RemoveListener(Listener* pListener);
+    // Returns the listener with a reference held, or nullptr.
+    Listener* AcquireListener(const sockaddr* pAddr);
+
+    UINT64 NextAdapterId();
+    USHORT NextPort();
+
+    private:
+    Fabric();
+
+    struct TokenSlot {
+        NDSoft::Region Region;
+        UINT32 Generation = 0;
+        bool InUse = false;
+    };
+
+    struct Segment {
+        SIZE_T Length;
+        int Fd;
+        UINT64 Id;
+        ULONG nRef;
+    };
+
+    void PublishToken(UINT32 index, const TokenSlot& slot);
+    bool CreateSegment(char* pBase, SIZE_T length);
+
+    mutable std::shared_mutex m_TokenLock;
+    std::vector<TokenSlot> m_Tokens;
+    std::vector<UINT32> m_FreeTokens;
+    Shm::TokenEntry* m_pSharedTokens = nullptr;
+    int m_TokenTableFd = -1;
+
+    std::mutex m_SegmentLock;
+    std::map<uintptr_t, Segment> m_Segments;
+    std::vector<std::weak_ptr<Link>> m_Links;
+    UINT64 m_NextSegmentId = 1;
+
+    std::mutex m_ListenerLock;
+    std::vector<std::pair<SockAddr, Listener*>> m_Listeners;
+
+    std::atomic<UINT64> m_NextAdapterId{ 1 };
+    std::atomic<USHORT> m_NextPort{ 49152 };
+};
+
+// MARK: Adapter
+class Adapter : public Unknown<IND2Adapter, IID_IND2Adapter> {
+    public:
+    explicit Adapter(const SockAddr& addr);
+
+    HRESULT CreateOverlappedFile(HANDLE* phOverlappedFile) override;
+    HRESULT Query(ND2_ADAPTER_INFO* pInfo, ULONG* pcbInfo) override;
+    HRESULT QueryAddressList(SOCKET_ADDRESS_LIST* pAddressList, ULONG* pcbAddressList) override;
+    HRESULT CreateCompletionQueue(REFIID iid, HANDLE hOverlappedFile, ULONG queueDepth, USHORT group,
+        KAFFINITY affinity, VOID** ppCompletionQueue) override;
+    HRESULT CreateMemoryRegion(REFIID iid, HANDLE hOverlappedFile, VOID** ppMemoryRegion) override;
+    HRESULT CreateMemoryWindow(REFIID iid, VOID** ppMemoryWindow) override;
+    HRESULT CreateSharedReceiveQueue(REFIID iid, HANDLE hOverlappedFile, ULONG queueDepth, ULONG maxRequestSge,
+        ULONG notifyThreshold, USHORT group, KAFFINITY affinity, VOID** ppSharedReceiveQueue) override;
+    HRESULT CreateQueuePair(REFIID iid, IUnknown* pReceiveCompletionQueue, IUnknown* pInitiatorCompletionQueue,
+        VOID* context, ULONG receiveQueueDepth, ULONG initiatorQueueDepth, ULONG maxReceiveRequestSge,
+        ULONG maxInitiatorRequestSge, ULONG inlineDataSize, VOID** ppQueuePair) override;
+    HRESULT CreateQueuePairWithSrq(REFIID iid, IUnknown* pReceiveCompletionQueue, IUnknown* pInitiatorCompletionQueue,
+        IUnknown* pSharedReceiveQueue, VOID* context, ULONG initiatorQueueDepth, ULONG maxInitiatorRequestSge,
+        ULONG inlineDataSize, VOID** ppQueuePair) override;
+    HRESULT CreateConnector(REFIID iid, HANDLE hOverlappedFile, VOID** ppConnector) override;
+    HRESULT CreateListener(REFIID iid, HANDLE hOverlappedFile, VOID** ppListener) override;
+
+    const SockAddr& GetAddress() const { return m_Addr; }
+
+    private:
+    SockAddr m_Addr;
+    UINT64 m_AdapterId;
+};
+
+// MARK: CompletionQueue
+class CompletionQueue : public Unknown<IND2CompletionQueue, IID_IND2CompletionQueue> {
+    public:
+    CompletionQueue(Adapter* pAdapter, ULONG queueDepth, USHORT group, KAFFINITY affinity);
+
+    HRESULT CancelOverlappedRequests() override;
+    HRESULT GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) override;
+    HRESULT GetNotifyAffinity(USHORT* pGroup, KAFFINITY* pAffinity) override;
+    HRESULT Resize(ULONG queueDepth) override;
+    HRESULT Notify(ULONG type, OVERLAPPED* pOverlapped) override;
+    ULONG GetResults(ND2_RESULT results[], ULONG nResults) override;
+
+    void Complete(const ND2_RESULT& result, bool solicited);
+
+    // Queue pairs connected to another process deliver receive completions
+    // through shared rings that this CQ drains when polled or armed.
+    void AddRemoteSource(QueuePair* pQp, Link* pLink);
+    void RemoveRemoteSource(QueuePair* pQp);
+    void DrainRemoteSources(bool wait);
+    bool IsNotifyPending() const { return m_NotifyPending.load(std::memory_order_seq_cst); }
+
+    private:
+    ~CompletionQueue() override;
+
+    bool MatchesNotify(HRESULT status, bool solicited) const;
+    void Grow(size_t capacity);
+
+    Adapter* m_pAdapter;
+    USHORT m_Group;
+    KAFFINITY m_Affinity;
+
+    std::mutex m_Lock;
+    std::vector<ND2_RESULT> m_Ring;
+    std::vector<bool> m_Solicited;
+    size_t m_Head = 0;
+    std::atomic<size_t> m_Count{ 0 };
+    OVERLAPPED* m_pNotifyOv = nullptr;
+    ULONG m_NotifyType = ND_CQ_NOTIFY_ANY;
+    std::atomic<bool> m_NotifyPending{ false };
+
+    // Taken before m_Lock when both are needed.
+    std::mutex m_SourceLock;
+    std::vector<std::pair<QueuePair*, Link*>> m_RemoteSources;
+    std::atomic<size_t> m_nRemoteSources{ 0 };
+};
+
+// MARK: MemoryRegion
+class MemoryRegion : public Unknown<IND2MemoryRegion, IID_IND2MemoryRegion> {
+    public:
+    explicit MemoryRegion(Adapter* pAdapter);
+
+    HRESULT CancelOverlappedRequests() override;
+    HRESULT GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) override;
+    HRESULT Register(const VOID* pBuffer, SIZE_T cbBuffer, ULONG flags, OVERLAPPED* pOverlapped) override;
+    HRESULT Deregister(OVERLAPPED* pOverlapped) override;
+    UINT32 GetLocalToken() override;
+    UINT32 GetRemoteToken() override;
+
+    bool Contains(const void* pBuffer, SIZE_T cbBuffer) const;
+
+    private:
+    ~MemoryRegion() override;
+
+    Adapter* m_pAdapter;
+    Region m_Region;
+    UINT32 m_Token = 0;
+};
+
+// MARK: MemoryWindow
+class MemoryWindow : public Unknown<IND2MemoryWindow, IID_IND2MemoryWindow> {
+    public:
+    explicit MemoryWindow(Adapter* pAdapter);
+
+    UINT32 GetRemoteToken() override;
+
+    void Bind(const void* pBuffer, SIZE_T cbBuffer, ULONG access);
+    void Invalidate();
+
+    private:
+    ~MemoryWindow() override;
+
+    Adapter* m_pAdapter;
+    UINT32 m_Token;
+};
+
+// MARK: QueuePair
+// State shared by the two ends of an established connection. Pointers are
+// cleared under Lock when an end goes away, so peers are always acquired
+// through AcquireQueuePair/AcquireConnector.
+struct Connection {
+    std::mutex Lock;
+    QueuePair* pQueuePair[2] = { nullptr, nullptr };
+    Connector* pConnector[2] = { nullptr, nullptr };
+
+    QueuePair* AcquireQueuePair(int side);
+    Connector* AcquireConnector(int side);
+};
+
+// A posted receive, waiting in a queue pair or a shared receive queue.
+struct ReceiveRequest {
+    VOID* Context = nullptr;
+    ULONG nSge = 0;
+    ND2_SGE Sge[MaxSge];
+};
+
+class QueuePair : public Unknown<IND2QueuePair, IID_IND2QueuePair> {
+    public:
+    QueuePair(Adapter* pAdapter, CompletionQueue* pReceiveCq, CompletionQueue* pInitiatorCq, VOID* context,
+        ULONG receiveQueueDepth, ULONG initiatorQueueDepth, ULONG maxReceiveRequestSge,
+        ULONG maxInitiatorRequestSge, ULONG inlineDataSize);
+    // Takes its receives from pSrq; Receive on the queue pair itself fails.
+    QueuePair(Adapter* pAdapter, CompletionQueue* pReceiveCq, CompletionQueue* pInitiatorCq, SharedReceiveQueue* pSrq,
+        VOID* context, ULONG initiatorQueueDepth, ULONG maxInitiatorRequestSge, ULONG inlineDataSize);
+
+    HRESULT Flush() override;
+    HRESULT Send(VOID* requestContext, const ND2_SGE sge[], ULONG nSge, ULONG flags) override;
+    HRESULT Receive(VOID* requestContext, const ND2_SGE sge[], ULONG nSge) override;
+    HRESULT Bind(VOID* requestContext, IUnknown* pMemoryRegion, IUnknown* pMemoryWindow,
+        const VOID* pBuffer, SIZE_T cbBuffer, ULONG flags) override;
+    HRESULT Invalidate(VOID* requestContext, IUnknown* pMemoryWindow, ULONG flags) override;
+    HRESULT Read(VOID* requestContext, const ND2_SGE sge[], ULONG nSge, UINT64 remoteAddress,
+        UINT32 remoteToken, ULONG flags) override;
+    HRESULT Write(VOID* requestContext, const ND2_SGE sge[], ULONG nSge, UINT64 remoteAddress,
+        UINT32 remoteToken, ULONG flags) override;
+
+    bool IsConnected() const { return m_pConnection != nullptr || m_Remote.load(std::memory_order_acquire); }
+    Adapter* GetAdapter() const { return m_pAdapter; }
+    void Attach(const std::shared_ptr<Connection>& pConnection, int side);
+    void OnDisconnect();
+
+    // Cross-process connections (NDSoftShm.cpp).
+    void AttachRemote(const std::shared_ptr<Link>& pLink);
+    // Called by the receive CQ with its source lock held.
+    void DrainRemoteCompletions(Link& link);
+    // Runs when the peer rings the doorbell: drains receive completions and
+    // retries sends that were waiting for the peer to post a receive.
+    void ProgressRemote();
+    // Called by the shared receive queue when receives were posted after
+    // this queue pair found it empty.
+    void OnSharedReceivePosted();
+    // The shared receive queue's ring for a peer to map, or -1.
+    int SharedReceivesFd() const;
+
+    private:
+    ~QueuePair() override;
+
+    // An initiator request that could not run yet because an earlier Send is
+    // still waiting for the peer to post a receive. Held by the target QP.
+    struct WorkRequest {
+        QueuePair* pInitiator = nullptr;
+        ND2_REQUEST_TYPE Type = Nd2RequestTypeSend;
+        VOID* Context = nullptr;
+        ULONG Flags = 0;
+        UINT64 RemoteAddress = 0;
+        UINT32 RemoteToken = 0;
+        std::vector<ND2_SGE> Sge;
+        std::vector<char> InlineData;
+    };
+
+    static WorkRequest MakeWorkRequest(QueuePair* pInitiator, ND2_REQUEST_TYPE type, VOID* context,
+        const ND2_SGE sge[], ULONG nSge, ULONG flags, UINT64 remoteAddress, UINT32 remoteToken);
+
+    QueuePair* AcquirePeer();
+    HRESULT CheckInitiatorRequest(const ND2_SGE sge[], ULONG nSge, ULONG flags, ULONG access) const;
+
+    // Runs on the target QP: executes the request now or queues it behind
+    // earlier stalled requests so the connection stays in order.
+    HRESULT Post(QueuePair* pInitiator, ND2_REQUEST_TYPE type, VOID* context, const ND2_SGE sge[],
+        ULONG nSge, ULONG flags, UINT64 remoteAddress, UINT32 remoteToken);
+    void ProgressStalled();
+    bool PopReceive(ReceiveRequest* pReceive);
+    void FlushReceives();
+    void FlushStalled();
+
+    // Run on the initiator once the target is ready for the request.
+    void Execute(QueuePair* pTarget, const WorkRequest& wr, const ReceiveRequest* pReceive);
+    void ExecuteSend(QueuePair* pTarget, VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags,
+        const ReceiveRequest& rr);
+    void ExecuteWrite(VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags, UINT64 remoteAddress,
+        UINT32 remoteToken);
+    void ExecuteRead(VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags, UINT64 remoteAddress,
+        UINT32 remoteToken);
+    void CompleteInitiator(VOID* context, ND2_REQUEST_TYPE type, HRESULT status, ULONG bytes, ULONG flags);
+    void CompleteReceive(VOID* context, HRESULT status, ULONG bytes, bool solicited);
+
+    HRESULT PostRemote(ND2_REQUEST_TYPE type, VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags,
+        UINT64 remoteAddress, UINT32 remoteToken);
+    HRESULT ReceiveRemote(Link& link, VOID* context, const ND2_SGE sge[], ULONG nSge);
+    bool PopPeerReceive(Link& link, Shm::ReceiveEntry* pEntry);
+    void ProgressRemoteStalled(Link& link);
+    void ExecuteRemote(Link& link, ND2_REQUEST_TYPE type, VOID* context, const ND2_SGE sge[], ULONG nSge,
+        ULONG flags, UINT64 remoteAddress, UINT32 remoteToken, const Shm::ReceiveEntry* pReceive);
+    void DetachRemote();
+    void FlushRemote(Link& link);
+
+    Adapter* m_pAdapter;
+    CompletionQueue* m_pReceiveCq;
+    CompletionQueue* m_pInitiatorCq;
+    VOID* m_Context;
+    ULONG m_ReceiveQueueDepth;
+    ULONG m_InitiatorQueueDepth;
+    ULONG m_MaxReceiveSge;
+    ULONG m_MaxInitiatorSge;
+    ULONG m_InlineDataSize;
+    SharedReceiveQueue* m_pSrq = nullptr;
+
+    std::shared_ptr<Connection> m_pConnection;
+    int m_Side = 0;
+
+    // Guards the receive ring and the requests stalled on this QP by the peer.
+    std::mutex m_Lock;
+    std::vector<ReceiveRequest> m_Receives;
+    size_t m_ReceiveHead = 0;
+    size_t m_ReceiveCount = 0;
+    std::deque<WorkRequest> m_Stalled;
+    bool m_Draining = false;
+    std::atomic<ULONG> m_StalledInitiator{ 0 };
+
+    // Cross-process state. Initiator requests run under m_SendLock, which
+    // keeps them in order and makes this QP the only consumer of the peer's
+    // receive ring; m_Lock guards m_pLink for the receive path.
+    std::mutex m_SendLock;
+    std::shared_ptr<Link> m_pLink;
+    std::atomic<bool> m_Remote{ false };
+    std::deque<WorkRequest> m_RemoteStalled;
+};
+
+// MARK: SharedReceiveQueue
+// Receives shared by every queue pair created with it. They are kept in a ring
+// in shared memory that peers in other processes map when they connect to one
+// of its queue pairs, so local and remote senders all take from the same place.
+class SharedReceiveQueue : public Unknown<IND2SharedReceiveQueue, IID_IND2SharedReceiveQueue> {
+    public:
+    SharedReceiveQueue(Adapter* pAdapter, ULONG queueDepth, ULONG maxRequestSge, ULONG notifyThreshold,
+        USHORT group, KAFFINITY affinity);
+
+    HRESULT CancelOverlappedRequests() override;
+    HRESULT GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) override;
+    HRESULT GetNotifyAffinity(USHORT* pGroup, KAFFINITY* pAffinity) override;
+    HRESULT Modify(ULONG queueDepth, ULONG notifyThreshold) override;
+    HRESULT Notify(OVERLAPPED* pOverlapped) override;
+    HRESULT Receive(VOID* requestContext, const ND2_SGE sge[], ULONG nSge) override;
+
+    // False if the shared ring could not be created.
+    bool IsValid() const { return m_pReceives != nullptr; }
+    int Fd() const { return m_Fd; }
+
+    // Takes the oldest receive. When there is none, pWaiter is remembered and
+    // its OnSharedReceivePosted runs after the next Receive.
+    bool Pop(ReceiveRequest* pReceive, QueuePair* pWaiter);
+    void OnReceiveCompleted();
+    void Detach(QueuePair* pQp);
+    // Connections whose peers take from the ring and may wait on it.
+    void AttachLink(Link* pLink);
+    void DetachLink(Link* pLink);
+
+    private:
+    ~SharedReceiveQueue() override;
+
+    Adapter* m_pAdapter;
+    ULONG m_MaxSge;
+    USHORT m_Group;
+    KAFFINITY m_Affinity;
+
+    int m_Fd = -1;
+    Shm::SharedReceives* m_pReceives = nullptr;
+
+    // Also the ring's only producer.
+    std::mutex m_Lock;
+    ULONG m_QueueDepth;
+    ULONG m_NotifyThreshold;
+    // Posted and not yet completed, including those a peer has taken.
+    ULONG m_Outstanding = 0;
+    OVERLAPPED* m_pNotifyOv = nullptr;
+    std::vector<QueuePair*> m_Waiters;
+    std::vector<Link*> m_Links;
+};
+
+// MARK: Connector
+// A connection request from an in-process client, or from another process
+// through pLink.
+struct ConnectRequest {
+    ConnectRequest(Connector* pClient, QueuePair* pClientQp);
+    explicit ConnectRequest(const std::shared_ptr<Link>& pLink);
+    ~ConnectRequest();
+
+    void Refuse(const std::vector<char>& privateData);
+
+    Connector* pClient = nullptr;
+    QueuePair* pClientQp = nullptr;
+    std::shared_ptr<Link> pLink;
+    SockAddr ClientAddr;
+    SockAddr ServerAddr;
+    std::vector<char> PrivateData;
+    ULONG InboundReadLimit = 0;
+    ULONG OutboundReadLimit = 0;
+};
+
+class Connector : public Unknown<IND2Connector, IID_IND2Connector> {
+    public:
+    explicit Connector(Adapter* pAdapter);
+
+    HRESULT CancelOverlappedRequests() override;
+    HRESULT GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) override;
+    HRESULT Bind(const sockaddr* pAddress, ULONG cbAddress) override;
+    HRESULT Connect(IUnknown* pQueuePair, const sockaddr* pDestAddress, ULONG cbDestAddress,
+        ULONG inboundReadLimit, ULONG outboundReadLimit, const VOID* pPrivateData, ULONG cbPrivateData,
+        OVERLAPPED* pOverlapped) override;
+    HRESULT CompleteConnect(OVERLAPPED* pOverlapped) override;
+    HRESULT Accept(IUnknown* pQueuePair, ULONG inboundReadLimit, ULONG outboundReadLimit,
+        const VOID* pPrivateData, ULONG cbPrivateData, OVERLAPPED* pOverlapped) override;
+    HRESULT Reject(const VOID* pPrivateData, ULONG cbPrivateData) override;
+    HRESULT GetReadLimits(ULONG* pInboundReadLimit, ULONG* pOutboundReadLimit) override;
+    HRESULT GetPrivateData(VOID* pPrivateData, ULONG* pcbPrivateData) override;
+    HRESULT GetLocalAddress(sockaddr* pAddress, ULONG* pcbAddress) override;
+    HRESULT GetPeerAddress(sockaddr* pAddress, ULONG* pcbAddress) override;
+    HRESULT NotifyDisconnect(OVERLAPPED* pOverlapped) override;
+    HRESULT Disconnect(OVERLAPPED* pOverlapped) override;
+
+    // Called by the listener and the peer connector.
+    void OnConnectionRequest(const std::shared_ptr<ConnectRequest>& pRequest);
+    // Returns false if the connector was no longer waiting for a reply.
+    bool OnConnectReply(HRESULT hr, const std::vector<char>& privateData,
+        const std::shared_ptr<Connection>& pConnection, const std::shared_ptr<Link>& pLink,
+        ULONG inboundReadLimit, ULONG outboundReadLimit);
+    void OnCompleteConnect();
+    void OnPeerDisconnect();
+
+    private:
+    ~Connector() override;
+
+    enum class State { Idle, Connecting, Replied, Requested, Accepting, Connected, Disconnected };
+
+    void Teardown();
+
+    Adapter* m_pAdapter;
+
+    std::mutex m_Lock;
+    State m_State = State::Idle;
+    SockAddr m_LocalAddr;
+    SockAddr m_PeerAddr;
+    std::vector<char> m_PrivateData;
+    ULONG m_InboundReadLimit = 0;
+    ULONG m_OutboundReadLimit = 0;
+    std::shared_ptr<ConnectRequest> m_pRequest;
+    std::shared_ptr<Connection> m_pConnection;
+    std::shared_ptr<Link> m_pLink;
+    int m_Side = 0;
+    OVERLAPPED* m_pConnectOv = nullptr;
+    OVERLAPPED* m_pAcceptOv = nullptr;
+    OVERLAPPED* m_pDisconnectOv = nullptr;
+};
+
+// MARK: Listener
+class Listener : public Unknown<IND2Listener, IID_IND2Listener> {
+    public:
+    explicit Listener(Adapter* pAdapter);
+
+    HRESULT CancelOverlappedRequests() override;
+    HRESULT GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) override;
+    HRESULT Bind(const sockaddr* pAddress, ULONG cbAddress) override;
+    HRESULT Listen(ULONG backlog) override;
+    HRESULT GetLocalAddress(sockaddr* pAddress, ULONG* pcbAddress) override;
+    HRESULT GetConnectionRequest(IUnknown* pConnector, OVERLAPPED* pOverlapped) override;
+
+    // Called by a connecting client.
+    HRESULT QueueRequest(const std::shared_ptr<ConnectRequest>& pRequest);
+
+    private:
+    ~Listener() override;
+
+    void Shutdown(HRESULT status);
+    void OnRemoteConnect();
+
+    struct PendingGet {
+        Connector* pConnector;
+        OVERLAPPED* pOv;
+    };
+
+    Adapter* m_pAdapter;
+
+    std::mutex m_Lock;
+    SockAddr m_Addr;
+    bool m_Listening = false;
+    ULONG m_Backlog = 0;
+    std::deque<std::shared_ptr<ConnectRequest>> m_Requests;
+    std::deque<PendingGet> m_PendingGets;
+
+    // Rendezvous for clients in other processes.
+    int m_Socket = -1;
+    UINT64 m_SocketHandler = 0;
+};
+
+} // namespace NDSoft
+
+#endif // NDSOFT_HPP
@@ -0,0 +1,192 @@
+#include "NDSoft.hpp"
+#include <new>
+
+namespace NDSoft {
+
+template <typename T>
+static T* QueryObject(IUnknown* pUnknown) {
+    return dynamic_cast<T*>(pUnknown);
+}
+
+// MARK: Adapter
+Adapter::Adapter(const SockAddr& addr) :
+    m_Addr(addr), m_AdapterId(Fabric::Instance().NextAdapterId())
+{
+}
+
+HRESULT Adapter::CreateOverlappedFile(HANDLE* phOverlappedFile) {
+    if (phOverlappedFile == nullptr) return ND_INVALID_PARAMETER;
+    // Nothing is ever queued on the file itself; completions signal the
+    // caller's OVERLAPPED::hEvent. A manual-reset event gives a closable handle.
+    *phOverlappedFile = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    return *phOverlappedFile ? ND_SUCCESS : ND_INSUFFICIENT_RESOURCES;
+}
+
+HRESULT Adapter::Query(ND2_ADAPTER_INFO* pInfo, ULONG* pcbInfo) {
+    if (pcbInfo == nullptr) return ND_INVALID_PARAMETER;
+    if (pInfo == nullptr || *pcbInfo < sizeof(ND2_ADAPTER_INFO)) {
+        *pcbInfo = sizeof(ND2_ADAPTER_INFO);
+        return ND_BUFFER_OVERFLOW;
+    }
+    if (pInfo->InfoVersion != ND_VERSION_2) return ND_INVALID_PARAMETER;
+
+    pInfo->VendorId = 0;
+    pInfo->DeviceId = 0;
+    pInfo->AdapterId = m_AdapterId;
+    pInfo->MaxRegistrationSize = SIZE_T(1) << 40;
+    pInfo->MaxWindowSize = SIZE_T(1) << 40;
+    pInfo->MaxInitiatorSge = MaxSge;
+    pInfo->MaxReceiveSge = MaxSge;
+    pInfo->MaxReadSge = MaxSge;
+    pInfo->MaxTransferLength = MaxTransferLength;
+    pInfo->MaxInlineDataSize = MaxInlineDataSize;
+    pInfo->MaxInboundReadLimit = MaxReadLimit;
+    pInfo->MaxOutboundReadLimit = MaxReadLimit;
+    pInfo->MaxReceiveQueueDepth = MaxQueueDepth;
+    pInfo->MaxInitiatorQueueDepth = MaxQueueDepth;
+    pInfo->MaxSharedReceiveQueueDepth = MaxQueueDepth;
+    pInfo->MaxCompletionQueueDepth = MaxCompletionQueueDepth;
+    pInfo->InlineRequestThreshold = MaxInlineDataSize;
+    pInfo->LargeRequestThreshold = 64 * 1024;
+    pInfo->MaxCallerData = MaxCallerData;
+    pInfo->MaxCalleeData = MaxCalleeData;
+    pInfo->AdapterFlags = ND_ADAPTER_FLAG_IN_ORDER_DMA_SUPPORTED | ND_ADAPTER_FLAG_LOOPBACK_CONNECTIONS_SUPPORTED;
+    *pcbInfo = sizeof(ND2_ADAPTER_INFO);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::QueryAddressList(SOCKET_ADDRESS_LIST* pAddressList, ULONG* pcbAddressList) {
+    if (pcbAddressList == nullptr) return ND_INVALID_PARAMETER;
+
+    SIZE_T needed = sizeof(SOCKET_ADDRESS_LIST) + m_Addr.Length;
+    if (pAddressList == nullptr || *pcbAddressList < needed) {
+        *pcbAddressList = static_cast<ULONG>(needed);
+        return ND_BUFFER_OVERFLOW;
+    }
+
+    BYTE* pAddr = reinterpret_cast<BYTE*>(pAddressList) + sizeof(SOCKET_ADDRESS_LIST);
+    std::memcpy(pAddr, m_Addr.Get(), m_Addr.Length);
+    pAddressList->iAddressCount = 1;
+    pAddressList->Address[0].lpSockaddr = reinterpret_cast<LPSOCKADDR>(pAddr);
+    pAddressList->Address[0].iSockaddrLength = static_cast<INT>(m_Addr.Length);
+    *pcbAddressList = static_cast<ULONG>(needed);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateCompletionQueue(REFIID iid, HANDLE, ULONG queueDepth, USHORT group, KAFFINITY affinity, VOID** ppCompletionQueue) {
+    if (ppCompletionQueue == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2CompletionQueue) return E_NOINTERFACE;
+    if (queueDepth == 0 || queueDepth > MaxCompletionQueueDepth) return ND_INVALID_PARAMETER_3;
+
+    CompletionQueue* pCq = new (std::nothrow) CompletionQueue(this, queueDepth, group, affinity);
+    if (pCq == nullptr) return ND_NO_MEMORY;
+    *ppCompletionQueue = static_cast<IND2CompletionQueue*>(pCq);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateMemoryRegion(REFIID iid, HANDLE, VOID** ppMemoryRegion) {
+    if (ppMemoryRegion == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2MemoryRegion) return E_NOINTERFACE;
+
+    MemoryRegion* pMr = new (std::nothrow) MemoryRegion(this);
+    if (pMr == nullptr) return ND_NO_MEMORY;
+    *ppMemoryRegion = static_cast<IND2MemoryRegion*>(pMr);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateMemoryWindow(REFIID iid, VOID** ppMemoryWindow) {
+    if (ppMemoryWindow == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2MemoryWindow) return E_NOINTERFACE;
+
+    MemoryWindow* pMw = new (std::nothrow) MemoryWindow(this);
+    if (pMw == nullptr) return ND_NO_MEMORY;
+    *ppMemoryWindow = static_cast<IND2MemoryWindow*>(pMw);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateSharedReceiveQueue(REFIID iid, HANDLE, ULONG queueDepth, ULONG maxRequestSge,
+    ULONG notifyThreshold, USHORT group, KAFFINITY affinity, VOID** ppSharedReceiveQueue) {
+    if (ppSharedReceiveQueue == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2SharedReceiveQueue) return E_NOINTERFACE;
+    if (queueDepth == 0 || queueDepth > MaxQueueDepth) return ND_INVALID_PARAMETER_3;
+    if (maxRequestSge > MaxSge) return ND_INVALID_PARAMETER_4;
+    if (notifyThreshold > queueDepth) return ND_INVALID_PARAMETER_5;
+
+    SharedReceiveQueue* pSrq = new (std::nothrow) SharedReceiveQueue(this, queueDepth, maxRequestSge, notifyThreshold,
+        group, affinity);
+    if (pSrq == nullptr) return ND_NO_MEMORY;
+    if (!pSrq->IsValid()) {
+        pSrq->Release();
+        return ND_INSUFFICIENT_RESOURCES;
+    }
+    *ppSharedReceiveQueue = static_cast<IND2SharedReceiveQueue*>(pSrq);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateQueuePair(REFIID iid, IUnknown* pReceiveCompletionQueue, IUnknown* pInitiatorCompletionQueue,
+    VOID* context, ULONG receiveQueueDepth, ULONG initiatorQueueDepth, ULONG maxReceiveRequestSge,
+    ULONG maxInitiatorRequestSge, ULONG inlineDataSize, VOID** ppQueuePair) {
+    if (ppQueuePair == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2QueuePair) return E_NOINTERFACE;
+
+    CompletionQueue* pReceiveCq = QueryObject<CompletionQueue>(pReceiveCompletionQueue);
+    CompletionQueue* pInitiatorCq = QueryObject<CompletionQueue>(pInitiatorCompletionQueue);
+    if (pReceiveCq == nullptr) return ND_INVALID_PARAMETER_2;
+    if (pInitiatorCq == nullptr) return ND_INVALID_PARAMETER_3;
+    if (receiveQueueDepth == 0 || receiveQueueDepth > MaxQueueDepth) return ND_INVALID_PARAMETER_5;
+    if (initiatorQueueDepth == 0 || initiatorQueueDepth > MaxQueueDepth) return ND_INVALID_PARAMETER_6;
+    if (maxReceiveRequestSge > MaxSge) return ND_INVALID_PARAMETER_7;
+    if (maxInitiatorRequestSge > MaxSge) return ND_INVALID_PARAMETER_8;
+    if (inlineDataSize > MaxInlineDataSize) return ND_INVALID_PARAMETER_9;
+
+    QueuePair* pQp = new (std::nothrow) QueuePair(this, pReceiveCq, pInitiatorCq, context, receiveQueueDepth,
+        initiatorQueueDepth, maxReceiveRequestSge, maxInitiatorRequestSge, inlineDataSize);
+    if (pQp == nullptr) return ND_NO_MEMORY;
+    *ppQueuePair = static_cast<IND2QueuePair*>(pQp);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateQueuePairWithSrq(REFIID iid, IUnknown* pReceiveCompletionQueue, IUnknown* pInitiatorCompletionQueue,
+    IUnknown* pSharedReceiveQueue, VOID* context, ULONG initiatorQueueDepth, ULONG maxInitiatorRequestSge,
+    ULONG inlineDataSize, VOID** ppQueuePair) {
+    if (ppQueuePair == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2QueuePair) return E_NOINTERFACE;
+
+    CompletionQueue* pReceiveCq = QueryObject<CompletionQueue>(pReceiveCompletionQueue);
+    CompletionQueue* pInitiatorCq = QueryObject<CompletionQueue>(pInitiatorCompletionQueue);
+    SharedReceiveQueue* pSrq = QueryObject<SharedReceiveQueue>(pSharedReceiveQueue);
+    if (pReceiveCq == nullptr) return ND_INVALID_PARAMETER_2;
+    if (pInitiatorCq == nullptr) return ND_INVALID_PARAMETER_3;
+    if (pSrq == nullptr) return ND_INVALID_PARAMETER_4;
+    if (initiatorQueueDepth == 0 || initiatorQueueDepth > MaxQueueDepth) return ND_INVALID_PARAMETER_6;
+    if (maxInitiatorRequestSge > MaxSge) return ND_INVALID_PARAMETER_7;
+    if (inlineDataSize > MaxInlineDataSize) return ND_INVALID_PARAMETER_8;
+
+    QueuePair* pQp = new (std::nothrow) QueuePair(this, pReceiveCq, pInitiatorCq, pSrq, context, initiatorQueueDepth,
+        maxInitiatorRequestSge, inlineDataSize);
+    if (pQp == nullptr) return ND_NO_MEMORY;
+    *ppQueuePair = static_cast<IND2QueuePair*>(pQp);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateConnector(REFIID iid, HANDLE, VOID** ppConnector) {
+    if (ppConnector == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2Connector) return E_NOINTERFACE;
+
+    Connector* pConnector = new (std::nothrow) Connector(this);
+    if (pConnector == nullptr) return ND_NO_MEMORY;
+    *ppConnector = static_cast<IND2Connector*>(pConnector);
+    return ND_SUCCESS;
+}
+
+HRESULT Adapter::CreateListener(REFIID iid, HANDLE, VOID** ppListener) {
+    if (ppListener == nullptr) return ND_INVALID_PARAMETER;
+    if (iid != IID_IND2Listener) return E_NOINTERFACE;
+
+    Listener* pListener = new (std::nothrow) Listener(this);
+    if (pListener == nullptr) return ND_NO_MEMORY;
+    *ppListener = static_cast<IND2Listener*>(pListener);
+    return ND_SUCCESS;
+}
+
+} // namespace NDSoft
@@ -0,0 +1,178 @@
+#include "NDSoft.hpp"
+
+namespace NDSoft {
+
+// MARK: CompletionQueue
+CompletionQueue::CompletionQueue(Adapter* pAdapter, ULONG queueDepth, USHORT group, KAFFINITY affinity) :
+    m_pAdapter(pAdapter), m_Group(group), m_Affinity(affinity), m_Ring(queueDepth), m_Solicited(queueDepth)
+{
+    m_pAdapter->AddRef();
+}
+
+CompletionQueue::~CompletionQueue() {
+    CancelOverlappedRequests();
+    m_pAdapter->Release();
+}
+
+HRESULT CompletionQueue::CancelOverlappedRequests() {
+    OVERLAPPED* pOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        std::swap(pOv, m_pNotifyOv);
+        m_NotifyPending.store(false, std::memory_order_seq_cst);
+    }
+    if (pOv) CompleteOverlapped(pOv, ND_CANCELED);
+    return ND_SUCCESS;
+}
+
+HRESULT CompletionQueue::GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) {
+    return WaitOverlapped(pOverlapped, wait);
+}
+
+HRESULT CompletionQueue::GetNotifyAffinity(USHORT* pGroup, KAFFINITY* pAffinity) {
+    if (pGroup == nullptr || pAffinity == nullptr) return ND_INVALID_PARAMETER;
+    *pGroup = m_Group;
+    *pAffinity = m_Affinity;
+    return ND_SUCCESS;
+}
+
+HRESULT CompletionQueue::Resize(ULONG queueDepth) {
+    if (queueDepth == 0 || queueDepth > MaxCompletionQueueDepth) return ND_INVALID_PARAMETER;
+
+    std::lock_guard lock(m_Lock);
+    if (queueDepth < m_Count.load(std::memory_order_relaxed)) return ND_BUFFER_OVERFLOW;
+    Grow(queueDepth);
+    return ND_SUCCESS;
+}
+
+bool CompletionQueue::MatchesNotify(HRESULT status, bool solicited) const {
+    switch (m_NotifyType) {
+        case ND_CQ_NOTIFY_ERRORS:
+            return FAILED(status);
+        case ND_CQ_NOTIFY_SOLICITED:
+            return solicited || FAILED(status);
+        default:
+            return true;
+    }
+}
+
+HRESULT CompletionQueue::Notify(ULONG type, OVERLAPPED* pOverlapped) {
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER;
+    if (type != ND_CQ_NOTIFY_ANY && type != ND_CQ_NOTIFY_ERRORS && type != ND_CQ_NOTIFY_SOLICITED) {
+        return ND_INVALID_PARAMETER_1;
+    }
+
+    SetOverlappedResult(pOverlapped, ND_PENDING);
+
+    std::unique_lock lock(m_Lock);
+    if (m_pNotifyOv != nullptr) return ND_DEVICE_BUSY;
+    m_NotifyType = type;
+
+    // Arming is level-triggered against entries already queued: a completion
+    // that raced ahead of Notify would otherwise never wake the caller.
+    size_t count = m_Count.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = (m_Head + i) % m_Ring.size();
+        if (MatchesNotify(m_Ring[slot].Status, m_Solicited[slot])) {
+            lock.unlock();
+            CompleteOverlapped(pOverlapped, ND_SUCCESS);
+            return ND_PENDING;
+        }
+    }
+
+    m_pNotifyOv = pOverlapped;
+    m_NotifyPending.store(true, std::memory_order_seq_cst);
+    lock.unlock();
+
+    // Arms remote sources and picks up anything they delivered meanwhile.
+    DrainRemoteSources(true);
+    return ND_PENDING;
+}
+
+ULONG CompletionQueue::GetResults(ND2_RESULT results[], ULONG nResults) {
+    if (results == nullptr || nResults == 0) return 0;
+    // Cheap unlocked check so polling an empty queue never contends with producers.
+    if (m_Count.load(std::memory_order_acquire) == 0) {
+        DrainRemoteSources(false);
+        if (m_Count.load(std::memory_order_acquire) == 0) return 0;
+    }
+
+    std::lock_guard lock(m_Lock);
+    size_t count = m_Count.load(std::memory_order_relaxed);
+    ULONG n = static_cast<ULONG>(std::min<size_t>(count, nResults));
+    for (ULONG i = 0; i < n; i++) {
+        results[i] = m_Ring[m_Head];
+        m_Head = (m_Head + 1) % m_Ring.size();
+    }
+    m_Count.store(count - n, std::memory_order_release);
+    return n;
+}
+
+void CompletionQueue::Complete(const ND2_RESULT& result, bool solicited) {
+    OVERLAPPED* pOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        size_t count = m_Count.load(std::memory_order_relaxed);
+        // Hardware would report a CQ overrun here; growing keeps the software
+        // provider usable when callers size queues for lossy polling.
+        if (count == m_Ring.size()) Grow(m_Ring.size() * 2);
+
+        size_t slot = (m_Head + count) % m_Ring.size();
+        m_Ring[slot] = result;
+        m_Solicited[slot] = solicited;
+        m_Count.store(count + 1, std::memory_order_release);
+
+        if (m_pNotifyOv != nullptr && MatchesNotify(result.Status, solicited)) {
+            std::swap(pOv, m_pNotifyOv);
+            m_NotifyPending.store(false, std::memory_order_seq_cst);
+        }
+    }
+    if (pOv) CompleteOverlapped(pOv, ND_SUCCESS);
+}
+
+void CompletionQueue::AddRemoteSource(QueuePair* pQp, Link* pLink) {
+    std::lock_guard lock(m_SourceLock);
+    m_RemoteSources.emplace_back(pQp, pLink);
+    m_nRemoteSources.fetch_add(1, std::memory_order_release);
+}
+
+void CompletionQueue::RemoveRemoteSource(QueuePair* pQp) {
+    std::lock_guard lock(m_SourceLock);
+    for (auto it = m_RemoteSources.begin(); it != m_RemoteSources.end(); ++it) {
+        if (it->first != pQp) continue;
+        // Report whatever the peer completed before the source goes away.
+        pQp->DrainRemoteCompletions(*it->second);
+        m_RemoteSources.erase(it);
+        m_nRemoteSources.fetch_sub(1, std::memory_order_release);
+        return;
+    }
+}
+
+void CompletionQueue::DrainRemoteSources(bool wait) {
+    if (m_nRemoteSources.load(std::memory_order_acquire) == 0) return;
+
+    // A poller that loses the race simply finds the entries on its next call.
+    std::unique_lock lock(m_SourceLock, std::defer_lock);
+    if (wait) {
+        lock.lock();
+    } else if (!lock.try_lock()) {
+        return;
+    }
+    for (auto& [pQp, pLink] : m_RemoteSources) pQp->DrainRemoteCompletions(*pLink);
+}
+
+void CompletionQueue::Grow(size_t capacity) {
+    size_t count = m_Count.load(std::memory_order_relaxed);
+    std::vector<ND2_RESULT> ring(capacity);
+    std::vector<bool> solicited(capacity);
+    for (size_t i = 0; i < count; i++) {
+        size_t slot = (m_Head + i) % m_Ring.size();
+        ring[i] = m_Ring[slot];
+        solicited[i] = m_Solicited[slot];
+    }
+    m_Ring = std::move(ring);
+    m_Solicited = std::move(solicited);
+    m_Head = 0;
+}
+
+} // namespace NDSoft
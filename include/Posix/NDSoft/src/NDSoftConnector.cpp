@@ -0,0 +1,549 @@
+#include "NDSoftShm.hpp"
+#include <unistd.h>
+
+namespace NDSoft {
+
+// MARK: ConnectRequest
+ConnectRequest::ConnectRequest(Connector* pClient, QueuePair* pClientQp) : pClient(pClient), pClientQp(pClientQp) {
+    pClient->AddRef();
+    pClientQp->AddRef();
+}
+
+ConnectRequest::ConnectRequest(const std::shared_ptr<Link>& pLink) : pLink(pLink) {
+}
+
+ConnectRequest::~ConnectRequest() {
+    if (pClientQp) pClientQp->Release();
+    if (pClient) pClient->Release();
+}
+
+void ConnectRequest::Refuse(const std::vector<char>& privateData) {
+    if (pLink) {
+        pLink->Refuse(privateData);
+    } else {
+        pClient->OnConnectReply(ND_CONNECTION_REFUSED, privateData, nullptr, nullptr, 0, 0);
+    }
+}
+
+// MARK: Connector
+Connector::Connector(Adapter* pAdapter) : m_pAdapter(pAdapter) {
+    m_pAdapter->AddRef();
+}
+
+Connector::~Connector() {
+    Teardown();
+    m_pAdapter->Release();
+}
+
+HRESULT Connector::CancelOverlappedRequests() {
+    OVERLAPPED* pConnectOv = nullptr;
+    OVERLAPPED* pAcceptOv = nullptr;
+    OVERLAPPED* pDisconnectOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State == State::Connecting) m_State = State::Idle;
+        std::swap(pConnectOv, m_pConnectOv);
+        std::swap(pAcceptOv, m_pAcceptOv);
+        std::swap(pDisconnectOv, m_pDisconnectOv);
+    }
+    if (pConnectOv) CompleteOverlapped(pConnectOv, ND_CANCELED);
+    if (pAcceptOv) CompleteOverlapped(pAcceptOv, ND_CANCELED);
+    if (pDisconnectOv) CompleteOverlapped(pDisconnectOv, ND_CANCELED);
+    return ND_SUCCESS;
+}
+
+HRESULT Connector::GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) {
+    return WaitOverlapped(pOverlapped, wait);
+}
+
+HRESULT Connector::Bind(const sockaddr* pAddress, ULONG cbAddress) {
+    SockAddr addr;
+    if (!addr.Set(pAddress, cbAddress)) return ND_INVALID_ADDRESS;
+    if (!IsLocalAddress(addr.Get())) return ND_INVALID_ADDRESS;
+
+    // Connectors never accept connections themselves, so the local port only
+    // identifies the endpoint and is not reserved in the fabric.
+    std::lock_guard lock(m_Lock);
+    if (m_State != State::Idle) return ND_CONNECTION_ACTIVE;
+    if (addr.Port() == 0) addr.SetPort(Fabric::Instance().NextPort());
+    m_LocalAddr = addr;
+    return ND_SUCCESS;
+}
+
+HRESULT Connector::Connect(IUnknown* pQueuePair, const sockaddr* pDestAddress, ULONG cbDestAddress,
+    ULONG inboundReadLimit, ULONG outboundReadLimit, const VOID* pPrivateData, ULONG cbPrivateData,
+    OVERLAPPED* pOverlapped) {
+    QueuePair* pQp = dynamic_cast<QueuePair*>(pQueuePair);
+    // Hardware can only connect a queue pair of the connector's own adapter.
+    if (pQp == nullptr || pQp->GetAdapter() != m_pAdapter) return ND_INVALID_PARAMETER_1;
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_8;
+    if (cbPrivateData > MaxCallerData) return ND_INVALID_BUFFER_SIZE;
+    if (inboundReadLimit > MaxReadLimit || outboundReadLimit > MaxReadLimit) return ND_INVALID_PARAMETER_MIX;
+
+    auto pRequest = std::make_shared<ConnectRequest>(this, pQp);
+    if (!pRequest->ServerAddr.Set(pDestAddress, cbDestAddress)) return ND_INVALID_ADDRESS;
+    if (pPrivateData != nullptr) {
+        const char* p = static_cast<const char*>(pPrivateData);
+        pRequest->PrivateData.assign(p, p + cbPrivateData);
+    }
+    pRequest->InboundReadLimit = inboundReadLimit;
+    pRequest->OutboundReadLimit = outboundReadLimit;
+
+    // A listener in this process is connected to directly; otherwise the
+    // request goes to whichever process on this host listens on the port.
+    Listener* pListener = Fabric::Instance().AcquireListener(pRequest->ServerAddr.Get());
+
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State != State::Idle || pQp->IsConnected()) {
+            if (pListener) pListener->Release();
+            return ND_CONNECTION_ACTIVE;
+        }
+        if (m_LocalAddr.Length == 0) {
+            m_LocalAddr = m_pAdapter->GetAddress();
+            m_LocalAddr.SetPort(Fabric::Instance().NextPort());
+        }
+        pRequest->ClientAddr = m_LocalAddr;
+        m_PeerAddr = pRequest->ServerAddr;
+        m_State = State::Connecting;
+        m_pConnectOv = pOverlapped;
+        SetOverlappedResult(pOverlapped, ND_PENDING);
+
+        // The reply arrives on the progress thread and waits for m_Lock, so
+        // the link is stored before it can be answered.
+        if (pListener == nullptr) {
+            HRESULT hr = Link::Connect(this, pQp, *pRequest, &m_pLink);
+            if (FAILED(hr)) {
+                m_State = State::Idle;
+                m_pConnectOv = nullptr;
+                return SetOverlappedResult(pOverlapped, hr);
+            }
+            return ND_PENDING;
+        }
+    }
+
+    HRESULT hr = pListener->QueueRequest(pRequest);
+    pListener->Release();
+    if (FAILED(hr)) {
+        std::lock_guard lock(m_Lock);
+        m_State = State::Idle;
+        m_pConnectOv = nullptr;
+        return SetOverlappedResult(pOverlapped, hr);
+    }
+    return ND_PENDING;
+}
+
+HRESULT Connector::CompleteConnect(OVERLAPPED* pOverlapped) {
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_1;
+
+    std::shared_ptr<Connection> pConnection;
+    std::shared_ptr<Link> pLink;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State != State::Replied) return SetOverlappedResult(pOverlapped, ND_CONNECTION_INVALID);
+        m_State = State::Connected;
+        pConnection = m_pConnection;
+        pLink = m_pLink;
+    }
+
+    if (pLink) {
+        pLink->CompleteConnect();
+    } else if (Connector* pServer = pConnection->AcquireConnector(1 - m_Side)) {
+        pServer->OnCompleteConnect();
+        pServer->Release();
+    }
+    return SetOverlappedResult(pOverlapped, ND_SUCCESS);
+}
+
+HRESULT Connector::Accept(IUnknown* pQueuePair, ULONG inboundReadLimit, ULONG outboundReadLimit,
+    const VOID* pPrivateData, ULONG cbPrivateData, OVERLAPPED* pOverlapped) {
+    QueuePair* pQp = dynamic_cast<QueuePair*>(pQueuePair);
+    if (pQp == nullptr || pQp->GetAdapter() != m_pAdapter) return ND_INVALID_PARAMETER_1;
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_6;
+    if (cbPrivateData > MaxCalleeData) return ND_INVALID_BUFFER_SIZE;
+    if (inboundReadLimit > MaxReadLimit || outboundReadLimit > MaxReadLimit) return ND_INVALID_PARAMETER_MIX;
+
+    std::vector<char> privateData;
+    if (pPrivateData != nullptr) {
+        const char* p = static_cast<const char*>(pPrivateData);
+        privateData.assign(p, p + cbPrivateData);
+    }
+
+    std::shared_ptr<ConnectRequest> pRequest;
+    std::shared_ptr<Connection> pConnection;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State != State::Requested) return ND_CONNECTION_INVALID;
+        if (pQp->IsConnected()) return ND_CONNECTION_ACTIVE;
+
+        pRequest = std::move(m_pRequest);
+        if (pRequest->pLink) {
+            m_pLink = pRequest->pLink;
+        } else {
+            pConnection = std::make_shared<Connection>();
+            pConnection->pQueuePair[0] = pRequest->pClientQp;
+            pConnection->pQueuePair[1] = pQp;
+            pConnection->pConnector[0] = pRequest->pClient;
+            pConnection->pConnector[1] = this;
+            m_pConnection = pConnection;
+        }
+        m_Side = 1;
+        m_State = State::Accepting;
+        m_pAcceptOv = pOverlapped;
+        SetOverlappedResult(pOverlapped, ND_PENDING);
+    }
+
+    // The client sees our limits from its own point of view.
+    if (pRequest->pLink) {
+        HRESULT hr = pRequest->pLink->Accept(this, pQp, privateData, outboundReadLimit, inboundReadLimit);
+        if (FAILED(hr)) {
+            std::lock_guard lock(m_Lock);
+            m_pLink.reset();
+            m_State = State::Disconnected;
+            m_pAcceptOv = nullptr;
+            return SetOverlappedResult(pOverlapped, hr);
+        }
+        return ND_PENDING;
+    }
+
+    pRequest->pClientQp->Attach(pConnection, 0);
+    pQp->Attach(pConnection, 1);
+    pRequest->pClient->OnConnectReply(ND_SUCCESS, privateData, pConnection, nullptr, outboundReadLimit,
+        inboundReadLimit);
+    return ND_PENDING;
+}
+
+HRESULT Connector::Reject(const VOID* pPrivateData, ULONG cbPrivateData) {
+    if (cbPrivateData > MaxCalleeData) return ND_INVALID_BUFFER_SIZE;
+
+    std::vector<char> privateData;
+    if (pPrivateData != nullptr) {
+        const char* p = static_cast<const char*>(pPrivateData);
+        privateData.assign(p, p + cbPrivateData);
+    }
+
+    std::shared_ptr<ConnectRequest> pRequest;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State != State::Requested) return ND_CONNECTION_INVALID;
+        pRequest = std::move(m_pRequest);
+        m_State = State::Idle;
+    }
+    pRequest->Refuse(privateData);
+    return ND_SUCCESS;
+}
+
+HRESULT Connector::GetReadLimits(ULONG* pInboundReadLimit, ULONG* pOutboundReadLimit) {
+    std::lock_guard lock(m_Lock);
+    if (m_State == State::Idle || m_State == State::Connecting) return ND_CONNECTION_INVALID;
+    if (pInboundReadLimit) *pInboundReadLimit = m_InboundReadLimit;
+    if (pOutboundReadLimit) *pOutboundReadLimit = m_OutboundReadLimit;
+    return ND_SUCCESS;
+}
+
+HRESULT Connector::GetPrivateData(VOID* pPrivateData, ULONG* pcbPrivateData) {
+    if (pcbPrivateData == nullptr) return ND_INVALID_PARAMETER_2;
+
+    std::lock_guard lock(m_Lock);
+    if (m_State == State::Connecting) return ND_CONNECTION_INVALID;
+    ULONG cbData = static_cast<ULONG>(m_PrivateData.size());
+    ULONG cbCopy = std::min(cbData, *pcbPrivateData);
+    if (pPrivateData != nullptr && cbCopy > 0) std::memcpy(pPrivateData, m_PrivateData.data(), cbCopy);
+    *pcbPrivateData = cbData;
+    return (pPrivateData == nullptr || cbCopy < cbData) && cbData > 0 ? ND_BUFFER_OVERFLOW : ND_SUCCESS;
+}
+
+HRESULT Connector::GetLocalAddress(sockaddr* pAddress, ULONG* pcbAddress) {
+    std::lock_guard lock(m_Lock);
+    return m_LocalAddr.CopyTo(pAddress, pcbAddress);
+}
+
+HRESULT Connector::GetPeerAddress(sockaddr* pAddress, ULONG* pcbAddress) {
+    std::lock_guard lock(m_Lock);
+    if (m_State == State::Idle) return ND_CONNECTION_INVALID;
+    return m_PeerAddr.CopyTo(pAddress, pcbAddress);
+}
+
+HRESULT Connector::NotifyDisconnect(OVERLAPPED* pOverlapped) {
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_1;
+
+    std::lock_guard lock(m_Lock);
+    if (m_State == State::Disconnected) return SetOverlappedResult(pOverlapped, ND_SUCCESS);
+    if (m_State != State::Connected && m_State != State::Accepting && m_State != State::Replied) {
+        return SetOverlappedResult(pOverlapped, ND_CONNECTION_INVALID);
+    }
+    if (m_pDisconnectOv != nullptr) return ND_DEVICE_BUSY;
+    m_pDisconnectOv = pOverlapped;
+    SetOverlappedResult(pOverlapped, ND_PENDING);
+    return ND_PENDING;
+}
+
+HRESULT Connector::Disconnect(OVERLAPPED* pOverlapped) {
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_1;
+    Teardown();
+    return SetOverlappedResult(pOverlapped, ND_SUCCESS);
+}
+
+void Connector::OnConnectionRequest(const std::shared_ptr<ConnectRequest>& pRequest) {
+    std::lock_guard lock(m_Lock);
+    m_pRequest = pRequest;
+    m_State = State::Requested;
+    m_LocalAddr = pRequest->ServerAddr;
+    m_PeerAddr = pRequest->ClientAddr;
+    m_PrivateData = pRequest->PrivateData;
+    m_InboundReadLimit = pRequest->OutboundReadLimit;
+    m_OutboundReadLimit = pRequest->InboundReadLimit;
+}
+
+bool Connector::OnConnectReply(HRESULT hr, const std::vector<char>& privateData,
+    const std::shared_ptr<Connection>& pConnection, const std::shared_ptr<Link>& pLink,
+    ULONG inboundReadLimit, ULONG outboundReadLimit) {
+    OVERLAPPED* pOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State != State::Connecting) return false;
+
+        m_PrivateData = privateData;
+        if (SUCCEEDED(hr)) {
+            m_pConnection = pConnection;
+            m_pLink = pLink;
+            m_Side = 0;
+            m_InboundReadLimit = inboundReadLimit;
+            m_OutboundReadLimit = outboundReadLimit;
+            m_State = State::Replied;
+        } else {
+            m_State = State::Idle;
+            m_pLink.reset();
+        }
+        std::swap(pOv, m_pConnectOv);
+    }
+    if (pOv) CompleteOverlapped(pOv, hr);
+    return true;
+}
+
+void Connector::OnCompleteConnect() {
+    OVERLAPPED* pOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State != State::Accepting) return;
+        m_State = State::Connected;
+        std::swap(pOv, m_pAcceptOv);
+    }
+    if (pOv) CompleteOverlapped(pOv, ND_SUCCESS);
+}
+
+void Connector::OnPeerDisconnect() {
+    OVERLAPPED* pAcceptOv = nullptr;
+    OVERLAPPED* pDisconnectOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_State == State::Disconnected) return;
+        m_State = State::Disconnected;
+        m_pConnection.reset();
+        m_pLink.reset();
+        std::swap(pAcceptOv, m_pAcceptOv);
+        std::swap(pDisconnectOv, m_pDisconnectOv);
+    }
+    if (pAcceptOv) CompleteOverlapped(pAcceptOv, ND_CONNECTION_ABORTED);
+    if (pDisconnectOv) CompleteOverlapped(pDisconnectOv, ND_SUCCESS);
+}
+
+void Connector::Teardown() {
+    std::shared_ptr<Connection> pConnection;
+    std::shared_ptr<Link> pLink;
+    std::shared_ptr<ConnectRequest> pRequest;
+    OVERLAPPED* pConnectOv = nullptr;
+    OVERLAPPED* pAcceptOv = nullptr;
+    OVERLAPPED* pDisconnectOv = nullptr;
+    int side;
+    {
+        std::lock_guard lock(m_Lock);
+        pConnection = std::move(m_pConnection);
+        pLink = std::move(m_pLink);
+        pRequest = std::move(m_pRequest);
+        side = m_Side;
+        if (m_State != State::Idle) m_State = State::Disconnected;
+        std::swap(pConnectOv, m_pConnectOv);
+        std::swap(pAcceptOv, m_pAcceptOv);
+        std::swap(pDisconnectOv, m_pDisconnectOv);
+    }
+
+    // A request we never answered is refused so the client does not hang.
+    if (pRequest) pRequest->Refuse({});
+    if (pLink) pLink->Close();
+
+    if (pConnection) {
+        {
+            std::lock_guard lock(pConnection->Lock);
+            if (pConnection->pConnector[side] == this) pConnection->pConnector[side] = nullptr;
+        }
+        QueuePair* pLocalQp = pConnection->AcquireQueuePair(side);
+        QueuePair* pPeerQp = pConnection->AcquireQueuePair(1 - side);
+        Connector* pPeer = pConnection->AcquireConnector(1 - side);
+        if (pLocalQp) {
+            pLocalQp->OnDisconnect();
+            pLocalQp->Release();
+        }
+        if (pPeerQp) {
+            pPeerQp->OnDisconnect();
+            pPeerQp->Release();
+        }
+        if (pPeer) {
+            pPeer->OnPeerDisconnect();
+            pPeer->Release();
+        }
+    }
+
+    if (pConnectOv) CompleteOverlapped(pConnectOv, ND_CANCELED);
+    if (pAcceptOv) CompleteOverlapped(pAcceptOv, ND_CANCELED);
+    if (pDisconnectOv) CompleteOverlapped(pDisconnectOv, ND_CANCELED);
+}
+
+// MARK: Listener
+Listener::Listener(Adapter* pAdapter) : m_pAdapter(pAdapter) {
+    m_pAdapter->AddRef();
+}
+
+Listener::~Listener() {
+    Shutdown(ND_CANCELED);
+    m_pAdapter->Release();
+}
+
+HRESULT Listener::CancelOverlappedRequests() {
+    std::deque<PendingGet> pendingGets;
+    {
+        std::lock_guard lock(m_Lock);
+        pendingGets.swap(m_PendingGets);
+    }
+    for (PendingGet& get : pendingGets) {
+        CompleteOverlapped(get.pOv, ND_CANCELED);
+        get.pConnector->Release();
+    }
+    return ND_SUCCESS;
+}
+
+HRESULT Listener::GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) {
+    return WaitOverlapped(pOverlapped, wait);
+}
+
+HRESULT Listener::Bind(const sockaddr* pAddress, ULONG cbAddress) {
+    SockAddr addr;
+    if (!addr.Set(pAddress, cbAddress)) return ND_INVALID_ADDRESS;
+    if (!IsLocalAddress(addr.Get())) return ND_INVALID_ADDRESS;
+
+    std::lock_guard lock(m_Lock);
+    if (m_Addr.Length != 0) return ND_INVALID_DEVICE_STATE;
+
+    // The port must be free both in this process and for every other process
+    // on the host; an automatically chosen one moves on until it is.
+    bool autoPort = addr.Port() == 0;
+    for (USHORT attempt = 0;; attempt++) {
+        if (autoPort) addr.SetPort(Fabric::Instance().NextPort());
+        HRESULT hr = Fabric::Instance().AddListener(addr, this);
+        if (SUCCEEDED(hr)) {
+            hr = BindRendezvous(addr.Port(), &m_Socket);
+            if (FAILED(hr)) Fabric::Instance().RemoveListener(this);
+        }
+        if (SUCCEEDED(hr)) {
+            m_Addr = addr;
+            return hr;
+        }
+        if (!autoPort || hr != ND_ADDRESS_ALREADY_EXISTS || attempt == 0x3FFF) return hr;
+    }
+}
+
+HRESULT Listener::Listen(ULONG backlog) {
+    std::lock_guard lock(m_Lock);
+    if (m_Addr.Length == 0) return ND_INVALID_DEVICE_STATE;
+    if (m_Socket >= 0 && m_SocketHandler == 0) {
+        if (listen(m_Socket, backlog != 0 ? static_cast<int>(backlog) : SOMAXCONN) != 0) return ND_INTERNAL_ERROR;
+        m_SocketHandler = ShmService::Instance().Add(m_Socket, [this](UINT32) { OnRemoteConnect(); });
+    }
+    m_Listening = true;
+    m_Backlog = backlog;
+    return ND_SUCCESS;
+}
+
+HRESULT Listener::GetLocalAddress(sockaddr* pAddress, ULONG* pcbAddress) {
+    std::lock_guard lock(m_Lock);
+    return m_Addr.CopyTo(pAddress, pcbAddress);
+}
+
+HRESULT Listener::GetConnectionRequest(IUnknown* pConnector, OVERLAPPED* pOverlapped) {
+    Connector* pServer = dynamic_cast<Connector*>(pConnector);
+    if (pServer == nullptr) return ND_INVALID_PARAMETER_1;
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_2;
+
+    std::shared_ptr<ConnectRequest> pRequest;
+    {
+        std::lock_guard lock(m_Lock);
+        if (!m_Listening) return SetOverlappedResult(pOverlapped, ND_INVALID_DEVICE_STATE);
+        if (m_Requests.empty()) {
+            pServer->AddRef();
+            m_PendingGets.push_back({ pServer, pOverlapped });
+            SetOverlappedResult(pOverlapped, ND_PENDING);
+            return ND_PENDING;
+        }
+        pRequest = std::move(m_Requests.front());
+        m_Requests.pop_front();
+    }
+    pServer->OnConnectionRequest(pRequest);
+    return SetOverlappedResult(pOverlapped, ND_SUCCESS);
+}
+
+void Listener::OnRemoteConnect() {
+    std::shared_ptr<ConnectRequest> pRequest = Link::AcceptRequest(m_Socket);
+    if (pRequest && FAILED(QueueRequest(pRequest))) pRequest->Refuse({});
+}
+
+HRESULT Listener::QueueRequest(const std::shared_ptr<ConnectRequest>& pRequest) {
+    PendingGet get;
+    {
+        std::lock_guard lock(m_Lock);
+        if (!m_Listening) return ND_CONNECTION_REFUSED;
+        if (m_PendingGets.empty()) {
+            // A backlog of zero lets the provider pick; this one does not limit it.
+            if (m_Backlog != 0 && m_Requests.size() >= m_Backlog) return ND_CONNECTION_REFUSED;
+            m_Requests.push_back(pRequest);
+            return ND_SUCCESS;
+        }
+        get = m_PendingGets.front();
+        m_PendingGets.pop_front();
+    }
+    get.pConnector->OnConnectionRequest(pRequest);
+    CompleteOverlapped(get.pOv, ND_SUCCESS);
+    get.pConnector->Release();
+    return ND_SUCCESS;
+}
+
+void Listener::Shutdown(HRESULT status) {
+    Fabric::Instance().RemoveListener(this);
+
+    // Waits for a connection being accepted on the progress thread.
+    UINT64 socketHandler;
+    {
+        std::lock_guard lock(m_Lock);
+        socketHandler = std::exchange(m_SocketHandler, 0);
+    }
+    ShmService::Instance().Remove(socketHandler);
+    if (m_Socket >= 0) {
+        close(m_Socket);
+        m_Socket = -1;
+    }
+
+    std::deque<std::shared_ptr<ConnectRequest>> requests;
+    std::deque<PendingGet> pendingGets;
+    {
+        std::lock_guard lock(m_Lock);
+        m_Listening = false;
+        requests.swap(m_Requests);
+        pendingGets.swap(m_PendingGets);
+    }
+    for (auto& pRequest : requests) pRequest->Refuse({});
+    for (PendingGet& get : pendingGets) {
+        CompleteOverlapped(get.pOv, status);
+        get.pConnector->Release();
+    }
+}
+
+} // namespace NDSoft
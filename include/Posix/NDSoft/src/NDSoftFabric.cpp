@@ -0,0 +1,248 @@
+#include "NDSoftShm.hpp"
+#include <thread>
+#include <ifaddrs.h>
+
+namespace NDSoft {
+
+// MARK: Overlapped helpers
+static std::atomic_ref<ULONG_PTR> OverlappedStatus(OVERLAPPED* pOv) {
+    return std::atomic_ref<ULONG_PTR>(pOv->Internal);
+}
+
+HRESULT SetOverlappedResult(OVERLAPPED* pOv, HRESULT hr) {
+    if (pOv) OverlappedStatus(pOv).store(static_cast<ULONG>(hr), std::memory_order_release);
+    return hr;
+}
+
+HRESULT CompleteOverlapped(OVERLAPPED* pOv, HRESULT hr) {
+    if (!pOv) return hr;
+    HANDLE hEvent = pOv->hEvent;
+    SetOverlappedResult(pOv, hr);
+    if (hEvent) SetEvent(hEvent);
+    return hr;
+}
+
+HRESULT WaitOverlapped(OVERLAPPED* pOv, BOOL wait) {
+    if (!pOv) return ND_INVALID_PARAMETER;
+    for (;;) {
+        HRESULT hr = static_cast<HRESULT>(static_cast<ULONG>(OverlappedStatus(pOv).load(std::memory_order_acquire)));
+        if (hr != ND_PENDING || !wait) return hr;
+        if (pOv->hEvent) {
+            WaitForSingleObject(pOv->hEvent, INFINITE);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// MARK: SockAddr
+bool SockAddr::Set(const sockaddr* pAddr, SIZE_T cbAddr) {
+    if (pAddr == nullptr) return false;
+    if (pAddr->sa_family == AF_INET && cbAddr >= sizeof(sockaddr_in)) {
+        Length = sizeof(sockaddr_in);
+    } else if (pAddr->sa_family == AF_INET6 && cbAddr >= sizeof(sockaddr_in6)) {
+        Length = sizeof(sockaddr_in6);
+    } else {
+        return false;
+    }
+    std::memset(&Storage, 0, sizeof(Storage));
+    std::memcpy(&Storage, pAddr, Length);
+    return true;
+}
+
+USHORT SockAddr::Port() const {
+    if (Storage.ss_family == AF_INET) return ntohs(reinterpret_cast<const sockaddr_in*>(&Storage)->sin_port);
+    if (Storage.ss_family == AF_INET6) return ntohs(reinterpret_cast<const sockaddr_in6*>(&Storage)->sin6_port);
+    return 0;
+}
+
+void SockAddr::SetPort(USHORT port) {
+    if (Storage.ss_family == AF_INET) reinterpret_cast<sockaddr_in*>(&Storage)->sin_port = htons(port);
+    if (Storage.ss_family == AF_INET6) reinterpret_cast<sockaddr_in6*>(&Storage)->sin6_port = htons(port);
+}
+
+HRESULT SockAddr::CopyTo(sockaddr* pAddr, ULONG* pcbAddr) const {
+    if (pcbAddr == nullptr) return ND_INVALID_PARAMETER;
+    if (Length == 0) return ND_CONNECTION_INVALID;
+    if (pAddr == nullptr || *pcbAddr < Length) {
+        *pcbAddr = Length;
+        return ND_BUFFER_OVERFLOW;
+    }
+    std::memcpy(pAddr, &Storage, Length);
+    *pcbAddr = Length;
+    return ND_SUCCESS;
+}
+
+static bool IsWildcard(const sockaddr* pAddr) {
+    if (pAddr->sa_family == AF_INET) {
+        return reinterpret_cast<const sockaddr_in*>(pAddr)->sin_addr.s_addr == htonl(INADDR_ANY);
+    }
+    if (pAddr->sa_family == AF_INET6) {
+        const in6_addr& a = reinterpret_cast<const sockaddr_in6*>(pAddr)->sin6_addr;
+        return std::memcmp(&a, &in6addr_any, sizeof(a)) == 0;
+    }
+    return false;
+}
+
+static bool SameHost(const sockaddr* pLhs, const sockaddr* pRhs) {
+    if (pLhs->sa_family != pRhs->sa_family) return false;
+    if (pLhs->sa_family == AF_INET) {
+        return reinterpret_cast<const sockaddr_in*>(pLhs)->sin_addr.s_addr ==
+            reinterpret_cast<const sockaddr_in*>(pRhs)->sin_addr.s_addr;
+    }
+    return std::memcmp(&reinterpret_cast<const sockaddr_in6*>(pLhs)->sin6_addr,
+        &reinterpret_cast<const sockaddr_in6*>(pRhs)->sin6_addr, sizeof(in6_addr)) == 0;
+}
+
+static bool IsLoopback(const sockaddr* pAddr) {
+    if (pAddr->sa_family == AF_INET) {
+        return (ntohl(reinterpret_cast<const sockaddr_in*>(pAddr)->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+    }
+    if (pAddr->sa_family == AF_INET6) {
+        return IN6_IS_ADDR_LOOPBACK(&reinterpret_cast<const sockaddr_in6*>(pAddr)->sin6_addr);
+    }
+    return false;
+}
+
+bool IsLocalAddress(const sockaddr* pAddr) {
+    if (pAddr == nullptr) return false;
+    if (IsWildcard(pAddr) || IsLoopback(pAddr)) return true;
+
+    struct ifaddrs* pList = nullptr;
+    if (getifaddrs(&pList) != 0) return false;
+
+    bool found = false;
+    for (struct ifaddrs* p = pList; p != nullptr && !found; p = p->ifa_next) {
+        if (p->ifa_addr != nullptr && SameHost(p->ifa_addr, pAddr)) found = true;
+    }
+    freeifaddrs(pList);
+    return found;
+}
+
+// MARK: Fabric
+// Tokens carry a slot index in the low 20 bits and a generation above it, so a
+// stale token from a deregistered region never resolves to its successor.
+constexpr UINT32 TokenIndexBits = 20;
+constexpr UINT32 TokenIndexMask = (1u << TokenIndexBits) - 1;
+static_assert(Shm::TokenTableEntries == 1u << TokenIndexBits);
+
+Fabric& Fabric::Instance() {
+    static Fabric fabric;
+    return fabric;
+}
+
+UINT32 Fabric::AllocateToken(const Region& region) {
+    std::unique_lock lock(m_TokenLock);
+    UINT32 index;
+    if (!m_FreeTokens.empty()) {
+        index = m_FreeTokens.back();
+        m_FreeTokens.pop_back();
+    } else {
+        if (m_Tokens.empty()) m_Tokens.emplace_back(); // slot 0 is never handed out
+        if (m_Tokens.size() > TokenIndexMask) return 0;
+        index = static_cast<UINT32>(m_Tokens.size());
+        m_Tokens.emplace_back();
+    }
+
+    TokenSlot& slot = m_Tokens[index];
+    slot.Region = region;
+    slot.InUse = true;
+    slot.Generation = (slot.Generation + 1) & (0xFFFFFFFFu >> TokenIndexBits);
+    PublishToken(index, slot);
+    return (slot.Generation << TokenIndexBits) | index;
+}
+
+void Fabric::UpdateToken(UINT32 token, const Region& region) {
+    std::unique_lock lock(m_TokenLock);
+    UINT32 index = token & TokenIndexMask;
+    if (index >= m_Tokens.size()) return;
+    TokenSlot& slot = m_Tokens[index];
+    if (slot.InUse && slot.Generation == (token >> TokenIndexBits)) {
+        slot.Region = region;
+        PublishToken(index, slot);
+    }
+}
+
+void Fabric::FreeToken(UINT32 token) {
+    std::unique_lock lock(m_TokenLock);
+    UINT32 index = token & TokenIndexMask;
+    if (index == 0 || index >= m_Tokens.size()) return;
+    TokenSlot& slot = m_Tokens[index];
+    if (!slot.InUse || slot.Generation != (token >> TokenIndexBits)) return;
+    slot.InUse = false;
+    slot.Region = {};
+    PublishToken(index, slot);
+    m_FreeTokens.push_back(index);
+}
+
+bool Fabric::CheckAccess(UINT32 token, const void* pAddr, SIZE_T length, ULONG access) const {
+    std::shared_lock lock(m_TokenLock);
+    UINT32 index = token & TokenIndexMask;
+    if (index >= m_Tokens.size()) return false;
+    const TokenSlot& slot = m_Tokens[index];
+    if (!slot.InUse || slot.Generation != (token >> TokenIndexBits)) return false;
+    if ((slot.Region.Access & access) != access) return false;
+
+    const char* p = static_cast<const char*>(pAddr);
+    if (length == 0) return true;
+    return p >= slot.Region.Base && length <= slot.Region.Length &&
+        static_cast<SIZE_T>(p - slot.Region.Base) <= slot.Region.Length - length;
+}
+
+// Mirrors a slot into the shared table under its sequence lock. Called with
+// m_TokenLock held exclusively, so there is a single writer.
+void Fabric::PublishToken(UINT32 index, const TokenSlot& slot) {
+    if (m_pSharedTokens == nullptr) return;
+    Shm::TokenEntry& entry = m_pSharedTokens[index];
+    UINT32 sequence = entry.Sequence.load(std::memory_order_relaxed);
+    entry.Sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.Token.store(slot.InUse ? (slot.Generation << TokenIndexBits) | index : 0, std::memory_order_relaxed);
+    entry.Access.store(slot.Region.Access, std::memory_order_relaxed);
+    entry.Base.store(reinterpret_cast<uintptr_t>(slot.Region.Base), std::memory_order_relaxed);
+    entry.Length.store(slot.Region.Length, std::memory_order_relaxed);
+    entry.Sequence.store(sequence + 2, std::memory_order_release);
+}
+
+
+HRESULT Fabric::AddListener(const SockAddr& addr, Listener* pListener) {
+    std::lock_guard lock(m_ListenerLock);
+    for (const auto& entry : m_Listeners) {
+        if (entry.first.Port() == addr.Port() && entry.first.Storage.ss_family == addr.Storage.ss_family &&
+            (SameHost(entry.first.Get(), addr.Get()) || IsWildcard(entry.first.Get()) || IsWildcard(addr.Get()))) {
+            return ND_ADDRESS_ALREADY_EXISTS;
+        }
+    }
+    m_Listeners.emplace_back(addr, pListener);
+    return ND_SUCCESS;
+}
+
+void Fabric::RemoveListener(Listener* pListener) {
+    std::lock_guard lock(m_ListenerLock);
+    std::erase_if(m_Listeners, [pListener](const auto& entry) { return entry.second == pListener; });
+}
+
+Listener* Fabric::AcquireListener(const sockaddr* pAddr) {
+    SockAddr target;
+    if (!target.Set(pAddr, sizeof(sockaddr_storage))) return nullptr;
+
+    std::lock_guard lock(m_ListenerLock);
+    for (const auto& entry : m_Listeners) {
+        if (entry.first.Port() != target.Port() || entry.first.Storage.ss_family != target.Storage.ss_family) continue;
+        if (!SameHost(entry.first.Get(), target.Get()) && !IsWildcard(entry.first.Get())) continue;
+        return entry.second->TryAddRef() ? entry.second : nullptr;
+    }
+    return nullptr;
+}
+
+UINT64 Fabric::NextAdapterId() {
+    return m_NextAdapterId.fetch_add(1, std::memory_order_relaxed);
+}
+
+USHORT Fabric::NextPort() {
+    USHORT port = m_NextPort.fetch_add(1, std::memory_order_relaxed);
+    if (port == 0xFFFF) m_NextPort.store(49152, std::memory_order_relaxed);
+    return port;
+}
+
+} // namespace NDSoft
@@ -0,0 +1,105 @@
+#include "NDSoft.hpp"
+
+namespace NDSoft {
+
+static ULONG RegionAccess(ULONG flags) {
+    // Each flag grants only its own access, as on hardware: remote reads need
+    // ND_MR_FLAG_ALLOW_REMOTE_READ even when remote writes are allowed.
+    // ND_MR_FLAG_ALLOW_REMOTE_WRITE carries the local write bit (see nddef.h).
+    ULONG access = 0;
+    if (flags & ND_MR_FLAG_ALLOW_LOCAL_WRITE) access |= AccessLocalWrite;
+    if (flags & ND_MR_FLAG_ALLOW_REMOTE_READ) access |= AccessRemoteRead;
+    if ((flags & ND_MR_FLAG_ALLOW_REMOTE_WRITE) == ND_MR_FLAG_ALLOW_REMOTE_WRITE) access |= AccessRemoteWrite;
+    return access;
+}
+
+// MARK: MemoryRegion
+MemoryRegion::MemoryRegion(Adapter* pAdapter) : m_pAdapter(pAdapter) {
+    m_pAdapter->AddRef();
+}
+
+MemoryRegion::~MemoryRegion() {
+    if (m_Token != 0) {
+        Fabric::Instance().FreeToken(m_Token);
+        Fabric::Instance().UnshareRegion(m_Region);
+    }
+    m_pAdapter->Release();
+}
+
+HRESULT MemoryRegion::CancelOverlappedRequests() {
+    return ND_SUCCESS;
+}
+
+HRESULT MemoryRegion::GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) {
+    return WaitOverlapped(pOverlapped, wait);
+}
+
+HRESULT MemoryRegion::Register(const VOID* pBuffer, SIZE_T cbBuffer, ULONG flags, OVERLAPPED* pOverlapped) {
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_4;
+    if (pBuffer == nullptr) return SetOverlappedResult(pOverlapped, ND_INVALID_PARAMETER_1);
+    if (cbBuffer == 0) return SetOverlappedResult(pOverlapped, ND_INVALID_PARAMETER_2);
+    if (m_Token != 0) return SetOverlappedResult(pOverlapped, ND_DEVICE_BUSY);
+
+    m_Region = { static_cast<const char*>(pBuffer), cbBuffer, RegionAccess(flags) };
+    m_Token = Fabric::Instance().AllocateToken(m_Region);
+    if (m_Token == 0) {
+        m_Region = {};
+        return SetOverlappedResult(pOverlapped, ND_INSUFFICIENT_RESOURCES);
+    }
+    // Peers in other processes reach the buffer through shared segments.
+    Fabric::Instance().ShareRegion(m_Region);
+    return SetOverlappedResult(pOverlapped, ND_SUCCESS);
+}
+
+HRESULT MemoryRegion::Deregister(OVERLAPPED* pOverlapped) {
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER_1;
+    if (m_Token == 0) return SetOverlappedResult(pOverlapped, ND_INVALID_PARAMETER);
+
+    Fabric::Instance().FreeToken(m_Token);
+    Fabric::Instance().UnshareRegion(m_Region);
+    m_Token = 0;
+    m_Region = {};
+    return SetOverlappedResult(pOverlapped, ND_SUCCESS);
+}
+
+UINT32 MemoryRegion::GetLocalToken() {
+    return m_Token;
+}
+
+UINT32 MemoryRegion::GetRemoteToken() {
+    return (m_Region.Access & (AccessRemoteRead | AccessRemoteWrite)) ? m_Token : 0;
+}
+
+bool MemoryRegion::Contains(const void* pBuffer, SIZE_T cbBuffer) const {
+    const char* p = static_cast<const char*>(pBuffer);
+    return m_Token != 0 && p >= m_Region.Base && cbBuffer <= m_Region.Length &&
+        static_cast<SIZE_T>(p - m_Region.Base) <= m_Region.Length - cbBuffer;
+}
+
+// MARK: MemoryWindow
+// A window owns a token from creation; binding points it at a slice of a
+// registered region and invalidation revokes all remote access again.
+MemoryWindow::MemoryWindow(Adapter* pAdapter) :
+    m_pAdapter(pAdapter), m_Token(Fabric::Instance().AllocateToken({}))
+{
+    m_pAdapter->AddRef();
+}
+
+MemoryWindow::~MemoryWindow() {
+    if (m_Token != 0) Fabric::Instance().FreeToken(m_Token);
+    m_pAdapter->Release();
+}
+
+UINT32 MemoryWindow::GetRemoteToken() {
+    return m_Token;
+}
+
+void MemoryWindow::Bind(const void* pBuffer, SIZE_T cbBuffer, ULONG access) {
+    Fabric::Instance().UpdateToken(m_Token, { static_cast<const char*>(pBuffer), cbBuffer, access });
+}
+
+void MemoryWindow::Invalidate() {
+    Fabric::Instance().UpdateToken(m_Token, {});
+}
+
+} // namespace NDSoft
@@ -0,0 +1,933 @@
+#include "NDSoftShm.hpp"
+#include <new>
+#include <thread>
+#include <unistd.h>
+
+namespace NDSoft {
+
+static SIZE_T SgeLength(const ND2_SGE sge[], ULONG nSge) {
+    SIZE_T length = 0;
+    for (ULONG i = 0; i < nSge; i++) length += sge[i].BufferLength;
+    return length;
+}
+
+static bool CheckSge(const ND2_SGE sge[], ULONG nSge, ULONG access) {
+    const Fabric& fabric = Fabric::Instance();
+    for (ULONG i = 0; i < nSge; i++) {
+        if (sge[i].BufferLength == 0) continue;
+        if (!fabric.CheckAccess(sge[i].MemoryRegionToken, sge[i].Buffer, sge[i].BufferLength, access)) return false;
+    }
+    return true;
+}
+
+// Gathers from src into the scatter list dst. The caller has checked that dst
+// is large enough.
+static void CopySge(const ND2_SGE dst[], ULONG nDst, const ND2_SGE src[], ULONG nSrc) {
+    ULONG d = 0;
+    SIZE_T dstOffset = 0;
+    for (ULONG s = 0; s < nSrc; s++) {
+        const char* pSrc = static_cast<const char*>(src[s].Buffer);
+        SIZE_T remaining = src[s].BufferLength;
+        while (remaining > 0 && d < nDst) {
+            SIZE_T n = std::min<SIZE_T>(remaining, dst[d].BufferLength - dstOffset);
+            std::memcpy(static_cast<char*>(dst[d].Buffer) + dstOffset, pSrc, n);
+            pSrc += n;
+            remaining -= n;
+            dstOffset += n;
+            if (dstOffset == dst[d].BufferLength) {
+                d++;
+                dstOffset = 0;
+            }
+        }
+    }
+}
+
+// Splits off the final byte of a gather list. Writes place it last, after a
+// release fence, the way a NIC places a write in ascending address order, so
+// a peer that polls the last byte of a record never sees it before the rest.
+// Writes of up to one word go in a single copy instead, so an aligned word is
+// never seen half written.
+static bool SplitLastByte(const ND2_SGE sge[], ULONG nSge, ULONG* pLast, char* pByte) {
+    if (SgeLength(sge, nSge) <= sizeof(UINT64)) return false;
+    for (ULONG i = nSge; i-- > 0;) {
+        if (sge[i].BufferLength == 0) continue;
+        *pLast = i;
+        *pByte = static_cast<const char*>(sge[i].Buffer)[sge[i].BufferLength - 1];
+        return true;
+    }
+    return false;
+}
+
+// MARK: Connection
+QueuePair* Connection::AcquireQueuePair(int side) {
+    std::lock_guard lock(Lock);
+    QueuePair* pQp = pQueuePair[side];
+    return (pQp && pQp->TryAddRef()) ? pQp : nullptr;
+}
+
+Connector* Connection::AcquireConnector(int side) {
+    std::lock_guard lock(Lock);
+    Connector* pConnector = this->pConnector[side];
+    return (pConnector && pConnector->TryAddRef()) ? pConnector : nullptr;
+}
+
+// MARK: QueuePair
+QueuePair::QueuePair(Adapter* pAdapter, CompletionQueue* pReceiveCq, CompletionQueue* pInitiatorCq, VOID* context,
+    ULONG receiveQueueDepth, ULONG initiatorQueueDepth, ULONG maxReceiveRequestSge,
+    ULONG maxInitiatorRequestSge, ULONG inlineDataSize) :
+    m_pAdapter(pAdapter), m_pReceiveCq(pReceiveCq), m_pInitiatorCq(pInitiatorCq), m_Context(context),
+    m_ReceiveQueueDepth(receiveQueueDepth), m_InitiatorQueueDepth(initiatorQueueDepth),
+    m_MaxReceiveSge(maxReceiveRequestSge), m_MaxInitiatorSge(maxInitiatorRequestSge),
+    m_InlineDataSize(inlineDataSize), m_Receives(receiveQueueDepth)
+{
+    m_pAdapter->AddRef();
+    m_pReceiveCq->AddRef();
+    m_pInitiatorCq->AddRef();
+}
+
+QueuePair::QueuePair(Adapter* pAdapter, CompletionQueue* pReceiveCq, CompletionQueue* pInitiatorCq,
+    SharedReceiveQueue* pSrq, VOID* context, ULONG initiatorQueueDepth, ULONG maxInitiatorRequestSge,
+    ULONG inlineDataSize) :
+    QueuePair(pAdapter, pReceiveCq, pInitiatorCq, context, 0, initiatorQueueDepth, 0, maxInitiatorRequestSge,
+        inlineDataSize)
+{
+    m_pSrq = pSrq;
+    m_pSrq->AddRef();
+}
+
+QueuePair::~QueuePair() {
+    OnDisconnect();
+    if (m_pSrq) {
+        m_pSrq->Detach(this);
+        m_pSrq->Release();
+    }
+    m_pInitiatorCq->Release();
+    m_pReceiveCq->Release();
+    m_pAdapter->Release();
+}
+
+void QueuePair::Attach(const std::shared_ptr<Connection>& pConnection, int side) {
+    std::lock_guard lock(m_Lock);
+    m_pConnection = pConnection;
+    m_Side = side;
+}
+
+void QueuePair::OnDisconnect() {
+    DetachRemote();
+
+    std::shared_ptr<Connection> pConnection;
+    {
+        std::lock_guard lock(m_Lock);
+        pConnection = std::move(m_pConnection);
+    }
+    if (pConnection) {
+        std::lock_guard lock(pConnection->Lock);
+        if (pConnection->pQueuePair[m_Side] == this) pConnection->pQueuePair[m_Side] = nullptr;
+    }
+    FlushReceives();
+    FlushStalled();
+}
+
+QueuePair* QueuePair::AcquirePeer() {
+    std::shared_ptr<Connection> pConnection;
+    int side;
+    {
+        std::lock_guard lock(m_Lock);
+        pConnection = m_pConnection;
+        side = m_Side;
+    }
+    return pConnection ? pConnection->AcquireQueuePair(1 - side) : nullptr;
+}
+
+HRESULT QueuePair::Flush() {
+    std::shared_ptr<Link> pLink;
+    {
+        std::lock_guard lock(m_Lock);
+        pLink = m_pLink;
+    }
+    if (pLink) {
+        FlushRemote(*pLink);
+        return ND_SUCCESS;
+    }
+
+    FlushReceives();
+    FlushStalled();
+    if (QueuePair* pPeer = AcquirePeer()) {
+        pPeer->FlushStalled();
+        pPeer->Release();
+    }
+    return ND_SUCCESS;
+}
+
+HRESULT QueuePair::CheckInitiatorRequest(const ND2_SGE sge[], ULONG nSge, ULONG flags, ULONG access) const {
+    if (nSge > m_MaxInitiatorSge || (nSge > 0 && sge == nullptr)) return ND_INVALID_PARAMETER_3;
+    if (SgeLength(sge, nSge) > MaxTransferLength) return ND_INVALID_BUFFER_SIZE;
+    if (m_StalledInitiator.load(std::memory_order_relaxed) >= m_InitiatorQueueDepth) return ND_NO_MORE_ENTRIES;
+    // Inline data is copied at post time and never referenced through a token.
+    if (!(flags & ND_OP_FLAG_INLINE) && !CheckSge(sge, nSge, access)) return ND_ACCESS_VIOLATION;
+    return ND_SUCCESS;
+}
+
+HRESULT QueuePair::Send(VOID* requestContext, const ND2_SGE sge[], ULONG nSge, ULONG flags) {
+    HRESULT hr = CheckInitiatorRequest(sge, nSge, flags, 0);
+    if (FAILED(hr)) return hr;
+    if (m_Remote.load(std::memory_order_acquire)) {
+        return PostRemote(Nd2RequestTypeSend, requestContext, sge, nSge, flags, 0, 0);
+    }
+
+    QueuePair* pPeer = AcquirePeer();
+    if (pPeer == nullptr) return ND_CONNECTION_INVALID;
+    hr = pPeer->Post(this, Nd2RequestTypeSend, requestContext, sge, nSge, flags, 0, 0);
+    pPeer->Release();
+    return hr;
+}
+
+HRESULT QueuePair::Write(VOID* requestContext, const ND2_SGE sge[], ULONG nSge, UINT64 remoteAddress,
+    UINT32 remoteToken, ULONG flags) {
+    HRESULT hr = CheckInitiatorRequest(sge, nSge, flags, 0);
+    if (FAILED(hr)) return hr;
+    if (m_Remote.load(std::memory_order_acquire)) {
+        return PostRemote(Nd2RequestTypeWrite, requestContext, sge, nSge, flags, remoteAddress, remoteToken);
+    }
+
+    QueuePair* pPeer = AcquirePeer();
+    if (pPeer == nullptr) return ND_CONNECTION_INVALID;
+    hr = pPeer->Post(this, Nd2RequestTypeWrite, requestContext, sge, nSge, flags, remoteAddress, remoteToken);
+    pPeer->Release();
+    return hr;
+}
+
+HRESULT QueuePair::Read(VOID* requestContext, const ND2_SGE sge[], ULONG nSge, UINT64 remoteAddress,
+    UINT32 remoteToken, ULONG flags) {
+    HRESULT hr = CheckInitiatorRequest(sge, nSge, flags & ~ND_OP_FLAG_INLINE, AccessLocalWrite);
+    if (FAILED(hr)) return hr;
+    if (m_Remote.load(std::memory_order_acquire)) {
+        return PostRemote(Nd2RequestTypeRead, requestContext, sge, nSge, flags & ~ND_OP_FLAG_INLINE,
+            remoteAddress, remoteToken);
+    }
+
+    QueuePair* pPeer = AcquirePeer();
+    if (pPeer == nullptr) return ND_CONNECTION_INVALID;
+    hr = pPeer->Post(this, Nd2RequestTypeRead, requestContext, sge, nSge, flags & ~ND_OP_FLAG_INLINE,
+        remoteAddress, remoteToken);
+    pPeer->Release();
+    return hr;
+}
+
+HRESULT QueuePair::Receive(VOID* requestContext, const ND2_SGE sge[], ULONG nSge) {
+    if (m_pSrq) return ND_INVALID_DEVICE_REQUEST;
+    if (nSge > m_MaxReceiveSge || (nSge > 0 && sge == nullptr)) return ND_INVALID_PARAMETER_3;
+    {
+        std::lock_guard lock(m_Lock);
+        if (m_pLink) return ReceiveRemote(*m_pLink, requestContext, sge, nSge);
+        if (m_ReceiveCount == m_Receives.size()) return ND_NO_MORE_ENTRIES;
+
+        ReceiveRequest& rr = m_Receives[(m_ReceiveHead + m_ReceiveCount) % m_Receives.size()];
+        rr.Context = requestContext;
+        rr.nSge = nSge;
+        std::copy(sge, sge + nSge, rr.Sge);
+        m_ReceiveCount++;
+    }
+    ProgressStalled();
+    return ND_SUCCESS;
+}
+
+HRESULT QueuePair::Bind(VOID* requestContext, IUnknown* pMemoryRegion, IUnknown* pMemoryWindow,
+    const VOID* pBuffer, SIZE_T cbBuffer, ULONG flags) {
+    MemoryRegion* pMr = dynamic_cast<MemoryRegion*>(pMemoryRegion);
+    MemoryWindow* pMw = dynamic_cast<MemoryWindow*>(pMemoryWindow);
+    if (pMr == nullptr) return ND_INVALID_PARAMETER_2;
+    if (pMw == nullptr) return ND_INVALID_PARAMETER_3;
+
+    if (!pMr->Contains(pBuffer, cbBuffer)) {
+        CompleteInitiator(requestContext, Nd2RequestTypeBind, ND_ACCESS_VIOLATION, 0, flags);
+        return ND_SUCCESS;
+    }
+
+    ULONG access = 0;
+    if (flags & ND_OP_FLAG_ALLOW_READ) access |= AccessRemoteRead;
+    if (flags & ND_OP_FLAG_ALLOW_WRITE) access |= AccessRemoteWrite;
+    pMw->Bind(pBuffer, cbBuffer, access);
+    CompleteInitiator(requestContext, Nd2RequestTypeBind, ND_SUCCESS, 0, flags);
+    return ND_SUCCESS;
+}
+
+HRESULT QueuePair::Invalidate(VOID* requestContext, IUnknown* pMemoryWindow, ULONG flags) {
+    MemoryWindow* pMw = dynamic_cast<MemoryWindow*>(pMemoryWindow);
+    if (pMw == nullptr) return ND_INVALID_PARAMETER_2;
+
+    pMw->Invalidate();
+    CompleteInitiator(requestContext, Nd2RequestTypeInvalidate, ND_SUCCESS, 0, flags);
+    return ND_SUCCESS;
+}
+
+// MARK: Target side
+HRESULT QueuePair::Post(QueuePair* pInitiator, ND2_REQUEST_TYPE type, VOID* context, const ND2_SGE sge[],
+    ULONG nSge, ULONG flags, UINT64 remoteAddress, UINT32 remoteToken) {
+    std::unique_lock lock(m_Lock);
+    if (m_Stalled.empty() && !m_Draining) {
+        if (type != Nd2RequestTypeSend) {
+            lock.unlock();
+            if (type == Nd2RequestTypeWrite) {
+                pInitiator->ExecuteWrite(context, sge, nSge, flags, remoteAddress, remoteToken);
+            } else {
+                pInitiator->ExecuteRead(context, sge, nSge, flags, remoteAddress, remoteToken);
+            }
+            return ND_SUCCESS;
+        }
+
+        ReceiveRequest rr;
+        if (PopReceive(&rr)) {
+            lock.unlock();
+            pInitiator->ExecuteSend(this, context, sge, nSge, flags, rr);
+            return ND_SUCCESS;
+        }
+    }
+
+    // Queue behind earlier requests; everything after a Send without a posted
+    // receive must wait for it to keep the connection's ordering.
+    pInitiator->AddRef();
+    pInitiator->m_StalledInitiator.fetch_add(1, std::memory_order_relaxed);
+    m_Stalled.push_back(MakeWorkRequest(pInitiator, type, context, sge, nSge, flags, remoteAddress, remoteToken));
+    return ND_SUCCESS;
+}
+
+QueuePair::WorkRequest QueuePair::MakeWorkRequest(QueuePair* pInitiator, ND2_REQUEST_TYPE type, VOID* context,
+    const ND2_SGE sge[], ULONG nSge, ULONG flags, UINT64 remoteAddress, UINT32 remoteToken) {
+    WorkRequest wr;
+    wr.pInitiator = pInitiator;
+    wr.Type = type;
+    wr.Context = context;
+    wr.Flags = flags;
+    wr.RemoteAddress = remoteAddress;
+    wr.RemoteToken = remoteToken;
+    if (flags & ND_OP_FLAG_INLINE) {
+        wr.InlineData.resize(SgeLength(sge, nSge));
+        ND2_SGE inlineSge = { wr.InlineData.data(), static_cast<ULONG>(wr.InlineData.size()), 0 };
+        CopySge(&inlineSge, 1, sge, nSge);
+    } else {
+        wr.Sge.assign(sge, sge + nSge);
+    }
+    return wr;
+}
+
+void QueuePair::ProgressStalled() {
+    std::unique_lock lock(m_Lock);
+    // Only one thread drains at a time; requests posted meanwhile queue up
+    // behind and are picked up by the loop below.
+    if (m_Draining) return;
+    m_Draining = true;
+
+    while (!m_Stalled.empty()) {
+        ReceiveRequest rr;
+        bool isSend = m_Stalled.front().Type == Nd2RequestTypeSend;
+        if (isSend && !PopReceive(&rr)) break;
+
+        WorkRequest wr = std::move(m_Stalled.front());
+        m_Stalled.pop_front();
+        lock.unlock();
+
+        wr.pInitiator->Execute(this, wr, isSend ? &rr : nullptr);
+        wr.pInitiator->m_StalledInitiator.fetch_sub(1, std::memory_order_relaxed);
+        wr.pInitiator->Release();
+
+        lock.lock();
+    }
+    m_Draining = false;
+}
+
+bool QueuePair::PopReceive(ReceiveRequest* pReceive) {
+    if (m_pSrq) return m_pSrq->Pop(pReceive, this);
+    if (m_ReceiveCount == 0) return false;
+    ReceiveRequest& rr = m_Receives[m_ReceiveHead];
+    pReceive->Context = rr.Context;
+    pReceive->nSge = rr.nSge;
+    std::copy(rr.Sge, rr.Sge + rr.nSge, pReceive->Sge);
+    m_ReceiveHead = (m_ReceiveHead + 1) % m_Receives.size();
+    m_ReceiveCount--;
+    return true;
+}
+
+void QueuePair::FlushReceives() {
+    // Receives still in a shared receive queue stay there for its other queue pairs.
+    if (m_pSrq) return;
+    std::vector<VOID*> contexts;
+    {
+        std::lock_guard lock(m_Lock);
+        ReceiveRequest rr;
+        while (PopReceive(&rr)) contexts.push_back(rr.Context);
+    }
+    for (VOID* context : contexts) CompleteReceive(context, ND_CANCELED, 0, false);
+}
+
+void QueuePair::FlushStalled() {
+    std::deque<WorkRequest> stalled;
+    {
+        std::lock_guard lock(m_Lock);
+        stalled.swap(m_Stalled);
+    }
+    for (WorkRequest& wr : stalled) {
+        // Flushed requests complete even when posted with SILENT_SUCCESS.
+        wr.pInitiator->CompleteInitiator(wr.Context, wr.Type, ND_CANCELED, 0, 0);
+        wr.pInitiator->m_StalledInitiator.fetch_sub(1, std::memory_order_relaxed);
+        wr.pInitiator->Release();
+    }
+}
+
+// MARK: Initiator side
+void QueuePair::Execute(QueuePair* pTarget, const WorkRequest& wr, const ReceiveRequest* pReceive) {
+    ND2_SGE inlineSge = { const_cast<char*>(wr.InlineData.data()), static_cast<ULONG>(wr.InlineData.size()), 0 };
+    const ND2_SGE* sge = (wr.Flags & ND_OP_FLAG_INLINE) ? &inlineSge : wr.Sge.data();
+    ULONG nSge = (wr.Flags & ND_OP_FLAG_INLINE) ? 1 : static_cast<ULONG>(wr.Sge.size());
+
+    switch (wr.Type) {
+        case Nd2RequestTypeSend:
+            ExecuteSend(pTarget, wr.Context, sge, nSge, wr.Flags, *pReceive);
+            break;
+        case Nd2RequestTypeWrite:
+            ExecuteWrite(wr.Context, sge, nSge, wr.Flags, wr.RemoteAddress, wr.RemoteToken);
+            break;
+        default:
+            ExecuteRead(wr.Context, sge, nSge, wr.Flags, wr.RemoteAddress, wr.RemoteToken);
+            break;
+    }
+}
+
+void QueuePair::ExecuteSend(QueuePair* pTarget, VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags,
+    const ReceiveRequest& rr) {
+    SIZE_T length = SgeLength(sge, nSge);
+    HRESULT sendStatus = ND_SUCCESS;
+    HRESULT receiveStatus = ND_SUCCESS;
+
+    if (!(flags & ND_OP_FLAG_INLINE) && !CheckSge(sge, nSge, 0)) {
+        sendStatus = ND_ACCESS_VIOLATION;
+        receiveStatus = ND_REMOTE_ERROR;
+    } else if (length > SgeLength(rr.Sge, rr.nSge)) {
+        sendStatus = ND_REMOTE_ERROR;
+        receiveStatus = ND_BUFFER_OVERFLOW;
+    } else if (!CheckSge(rr.Sge, rr.nSge, AccessLocalWrite)) {
+        sendStatus = ND_REMOTE_ERROR;
+        receiveStatus = ND_ACCESS_VIOLATION;
+    } else {
+        CopySge(rr.Sge, rr.nSge, sge, nSge);
+    }
+
+    // The send completes before the peer can see the message, so a reply can
+    // never overtake the completion of the request that caused it.
+    ULONG bytes = SUCCEEDED(receiveStatus) ? static_cast<ULONG>(length) : 0;
+    CompleteInitiator(context, Nd2RequestTypeSend, sendStatus, SUCCEEDED(sendStatus) ? bytes : 0, flags);
+    pTarget->CompleteReceive(rr.Context, receiveStatus, bytes, (flags & ND_OP_FLAG_SEND_AND_SOLICIT_EVENT) != 0);
+}
+
+void QueuePair::ExecuteWrite(VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags, UINT64 remoteAddress,
+    UINT32 remoteToken) {
+    SIZE_T length = SgeLength(sge, nSge);
+    void* pRemote = reinterpret_cast<void*>(static_cast<uintptr_t>(remoteAddress));
+    HRESULT status = ND_SUCCESS;
+
+    if (!(flags & ND_OP_FLAG_INLINE) && !CheckSge(sge, nSge, 0)) {
+        status = ND_ACCESS_VIOLATION;
+    } else if (!Fabric::Instance().CheckAccess(remoteToken, pRemote, length, AccessRemoteWrite)) {
+        status = ND_REMOTE_ERROR;
+    } else {
+        ULONG last;
+        char byte;
+        bool split = SplitLastByte(sge, nSge, &last, &byte);
+        ND2_SGE remote = { pRemote, static_cast<ULONG>(split ? length - 1 : length), remoteToken };
+        CopySge(&remote, 1, sge, nSge);
+        if (split) {
+            std::atomic_thread_fence(std::memory_order_release);
+            static_cast<volatile char*>(pRemote)[length - 1] = byte;
+        }
+    }
+    CompleteInitiator(context, Nd2RequestTypeWrite, status, SUCCEEDED(status) ? static_cast<ULONG>(length) : 0, flags);
+}
+
+void QueuePair::ExecuteRead(VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags, UINT64 remoteAddress,
+    UINT32 remoteToken) {
+    SIZE_T length = SgeLength(sge, nSge);
+    void* pRemote = reinterpret_cast<void*>(static_cast<uintptr_t>(remoteAddress));
+    HRESULT status = ND_SUCCESS;
+
+    if (!CheckSge(sge, nSge, AccessLocalWrite)) {
+        status = ND_ACCESS_VIOLATION;
+    } else if (!Fabric::Instance().CheckAccess(remoteToken, pRemote, length, AccessRemoteRead)) {
+        status = ND_REMOTE_ERROR;
+    } else {
+        ND2_SGE remote = { pRemote, static_cast<ULONG>(length), remoteToken };
+        CopySge(sge, nSge, &remote, 1);
+    }
+    CompleteInitiator(context, Nd2RequestTypeRead, status, SUCCEEDED(status) ? static_cast<ULONG>(length) : 0, flags);
+}
+
+void QueuePair::CompleteInitiator(VOID* context, ND2_REQUEST_TYPE type, HRESULT status, ULONG bytes, ULONG flags) {
+    if (SUCCEEDED(status) && (flags & ND_OP_FLAG_SILENT_SUCCESS)) return;
+
+    ND2_RESULT result = {};
+    result.Status = status;
+    result.BytesTransferred = bytes;
+    result.QueuePairContext = m_Context;
+    result.RequestContext = context;
+    result.RequestType = type;
+    m_pInitiatorCq->Complete(result, false);
+}
+
+void QueuePair::CompleteReceive(VOID* context, HRESULT status, ULONG bytes, bool solicited) {
+    ND2_RESULT result = {};
+    result.Status = status;
+    result.BytesTransferred = bytes;
+    result.QueuePairContext = m_Context;
+    result.RequestContext = context;
+    result.RequestType = Nd2RequestTypeReceive;
+    // Free the SRQ slot first, so a consumer reposting from the completion finds room.
+    if (m_pSrq) m_pSrq->OnReceiveCompleted();
+    m_pReceiveCq->Complete(result, solicited);
+}
+
+// MARK: Cross-process
+// Work requests to a peer in another process run on the posting thread, which
+// copies straight into the peer's memory, and receive completions travel back
+// over the channel's rings. See NDSoftShm.hpp.
+static void LockRing(std::atomic<UINT32>& lock) {
+    while (lock.exchange(1, std::memory_order_acquire) != 0) std::this_thread::yield();
+}
+
+static void UnlockRing(std::atomic<UINT32>& lock) {
+    lock.store(0, std::memory_order_release);
+}
+
+void QueuePair::AttachRemote(const std::shared_ptr<Link>& pLink) {
+    {
+        std::scoped_lock lock(m_SendLock, m_Lock);
+        m_pLink = pLink;
+        // Receives posted before the connection was established move to the shared ring.
+        ReceiveRequest rr;
+        while (!m_pSrq && PopReceive(&rr)) {
+            Shm::ReceiveEntry entry = { reinterpret_cast<uintptr_t>(rr.Context), rr.nSge, 0, {} };
+            for (ULONG i = 0; i < rr.nSge; i++) {
+                entry.Sge[i] = { reinterpret_cast<uintptr_t>(rr.Sge[i].Buffer), rr.Sge[i].BufferLength,
+                    rr.Sge[i].MemoryRegionToken };
+            }
+            pLink->Local().Receives.Push(entry);
+        }
+        m_Remote.store(true, std::memory_order_release);
+    }
+    if (m_pSrq) m_pSrq->AttachLink(pLink.get());
+    m_pReceiveCq->AddRemoteSource(this, pLink.get());
+}
+
+void QueuePair::DetachRemote() {
+    std::shared_ptr<Link> pLink;
+    {
+        std::scoped_lock lock(m_SendLock, m_Lock);
+        pLink = std::move(m_pLink);
+        m_Remote.store(false, std::memory_order_release);
+    }
+    if (!pLink) return;
+
+    if (m_pSrq) m_pSrq->DetachLink(pLink.get());
+    m_pReceiveCq->RemoveRemoteSource(this);
+    pLink->Forget(this);
+    FlushRemote(*pLink);
+}
+
+void QueuePair::FlushRemote(Link& link) {
+    m_pReceiveCq->DrainRemoteSources(true);
+
+    std::deque<WorkRequest> stalled;
+    {
+        std::lock_guard lock(m_SendLock);
+        stalled.swap(m_RemoteStalled);
+        link.Local().WantReceive.store(0, std::memory_order_relaxed);
+    }
+    for (WorkRequest& wr : stalled) {
+        CompleteInitiator(wr.Context, wr.Type, ND_CANCELED, 0, 0);
+        m_StalledInitiator.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Take back the receives the peer has not consumed yet.
+    std::vector<VOID*> contexts;
+    {
+        std::lock_guard lock(m_Lock);
+        Shm::Endpoint& local = link.Local();
+        Shm::ReceiveEntry entry;
+        LockRing(local.ReceiveLock);
+        while (local.Receives.Pop(&entry)) contexts.push_back(reinterpret_cast<VOID*>(entry.Context));
+        UnlockRing(local.ReceiveLock);
+    }
+    for (VOID* context : contexts) CompleteReceive(context, ND_CANCELED, 0, false);
+    FlushReceives();
+}
+
+HRESULT QueuePair::ReceiveRemote(Link& link, VOID* context, const ND2_SGE sge[], ULONG nSge) {
+    Shm::Endpoint& local = link.Local();
+    if (local.Receives.Size() >= m_ReceiveQueueDepth) return ND_NO_MORE_ENTRIES;
+    // Every receive comes back as a completion on the same side, and the peer
+    // may hold one more between the two rings, so both must fit together.
+    if (local.Receives.Size() + local.Completions.Size() + 2 > Shm::RingEntries) {
+        m_pReceiveCq->DrainRemoteSources(true);
+        if (local.Receives.Size() + local.Completions.Size() + 2 > Shm::RingEntries) return ND_NO_MORE_ENTRIES;
+    }
+
+    Shm::ReceiveEntry entry = { reinterpret_cast<uintptr_t>(context), nSge, 0, {} };
+    for (ULONG i = 0; i < nSge; i++) {
+        entry.Sge[i] = { reinterpret_cast<uintptr_t>(sge[i].Buffer), sge[i].BufferLength, sge[i].MemoryRegionToken };
+    }
+    local.Receives.Push(entry);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (link.Peer().WantReceive.load(std::memory_order_relaxed)) link.RingPeer();
+    return ND_SUCCESS;
+}
+
+void QueuePair::OnSharedReceivePosted() {
+    ProgressStalled();
+}
+
+int QueuePair::SharedReceivesFd() const {
+    return m_pSrq ? m_pSrq->Fd() : -1;
+}
+
+HRESULT QueuePair::PostRemote(ND2_REQUEST_TYPE type, VOID* context, const ND2_SGE sge[], ULONG nSge, ULONG flags,
+    UINT64 remoteAddress, UINT32 remoteToken) {
+    std::lock_guard lock(m_SendLock);
+    if (!m_pLink || m_pLink->IsClosed()) return ND_CONNECTION_INVALID;
+    Link& link = *m_pLink;
+
+    if (m_RemoteStalled.empty()) {
+        Shm::ReceiveEntry receive;
+        if (type != Nd2RequestTypeSend) {
+            ExecuteRemote(link, type, context, sge, nSge, flags, remoteAddress, remoteToken, nullptr);
+            return ND_SUCCESS;
+        }
+        if (PopPeerReceive(link, &receive)) {
+            ExecuteRemote(link, type, context, sge, nSge, flags, 0, 0, &receive);
+            return ND_SUCCESS;
+        }
+    }
+
+    m_StalledInitiator.fetch_add(1, std::memory_order_relaxed);
+    m_RemoteStalled.push_back(MakeWorkRequest(nullptr, type, context, sge, nSge, flags, remoteAddress, remoteToken));
+    // Ask for a doorbell on the peer's next receive, then retry in case it
+    // was posted before the flag became visible.
+    link.Local().WantReceive.store(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    ProgressRemoteStalled(link);
+    return ND_SUCCESS;
+}
+
+void QueuePair::ProgressRemote() {
+    m_pReceiveCq->DrainRemoteSources(true);
+
+    std::lock_guard lock(m_SendLock);
+    if (m_pLink) ProgressRemoteStalled(*m_pLink);
+}
+
+void QueuePair::ProgressRemoteStalled(Link& link) {
+    while (!m_RemoteStalled.empty()) {
+        const WorkRequest& wr = m_RemoteStalled.front();
+        Shm::ReceiveEntry receive;
+        bool isSend = wr.Type == Nd2RequestTypeSend;
+        if (isSend && !PopPeerReceive(link, &receive)) {
+            // Other connections share the peer's receives and may have taken
+            // the one a doorbell announced; ask again before waiting.
+            Shm::SharedReceives* pPeerSrq = link.PeerSrq();
+            if (pPeerSrq == nullptr) return;
+            pPeerSrq->Waiting.store(1, std::memory_order_seq_cst);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!PopPeerReceive(link, &receive)) return;
+        }
+
+        ND2_SGE inlineSge = { const_cast<char*>(wr.InlineData.data()), static_cast<ULONG>(wr.InlineData.size()), 0 };
+        const ND2_SGE* sge = (wr.Flags & ND_OP_FLAG_INLINE) ? &inlineSge : wr.Sge.data();
+        ULONG nSge = (wr.Flags & ND_OP_FLAG_INLINE) ? 1 : static_cast<ULONG>(wr.Sge.size());
+        ExecuteRemote(link, wr.Type, wr.Context, sge, nSge, wr.Flags, wr.RemoteAddress, wr.RemoteToken,
+            isSend ? &receive : nullptr);
+        m_StalledInitiator.fetch_sub(1, std::memory_order_relaxed);
+        m_RemoteStalled.pop_front();
+    }
+    link.Local().WantReceive.store(0, std::memory_order_relaxed);
+}
+
+bool QueuePair::PopPeerReceive(Link& link, Shm::ReceiveEntry* pEntry) {
+    bool popped;
+    if (Shm::SharedReceives* pPeerSrq = link.PeerSrq()) {
+        LockRing(pPeerSrq->ReceiveLock);
+        popped = pPeerSrq->Receives.Pop(pEntry);
+        UnlockRing(pPeerSrq->ReceiveLock);
+    } else {
+        Shm::Endpoint& peer = link.Peer();
+        LockRing(peer.ReceiveLock);
+        popped = peer.Receives.Pop(pEntry);
+        UnlockRing(peer.ReceiveLock);
+    }
+    if (popped) pEntry->nSge = std::min<UINT32>(pEntry->nSge, MaxSge);
+    return popped;
+}
+
+void QueuePair::ExecuteRemote(Link& link, ND2_REQUEST_TYPE type, VOID* context, const ND2_SGE sge[], ULONG nSge,
+    ULONG flags, UINT64 remoteAddress, UINT32 remoteToken, const Shm::ReceiveEntry* pReceive) {
+    SIZE_T length = SgeLength(sge, nSge);
+    HRESULT status = ND_SUCCESS;
+
+    if (type == Nd2RequestTypeRead) {
+        if (!CheckSge(sge, nSge, AccessLocalWrite)) {
+            status = ND_ACCESS_VIOLATION;
+        } else if (!link.CheckAccess(remoteToken, remoteAddress, length, AccessRemoteRead)) {
+            status = ND_REMOTE_ERROR;
+        } else {
+            UINT64 address = remoteAddress;
+            for (ULONG i = 0; i < nSge && SUCCEEDED(status); i++) {
+                if (!link.CopyFromPeer(static_cast<char*>(sge[i].Buffer), address, sge[i].BufferLength)) {
+                    status = ND_REMOTE_ERROR;
+                }
+                address += sge[i].BufferLength;
+            }
+        }
+        CompleteInitiator(context, type, status, SUCCEEDED(status) ? static_cast<ULONG>(length) : 0, flags);
+        return;
+    }
+
+    if (!(flags & ND_OP_FLAG_INLINE) && !CheckSge(sge, nSge, 0)) status = ND_ACCESS_VIOLATION;
+
+    if (type == Nd2RequestTypeWrite) {
+        if (SUCCEEDED(status) && !link.CheckAccess(remoteToken, remoteAddress, length, AccessRemoteWrite)) {
+            status = ND_REMOTE_ERROR;
+        }
+        ULONG last = nSge;
+        char byte;
+        bool split = SUCCEEDED(status) && SplitLastByte(sge, nSge, &last, &byte);
+        UINT64 address = remoteAddress;
+        for (ULONG i = 0; i < nSge && SUCCEEDED(status); i++) {
+            SIZE_T n = i == last ? sge[i].BufferLength - 1 : sge[i].BufferLength;
+            if (!link.CopyToPeer(address, static_cast<const char*>(sge[i].Buffer), n)) status = ND_REMOTE_ERROR;
+            address += n;
+        }
+        if (split && SUCCEEDED(status)) {
+            std::atomic_thread_fence(std::memory_order_release);
+            if (!link.CopyToPeer(address, &byte, 1)) status = ND_REMOTE_ERROR;
+        }
+        CompleteInitiator(context, type, status, SUCCEEDED(status) ? static_cast<ULONG>(length) : 0, flags);
+        return;
+    }
+
+    // Send: scatter into the receive the peer posted.
+    HRESULT receiveStatus = ND_SUCCESS;
+    SIZE_T capacity = 0;
+    for (UINT32 i = 0; i < pReceive->nSge; i++) capacity += pReceive->Sge[i].Length;
+    if (FAILED(status)) {
+        receiveStatus = ND_REMOTE_ERROR;
+    } else if (length > capacity) {
+        status = ND_REMOTE_ERROR;
+        receiveStatus = ND_BUFFER_OVERFLOW;
+    } else {
+        for (UINT32 i = 0; i < pReceive->nSge && SUCCEEDED(receiveStatus); i++) {
+            const Shm::SgeDesc& dst = pReceive->Sge[i];
+            if (dst.Length > 0 && !link.CheckAccess(dst.Token, dst.Address, dst.Length, AccessLocalWrite)) {
+                status = ND_REMOTE_ERROR;
+                receiveStatus = ND_ACCESS_VIOLATION;
+            }
+        }
+        UINT32 d = 0;
+        SIZE_T dstOffset = 0;
+        for (ULONG s = 0; s < nSge && SUCCEEDED(receiveStatus); s++) {
+            const char* pSrc = static_cast<const char*>(sge[s].Buffer);
+            SIZE_T remaining = sge[s].BufferLength;
+            while (remaining > 0 && d < pReceive->nSge) {
+                const Shm::SgeDesc& dst = pReceive->Sge[d];
+                SIZE_T n = std::min<SIZE_T>(remaining, dst.Length - dstOffset);
+                if (!link.CopyToPeer(dst.Address + dstOffset, pSrc, n)) {
+                    status = ND_REMOTE_ERROR;
+                    receiveStatus = ND_ACCESS_VIOLATION;
+                    break;
+                }
+                pSrc += n;
+                remaining -= n;
+                dstOffset += n;
+                if (dstOffset == dst.Length) {
+                    d++;
+                    dstOffset = 0;
+                }
+            }
+        }
+    }
+
+    // As in process, the send completes before the peer can see the message.
+    ULONG bytes = SUCCEEDED(receiveStatus) ? static_cast<ULONG>(length) : 0;
+    CompleteInitiator(context, type, status, SUCCEEDED(status) ? bytes : 0, flags);
+
+    Shm::CompletionEntry completion = { pReceive->Context, receiveStatus, bytes,
+        (flags & ND_OP_FLAG_SEND_AND_SOLICIT_EVENT) ? 1u : 0u, 0 };
+    Shm::Endpoint& peer = link.Peer();
+    // Cannot stay full: the peer only posts receives the two rings can hold.
+    while (!peer.Completions.Push(completion)) std::this_thread::yield();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (peer.Armed.load(std::memory_order_relaxed)) link.RingPeer();
+}
+
+void QueuePair::DrainRemoteCompletions(Link& link) {
+    Shm::Endpoint& local = link.Local();
+    Shm::CompletionEntry completion;
+    for (;;) {
+        while (local.Completions.Pop(&completion)) {
+            CompleteReceive(reinterpret_cast<VOID*>(completion.Context), completion.Status, completion.Bytes,
+                completion.Solicited != 0);
+        }
+        // Ask the peer for doorbells only while someone waits on the CQ, and
+        // look again after arming so an entry that raced the flag is not missed.
+        bool armed = m_pReceiveCq->IsNotifyPending();
+        local.Armed.store(armed ? 1 : 0, std::memory_order_seq_cst);
+        if (!armed) return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (local.Completions.Size() == 0) return;
+    }
+}
+
+// MARK: SharedReceiveQueue
+SharedReceiveQueue::SharedReceiveQueue(Adapter* pAdapter, ULONG queueDepth, ULONG maxRequestSge, ULONG notifyThreshold,
+    USHORT group, KAFFINITY affinity) :
+    m_pAdapter(pAdapter), m_MaxSge(maxRequestSge), m_Group(group), m_Affinity(affinity), m_QueueDepth(queueDepth),
+    m_NotifyThreshold(notifyThreshold)
+{
+    m_pAdapter->AddRef();
+    m_pReceives = CreateSharedReceives(&m_Fd);
+}
+
+SharedReceiveQueue::~SharedReceiveQueue() {
+    CancelOverlappedRequests();
+    UnmapSharedReceives(m_pReceives);
+    if (m_Fd >= 0) close(m_Fd);
+    m_pAdapter->Release();
+}
+
+HRESULT SharedReceiveQueue::CancelOverlappedRequests() {
+    OVERLAPPED* pOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        std::swap(pOv, m_pNotifyOv);
+    }
+    if (pOv) CompleteOverlapped(pOv, ND_CANCELED);
+    return ND_SUCCESS;
+}
+
+HRESULT SharedReceiveQueue::GetOverlappedResult(OVERLAPPED* pOverlapped, BOOL wait) {
+    return WaitOverlapped(pOverlapped, wait);
+}
+
+HRESULT SharedReceiveQueue::GetNotifyAffinity(USHORT* pGroup, KAFFINITY* pAffinity) {
+    if (pGroup == nullptr || pAffinity == nullptr) return ND_INVALID_PARAMETER;
+    *pGroup = m_Group;
+    *pAffinity = m_Affinity;
+    return ND_SUCCESS;
+}
+
+HRESULT SharedReceiveQueue::Modify(ULONG queueDepth, ULONG notifyThreshold) {
+    if (queueDepth > MaxQueueDepth) return ND_INVALID_PARAMETER_1;
+
+    std::lock_guard lock(m_Lock);
+    if (queueDepth != 0) {
+        if (queueDepth < m_Outstanding) return ND_BUFFER_OVERFLOW;
+        m_QueueDepth = queueDepth;
+    }
+    if (notifyThreshold > m_QueueDepth) return ND_INVALID_PARAMETER_2;
+    m_NotifyThreshold = notifyThreshold;
+    return ND_SUCCESS;
+}
+
+// Level-triggered, like CompletionQueue::Notify: an SRQ already under its
+// threshold completes the request at once.
+HRESULT SharedReceiveQueue::Notify(OVERLAPPED* pOverlapped) {
+    if (pOverlapped == nullptr) return ND_INVALID_PARAMETER;
+    SetOverlappedResult(pOverlapped, ND_PENDING);
+
+    std::unique_lock lock(m_Lock);
+    if (m_pNotifyOv != nullptr) return ND_DEVICE_BUSY;
+    if (m_Outstanding < m_NotifyThreshold) {
+        lock.unlock();
+        CompleteOverlapped(pOverlapped, ND_SUCCESS);
+        return ND_PENDING;
+    }
+    m_pNotifyOv = pOverlapped;
+    return ND_PENDING;
+}
+
+HRESULT SharedReceiveQueue::Receive(VOID* requestContext, const ND2_SGE sge[], ULONG nSge) {
+    if (nSge > m_MaxSge || (nSge > 0 && sge == nullptr)) return ND_INVALID_PARAMETER_3;
+
+    Shm::ReceiveEntry entry = { reinterpret_cast<uintptr_t>(requestContext), nSge, 0, {} };
+    for (ULONG i = 0; i < nSge; i++) {
+        entry.Sge[i] = { reinterpret_cast<uintptr_t>(sge[i].Buffer), sge[i].BufferLength, sge[i].MemoryRegionToken };
+    }
+
+    std::vector<QueuePair*> waiters;
+    {
+        std::lock_guard lock(m_Lock);
+        // The ring holds no more than is outstanding, so it has room.
+        if (m_Outstanding == m_QueueDepth) return ND_NO_MORE_ENTRIES;
+        m_pReceives->Receives.Push(entry);
+        m_Outstanding++;
+
+        for (QueuePair* pQp : m_Waiters) {
+            if (pQp->TryAddRef()) waiters.push_back(pQp);
+        }
+        m_Waiters.clear();
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_pReceives->Waiting.exchange(0, std::memory_order_seq_cst)) {
+            for (Link* pLink : m_Links) {
+                if (pLink->Peer().WantReceive.load(std::memory_order_relaxed)) pLink->RingPeer();
+            }
+        }
+    }
+    for (QueuePair* pQp : waiters) {
+        pQp->OnSharedReceivePosted();
+        pQp->Release();
+    }
+    return ND_SUCCESS;
+}
+
+bool SharedReceiveQueue::Pop(ReceiveRequest* pReceive, QueuePair* pWaiter) {
+    std::lock_guard lock(m_Lock);
+    Shm::ReceiveEntry entry;
+    LockRing(m_pReceives->ReceiveLock);
+    bool popped = m_pReceives->Receives.Pop(&entry);
+    UnlockRing(m_pReceives->ReceiveLock);
+    if (!popped) {
+        if (std::find(m_Waiters.begin(), m_Waiters.end(), pWaiter) == m_Waiters.end()) m_Waiters.push_back(pWaiter);
+        return false;
+    }
+
+    pReceive->Context = reinterpret_cast<VOID*>(entry.Context);
+    pReceive->nSge = entry.nSge;
+    for (ULONG i = 0; i < entry.nSge; i++) {
+        pReceive->Sge[i] = { reinterpret_cast<VOID*>(entry.Sge[i].Address), entry.Sge[i].Length, entry.Sge[i].Token };
+    }
+    return true;
+}
+
+void SharedReceiveQueue::OnReceiveCompleted() {
+    OVERLAPPED* pOv = nullptr;
+    {
+        std::lock_guard lock(m_Lock);
+        m_Outstanding--;
+        if (m_Outstanding < m_NotifyThreshold) std::swap(pOv, m_pNotifyOv);
+    }
+    if (pOv) CompleteOverlapped(pOv, ND_SUCCESS);
+}
+
+void SharedReceiveQueue::Detach(QueuePair* pQp) {
+    std::lock_guard lock(m_Lock);
+    m_Waiters.erase(std::remove(m_Waiters.begin(), m_Waiters.end(), pQp), m_Waiters.end());
+}
+
+void SharedReceiveQueue::AttachLink(Link* pLink) {
+    std::lock_guard lock(m_Lock);
+    m_Links.push_back(pLink);
+}
+
+void SharedReceiveQueue::DetachLink(Link* pLink) {
+    std::lock_guard lock(m_Lock);
+    m_Links.erase(std::remove(m_Links.begin(), m_Links.end(), pLink), m_Links.end());
+}
+
+} // namespace NDSoft
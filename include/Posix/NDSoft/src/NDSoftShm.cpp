@@ -0,0 +1,849 @@
+#include "NDSoftShm.hpp"
+#include <fstream>
+#include <string>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace NDSoft {
+
+constexpr int MaxMessageFds = 4;
+constexpr int ConnectTimeoutMs = 1000;
+
+static SIZE_T PageSize() {
+    static const SIZE_T pageSize = static_cast<SIZE_T>(sysconf(_SC_PAGESIZE));
+    return pageSize;
+}
+
+// Listeners are found by port alone, in the abstract socket namespace so
+// nothing is left behind in the file system.
+static socklen_t RendezvousAddress(USHORT port, sockaddr_un* pAddr) {
+    std::memset(pAddr, 0, sizeof(*pAddr));
+    pAddr->sun_family = AF_UNIX;
+    int n = std::snprintf(pAddr->sun_path + 1, sizeof(pAddr->sun_path) - 1, "NDSoft:%u", port);
+    return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 + n);
+}
+
+static HRESULT SendMessage(int s, const Link::Message& message, const int* pFds, int nFds) {
+    iovec iov = { const_cast<Link::Message*>(&message), sizeof(message) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MaxMessageFds)] = {};
+    if (nFds > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nFds);
+        cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg);
+        pCmsg->cmsg_level = SOL_SOCKET;
+        pCmsg->cmsg_type = SCM_RIGHTS;
+        pCmsg->cmsg_len = CMSG_LEN(sizeof(int) * nFds);
+        std::memcpy(CMSG_DATA(pCmsg), pFds, sizeof(int) * nFds);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(s, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == sizeof(message) ? ND_SUCCESS : ND_CONNECTION_ABORTED;
+}
+
+// Returns 1 for a message, 0 if none is waiting and -1 once the peer is gone.
+static int ReceiveMessage(int s, Link::Message* pMessage, std::vector<int>* pFds) {
+    iovec iov = { pMessage, sizeof(*pMessage) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MaxMessageFds)];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(s, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    if (n == 0) return -1;
+
+    for (cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg); pCmsg != nullptr; pCmsg = CMSG_NXTHDR(&msg, pCmsg)) {
+        if (pCmsg->cmsg_level != SOL_SOCKET || pCmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t nFds = (pCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* pData = reinterpret_cast<const int*>(CMSG_DATA(pCmsg));
+        pFds->insert(pFds->end(), pData, pData + nFds);
+    }
+    // A short message is a protocol error; treat the peer as gone.
+    return n == sizeof(*pMessage) ? 1 : -1;
+}
+
+static void CloseFds(std::vector<int>& fds) {
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+    fds.clear();
+}
+
+// Page ranges of [start, end) that are private anonymous memory and can move
+// onto a shared segment without changing what the program sees.
+static std::vector<std::pair<uintptr_t, uintptr_t>> PrivateAnonymousRanges(uintptr_t start, uintptr_t end) {
+    std::vector<std::pair<uintptr_t, uintptr_t>> ranges;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        unsigned long lo, hi, offset, inode;
+        char perms[8], dev[16];
+        int pathPos = 0;
+        if (std::sscanf(line.c_str(), "%lx-%lx %7s %lx %15s %lu %n", &lo, &hi, perms, &offset, dev, &inode, &pathPos) < 6) {
+            continue;
+        }
+        if (hi <= start || lo >= end) continue;
+        const char* pPath = line.c_str() + pathPos;
+        bool anonymous = inode == 0 && (pPath[0] == '\0' || std::strcmp(pPath, "[heap]") == 0);
+        if (!anonymous || std::strcmp(perms, "rw-p") != 0) continue;
+
+        lo = std::max<uintptr_t>(lo, start);
+        hi = std::min<uintptr_t>(hi, end);
+        if (!ranges.empty() && ranges.back().second == lo) {
+            ranges.back().second = hi;
+        } else {
+            ranges.emplace_back(lo, hi);
+        }
+    }
+    return ranges;
+}
+
+HRESULT BindRendezvous(USHORT port, int* pSocket) {
+    *pSocket = -1;
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    // Without unix sockets the listener still serves in-process clients.
+    if (s < 0) return ND_SUCCESS;
+
+    sockaddr_un addr;
+    socklen_t len = RendezvousAddress(port, &addr);
+    if (bind(s, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+        int error = errno;
+        close(s);
+        return error == EADDRINUSE ? ND_ADDRESS_ALREADY_EXISTS : ND_SUCCESS;
+    }
+    *pSocket = s;
+    return ND_SUCCESS;
+}
+
+Shm::SharedReceives* CreateSharedReceives(int* pFd) {
+    int fd = memfd_create("ndsoft-srq", MFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+    if (ftruncate(fd, sizeof(Shm::SharedReceives)) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    void* p = mmap(nullptr, sizeof(Shm::SharedReceives), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    *pFd = fd;
+    return static_cast<Shm::SharedReceives*>(p);
+}
+
+Shm::SharedReceives* MapSharedReceives(int fd) {
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<SIZE_T>(st.st_size) >= sizeof(Shm::SharedReceives)) {
+        p = mmap(nullptr, sizeof(Shm::SharedReceives), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return p == MAP_FAILED ? nullptr : static_cast<Shm::SharedReceives*>(p);
+}
+
+void UnmapSharedReceives(Shm::SharedReceives* pReceives) {
+    if (pReceives) munmap(pReceives, sizeof(Shm::SharedReceives));
+}
+
+// MARK: Service
+ShmService& ShmService::Instance() {
+    static ShmService service;
+    return service;
+}
+
+ShmService::ShmService() {
+    m_Epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_Stop = eventfd(0, EFD_CLOEXEC);
+    if (m_Epoll < 0 || m_Stop < 0) {
+        std::cerr << "NDSoft: cannot start the shared-memory progress thread." << std::endl;
+        return;
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(m_Epoll, EPOLL_CTL_ADD, m_Stop, &ev);
+    m_Thread = std::thread(&ShmService::Run, this);
+}
+
+ShmService::~ShmService() {
+    if (m_Thread.joinable()) {
+        UINT64 one = 1;
+        (void)!write(m_Stop, &one, sizeof(one));
+        m_Thread.join();
+    }
+    if (m_Stop >= 0) close(m_Stop);
+    if (m_Epoll >= 0) close(m_Epoll);
+}
+
+UINT64 ShmService::Add(int fd, Handler handler) {
+    if (!m_Thread.joinable()) return 0;
+
+    std::lock_guard lock(m_Lock);
+    UINT64 id = m_NextId++;
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = id;
+    m_Handlers[id] = { fd, std::make_shared<Handler>(std::move(handler)) };
+    if (epoll_ctl(m_Epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        m_Handlers.erase(id);
+        return 0;
+    }
+    return id;
+}
+
+void ShmService::Remove(UINT64 id) {
+    if (id == 0) return;
+
+    std::unique_lock lock(m_Lock);
+    auto it = m_Handlers.find(id);
+    if (it == m_Handlers.end()) return;
+    epoll_ctl(m_Epoll, EPOLL_CTL_DEL, it->second.Fd, nullptr);
+    m_Handlers.erase(it);
+    if (std::this_thread::get_id() != m_Thread.get_id()) {
+        m_Idle.wait(lock, [this, id]() { return m_Running != id; });
+    }
+}
+
+void ShmService::Run() {
+    epoll_event events[64];
+    for (;;) {
+        int n = epoll_wait(m_Epoll, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "NDSoft: epoll_wait failed, errno " << errno << std::endl;
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            UINT64 id = events[i].data.u64;
+            if (id == 0) return;
+
+            std::shared_ptr<Handler> pHandler;
+            {
+                std::lock_guard lock(m_Lock);
+                auto it = m_Handlers.find(id);
+                if (it == m_Handlers.end()) continue;
+                pHandler = it->second.pHandler;
+                m_Running = id;
+            }
+            (*pHandler)(events[i].events);
+            {
+                std::lock_guard lock(m_Lock);
+                m_Running = 0;
+            }
+            m_Idle.notify_all();
+        }
+    }
+}
+
+// MARK: Fabric
+// The token table is a sparse memfd, so only the pages of slots in use are
+// ever backed. Peers map it read-only and validate remote tokens themselves.
+Fabric::Fabric() {
+    SIZE_T size = sizeof(Shm::TokenEntry) * Shm::TokenTableEntries;
+    int fd = memfd_create("ndsoft-tokens", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return;
+    void* p = ftruncate(fd, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (p == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+#ifdef F_SEAL_FUTURE_WRITE
+    // Our mapping stays writable; peers can only ever map the table read-only.
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL);
+#endif
+    m_pSharedTokens = static_cast<Shm::TokenEntry*>(p);
+    m_TokenTableFd = fd;
+}
+
+// Copies the pages' contents into a new memfd and maps it over them. Writes
+// to the range by other threads while this runs would be lost, as would any
+// mlock on it; registration normally happens before a buffer is in use.
+bool Fabric::CreateSegment(char* pBase, SIZE_T length) {
+    int fd = memfd_create("ndsoft-segment", MFD_CLOEXEC);
+    if (fd < 0) return false;
+    if (ftruncate(fd, length) != 0) {
+        close(fd);
+        return false;
+    }
+    for (SIZE_T done = 0; done < length;) {
+        ssize_t n = pwrite(fd, pBase + done, length - done, done);
+        if (n <= 0) {
+            close(fd);
+            return false;
+        }
+        done += n;
+    }
+    if (mmap(pBase, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    UINT64 id = m_NextSegmentId++;
+    m_Segments[reinterpret_cast<uintptr_t>(pBase)] = { length, fd, id, 1 };
+    for (auto& pWeak : m_Links) {
+        if (auto pLink = pWeak.lock()) pLink->AnnounceSegment(id, reinterpret_cast<uintptr_t>(pBase), length, fd);
+    }
+    return true;
+}
+
+void Fabric::ShareRegion(const Region& region) {
+    if (m_TokenTableFd < 0) return;
+    SIZE_T pageSize = PageSize();
+    uintptr_t start = (reinterpret_cast<uintptr_t>(region.Base) + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(region.Base) + region.Length) & ~(pageSize - 1);
+    if (start >= end) return;
+
+    std::lock_guard lock(m_SegmentLock);
+    // Segments already covering part of the range are shared with the regions
+    // that created them; new segments only fill the gaps.
+    std::vector<std::pair<uintptr_t, uintptr_t>> gaps;
+    uintptr_t cursor = start;
+    auto it = m_Segments.upper_bound(start);
+    if (it != m_Segments.begin() && std::prev(it)->first + std::prev(it)->second.Length > start) --it;
+    for (; it != m_Segments.end() && it->first < end; ++it) {
+        if (it->first > cursor) gaps.emplace_back(cursor, it->first);
+        it->second.nRef++;
+        cursor = std::max<uintptr_t>(cursor, it->first + it->second.Length);
+    }
+    if (cursor < end) gaps.emplace_back(cursor, end);
+
+    for (const auto& gap : gaps) {
+        for (const auto& range : PrivateAnonymousRanges(gap.first, gap.second)) {
+            CreateSegment(reinterpret_cast<char*>(range.first), range.second - range.first);
+        }
+    }
+}
+
+void Fabric::UnshareRegion(const Region& region) {
+    if (m_TokenTableFd < 0) return;
+    SIZE_T pageSize = PageSize();
+    uintptr_t start = (reinterpret_cast<uintptr_t>(region.Base) + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(region.Base) + region.Length) & ~(pageSize - 1);
+    if (start >= end) return;
+
+    std::lock_guard lock(m_SegmentLock);
+    auto it = m_Segments.upper_bound(start);
+    if (it != m_Segments.begin() && std::prev(it)->first + std::prev(it)->second.Length > start) --it;
+    while (it != m_Segments.end() && it->first < end) {
+        if (--it->second.nRef > 0) {
+            ++it;
+            continue;
+        }
+        // The pages stay mapped from the memfd; only peers drop their view.
+        for (auto& pWeak : m_Links) {
+            if (auto pLink = pWeak.lock()) pLink->AnnounceSegmentRemoved(it->second.Id, it->first);
+        }
+        close(it->second.Fd);
+        it = m_Segments.erase(it);
+    }
+}
+
+void Fabric::AttachLink(const std::shared_ptr<Link>& pLink) {
+    std::lock_guard lock(m_SegmentLock);
+    std::erase_if(m_Links, [](const std::weak_ptr<Link>& pWeak) { return pWeak.expired(); });
+    m_Links.push_back(pLink);
+    for (const auto& [address, segment] : m_Segments) {
+        pLink->AnnounceSegment(segment.Id, address, segment.Length, segment.Fd);
+    }
+}
+
+void Fabric::DetachLink(const Link* pLink) {
+    std::lock_guard lock(m_SegmentLock);
+    std::erase_if(m_Links, [pLink](const std::weak_ptr<Link>& pWeak) {
+        auto pLocked = pWeak.lock();
+        return !pLocked || pLocked.get() == pLink;
+    });
+}
+
+// MARK: Link
+Link::Link(int socket, int side) : m_Socket(socket), m_Side(side) {
+    m_Doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ucred cred = {};
+    socklen_t len = sizeof(cred);
+    if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) m_PeerPid = cred.pid;
+}
+
+Link::~Link() {
+    ShmService::Instance().Remove(m_SocketHandler);
+    ShmService::Instance().Remove(m_DoorbellHandler);
+    if (m_pPendingQp) m_pPendingQp->Release();
+
+    for (auto& [address, segment] : m_PeerSegments) munmap(segment.pLocal, segment.Length);
+    if (m_pPeerTokens) munmap(const_cast<Shm::TokenEntry*>(m_pPeerTokens), sizeof(Shm::TokenEntry) * Shm::TokenTableEntries);
+    UnmapSharedReceives(m_pPeerSrq);
+    if (m_pChannel) munmap(m_pChannel, sizeof(Shm::Channel));
+    if (m_ChannelFd >= 0) close(m_ChannelFd);
+    if (m_PeerDoorbell >= 0) close(m_PeerDoorbell);
+    if (m_Doorbell >= 0) close(m_Doorbell);
+    close(m_Socket);
+}
+
+HRESULT Link::Connect(Connector* pConnector, QueuePair* pQp, const ConnectRequest& request,
+    std::shared_ptr<Link>* ppLink) {
+    int tokenFd = Fabric::Instance().GetTokenTableFd();
+    if (tokenFd < 0) return ND_CONNECTION_REFUSED;
+
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s < 0) return ND_CONNECTION_REFUSED;
+    sockaddr_un addr;
+    socklen_t len = RendezvousAddress(request.ServerAddr.Port(), &addr);
+    if (connect(s, reinterpret_cast<sockaddr*>(&addr), len) != 0) {
+        close(s);
+        return ND_CONNECTION_REFUSED;
+    }
+
+    std::shared_ptr<Link> pLink(new Link(s, 0));
+    if (!pLink->MapChannel(-1, true) || !pLink->Start()) return ND_INSUFFICIENT_RESOURCES;
+    {
+        std::lock_guard lock(pLink->m_Lock);
+        pLink->m_pConnector = pConnector;
+        pLink->m_pPendingQp = pQp;
+        pQp->AddRef();
+    }
+
+    Message message = {};
+    message.Type = MessageType::ConnectRequest;
+    message.cbPrivateData = static_cast<UINT32>(request.PrivateData.size());
+    std::memcpy(message.PrivateData, request.PrivateData.data(), request.PrivateData.size());
+    message.InboundReadLimit = request.InboundReadLimit;
+    message.OutboundReadLimit = request.OutboundReadLimit;
+    std::memcpy(&message.ClientAddr, &request.ClientAddr.Storage, sizeof(sockaddr_storage));
+    std::memcpy(&message.ServerAddr, &request.ServerAddr.Storage, sizeof(sockaddr_storage));
+    int fds[] = { pLink->m_ChannelFd, tokenFd, pLink->m_Doorbell, pQp->SharedReceivesFd() };
+    HRESULT hr = SendMessage(s, message, fds, fds[3] >= 0 ? 4 : 3);
+    if (FAILED(hr)) {
+        pLink->MarkClosed();
+        pLink->DisconnectLocal(false);
+        return ND_CONNECTION_REFUSED;
+    }
+    *ppLink = std::move(pLink);
+    return ND_SUCCESS;
+}
+
+std::shared_ptr<ConnectRequest> Link::AcceptRequest(int listenSocket) {
+    int s = accept4(listenSocket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (s < 0) return nullptr;
+    std::shared_ptr<Link> pLink(new Link(s, 1));
+
+    // The client sends its request right after connecting.
+    Message message;
+    std::vector<int> fds;
+    pollfd pfd = { s, POLLIN, 0 };
+    if (poll(&pfd, 1, ConnectTimeoutMs) != 1 || ReceiveMessage(s, &message, &fds) != 1 ||
+        message.Type != MessageType::ConnectRequest || fds.size() < 3 || fds.size() > 4) {
+        CloseFds(fds);
+        return nullptr;
+    }
+
+    bool mapped = pLink->MapChannel(fds[0], false);
+    fds[0] = -1;
+    mapped = pLink->MapPeerTokens(fds[1]) && mapped;
+    fds[1] = -1;
+    pLink->m_PeerDoorbell = fds[2];
+    if (fds.size() == 4) {
+        pLink->m_pPeerSrq = MapSharedReceives(fds[3]);
+        mapped = pLink->m_pPeerSrq != nullptr && mapped;
+    }
+    fds.clear();
+    if (!mapped || !pLink->Start()) return nullptr;
+
+    auto pRequest = std::make_shared<ConnectRequest>(pLink);
+    pRequest->ClientAddr.Set(reinterpret_cast<const sockaddr*>(&message.ClientAddr), sizeof(sockaddr_storage));
+    pRequest->ServerAddr.Set(reinterpret_cast<const sockaddr*>(&message.ServerAddr), sizeof(sockaddr_storage));
+    ULONG cbPrivateData = std::min<ULONG>(message.cbPrivateData, MaxCallerData);
+    pRequest->PrivateData.assign(message.PrivateData, message.PrivateData + cbPrivateData);
+    pRequest->InboundReadLimit = std::min<ULONG>(message.InboundReadLimit, MaxReadLimit);
+    pRequest->OutboundReadLimit = std::min<ULONG>(message.OutboundReadLimit, MaxReadLimit);
+    return pRequest;
+}
+
+bool Link::Start() {
+    if (m_Doorbell < 0) return false;
+    // Let the peer reach unshared bytes of our buffers with process_vm_*.
+    if (m_PeerPid > 0) prctl(PR_SET_PTRACER, m_PeerPid, 0, 0, 0);
+
+    std::weak_ptr<Link> pWeak = weak_from_this();
+    m_SocketHandler = ShmService::Instance().Add(m_Socket, [pWeak](UINT32 events) {
+        if (auto pLink = pWeak.lock()) pLink->OnReadable(events);
+    });
+    m_DoorbellHandler = ShmService::Instance().Add(m_Doorbell, [pWeak](UINT32) {
+        if (auto pLink = pWeak.lock()) pLink->OnDoorbell();
+    });
+    return m_SocketHandler != 0 && m_DoorbellHandler != 0;
+}
+
+bool Link::MapChannel(int fd, bool create) {
+    if (create) {
+        fd = memfd_create("ndsoft-channel", MFD_CLOEXEC);
+        if (fd < 0) return false;
+        if (ftruncate(fd, sizeof(Shm::Channel)) != 0) {
+            close(fd);
+            return false;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<SIZE_T>(st.st_size) < sizeof(Shm::Channel)) {
+            close(fd);
+            return false;
+        }
+    }
+
+    void* p = mmap(nullptr, sizeof(Shm::Channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    m_ChannelFd = fd;
+    m_pChannel = static_cast<Shm::Channel*>(p);
+    if (create) {
+        m_pChannel->Magic = Shm::ChannelMagic;
+        m_pChannel->Version = Shm::ChannelVersion;
+    }
+    return m_pChannel->Magic == Shm::ChannelMagic && m_pChannel->Version == Shm::ChannelVersion;
+}
+
+bool Link::MapPeerTokens(int fd) {
+    SIZE_T size = sizeof(Shm::TokenEntry) * Shm::TokenTableEntries;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<SIZE_T>(st.st_size) >= size) {
+        p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) return false;
+    m_pPeerTokens = static_cast<const Shm::TokenEntry*>(p);
+    return true;
+}
+
+HRESULT Link::Accept(Connector* pConnector, QueuePair* pQp, const std::vector<char>& privateData,
+    ULONG inboundReadLimit, ULONG outboundReadLimit) {
+    if (IsClosed()) return ND_CONNECTION_ABORTED;
+    {
+        std::lock_guard lock(m_Lock);
+        m_pConnector = pConnector;
+        m_pQueuePair = pQp;
+    }
+    // Attach before replying so the client's first Send finds our receives.
+    pQp->AttachRemote(shared_from_this());
+    Fabric::Instance().AttachLink(shared_from_this());
+
+    Message message = {};
+    message.Type = MessageType::Accept;
+    message.cbPrivateData = static_cast<UINT32>(privateData.size());
+    std::memcpy(message.PrivateData, privateData.data(), privateData.size());
+    message.InboundReadLimit = inboundReadLimit;
+    message.OutboundReadLimit = outboundReadLimit;
+    int fds[] = { Fabric::Instance().GetTokenTableFd(), m_Doorbell, pQp->SharedReceivesFd() };
+    HRESULT hr = SendMessage(m_Socket, message, fds, fds[2] >= 0 ? 3 : 2);
+    if (FAILED(hr) && MarkClosed()) DisconnectLocal(false);
+    return hr;
+}
+
+void Link::Refuse(const std::vector<char>& privateData) {
+    Message message = {};
+    message.Type = MessageType::Reject;
+    message.cbPrivateData = static_cast<UINT32>(privateData.size());
+    std::memcpy(message.PrivateData, privateData.data(), privateData.size());
+    SendMessage(m_Socket, message, nullptr, 0);
+    MarkClosed();
+}
+
+void Link::CompleteConnect() {
+    Message message = {};
+    message.Type = MessageType::CompleteConnect;
+    SendMessage(m_Socket, message, nullptr, 0);
+}
+
+void Link::Close() {
+    if (!MarkClosed()) return;
+    Message message = {};
+    message.Type = MessageType::Disconnect;
+    SendMessage(m_Socket, message, nullptr, 0);
+    DisconnectLocal(false);
+}
+
+bool Link::MarkClosed() {
+    if (m_Closed.exchange(true, std::memory_order_acq_rel)) return false;
+    if (m_pChannel) Local().Closed.store(1, std::memory_order_release);
+    ShmService::Instance().Remove(m_SocketHandler);
+    ShmService::Instance().Remove(m_DoorbellHandler);
+    m_SocketHandler = 0;
+    m_DoorbellHandler = 0;
+    Fabric::Instance().DetachLink(this);
+    return true;
+}
+
+void Link::DisconnectLocal(bool notifyConnector) {
+    QueuePair* pPendingQp;
+    QueuePair* pQp;
+    Connector* pConnector;
+    {
+        std::lock_guard lock(m_Lock);
+        pPendingQp = std::exchange(m_pPendingQp, nullptr);
+        pQp = (m_pQueuePair && m_pQueuePair->TryAddRef()) ? m_pQueuePair : nullptr;
+        pConnector = (m_pConnector && m_pConnector->TryAddRef()) ? m_pConnector : nullptr;
+        m_pQueuePair = nullptr;
+        m_pConnector = nullptr;
+    }
+    if (pPendingQp) pPendingQp->Release();
+    if (pQp) {
+        pQp->OnDisconnect();
+        pQp->Release();
+    }
+    if (pConnector) {
+        // A client still waiting for its reply sees the connection refused.
+        if (notifyConnector && !pConnector->OnConnectReply(ND_CONNECTION_REFUSED, {}, nullptr, nullptr, 0, 0)) {
+            pConnector->OnPeerDisconnect();
+        }
+        pConnector->Release();
+    }
+}
+
+void Link::OnPeerClosed() {
+    if (MarkClosed()) DisconnectLocal(true);
+}
+
+void Link::OnReadable(UINT32) {
+    while (!IsClosed()) {
+        Message message;
+        std::vector<int> fds;
+        int result = ReceiveMessage(m_Socket, &message, &fds);
+        if (result == 0) return;
+        if (result < 0) {
+            CloseFds(fds);
+            OnPeerClosed();
+            return;
+        }
+        OnMessage(message, fds);
+        CloseFds(fds);
+    }
+}
+
+void Link::OnMessage(const Message& message, std::vector<int>& fds) {
+    std::vector<char> privateData(message.PrivateData,
+        message.PrivateData + std::min<ULONG>(message.cbPrivateData, MaxCalleeData));
+
+    switch (message.Type) {
+        case MessageType::Accept: {
+            if (m_Side != 0 || fds.size() < 2 || fds.size() > 3 || m_pPeerTokens != nullptr) return OnPeerClosed();
+            bool mapped = MapPeerTokens(fds[0]);
+            fds[0] = -1;
+            m_PeerDoorbell = std::exchange(fds[1], -1);
+            if (fds.size() == 3) {
+                m_pPeerSrq = MapSharedReceives(std::exchange(fds[2], -1));
+                mapped = m_pPeerSrq != nullptr && mapped;
+            }
+            if (!mapped) return OnPeerClosed();
+
+            QueuePair* pQp;
+            Connector* pConnector;
+            {
+                std::lock_guard lock(m_Lock);
+                pQp = std::exchange(m_pPendingQp, nullptr);
+                m_pQueuePair = pQp;
+                pConnector = (m_pConnector && m_pConnector->TryAddRef()) ? m_pConnector : nullptr;
+            }
+            if (pQp) {
+                pQp->AttachRemote(shared_from_this());
+                pQp->Release();
+            }
+            Fabric::Instance().AttachLink(shared_from_this());
+
+            bool replied = pConnector && pConnector->OnConnectReply(ND_SUCCESS, privateData, nullptr,
+                shared_from_this(), message.InboundReadLimit, message.OutboundReadLimit);
+            if (pConnector) pConnector->Release();
+            if (!replied) Close();
+            break;
+        }
+        case MessageType::Reject: {
+            Connector* pConnector = AcquireConnector();
+            if (MarkClosed()) {
+                DisconnectLocal(false);
+                if (pConnector) pConnector->OnConnectReply(ND_CONNECTION_REFUSED, privateData, nullptr, nullptr, 0, 0);
+            }
+            if (pConnector) pConnector->Release();
+            break;
+        }
+        case MessageType::CompleteConnect:
+            if (Connector* pConnector = AcquireConnector()) {
+                pConnector->OnCompleteConnect();
+                pConnector->Release();
+            }
+            break;
+        case MessageType::Disconnect:
+            OnPeerClosed();
+            break;
+        case MessageType::Segment: {
+            if (fds.size() != 1 || message.Length == 0) break;
+            void* p = mmap(nullptr, message.Length, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+            if (p == MAP_FAILED) break;
+            std::unique_lock lock(m_SegmentLock);
+            auto it = m_PeerSegments.find(message.Address);
+            if (it != m_PeerSegments.end()) munmap(it->second.pLocal, it->second.Length);
+            m_PeerSegments[message.Address] = { message.Length, static_cast<char*>(p), message.SegmentId };
+            break;
+        }
+        case MessageType::SegmentRemoved: {
+            std::unique_lock lock(m_SegmentLock);
+            auto it = m_PeerSegments.find(message.Address);
+            if (it != m_PeerSegments.end() && it->second.Id == message.SegmentId) {
+                munmap(it->second.pLocal, it->second.Length);
+                m_PeerSegments.erase(it);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void Link::OnDoorbell() {
+    UINT64 count;
+    while (read(m_Doorbell, &count, sizeof(count)) == sizeof(count)) {}
+    if (QueuePair* pQp = AcquireQueuePair()) {
+        pQp->ProgressRemote();
+        pQp->Release();
+    }
+}
+
+void Link::AnnounceSegment(UINT64 id, UINT64 address, UINT64 length, int fd) {
+    Message message = {};
+    message.Type = MessageType::Segment;
+    message.SegmentId = id;
+    message.Address = address;
+    message.Length = length;
+    SendMessage(m_Socket, message, &fd, 1);
+}
+
+void Link::AnnounceSegmentRemoved(UINT64 id, UINT64 address) {
+    Message message = {};
+    message.Type = MessageType::SegmentRemoved;
+    message.SegmentId = id;
+    message.Address = address;
+    SendMessage(m_Socket, message, nullptr, 0);
+}
+
+QueuePair* Link::AcquireQueuePair() {
+    std::lock_guard lock(m_Lock);
+    return (m_pQueuePair && m_pQueuePair->TryAddRef()) ? m_pQueuePair : nullptr;
+}
+
+Connector* Link::AcquireConnector() {
+    std::lock_guard lock(m_Lock);
+    return (m_pConnector && m_pConnector->TryAddRef()) ? m_pConnector : nullptr;
+}
+
+void Link::Forget(QueuePair* pQp) {
+    std::lock_guard lock(m_Lock);
+    if (m_pQueuePair == pQp) m_pQueuePair = nullptr;
+}
+
+void Link::RingPeer() {
+    if (m_PeerDoorbell < 0) return;
+    UINT64 one = 1;
+    (void)!write(m_PeerDoorbell, &one, sizeof(one));
+}
+
+bool Link::CheckAccess(UINT32 token, UINT64 address, SIZE_T length, ULONG access) const {
+    if (m_pPeerTokens == nullptr || token == 0) return false;
+    const Shm::TokenEntry& entry = m_pPeerTokens[token & (Shm::TokenTableEntries - 1)];
+
+    UINT32 current = 0, granted = 0;
+    UINT64 base = 0, size = 0;
+    for (int attempt = 0;; attempt++) {
+        // The owner crashing mid-update must not hang us forever.
+        if (attempt == 1 << 16) return false;
+        UINT32 sequence = entry.Sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        current = entry.Token.load(std::memory_order_relaxed);
+        granted = entry.Access.load(std::memory_order_relaxed);
+        base = entry.Base.load(std::memory_order_relaxed);
+        size = entry.Length.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.Sequence.load(std::memory_order_relaxed) == sequence) break;
+    }
+
+    if (current != token || (granted & access) != access) return false;
+    if (length == 0) return true;
+    return address >= base && length <= size && address - base <= size - length;
+}
+
+// Bytes in a segment the peer shared with us are copied directly; anything
+// else (partial pages at the ends of a buffer, memory that could not be
+// shared) goes through process_vm_readv/writev.
+bool Link::CopyToPeer(UINT64 address, const char* pSrc, SIZE_T length) {
+    std::shared_lock lock(m_SegmentLock);
+    while (length > 0) {
+        auto it = m_PeerSegments.upper_bound(address);
+        UINT64 next = it == m_PeerSegments.end() ? UINT64_MAX : it->first;
+        SIZE_T n;
+        if (it != m_PeerSegments.begin() && address < std::prev(it)->first + std::prev(it)->second.Length) {
+            const auto& [start, segment] = *std::prev(it);
+            n = static_cast<SIZE_T>(std::min<UINT64>(length, start + segment.Length - address));
+            std::memcpy(segment.pLocal + (address - start), pSrc, n);
+        } else {
+            n = static_cast<SIZE_T>(std::min<UINT64>(length, next - address));
+            iovec local = { const_cast<char*>(pSrc), n };
+            iovec remote = { reinterpret_cast<void*>(static_cast<uintptr_t>(address)), n };
+            ssize_t written = process_vm_writev(m_PeerPid, &local, 1, &remote, 1, 0);
+            if (written <= 0) return false;
+            n = written;
+        }
+        address += n;
+        pSrc += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool Link::CopyFromPeer(char* pDst, UINT64 address, SIZE_T length) {
+    std::shared_lock lock(m_SegmentLock);
+    while (length > 0) {
+        auto it = m_PeerSegments.upper_bound(address);
+        UINT64 next = it == m_PeerSegments.end() ? UINT64_MAX : it->first;
+        SIZE_T n;
+        if (it != m_PeerSegments.begin() && address < std::prev(it)->first + std::prev(it)->second.Length) {
+            const auto& [start, segment] = *std::prev(it);
+            n = static_cast<SIZE_T>(std::min<UINT64>(length, start + segment.Length - address));
+            std::memcpy(pDst, segment.pLocal + (address - start), n);
+        } else {
+            n = static_cast<SIZE_T>(std::min<UINT64>(length, next - address));
+            iovec local = { pDst, n };
+            iovec remote = { reinterpret_cast<void*>(static_cast<uintptr_t>(address)), n };
+            ssize_t read = process_vm_readv(m_PeerPid, &local, 1, &remote, 1, 0);
+            if (read <= 0) return false;
+            n = read;
+        }
+        address += n;
+        pDst += n;
+        length -= n;
+    }
+    return true;
+}
+
+} // namespace NDSoft
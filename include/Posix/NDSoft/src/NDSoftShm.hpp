@@ -0,0 +1,280 @@
+#ifndef NDSOFT_SHM_HPP
+#define NDSOFT_SHM_HPP
+#pragma once
+
+// Cross-process transport for peers on the same host. Registered memory is
+// backed by memfd segments that both processes map, each connection shares a
+// channel of lock-free rings for receives and receive completions, and a
+// per-process progress thread handles connection control and doorbells.
+
+#include "NDSoft.hpp"
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace NDSoft {
+namespace Shm {
+
+constexpr UINT32 ChannelMagic = 0x4D53444E; // "NDSM"
+constexpr UINT32 ChannelVersion = 1;
+
+// Ring capacity covers the deepest receive queue an adapter reports.
+constexpr UINT64 RingEntries = 16384;
+static_assert((RingEntries & (RingEntries - 1)) == 0 && RingEntries >= MaxQueueDepth);
+
+constexpr UINT32 TokenTableEntries = 1u << 20;
+
+struct SgeDesc {
+    UINT64 Address;
+    UINT32 Length;
+    UINT32 Token;
+};
+
+struct ReceiveEntry {
+    UINT64 Context;
+    UINT32 nSge;
+    UINT32 Reserved;
+    SgeDesc Sge[MaxSge];
+};
+
+struct CompletionEntry {
+    UINT64 Context;
+    HRESULT Status;
+    UINT32 Bytes;
+    UINT32 Solicited;
+    UINT32 Reserved;
+};
+
+// Single-producer/single-consumer ring living in shared memory.
+template <typename T>
+struct Ring {
+    alignas(64) std::atomic<UINT64> Head;
+    alignas(64) std::atomic<UINT64> Tail;
+    alignas(64) T Entries[RingEntries];
+
+    bool Push(const T& entry) {
+        UINT64 tail = Tail.load(std::memory_order_relaxed);
+        if (tail - Head.load(std::memory_order_acquire) == RingEntries) return false;
+        Entries[tail & (RingEntries - 1)] = entry;
+        Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T* pEntry) {
+        UINT64 head = Head.load(std::memory_order_relaxed);
+        if (head == Tail.load(std::memory_order_acquire)) return false;
+        *pEntry = Entries[head & (RingEntries - 1)];
+        Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    UINT64 Size() const {
+        return Tail.load(std::memory_order_acquire) - Head.load(std::memory_order_acquire);
+    }
+};
+
+// One side of a connection. Receives are produced by this side and consumed
+// by the peer's sends; completions are produced by the peer and drained into
+// this side's receive CQ.
+struct alignas(64) Endpoint {
+    Ring<ReceiveEntry> Receives;
+    Ring<CompletionEntry> Completions;
+    // Set while this side's CQ has a Notify outstanding: ring the doorbell.
+    alignas(64) std::atomic<UINT32> Armed;
+    // Set while this side has sends waiting for a peer receive.
+    std::atomic<UINT32> WantReceive;
+    // Serializes the peer's consumption of Receives against a local flush.
+    std::atomic<UINT32> ReceiveLock;
+    std::atomic<UINT32> Closed;
+};
+
+// The receives of a shared receive queue. Peers connected to any of its queue
+// pairs map the same ring and take from it under ReceiveLock, so a receive
+// waits for whichever connection needs it first.
+struct alignas(64) SharedReceives {
+    Ring<ReceiveEntry> Receives;
+    alignas(64) std::atomic<UINT32> ReceiveLock;
+    // Set by a peer whose sends wait for a receive. The owner clears it when
+    // it posts and rings every connection whose WantReceive is set.
+    std::atomic<UINT32> Waiting;
+};
+
+struct Channel {
+    UINT32 Magic;
+    UINT32 Version;
+    Endpoint Side[2];
+};
+
+// Process-wide token table published read-only to connected peers. Entries
+// are written under a sequence lock so readers never see a torn region.
+struct TokenEntry {
+    std::atomic<UINT32> Sequence;
+    std::atomic<UINT32> Token;
+    std::atomic<UINT32> Access;
+    std::atomic<UINT32> Reserved;
+    std::atomic<UINT64> Base;
+    std::atomic<UINT64> Length;
+};
+
+static_assert(std::atomic<UINT64>::is_always_lock_free && std::atomic<UINT32>::is_always_lock_free,
+    "shared-memory atomics must be address-free");
+
+} // namespace Shm
+
+// MARK: Service
+// The progress thread. Handlers run on it when their descriptor is readable.
+class ShmService {
+    public:
+    using Handler = std::function<void(UINT32 events)>;
+
+    static ShmService& Instance();
+
+    UINT64 Add(int fd, Handler handler);
+    // Waits for a running invocation of the handler unless called from it.
+    void Remove(UINT64 id);
+
+    private:
+    ShmService();
+    ~ShmService();
+
+    void Run();
+
+    int m_Epoll = -1;
+    int m_Stop = -1;
+    std::thread m_Thread;
+
+    std::mutex m_Lock;
+    std::condition_variable m_Idle;
+    struct Entry {
+        int Fd;
+        std::shared_ptr<Handler> pHandler;
+    };
+    std::unordered_map<UINT64, Entry> m_Handlers;
+    UINT64 m_NextId = 1;
+    UINT64 m_Running = 0;
+};
+
+// Binds the unix-domain socket through which processes on this host reach a
+// listener on the given port. Fails with ND_ADDRESS_ALREADY_EXISTS if another
+// process listens on the port.
+HRESULT BindRendezvous(USHORT port, int* pSocket);
+
+// Shared receive queue rings, backed by a memfd so they can be handed to peers.
+// MapSharedReceives takes ownership of fd.
+Shm::SharedReceives* CreateSharedReceives(int* pFd);
+Shm::SharedReceives* MapSharedReceives(int fd);
+void UnmapSharedReceives(Shm::SharedReceives* pReceives);
+
+// MARK: Link
+// A connection to a queue pair in another process on this host.
+class Link : public std::enable_shared_from_this<Link> {
+    public:
+    enum class MessageType : UINT32 {
+        ConnectRequest = 1,
+        Accept,
+        Reject,
+        CompleteConnect,
+        Disconnect,
+        Segment,
+        SegmentRemoved,
+    };
+
+    struct Message {
+        MessageType Type;
+        UINT32 cbPrivateData;
+        UINT32 InboundReadLimit;
+        UINT32 OutboundReadLimit;
+        UINT64 SegmentId;
+        UINT64 Address;
+        UINT64 Length;
+        sockaddr_storage ClientAddr;
+        sockaddr_storage ServerAddr;
+        char PrivateData[MaxCalleeData];
+    };
+
+    ~Link();
+
+    // Client side: connects to the listener bound to the address's port in
+    // another process and sends the request. The reply arrives on the
+    // progress thread.
+    static HRESULT Connect(Connector* pConnector, QueuePair* pQp, const ConnectRequest& request,
+        std::shared_ptr<Link>* ppLink);
+    // Server side: accepts a connection on a listening socket.
+    static std::shared_ptr<ConnectRequest> AcceptRequest(int listenSocket);
+
+    HRESULT Accept(Connector* pConnector, QueuePair* pQp, const std::vector<char>& privateData,
+        ULONG inboundReadLimit, ULONG outboundReadLimit);
+    void Refuse(const std::vector<char>& privateData);
+    void CompleteConnect();
+    // Disconnects locally and tells the peer.
+    void Close();
+    bool IsClosed() const { return m_Closed.load(std::memory_order_acquire); }
+
+    void AnnounceSegment(UINT64 id, UINT64 address, UINT64 length, int fd);
+    void AnnounceSegmentRemoved(UINT64 id, UINT64 address);
+
+    // Data path
+    Shm::Endpoint& Local() { return m_pChannel->Side[m_Side]; }
+    Shm::Endpoint& Peer() { return m_pChannel->Side[1 - m_Side]; }
+    // Set when the peer's queue pair takes its receives from a shared receive queue.
+    Shm::SharedReceives* PeerSrq() { return m_pPeerSrq; }
+    int Side() const { return m_Side; }
+    bool CheckAccess(UINT32 token, UINT64 address, SIZE_T length, ULONG access) const;
+    bool CopyToPeer(UINT64 address, const char* pSrc, SIZE_T length);
+    bool CopyFromPeer(char* pDst, UINT64 address, SIZE_T length);
+    void RingPeer();
+
+    QueuePair* AcquireQueuePair();
+    Connector* AcquireConnector();
+    void Forget(QueuePair* pQp);
+
+    private:
+    Link(int socket, int side);
+
+    bool Start();
+    void OnReadable(UINT32 events);
+    void OnMessage(const Message& message, std::vector<int>& fds);
+    void OnDoorbell();
+    void OnPeerClosed();
+    // Stops the progress thread handlers; false if already closed.
+    bool MarkClosed();
+    void DisconnectLocal(bool notifyConnector);
+    bool MapChannel(int fd, bool create);
+    bool MapPeerTokens(int fd);
+
+    int m_Socket;
+    int m_Side;
+    pid_t m_PeerPid = 0;
+    int m_Doorbell = -1;
+    int m_PeerDoorbell = -1;
+    int m_ChannelFd = -1;
+    Shm::Channel* m_pChannel = nullptr;
+    const Shm::TokenEntry* m_pPeerTokens = nullptr;
+    Shm::SharedReceives* m_pPeerSrq = nullptr;
+    UINT64 m_SocketHandler = 0;
+    UINT64 m_DoorbellHandler = 0;
+    std::atomic<bool> m_Closed{ false };
+
+    // Local endpoints, cleared under m_Lock when they go away.
+    std::mutex m_Lock;
+    Connector* m_pConnector = nullptr;
+    QueuePair* m_pQueuePair = nullptr;
+    // The client's queue pair, referenced until the server accepts.
+    QueuePair* m_pPendingQp = nullptr;
+
+    struct PeerSegment {
+        UINT64 Length;
+        char* pLocal;
+        UINT64 Id;
+    };
+    mutable std::shared_mutex m_SegmentLock;
+    std::map<UINT64, PeerSegment> m_PeerSegments;
+};
+
+} // namespace NDSoft
+
+#endif // NDSOFT_SHM_HPP
@@ -0,0 +1,121 @@
+#include "NDSoft.hpp"
+#include <ndsupport.h>
+#include <new>
+#include <ifaddrs.h>
+#include <unistd.h>
+
+// The ndsupport.h entry points, backed by the software provider. Every local
+// IPv4/IPv6 address (including loopback) is reported as ND-capable.
+
+using namespace NDSoft;
+
+static bool IsUsableAddress(const sockaddr* pAddr) {
+    return pAddr != nullptr && (pAddr->sa_family == AF_INET || pAddr->sa_family == AF_INET6);
+}
+
+HRESULT ND_HELPER_API NdStartup(VOID) {
+    return ND_SUCCESS;
+}
+
+HRESULT ND_HELPER_API NdCleanup(VOID) {
+    return ND_SUCCESS;
+}
+
+VOID ND_HELPER_API NdFlushProviders(VOID) {
+}
+
+HRESULT ND_HELPER_API NdQueryAddressList(DWORD flags, SOCKET_ADDRESS_LIST* pAddressList, SIZE_T* pcbAddressList) {
+    if (pcbAddressList == nullptr) return ND_INVALID_PARAMETER_3;
+    if (flags & ND_QUERY_EXCLUDE_NDv2_ADDRESSES) {
+        SIZE_T needed = sizeof(SOCKET_ADDRESS_LIST);
+        if (pAddressList == nullptr || *pcbAddressList < needed) {
+            *pcbAddressList = needed;
+            return ND_BUFFER_OVERFLOW;
+        }
+        pAddressList->iAddressCount = 0;
+        *pcbAddressList = needed;
+        return ND_SUCCESS;
+    }
+
+    struct ifaddrs* pList = nullptr;
+    if (getifaddrs(&pList) != 0) return ND_INTERNAL_ERROR;
+
+    std::vector<SockAddr> addrs;
+    for (struct ifaddrs* p = pList; p != nullptr; p = p->ifa_next) {
+        if (!IsUsableAddress(p->ifa_addr)) continue;
+        SockAddr addr;
+        if (addr.Set(p->ifa_addr, sizeof(sockaddr_storage))) addrs.push_back(addr);
+    }
+    freeifaddrs(pList);
+
+    // The list header already holds one SOCKET_ADDRESS; the sockaddrs follow the array.
+    SIZE_T header = sizeof(SOCKET_ADDRESS_LIST) + (addrs.empty() ? 0 : (addrs.size() - 1) * sizeof(SOCKET_ADDRESS));
+    SIZE_T needed = header;
+    for (const SockAddr& addr : addrs) needed += addr.Length;
+
+    if (pAddressList == nullptr || *pcbAddressList < needed) {
+        *pcbAddressList = needed;
+        return ND_BUFFER_OVERFLOW;
+    }
+
+    BYTE* pNext = reinterpret_cast<BYTE*>(pAddressList) + header;
+    pAddressList->iAddressCount = static_cast<INT>(addrs.size());
+    for (size_t i = 0; i < addrs.size(); i++) {
+        std::memcpy(pNext, addrs[i].Get(), addrs[i].Length);
+        pAddressList->Address[i].lpSockaddr = reinterpret_cast<LPSOCKADDR>(pNext);
+        pAddressList->Address[i].iSockaddrLength = static_cast<INT>(addrs[i].Length);
+        pNext += addrs[i].Length;
+    }
+    *pcbAddressList = needed;
+    return ND_SUCCESS;
+}
+
+HRESULT ND_HELPER_API NdResolveAddress(const struct sockaddr* pRemoteAddress, SIZE_T cbRemoteAddress,
+    struct sockaddr* pLocalAddress, SIZE_T* pcbLocalAddress) {
+    SockAddr remote;
+    if (!remote.Set(pRemoteAddress, cbRemoteAddress)) return ND_INVALID_ADDRESS;
+    if (pcbLocalAddress == nullptr) return ND_INVALID_PARAMETER_4;
+
+    // Let the routing table pick the source address a UDP socket would use.
+    if (remote.Port() == 0) remote.SetPort(9);
+    int s = socket(remote.Storage.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (s < 0) return ND_INTERNAL_ERROR;
+
+    SockAddr local;
+    socklen_t len = sizeof(local.Storage);
+    bool ok = connect(s, remote.Get(), remote.Length) == 0 &&
+        getsockname(s, reinterpret_cast<sockaddr*>(&local.Storage), &len) == 0;
+    close(s);
+    if (!ok) return ND_NETWORK_UNREACHABLE;
+
+    local.Length = len;
+    local.SetPort(0);
+    ULONG cbLocal = static_cast<ULONG>(std::min<SIZE_T>(*pcbLocalAddress, 0xFFFFFFFF));
+    HRESULT hr = local.CopyTo(pLocalAddress, &cbLocal);
+    *pcbLocalAddress = cbLocal;
+    return hr;
+}
+
+HRESULT ND_HELPER_API NdCheckAddress(const struct sockaddr* pAddress, SIZE_T cbAddress) {
+    SockAddr addr;
+    if (!addr.Set(pAddress, cbAddress)) return ND_INVALID_ADDRESS;
+    return IsLocalAddress(addr.Get()) ? ND_SUCCESS : ND_INVALID_ADDRESS;
+}
+
+HRESULT ND_HELPER_API NdOpenAdapter(REFIID iid, const struct sockaddr* pAddress, SIZE_T cbAddress, VOID** ppIAdapter) {
+    if (ppIAdapter == nullptr) return ND_INVALID_PARAMETER_4;
+    if (iid != IID_IND2Adapter) return E_NOINTERFACE;
+
+    SockAddr addr;
+    if (!addr.Set(pAddress, cbAddress) || !IsLocalAddress(addr.Get())) return ND_INVALID_ADDRESS;
+    addr.SetPort(0);
+
+    Adapter* pAdapter = new (std::nothrow) Adapter(addr);
+    if (pAdapter == nullptr) return ND_NO_MEMORY;
+    *ppIAdapter = static_cast<IND2Adapter*>(pAdapter);
+    return ND_SUCCESS;
+}
+
+HRESULT ND_HELPER_API NdOpenV1Adapter(const struct sockaddr*, SIZE_T, INDAdapter**) {
+    return ND_NOT_SUPPORTED;
+}
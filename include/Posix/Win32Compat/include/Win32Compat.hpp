@@ -0,0 +1,278 @@
+#ifndef WIN32COMPAT_HPP
+#define WIN32COMPAT_HPP
+#pragma once
+
+// Minimal Win32/Winsock surface needed to build the NetworkDirect SPI headers,
+// NDSession and the examples on POSIX hosts. Only what the tree actually uses
+// is provided; the semantics follow the Win32 documentation closely enough for
+// the software providers in include/Posix/NDSoft.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdarg>
+#include <cerrno>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// MARK: Basic types
+typedef int32_t             BOOL;
+typedef uint8_t             BOOLEAN;
+typedef uint8_t             BYTE;
+typedef char                CHAR;
+typedef wchar_t             WCHAR;
+typedef int                 INT;
+typedef unsigned int        UINT;
+typedef int32_t             LONG;
+typedef uint32_t            ULONG;
+typedef int64_t             LONGLONG;
+typedef uint64_t            ULONGLONG;
+typedef uint16_t            USHORT;
+typedef uint16_t            WORD;
+typedef uint32_t            DWORD;
+typedef uint16_t            UINT16;
+typedef uint32_t            UINT32;
+typedef uint64_t            UINT64;
+typedef int64_t             INT64;
+typedef uintptr_t           ULONG_PTR;
+typedef size_t              SIZE_T;
+typedef ULONG_PTR           KAFFINITY;
+typedef void*               PVOID;
+typedef void*               LPVOID;
+typedef void*               HANDLE;
+typedef HANDLE              HMODULE;
+typedef char*               LPSTR;
+typedef const char*         LPCSTR;
+typedef INT*                LPINT;
+typedef DWORD*              LPDWORD;
+typedef LONG                HRESULT;
+typedef int                 errno_t;
+
+#define VOID void
+#define TRUE 1
+#define FALSE 0
+#define CONST const
+
+#define MAKEWORD(a, b) ((WORD)(((BYTE)((a) & 0xff)) | ((WORD)((BYTE)((b) & 0xff))) << 8))
+#define DECLARE_HANDLE(name) typedef struct name##__* name
+
+#ifndef __stdcall
+#define __stdcall
+#endif
+
+#ifndef EXTERN_C
+#define EXTERN_C extern "C"
+#endif
+
+// MARK: HRESULT
+#define SUCCEEDED(hr)   (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)      (((HRESULT)(hr)) < 0)
+
+#define S_OK            ((HRESULT)0x00000000L)
+#define S_FALSE         ((HRESULT)0x00000001L)
+#define E_NOTIMPL       ((HRESULT)0x80004001L)
+#define E_NOINTERFACE   ((HRESULT)0x80004002L)
+#define E_POINTER       ((HRESULT)0x80004003L)
+#define E_FAIL          ((HRESULT)0x80004005L)
+#define E_OUTOFMEMORY   ((HRESULT)0x8007000EL)
+#define E_INVALIDARG    ((HRESULT)0x80070057L)
+
+// MARK: SAL annotations
+// The SPI headers are annotated for the MSVC analyzer; on POSIX they carry no meaning.
+// __in and __out are left to unknwn.h because libstdc++ uses them as identifiers.
+#define __in_opt
+#define __out_opt
+#define __inout
+#define __inout_opt
+#define __deref_out
+#define __in_ecount_opt(x)
+#define __in_bcount(x)
+#define __in_bcount_opt(x)
+#define __out_bcount_opt(x)
+#define __inout_bcount_opt(x)
+#define __out_ecount_part(x, y)
+#define __out_ecount_part_opt(x, y)
+#define __out_bcount_part_opt(x, y)
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Deref_out_
+#define _In_bytecount_(x)
+#define _Out_bytecap_(x)
+#define _Out_opt_bytecap_post_bytecount_(x, y)
+#define _Out_writes_(x)
+#define _Releases_lock_(x)
+
+// MARK: COM
+typedef struct _GUID {
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t  Data4[8];
+} GUID;
+
+typedef GUID IID;
+typedef GUID CLSID;
+typedef const IID& REFIID;
+typedef const CLSID& REFCLSID;
+
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    inline constexpr GUID name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+
+inline bool operator==(const GUID& lhs, const GUID& rhs) {
+    return std::memcmp(&lhs, &rhs, sizeof(GUID)) == 0;
+}
+
+inline bool operator!=(const GUID& lhs, const GUID& rhs) {
+    return !(lhs == rhs);
+}
+
+#define IsEqualGUID(a, b) ((a) == (b))
+#define InlineIsEqualGUID(a, b) ((a) == (b))
+
+#define PURE = 0
+#define THIS_
+#define THIS void
+#define STDMETHOD(method) virtual HRESULT method
+#define STDMETHOD_(type, method) virtual type method
+#define IFACEMETHOD(method) STDMETHOD(method)
+#define IFACEMETHOD_(type, method) STDMETHOD_(type, method)
+#define DECLARE_INTERFACE(iface) struct iface
+#define DECLARE_INTERFACE_(iface, base) struct iface : public base
+
+DEFINE_GUID(IID_IUnknown,
+    0x00000000, 0x0000, 0x0000, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46);
+
+struct IUnknown {
+    virtual HRESULT QueryInterface(REFIID riid, LPVOID* ppvObj) = 0;
+    virtual ULONG AddRef() = 0;
+    virtual ULONG Release() = 0;
+};
+
+// MARK: Overlapped I/O and events
+typedef struct _OVERLAPPED {
+    ULONG_PTR Internal;
+    ULONG_PTR InternalHigh;
+    DWORD Offset;
+    DWORD OffsetHigh;
+    HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef struct _SECURITY_ATTRIBUTES SECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+
+#define INFINITE        0xFFFFFFFF
+#define WAIT_OBJECT_0   0x00000000L
+#define WAIT_TIMEOUT    0x00000102L
+#define WAIT_FAILED     0xFFFFFFFF
+
+HANDLE CreateEvent(LPSECURITY_ATTRIBUTES pAttributes, BOOL bManualReset, BOOL bInitialState, LPCSTR pName);
+BOOL SetEvent(HANDLE hEvent);
+BOOL ResetEvent(HANDLE hEvent);
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD milliseconds);
+BOOL CloseHandle(HANDLE hObject);
+
+// MARK: Heap
+#define HEAP_ZERO_MEMORY 0x00000008
+
+HANDLE GetProcessHeap();
+LPVOID HeapAlloc(HANDLE hHeap, DWORD flags, SIZE_T bytes);
+BOOL HeapFree(HANDLE hHeap, DWORD flags, LPVOID pMem);
+SIZE_T HeapSize(HANDLE hHeap, DWORD flags, const VOID* pMem);
+
+#define RtlZeroMemory(dst, len) std::memset((dst), 0, (len))
+#define ZeroMemory RtlZeroMemory
+#define CopyMemory(dst, src, len) std::memcpy((dst), (src), (len))
+
+// MARK: Winsock
+typedef int SOCKET;
+#define INVALID_SOCKET  (-1)
+#define SOCKET_ERROR    (-1)
+
+typedef struct sockaddr SOCKADDR, *LPSOCKADDR;
+typedef struct sockaddr_in SOCKADDR_IN;
+typedef struct sockaddr_in6 SOCKADDR_IN6;
+typedef struct _WSAPROTOCOL_INFO WSAPROTOCOL_INFO, *LPWSAPROTOCOL_INFO;
+
+typedef struct _SOCKET_ADDRESS {
+    LPSOCKADDR lpSockaddr;
+    INT iSockaddrLength;
+} SOCKET_ADDRESS;
+
+typedef struct _SOCKET_ADDRESS_LIST {
+    INT iAddressCount;
+    SOCKET_ADDRESS Address[1];
+} SOCKET_ADDRESS_LIST;
+
+typedef struct WSAData {
+    WORD wVersion;
+    WORD wHighVersion;
+    char szDescription[257];
+    char szSystemStatus[129];
+} WSADATA, *LPWSADATA;
+
+int WSAStartup(WORD versionRequested, LPWSADATA pWsaData);
+int WSACleanup();
+INT WSAStringToAddress(LPSTR addressString, INT addressFamily, LPWSAPROTOCOL_INFO pProtocolInfo, LPSOCKADDR pAddress, LPINT pAddressLength);
+INT WSAAddressToString(LPSOCKADDR pAddress, DWORD addressLength, LPWSAPROTOCOL_INFO pProtocolInfo, LPSTR addressString, LPDWORD pAddressStringLength);
+
+// MARK: CRT secure functions
+template <size_t N>
+inline int sprintf_s(char (&buffer)[N], const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int ret = std::vsnprintf(buffer, N, format, args);
+    va_end(args);
+    return ret;
+}
+
+inline int sprintf_s(char* buffer, size_t size, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int ret = std::vsnprintf(buffer, size, format, args);
+    va_end(args);
+    return ret;
+}
+
+inline errno_t strcpy_s(char* dest, size_t size, const char* src) {
+    if (dest == nullptr || src == nullptr || size == 0) return EINVAL;
+    size_t len = std::strlen(src);
+    if (len >= size) {
+        dest[0] = '\0';
+        return ERANGE;
+    }
+    std::memcpy(dest, src, len + 1);
+    return 0;
+}
+
+template <size_t N>
+inline errno_t strcpy_s(char (&dest)[N], const char* src) {
+    return strcpy_s(dest, N, src);
+}
+
+#if !defined(__x86_64__) && !defined(__i386__)
+inline void _mm_pause() {
+#if defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+#endif
+
+namespace Win32Compat {
+    // Base of everything a HANDLE can point at, so CloseHandle can destroy it.
+    class KernelObject {
+    public:
+        virtual ~KernelObject() = default;
+    };
+
+    // Returns the pollable descriptor behind an event handle, or -1.
+    int GetEventFd(HANDLE hEvent);
+}
+
+#endif // WIN32COMPAT_HPP
@@ -0,0 +1,9 @@
+#pragma once
+
+// POSIX stand-in for the Windows SDK header of the same name.
+#include "Win32Compat.hpp"
+
+// Only ndspi.h includes this header. libstdc++ uses __in and __out as
+// identifiers, so ndspi.h undefines them again once its declarations are done.
+#define __in
+#define __out
@@ -0,0 +1,4 @@
+#pragma once
+
+// POSIX stand-in for the Windows SDK header of the same name.
+#include "Win32Compat.hpp"
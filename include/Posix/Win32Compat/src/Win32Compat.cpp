@@ -0,0 +1,216 @@
+#include "Win32Compat.hpp"
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace Win32Compat {
+
+// MARK: Event
+// Events are eventfd-backed so they can be handed to poll/epoll as well as
+// waited on through WaitForSingleObject. An auto-reset event is consumed by the
+// read that follows a successful poll; a manual-reset event is only observed.
+class Event : public KernelObject {
+    public:
+    Event(int fd, bool manualReset) : m_Fd(fd), m_ManualReset(manualReset) {}
+    ~Event() override { close(m_Fd); }
+
+    int Fd() const { return m_Fd; }
+    bool IsManualReset() const { return m_ManualReset; }
+
+    private:
+    int m_Fd;
+    bool m_ManualReset;
+};
+
+static Event* AsEvent(HANDLE h) {
+    return dynamic_cast<Event*>(static_cast<KernelObject*>(h));
+}
+
+int GetEventFd(HANDLE hEvent) {
+    Event* pEvent = AsEvent(hEvent);
+    return pEvent ? pEvent->Fd() : -1;
+}
+
+// Stand-in for the process heap handle; never dereferenced.
+static KernelObject g_ProcessHeap;
+
+// Every heap block carries its requested size so HeapSize can report it.
+// The header keeps the 16-byte alignment HeapAlloc guarantees on x64.
+struct alignas(16) HeapBlockHeader {
+    SIZE_T Size;
+};
+
+} // namespace Win32Compat
+
+using namespace Win32Compat;
+
+// MARK: Events
+HANDLE CreateEvent(LPSECURITY_ATTRIBUTES, BOOL bManualReset, BOOL bInitialState, LPCSTR) {
+    int fd = eventfd(bInitialState ? 1 : 0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) return nullptr;
+    return static_cast<KernelObject*>(new Event(fd, bManualReset != FALSE));
+}
+
+BOOL SetEvent(HANDLE hEvent) {
+    Event* pEvent = AsEvent(hEvent);
+    if (!pEvent) return FALSE;
+    uint64_t one = 1;
+    ssize_t n = write(pEvent->Fd(), &one, sizeof(one));
+    // EAGAIN means the counter is saturated, which is still "signaled".
+    return (n == sizeof(one) || errno == EAGAIN) ? TRUE : FALSE;
+}
+
+BOOL ResetEvent(HANDLE hEvent) {
+    Event* pEvent = AsEvent(hEvent);
+    if (!pEvent) return FALSE;
+    uint64_t value;
+    while (read(pEvent->Fd(), &value, sizeof(value)) == sizeof(value)) {}
+    return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD milliseconds) {
+    Event* pEvent = AsEvent(hHandle);
+    if (!pEvent) return WAIT_FAILED;
+
+    struct pollfd pfd = { pEvent->Fd(), POLLIN, 0 };
+    int timeout = (milliseconds == INFINITE) ? -1 : static_cast<int>(milliseconds);
+    for (;;) {
+        int n = poll(&pfd, 1, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return WAIT_FAILED;
+        }
+        if (n == 0) return WAIT_TIMEOUT;
+        if (pEvent->IsManualReset()) return WAIT_OBJECT_0;
+
+        uint64_t value;
+        if (read(pEvent->Fd(), &value, sizeof(value)) == sizeof(value)) return WAIT_OBJECT_0;
+        // Another waiter consumed the signal first; keep waiting.
+        if (errno != EAGAIN) return WAIT_FAILED;
+    }
+}
+
+BOOL CloseHandle(HANDLE hObject) {
+    if (hObject == nullptr || hObject == &g_ProcessHeap) return FALSE;
+    delete static_cast<KernelObject*>(hObject);
+    return TRUE;
+}
+
+// MARK: Heap
+HANDLE GetProcessHeap() {
+    return &g_ProcessHeap;
+}
+
+LPVOID HeapAlloc(HANDLE, DWORD flags, SIZE_T bytes) {
+    void* p = (flags & HEAP_ZERO_MEMORY) ? std::calloc(1, sizeof(HeapBlockHeader) + bytes)
+                                         : std::malloc(sizeof(HeapBlockHeader) + bytes);
+    if (!p) return nullptr;
+    HeapBlockHeader* pHeader = static_cast<HeapBlockHeader*>(p);
+    pHeader->Size = bytes;
+    return pHeader + 1;
+}
+
+BOOL HeapFree(HANDLE, DWORD, LPVOID pMem) {
+    if (!pMem) return TRUE;
+    std::free(static_cast<HeapBlockHeader*>(pMem) - 1);
+    return TRUE;
+}
+
+SIZE_T HeapSize(HANDLE, DWORD, const VOID* pMem) {
+    if (!pMem) return static_cast<SIZE_T>(-1);
+    return (static_cast<const HeapBlockHeader*>(pMem) - 1)->Size;
+}
+
+// MARK: Winsock
+int WSAStartup(WORD versionRequested, LPWSADATA pWsaData) {
+    if (pWsaData) {
+        std::memset(pWsaData, 0, sizeof(*pWsaData));
+        pWsaData->wVersion = versionRequested;
+        pWsaData->wHighVersion = MAKEWORD(2, 2);
+    }
+    return 0;
+}
+
+int WSACleanup() {
+    return 0;
+}
+
+// Accepts "a.b.c.d", "a.b.c.d:port", "x:y::z" and "[x:y::z]:port".
+INT WSAStringToAddress(LPSTR addressString, INT addressFamily, LPWSAPROTOCOL_INFO, LPSOCKADDR pAddress, LPINT pAddressLength) {
+    if (!addressString || !pAddress || !pAddressLength) return SOCKET_ERROR;
+
+    std::string str(addressString);
+    std::string host = str;
+    std::string port;
+
+    if (addressFamily == AF_INET) {
+        size_t colon = str.rfind(':');
+        if (colon != std::string::npos) {
+            host = str.substr(0, colon);
+            port = str.substr(colon + 1);
+        }
+        if (*pAddressLength < static_cast<INT>(sizeof(sockaddr_in))) return SOCKET_ERROR;
+
+        sockaddr_in* pIn = reinterpret_cast<sockaddr_in*>(pAddress);
+        std::memset(pIn, 0, sizeof(*pIn));
+        pIn->sin_family = AF_INET;
+        if (inet_pton(AF_INET, host.c_str(), &pIn->sin_addr) != 1) return SOCKET_ERROR;
+        if (!port.empty()) pIn->sin_port = htons(static_cast<uint16_t>(std::strtoul(port.c_str(), nullptr, 10)));
+        *pAddressLength = sizeof(sockaddr_in);
+        return 0;
+    }
+
+    if (addressFamily == AF_INET6) {
+        if (!str.empty() && str[0] == '[') {
+            size_t close = str.find(']');
+            if (close == std::string::npos) return SOCKET_ERROR;
+            host = str.substr(1, close - 1);
+            if (close + 1 < str.size() && str[close + 1] == ':') port = str.substr(close + 2);
+        }
+        if (*pAddressLength < static_cast<INT>(sizeof(sockaddr_in6))) return SOCKET_ERROR;
+
+        sockaddr_in6* pIn6 = reinterpret_cast<sockaddr_in6*>(pAddress);
+        std::memset(pIn6, 0, sizeof(*pIn6));
+        pIn6->sin6_family = AF_INET6;
+        if (inet_pton(AF_INET6, host.c_str(), &pIn6->sin6_addr) != 1) return SOCKET_ERROR;
+        if (!port.empty()) pIn6->sin6_port = htons(static_cast<uint16_t>(std::strtoul(port.c_str(), nullptr, 10)));
+        *pAddressLength = sizeof(sockaddr_in6);
+        return 0;
+    }
+
+    return SOCKET_ERROR;
+}
+
+INT WSAAddressToString(LPSOCKADDR pAddress, DWORD, LPWSAPROTOCOL_INFO, LPSTR addressString, LPDWORD pAddressStringLength) {
+    if (!pAddress || !addressString || !pAddressStringLength) return SOCKET_ERROR;
+
+    char host[INET6_ADDRSTRLEN] = { 0 };
+    uint16_t port = 0;
+    bool v6 = false;
+    if (pAddress->sa_family == AF_INET) {
+        const sockaddr_in* pIn = reinterpret_cast<const sockaddr_in*>(pAddress);
+        inet_ntop(AF_INET, &pIn->sin_addr, host, sizeof(host));
+        port = ntohs(pIn->sin_port);
+    } else if (pAddress->sa_family == AF_INET6) {
+        const sockaddr_in6* pIn6 = reinterpret_cast<const sockaddr_in6*>(pAddress);
+        inet_ntop(AF_INET6, &pIn6->sin6_addr, host, sizeof(host));
+        port = ntohs(pIn6->sin6_port);
+        v6 = true;
+    } else {
+        return SOCKET_ERROR;
+    }
+
+    std::string str = host;
+    if (port != 0) str = (v6 ? "[" + str + "]" : str) + ":" + std::to_string(port);
+
+    if (*pAddressStringLength < str.size() + 1) {
+        *pAddressStringLength = static_cast<DWORD>(str.size() + 1);
+        return SOCKET_ERROR;
+    }
+    std::memcpy(addressString, str.c_str(), str.size() + 1);
+    *pAddressStringLength = static_cast<DWORD>(str.size() + 1);
+    return 0;
+}
@@ -0,0 +1,217 @@
+#ifndef NDASYNC_HPP
+#define NDASYNC_HPP
+#pragma once
+
+#include <ndsupport.h>
+#include "NDDispatcher.hpp"
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Coroutine support for NDSession. Sessions attached to an NDEventLoop can
+// co_await their operations instead of blocking on them: the loop polls every
+// attached CQ and every pending connection request, resumes whichever
+// coroutines they complete, and sleeps on a single event when none is ready.
+// One thread can therefore keep any number of sessions busy.
+//
+// Like the rest of NDSession it is meant to be driven from a single thread.
+
+class NDSessionBase;
+class NDOverlappedRequest;
+template <typename T> class NDTask;
+
+// MARK: NDEventLoop
+class NDEventLoop {
+    public:
+    NDEventLoop();
+    ~NDEventLoop();
+    NDEventLoop(const NDEventLoop&) = delete;
+    NDEventLoop& operator=(const NDEventLoop&) = delete;
+
+    // The session's CQ must exist. An attached session must not make blocking
+    // waits, since the loop keeps its CQ armed; it detaches when destroyed.
+    HRESULT Attach(NDSessionBase& session);
+    void Detach(NDSessionBase& session);
+
+    // Runs the task up to its first suspension. From then on the loop owns it
+    // and frees it when it finishes; its result is discarded.
+    template <typename T>
+    void Spawn(NDTask<T> task);
+
+    // Resumes every coroutine whose operation has completed, without waiting.
+    // Returns how many were resumed.
+    ULONG Poll();
+    // Polls, sleeping while nothing is ready, until every spawned task has
+    // finished or nothing attached could ever complete.
+    void Run();
+
+    ULONG Tasks() const { return m_Tasks; }
+
+    private:
+    friend class NDOverlappedRequest;
+    template <typename T> friend class NDTask;
+
+    struct Source {
+        NDSessionBase* pSession = nullptr;
+        IND2CompletionQueue* pCq = nullptr;
+        OVERLAPPED NotifyOv = {};   // signals m_hEvent
+        bool Armed = false;
+    };
+
+    void Arm();
+    void Watch(NDOverlappedRequest* pRequest);
+    void Unwatch(NDOverlappedRequest* pRequest);
+
+    std::vector<std::unique_ptr<Source>> m_Sources;
+    std::vector<NDOverlappedRequest*> m_Pending;
+    HANDLE m_hEvent = nullptr;
+    ULONG m_Tasks = 0;
+};
+
+// MARK: NDTask
+// A coroutine returning T. It starts suspended and runs once awaited or
+// spawned; an awaiting coroutine is resumed directly when it finishes.
+// NDSession reports failures as HRESULTs, so an escaping exception terminates.
+template <typename T = HRESULT>
+class NDTask {
+    public:
+    struct promise_type;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept {
+            promise_type& promise = handle.promise();
+            if (promise.Continuation) return promise.Continuation;
+            if (promise.pLoop != nullptr) {
+                promise.pLoop->m_Tasks--;
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    struct promise_type {
+        T Value{};
+        std::coroutine_handle<> Continuation;
+        NDEventLoop* pLoop = nullptr;   // set for spawned tasks, which free themselves
+
+        NDTask get_return_object() noexcept { return NDTask(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() const noexcept { return {}; }
+        FinalAwaiter final_suspend() const noexcept { return {}; }
+        void return_value(T value) { Value = std::move(value); }
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+
+    NDTask(NDTask&& other) noexcept : m_Handle(std::exchange(other.m_Handle, nullptr)) {}
+    NDTask& operator=(NDTask&& other) noexcept {
+        if (this != &other) {
+            if (m_Handle) m_Handle.destroy();
+            m_Handle = std::exchange(other.m_Handle, nullptr);
+        }
+        return *this;
+    }
+    ~NDTask() {
+        if (m_Handle) m_Handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !m_Handle || m_Handle.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        m_Handle.promise().Continuation = awaiting;
+        return m_Handle;
+    }
+    T await_resume() { return std::move(m_Handle.promise().Value); }
+
+    private:
+    friend class NDEventLoop;
+    explicit NDTask(Handle handle) : m_Handle(handle) {}
+
+    Handle m_Handle;
+};
+
+template <typename T>
+void NDEventLoop::Spawn(NDTask<T> task) {
+    auto handle = std::exchange(task.m_Handle, nullptr);
+    handle.promise().pLoop = this;
+    m_Tasks++;
+    handle.resume();
+}
+
+// MARK: NDCompletion
+// One tracked request, posted as soon as the awaitable is made so receives
+// can be up before the peer sends and several requests can be in flight
+// before the first co_await. Awaiting yields the request's ND2_RESULT, and a
+// request that could not be posted yields at once with its HRESULT as Status.
+// The handler points at the awaitable, so it cannot move and must be awaited
+// before it goes out of scope.
+class NDCompletion {
+    public:
+    template <typename Post>
+    explicit NDCompletion(Post&& post) {
+        HRESULT hr = post(NDDispatcher::Handler([this](const ND2_RESULT& result) { Complete(result); }));
+        if (FAILED(hr)) {
+            m_Result.Status = hr;
+            m_Done = true;
+        }
+    }
+    NDCompletion(const NDCompletion&) = delete;
+    NDCompletion& operator=(const NDCompletion&) = delete;
+
+    bool await_ready() const noexcept { return m_Done; }
+    void await_suspend(std::coroutine_handle<> awaiting) noexcept { m_Awaiting = awaiting; }
+    ND2_RESULT await_resume() const noexcept { return m_Result; }
+
+    private:
+    void Complete(const ND2_RESULT& result) {
+        m_Result = result;
+        m_Done = true;
+        if (m_Awaiting) m_Awaiting.resume();
+    }
+
+    ND2_RESULT m_Result = {};
+    bool m_Done = false;
+    std::coroutine_handle<> m_Awaiting;
+};
+
+// MARK: NDOverlappedRequest
+// One overlapped request on a connector or listener, issued as soon as the
+// awaitable is made, with an OVERLAPPED that signals the loop. Awaiting
+// yields its HRESULT. Without a loop the request is not issued and yields
+// ND_INVALID_DEVICE_STATE. Destroying it while pending cancels every request
+// on the object.
+class NDOverlappedRequest {
+    public:
+    template <typename Start>
+    NDOverlappedRequest(NDEventLoop* pLoop, IND2Overlapped* pObject, Start&& start) : m_pLoop(pLoop), m_pObject(pObject) {
+        if (pLoop == nullptr) {
+            m_Result = ND_INVALID_DEVICE_STATE;
+            return;
+        }
+        m_Ov.hEvent = pLoop->m_hEvent;
+        m_Result = start(&m_Ov);
+        if (m_Result == ND_PENDING) pLoop->Watch(this);
+    }
+    ~NDOverlappedRequest();
+    NDOverlappedRequest(const NDOverlappedRequest&) = delete;
+    NDOverlappedRequest& operator=(const NDOverlappedRequest&) = delete;
+
+    bool await_ready() const noexcept { return m_Result != ND_PENDING; }
+    void await_suspend(std::coroutine_handle<> awaiting) noexcept { m_Awaiting = awaiting; }
+    HRESULT await_resume() const noexcept { return m_Result; }
+
+    private:
+    friend class NDEventLoop;
+    // Called by the loop; returns whether the request has completed.
+    bool Poll();
+
+    NDEventLoop* m_pLoop;
+    IND2Overlapped* m_pObject;
+    OVERLAPPED m_Ov = {};
+    HRESULT m_Result = ND_PENDING;
+    std::coroutine_handle<> m_Awaiting;
+};
+
+#endif // NDASYNC_HPP
@@ -0,0 +1,112 @@
+#ifndef NDBUFFERPOOL_HPP
+#define NDBUFFERPOOL_HPP
+#pragma once
+
+#include <ndsupport.h>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <span>
+#include <vector>
+
+// A buffer handed out by NDBufferPool, already registered.
+struct NDBuffer {
+    void* Data = nullptr;
+    ULONG Capacity = 0;
+    UINT32 Token = 0;   // MemoryRegionToken of the region it lives in
+
+    explicit operator bool() const { return Data != nullptr; }
+    ND2_SGE Sge(ULONG length) const { return { Data, length, Token }; }
+    ND2_SGE Sge() const { return Sge(Capacity); }
+};
+
+// Registered memory split into fixed-size buffers. Each size class is one
+// region, registered once and carved into cache-line-aligned slots, so any
+// number of variable-size messages can be in flight without registering per
+// message or sharing a buffer.
+//
+// Allocate and Free are lock-free and may be called from any thread. Each
+// thread keeps a small cache of slots per class and only touches the shared
+// free lists to refill or spill half of it. A cache holds at most an eighth of
+// its class, so one thread cannot drain a small class; classes of fewer than
+// eight slots are not cached at all. Up to MaxThreadCaches threads alive at
+// once get a cache, and any more go to the shared lists directly. A thread
+// that exits returns its cached slots to every open pool and frees its cache
+// for the next thread.
+class NDBufferPool {
+    public:
+    struct SizeClass {
+        ULONG Size;     // rounded up to a multiple of CacheLine
+        ULONG Count;
+    };
+    // 64 bytes to 1MB in powers of four, 16MB in total.
+    static constexpr std::array<SizeClass, 8> DefaultClasses = { {
+        { 64, 16384 }, { 256, 8192 }, { 1024, 4096 }, { 4096, 1024 },
+        { 16384, 256 }, { 65536, 64 }, { 262144, 16 }, { 1048576, 4 },
+    } };
+
+    static constexpr ULONG CacheLine = 64;
+    static constexpr ULONG MaxClasses = 16;
+    static constexpr ULONG MaxThreadCaches = 64;
+
+    NDBufferPool();
+    ~NDBufferPool();
+    NDBufferPool(const NDBufferPool&) = delete;
+    NDBufferPool& operator=(const NDBufferPool&) = delete;
+
+    // Allocates and registers one region per class with the given ND_MR_FLAG_* flags,
+    // on numaNode when it is not -1.
+    HRESULT Initialize(IND2Adapter* pAdapter, HANDLE hAdapterFile, ULONG flags,
+        std::span<const SizeClass> classes = DefaultClasses, LONG numaNode = -1);
+    // Deregisters and frees every region. Buffers must no longer be in use.
+    void Close();
+
+    // Returns a buffer from the smallest class that fits and still has a free
+    // slot, or an empty NDBuffer when none does.
+    NDBuffer Allocate(size_t size);
+    void Free(const void* pData);
+    void Free(const NDBuffer& buffer) { Free(buffer.Data); }
+
+    bool IsInitialized() const { return m_ClassCount != 0; }
+    ULONG ClassCount() const { return m_ClassCount; }
+    ULONG ClassSize(ULONG sizeClass) const { return m_Classes[sizeClass].Size; }
+
+    private:
+    static constexpr UINT32 NoSlot = 0xFFFFFFFF;
+    static constexpr ULONG ThreadCacheSlots = 32;
+
+    // Treiber stack of slot indices; the top 32 bits of Head count pushes
+    // so a slot popped and pushed back between a load and a CAS is noticed.
+    struct alignas(CacheLine) Class {
+        ULONG Size = 0;
+        ULONG Count = 0;
+        char* pBase = nullptr;
+        IND2MemoryRegion* pMr = nullptr;
+        UINT32 Token = 0;
+        ULONG CacheSlots = 0;   // most slots one thread may cache
+        std::unique_ptr<std::atomic<UINT32>[]> pNext;
+        std::atomic<UINT64> Head{ NoSlot };
+    };
+
+    struct alignas(CacheLine) ThreadCache {
+        std::array<std::array<UINT32, ThreadCacheSlots>, MaxClasses> Slots;
+        std::array<ULONG, MaxClasses> Count{};
+    };
+
+    // Owns the calling thread's cache index; defined with the pool.
+    struct ThreadIndex;
+
+    static UINT32 Pop(Class& sizeClass);
+    static void Push(Class& sizeClass, UINT32 slot);
+    ThreadCache* GetThreadCache();
+    // Returns every slot cached under index to the shared lists.
+    void FlushThreadCache(ULONG index);
+    bool Take(ULONG classIndex, UINT32* pSlot);
+
+    std::array<Class, MaxClasses> m_Classes;
+    ULONG m_ClassCount = 0;
+    std::unique_ptr<ThreadCache[]> m_ThreadCaches;
+    OVERLAPPED m_Ov;
+};
+
+#endif // NDBUFFERPOOL_HPP
@@ -0,0 +1,58 @@
+#ifndef NDDISPATCHER_HPP
+#define NDDISPATCHER_HPP
+#pragma once
+
+#include <ndsupport.h>
+#include <functional>
+#include <vector>
+
+// Routes completions to per-request handlers. Each posted request takes a
+// record from a slab allocated up front, and the record's index and generation
+// travel in ND2_RESULT::RequestContext, so requests may complete in any order
+// and a stale or foreign context is never mistaken for a live one.
+// Like the rest of NDSession it is meant to be driven from a single thread.
+class NDDispatcher {
+    public:
+    // std::function keeps small captures inline, up to two pointers in
+    // libstdc++; other standard libraries set their own limits, and larger
+    // captures allocate when the request is tracked.
+    using Handler = std::function<void(const ND2_RESULT& result)>;
+
+    explicit NDDispatcher(ULONG capacity = 4096);
+
+    // Returns the RequestContext to post with, or nullptr if every record is in use.
+    void* Track(Handler handler);
+    // Releases a record whose request was never posted.
+    void Cancel(void* requestContext);
+    // Runs and releases the handler the context belongs to. Returns false only
+    // for contexts the dispatcher did not issue; a stale one, whose request has
+    // already completed, is counted in StaleCompletions and consumed.
+    bool Dispatch(const ND2_RESULT& result);
+
+    static bool IsTracked(const void* requestContext);
+    // Whether the context belongs to a request that has not completed yet.
+    bool IsOutstanding(const void* requestContext) const;
+    ULONG Outstanding() const { return m_Outstanding; }
+    ULONG Capacity() const { return static_cast<ULONG>(m_Records.size()); }
+    UINT64 StaleCompletions() const { return m_StaleCompletions; }
+
+    private:
+    struct Record {
+        Handler OnComplete;
+        UINT32 Generation = 0;
+        UINT32 NextFree = 0;
+        bool InUse = false;
+    };
+
+    Record* Find(const void* requestContext, UINT32* pIndex);
+    void Release(UINT32 index);
+
+    static constexpr UINT32 NoRecord = 0xFFFFFFFF;
+
+    std::vector<Record> m_Records;
+    UINT32 m_FreeHead = NoRecord;
+    ULONG m_Outstanding = 0;
+    UINT64 m_StaleCompletions = 0;
+};
+
+#endif // NDDISPATCHER_HPP
@@ -0,0 +1,53 @@
+#ifndef NDMEMORY_HPP
+#define NDMEMORY_HPP
+#pragma once
+
+#include <winsock2.h>
+#include <ndsupport.h>
+
+// Where an adapter sits: its NUMA node and the cores on that node. DMA to
+// memory on another socket crosses the interconnect, so registered buffers
+// and the threads that handle completions belong on this node.
+struct NDLocality {
+    LONG NumaNode = -1;         // -1 when the platform does not say
+    USHORT Group = 0;           // processor group of the node's cores
+    KAFFINITY Affinity = 0;     // the node's cores within Group; 0 means any core
+
+    bool IsKnown() const { return NumaNode >= 0; }
+};
+
+// Page-granular memory for registration, placed on a chosen NUMA node.
+// Pages come from the OS already zero, so there is never a zeroing pass of
+// our own; a caller that fills the buffer itself can also skip Prefault and
+// let its own writes fault the pages in.
+class NDMemory {
+    public:
+    // Flags for Allocate; Free must be given the same ones.
+    // Back the buffer with large pages, so the adapter needs far fewer
+    // translations for it. Windows needs SeLockMemoryPrivilege and Linux
+    // reserved huge pages; without them it falls back to transparent huge
+    // pages on Linux and to small pages on Windows. Ignored below one large page.
+    static constexpr ULONG LargePages = 0x1;
+    // Fault in every page before returning, from several threads when the
+    // buffer is large.
+    static constexpr ULONG Prefault = 0x2;
+
+    // Finds the adapter that owns the address. On Windows the node comes from
+    // the network device's properties, elsewhere from sysfs; a software or
+    // virtual adapter has none and yields an unknown locality.
+    static NDLocality QueryLocality(const sockaddr_in& address);
+
+    // Zeroed, page-aligned memory. With a node it is bound there, preferably,
+    // and with Prefault it is resident on that node before it is registered.
+    static void* Allocate(SIZE_T length, LONG numaNode = -1, ULONG flags = Prefault);
+    static void Free(void* pBuffer, SIZE_T length, ULONG flags = Prefault);
+
+    // Size of one large page, or 0 when the platform has none.
+    static SIZE_T LargePageSize();
+
+    // Restricts the calling thread to the cores near the adapter. Does
+    // nothing and returns false when they are unknown.
+    static bool BindCurrentThread(const NDLocality& locality);
+};
+
+#endif // NDMEMORY_HPP
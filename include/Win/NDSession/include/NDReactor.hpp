@@ -0,0 +1,97 @@
+#ifndef NDREACTOR_HPP
+#define NDREACTOR_HPP
+#pragma once
+
+#include <ndsupport.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+class NDSessionBase;
+
+// Serves the CQs of many sessions from one thread. Every registered CQ stays
+// armed with Notify, and all the notifications land on one wait primitive: an
+// I/O completion port on Windows, epoll over each CQ's eventfd-backed event
+// elsewhere. A wait therefore returns exactly the sessions with completions,
+// however many are registered. Each of those is drained in batches: tracked
+// requests go to their handlers as in DispatchCompletions, and completions
+// posted with a plain context go to the handler the session was registered
+// with. The CQ is then armed again.
+//
+// Run one reactor per thread, usually one per core, and give each its share of
+// the sessions. A registered session belongs to its reactor's thread: only
+// that thread may post on it or register and unregister it, and it must not
+// make blocking waits or be attached to an NDEventLoop as well. On Windows
+// the port is bound to each session's adapter file, so the session's own
+// overlapped requests reach the port too; the reactor ignores them. That
+// binding lasts as long as the file, so once registered a session can only
+// be registered again with the same reactor.
+class NDReactor {
+    public:
+    // Completions of one batch that no tracked request claimed.
+    using CompletionHandler = std::function<void(NDSessionBase& session, std::span<const ND2_RESULT> results)>;
+
+    struct Stats {
+        UINT64 Wakeups = 0;         // waits that returned at least one session
+        UINT64 Services = 0;        // sessions drained and re-armed
+        UINT64 Completions = 0;
+    };
+
+    NDReactor();
+    ~NDReactor();
+    NDReactor(const NDReactor&) = delete;
+    NDReactor& operator=(const NDReactor&) = delete;
+
+    bool IsInitialized() const;
+
+    // The session's CQ must exist. It unregisters itself when destroyed, but
+    // not from inside one of its own handlers. On Windows, fails with
+    // ND_INVALID_DEVICE_STATE for a session once registered with another reactor.
+    HRESULT Register(NDSessionBase& session, CompletionHandler onCompletions = nullptr);
+    void Unregister(NDSessionBase& session);
+    size_t Sessions() const { return m_Sources.size(); }
+
+    // Waits up to timeoutMs for sessions with completions and drains them.
+    // Returns the number of completions handled.
+    ULONG RunOnce(DWORD timeoutMs = INFINITE);
+    // Runs until Stop. Stop may be called from any thread.
+    void Run();
+    void Stop();
+
+    const Stats& GetStats() const { return m_Stats; }
+
+    private:
+    struct Source {
+        NDSessionBase* pSession = nullptr;
+        IND2CompletionQueue* pCq = nullptr;
+        CompletionHandler OnCompletions;
+        OVERLAPPED NotifyOv = {};
+        bool Armed = false;
+    };
+
+    static constexpr ULONG Batch = 64;
+    static constexpr ULONG MaxEvents = 64;
+
+    ULONG Service(Source& source);
+    ULONG Drain(Source& source);
+    void Disarm(Source& source);
+
+    std::vector<std::unique_ptr<Source>> m_Sources;
+    // Notifications name their OVERLAPPED, which may belong to a session
+    // that has since unregistered; only these are live.
+    std::unordered_map<OVERLAPPED*, Source*> m_ByOverlapped;
+    std::atomic<bool> m_Stopping{ false };
+    Stats m_Stats;
+
+    #ifdef _WIN32
+    HANDLE m_hPort = nullptr;
+    #else
+    int m_Epoll = -1;
+    HANDLE m_hWake = nullptr;   // set by Stop
+    #endif
+};
+
+#endif // NDREACTOR_HPP
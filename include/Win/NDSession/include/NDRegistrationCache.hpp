@@ -0,0 +1,106 @@
+#ifndef NDREGISTRATIONCACHE_HPP
+#define NDREGISTRATIONCACHE_HPP
+#pragma once
+
+#include <ndsupport.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Pin-down cache for buffers the application owns. Registrations are kept
+// after use and found again by address range, so sending from the same memory
+// twice registers it once.
+//
+// The indexed regions never overlap: a miss registers the page-aligned union
+// of the request and every cached region it overlaps or touches, and takes
+// those out of the index. An ordered map keyed by start address is therefore
+// a complete interval index, and a lookup is a single upper_bound. Merged-over
+// regions that are still in use are retired and deregistered on their last
+// Release. Unused regions are evicted least recently used first whenever the
+// registered total exceeds the byte budget.
+//
+// The cache cannot see memory being freed. Before the application frees or
+// unmaps a buffer it has passed to Acquire, it must call Invalidate on it;
+// otherwise a later buffer at the same address hits a registration of pages
+// that are gone, and a miss can merge a new range with one.
+//
+// Like the rest of NDSession it is meant to be driven from a single thread.
+class NDRegistrationCache {
+    struct Region;
+
+    public:
+    // Keeps its region registered until passed to Release.
+    class Handle {
+        public:
+        Handle() = default;
+        explicit operator bool() const { return m_pRegion != nullptr; }
+        UINT32 Token() const { return m_Token; }
+
+        private:
+        friend class NDRegistrationCache;
+        Handle(Region* pRegion, UINT32 token) : m_pRegion(pRegion), m_Token(token) {}
+        Region* m_pRegion = nullptr;
+        UINT32 m_Token = 0;
+    };
+
+    struct Stats {
+        UINT64 Hits = 0;
+        UINT64 Misses = 0;
+        UINT64 Evictions = 0;
+        UINT64 Merges = 0;          // cached regions folded into a larger one
+        UINT64 Invalidations = 0;   // regions dropped by Invalidate
+        UINT64 RegisteredBytes = 0;
+    };
+
+    NDRegistrationCache() = default;
+    ~NDRegistrationCache();
+    NDRegistrationCache(const NDRegistrationCache&) = delete;
+    NDRegistrationCache& operator=(const NDRegistrationCache&) = delete;
+
+    HRESULT Initialize(IND2Adapter* pAdapter, HANDLE hAdapterFile, ULONG flags, UINT64 byteBudget);
+    // Deregisters everything. No handle may be outstanding.
+    void Close();
+
+    // Finds or creates a registration covering [pBuf, pBuf + length).
+    HRESULT Acquire(const void* pBuf, SIZE_T length, Handle* pHandle);
+    void Release(Handle& handle);
+    // Drops every registration overlapping [pBuf, pBuf + length). Unused ones
+    // are deregistered now, ones still held when their last handle is released.
+    void Invalidate(const void* pBuf, SIZE_T length);
+
+    // Opaque form of a handle, for carrying it in a RequestContext.
+    static void* ToContext(const Handle& handle) { return handle.m_pRegion; }
+    static Handle FromContext(void* requestContext);
+
+    bool IsInitialized() const { return m_pAdapter != nullptr; }
+    const Stats& GetStats() const { return m_Stats; }
+
+    private:
+    struct Region {
+        UINT64 Start = 0;
+        UINT64 End = 0;
+        IND2MemoryRegion* pMr = nullptr;
+        UINT32 Token = 0;
+        ULONG References = 0;
+        bool Retired = false;
+        std::list<Region*>::iterator Unused;    // position in m_Lru while References == 0
+    };
+
+    HRESULT Register(UINT64 start, UINT64 end, std::unique_ptr<Region>* ppRegion);
+    void Deregister(Region& region);
+    void Evict();
+
+    IND2Adapter* m_pAdapter = nullptr;
+    HANDLE m_hAdapterFile = nullptr;
+    ULONG m_Flags = 0;
+    UINT64 m_ByteBudget = 0;
+    OVERLAPPED m_Ov = {};
+
+    std::map<UINT64, std::unique_ptr<Region>> m_Index;
+    std::vector<std::unique_ptr<Region>> m_Retired;
+    std::list<Region*> m_Lru;   // unused indexed regions, least recently used first
+    Stats m_Stats;
+};
+
+#endif // NDREGISTRATIONCACHE_HPP
@@ -0,0 +1,88 @@
+#ifndef NDSEGMENTEDREGION_HPP
+#define NDSEGMENTEDREGION_HPP
+#pragma once
+
+#include <ndsupport.h>
+#include <memory>
+
+// One logical registration of a buffer too large to register as a single
+// memory region. Registering pins and translates every page, so one huge
+// Register is slow, runs on one thread and is capped by the adapter's
+// MaxRegistrationSize and by 32-bit lengths elsewhere in the stack. The
+// buffer is instead cut into segments of equal size, each registered as its
+// own region, and worker threads register the segments concurrently.
+//
+// Segments are equal, so finding the one under an offset is a division.
+// Map and BuildSges turn an (offset, length) range into one piece per
+// segment it touches. A remote operation cannot cross a segment boundary,
+// so the peer must issue one per piece.
+class NDSegmentedRegion {
+    public:
+    // Segments are a whole number of pages.
+    static constexpr SIZE_T SegmentAlignment = 4096;
+    static constexpr SIZE_T DefaultSegmentSize = 256 * 1024 * 1024;
+
+    struct Segment {
+        char* pBase = nullptr;
+        SIZE_T Length = 0;
+        IND2MemoryRegion* pMr = nullptr;
+        bool Registered = false;    // tokens are only valid while set; 0 is a valid token
+        UINT32 LocalToken = 0;
+        UINT32 RemoteToken = 0;     // 0 unless registered with a remote flag
+    };
+
+    // The part of a range that lies in one segment.
+    struct Piece {
+        char* pAddress = nullptr;
+        ULONG Length = 0;
+        UINT32 LocalToken = 0;
+        UINT32 RemoteToken = 0;
+    };
+
+    NDSegmentedRegion() = default;
+    ~NDSegmentedRegion();
+    NDSegmentedRegion(const NDSegmentedRegion&) = delete;
+    NDSegmentedRegion& operator=(const NDSegmentedRegion&) = delete;
+
+    // Registers [pBuffer, pBuffer + length) with the given ND_MR_FLAG_* flags.
+    // segmentSize is rounded up to SegmentAlignment and capped by the
+    // adapter's MaxRegistrationSize and by ULONG; 0 picks DefaultSegmentSize.
+    // threads 0 uses one per core, never more than there are segments. When
+    // any segment fails, the others are deregistered and its error returned.
+    HRESULT Register(IND2Adapter* pAdapter, HANDLE hAdapterFile, void* pBuffer, UINT64 length, ULONG flags,
+        SIZE_T segmentSize = 0, ULONG threads = 0);
+    // Deregisters every segment, from as many threads as registered them.
+    void Deregister();
+
+    // Splits [offset, offset + length) into at most maxPieces pieces. Returns
+    // how many it wrote, or 0 when the range is empty, out of bounds, or
+    // spans more segments than maxPieces.
+    ULONG Map(UINT64 offset, UINT64 length, Piece* pPieces, ULONG maxPieces) const;
+    // Map as scatter-gather entries for a local work request.
+    ULONG BuildSges(UINT64 offset, UINT64 length, ND2_SGE* pSges, ULONG maxSge) const;
+
+    bool IsRegistered() const { return m_SegmentCount != 0; }
+    void* Base() const { return m_pBase; }
+    UINT64 Length() const { return m_Length; }
+    SIZE_T SegmentSize() const { return m_SegmentSize; }
+    ULONG SegmentCount() const { return m_SegmentCount; }
+    const Segment& GetSegment(ULONG index) const { return m_Segments[index]; }
+
+    private:
+    // The segments a valid range starts and ends in.
+    bool Span(UINT64 offset, UINT64 length, ULONG maxPieces, ULONG* pFirst, ULONG* pLast) const;
+    Piece Slice(ULONG index, UINT64 offset, UINT64 end) const;
+    // Runs work on every segment from threads threads, each with its own
+    // OVERLAPPED, and returns the first failure; no segment is started after it.
+    template <typename Work>
+    HRESULT ForEachSegment(ULONG threads, Work work);
+
+    char* m_pBase = nullptr;
+    UINT64 m_Length = 0;
+    SIZE_T m_SegmentSize = 0;
+    ULONG m_SegmentCount = 0;
+    ULONG m_Threads = 1;
+    std::unique_ptr<Segment[]> m_Segments;
+};
+
+#endif // NDSEGMENTEDREGION_HPP
@@ -2,14 +2,78 @@
 #define NDSESSION_HPP
 #pragma once
 
-#include <WinSock2.h>
-#include <WS2tcpip.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <ndsupport.h>
+#include "NDAsync.hpp"
+#include "NDBufferPool.hpp"
+#include "NDDispatcher.hpp"
+#include "NDMemory.hpp"
+#include "NDReactor.hpp"
+#include "NDRegistrationCache.hpp"
+#include "NDSegmentedRegion.hpp"
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <span>
 #include <variant>
+#include <vector>
 #include <iostream>
+#include <memory>
+#include <optional>
+
+class NDConnection;
+
+// Connection parameters carried in the private data of Connect and Accept, so
+// each side knows the other's buffer and limits as soon as the connection is
+// up, without a message round trip of its own. It fits the 56 bytes of caller
+// data every provider accepts. Fields are only ever appended; Version changes
+// when the meaning of an existing one does.
+struct NDHandshake {
+    static constexpr UINT32 Magic = 0x4853444E;     // "NDSH"
+    static constexpr UINT16 CurrentVersion = 1;
+
+    UINT32 Signature = Magic;
+    UINT16 Version = CurrentVersion;
+    UINT16 Reserved = 0;
+    UINT64 BufferAddress = 0;
+    UINT64 BufferLength = 0;
+    UINT32 BufferToken = 0;     // remote token of the MR or MW covering the buffer
+    UINT32 ReceiveCredits = 0;  // receives the sender keeps posted for its peer
+    UINT32 MaxMessageSize = 0;  // largest Send the sender's receives take
+    UINT32 Reserved2 = 0;
+};
+static_assert(sizeof(NDHandshake) <= 56, "NDHandshake must fit the caller private data limit");
 
 class NDSessionBase {
+    friend class NDEventLoop;
+    friend class NDReactor;
+
     public:
+    // How WaitForCompletions behaves when the CQ is empty.
+    enum class CompletionWait {
+        Poll,           // return 0 immediately
+        Block,          // arm the CQ and sleep until something completes
+        SpinThenBlock,  // poll for an adaptive budget before sleeping
+    };
+
+    // How often blocking waits were satisfied while spinning versus sleeping
+    // on Notify and the event.
+    struct WaitStats {
+        UINT64 SpinHits = 0;
+        UINT64 EventWaits = 0;
+        std::chrono::nanoseconds SpinBudget{ 0 };
+    };
+
+    WaitStats GetWaitStats() const {
+        return { m_SpinHits, m_EventWaits, m_SpinBudget };
+    }
+    void ResetWaitStats() {
+        m_SpinHits = 0;
+        m_EventWaits = 0;
+    }
+
     void CheckForOPs() {
         ND2_RESULT ndRes = WaitForCompletion(ND_CQ_NOTIFY_ANY, false);
         if (ndRes.Status != ND_PENDING) {
@@ -26,13 +90,46 @@ class NDSessionBase {
     IND2QueuePair *m_pQp;
     IND2Connector *m_pConnector;
     HANDLE m_hAdapterFile;
-    DWORD m_Buf_Len;
+    SIZE_T m_Buf_Len;
     void* m_Buf;
+    ULONG m_Buf_Flags = NDMemory::Prefault;     // NDMemory flags m_Buf was allocated with
     IND2MemoryWindow *m_pMw;
     OVERLAPPED m_Ov;
 
+    // Largest piece the *Large operations post, from the adapter's MaxTransferLength.
     size_t m_MaxPerTransfer = 1500;
 
+    // Filled in by Initialize. Registered memory the session allocates lives
+    // on this node, and its CQs and SRQ notify on this node's cores.
+    NDLocality m_Locality;
+
+    NDDispatcher m_Dispatcher;
+    // Set while attached to an NDEventLoop, which the *Async operations need.
+    NDEventLoop* m_pLoop = nullptr;
+    // Set while registered with an NDReactor.
+    NDReactor* m_pReactor = nullptr;
+    #ifdef _WIN32
+    // The completion port m_hAdapterFile was bound to by the first NDReactor
+    // it was registered with. A handle cannot be bound to another port.
+    HANDLE m_hAdapterPort = nullptr;
+    #endif
+
+    // Empty until CreateBufferPool; lives alongside m_Buf and its MR.
+    NDBufferPool m_BufferPool;
+    // Registrations of application-owned buffers; empty until CreateRegistrationCache.
+    NDRegistrationCache m_RegistrationCache;
+
+    // Null until CreateSRQ.
+    IND2SharedReceiveQueue *m_pSrq = nullptr;
+
+    // Blocking single-result waits spin first; set to Block to always sleep.
+    CompletionWait m_BlockingWait = CompletionWait::SpinThenBlock;
+
+    // Send and Write add ND_OP_FLAG_INLINE when the payload fits under
+    // m_InlineThreshold, which CreateQP derives from the adapter's limits.
+    bool m_AutoInline = true;
+    ULONG m_InlineThreshold = 0;
+
     protected:
     NDSessionBase();
     ~NDSessionBase();
@@ -44,15 +141,48 @@ class NDSessionBase {
     HRESULT InvalidateMW();
     
     ND2_ADAPTER_INFO GetAdapterInfo();
+    const NDLocality& GetAdapterLocality() const { return m_Locality; }
+    // The processor group and cores the main CQ's notifications are steered to.
+    HRESULT GetNotifyAffinity(USHORT* pGroup, KAFFINITY* pAffinity);
 
     HRESULT CreateMR();
-    HRESULT RegisterDataBuffer(DWORD bufferLength, ULONG type);
-    HRESULT RegisterDataBuffer(void *pBuffer, DWORD bufferLength, ULONG type);
+    // Allocates m_Buf with the given NDMemory flags and registers it. Without
+    // Prefault the caller's first writes fault the pages in, which is cheapest
+    // for a buffer it fills anyway.
+    HRESULT RegisterDataBuffer(SIZE_T bufferLength, ULONG type, ULONG allocation = 0);
+    HRESULT RegisterDataBuffer(void *pBuffer, SIZE_T bufferLength, ULONG type);
+    HRESULT CreateBufferPool(ULONG type = ND_MR_FLAG_ALLOW_LOCAL_WRITE,
+        std::span<const NDBufferPool::SizeClass> classes = NDBufferPool::DefaultClasses);
+    HRESULT CreateRegistrationCache(UINT64 byteBudget = 256ULL * 1024 * 1024, ULONG type = ND_MR_FLAG_ALLOW_LOCAL_WRITE);
+    // Registers a buffer of any size on this adapter as several regions at once; see NDSegmentedRegion.
+    HRESULT RegisterSegmented(NDSegmentedRegion* pRegion, void* pBuffer, UINT64 length, ULONG type,
+        SIZE_T segmentSize = 0, ULONG threads = 0);
     HRESULT CreateCQ(DWORD depth);
     HRESULT CreateCQ(IND2CompletionQueue **pCq, DWORD depth);
     HRESULT CreateConnector();
-    HRESULT CreateQP(DWORD queueDepth, DWORD nSge, DWORD inlineDataSize = 0);
-    HRESULT CreateQP(DWORD receiveQueueDepth, DWORD initiatorQueueDepth, DWORD maxReceiveRequestSge, DWORD maxInitiatorRequestSge);
+    // AdapterInlineSize asks for the adapter's MaxInlineDataSize.
+    static constexpr DWORD AdapterInlineSize = 0xFFFFFFFF;
+    HRESULT CreateQP(DWORD queueDepth, DWORD nSge, DWORD inlineDataSize = AdapterInlineSize);
+    HRESULT CreateQP(DWORD receiveQueueDepth, DWORD initiatorQueueDepth, DWORD maxReceiveRequestSge, DWORD maxInitiatorRequestSge,
+        DWORD inlineDataSize = AdapterInlineSize);
+    DWORD ResolveInlineSize(DWORD inlineDataSize);
+    void SetInlineThreshold(DWORD inlineDataSize);
+
+    // Shared receive queue for every QP made with CreateQPWithSrq. Its buffers
+    // come from a pool of exactly `depth` slots of bufferSize bytes, so receive
+    // memory stays the same however many connections share it. onReceive runs
+    // from DispatchCompletions with the buffer each message landed in, which
+    // goes back to the pool when it returns. Whenever fewer than lowWater
+    // receives remain posted the SRQ is topped back up to depth in one batch;
+    // lowWater 0 tops it up after every completion.
+    // Posted receives count against the dispatcher's capacity.
+    using ReceiveHandler = std::function<void(const ND2_RESULT& result, const NDBuffer& buffer)>;
+    HRESULT CreateSRQ(ULONG depth, ULONG bufferSize, ULONG lowWater, ReceiveHandler onReceive);
+    HRESULT CreateQPWithSrq(DWORD initiatorQueueDepth, DWORD nSge, DWORD inlineDataSize = AdapterInlineSize);
+    HRESULT CreateQPWithSrq(IND2QueuePair** ppQp, DWORD initiatorQueueDepth, DWORD nSge, DWORD inlineDataSize = AdapterInlineSize);
+    // Posts receives until depth are outstanding.
+    HRESULT RefillSRQ();
+    ULONG SrqPosted() const { return m_SrqPosted; }
 
     void ClearOPs();
     
@@ -69,21 +199,395 @@ class NDSessionBase {
     HRESULT Write(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags, void *requestContext = nullptr);
     HRESULT Read(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags, void *requestContext = nullptr);
 
+    // Same operations with a completion handler run by DispatchCompletions or
+    // WaitForCompletion, so any number of them can be in flight at once.
+    HRESULT PostReceive(const ND2_SGE* Sge, const DWORD nSge, NDDispatcher::Handler handler);
+    HRESULT Send(const ND2_SGE* Sge, const ULONG nSge, ULONG flags, NDDispatcher::Handler handler);
+    HRESULT Write(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags, NDDispatcher::Handler handler);
+    HRESULT Read(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags, NDDispatcher::Handler handler);
+    // The same on one of the connections a server accepted with StartAccepting.
+    HRESULT PostReceive(NDConnection& connection, const ND2_SGE* Sge, const DWORD nSge, NDDispatcher::Handler handler);
+    HRESULT Send(NDConnection& connection, const ND2_SGE* Sge, const ULONG nSge, ULONG flags, NDDispatcher::Handler handler);
+
+    // Selectively signaled Sends, Writes and Reads on the main QP. Only every
+    // SignalInterval-th asks for a completion; the rest are posted with
+    // ND_OP_FLAG_SILENT_SUCCESS, so the CQ carries one entry per interval.
+    // Requests on a QP complete in order, so once a signaled one completes
+    // every silent one posted before it has succeeded: their handlers run
+    // then, oldest first and ahead of its own, and only then may their
+    // buffers be reused. A silent request that fails, or is flushed, still
+    // completes on its own with its error. The last request of a stream must
+    // be posted with last set, which always signals, or the silent ones
+    // before it never finish. Silent requests hold their initiator queue
+    // slots until then, so the interval must not exceed the queue depth.
+    void SetSignalInterval(ULONG interval) { m_SignalInterval = std::max<ULONG>(interval, 1); }
+    ULONG SignalInterval() const { return m_SignalInterval; }
+    HRESULT SendSelective(const ND2_SGE* Sge, const ULONG nSge, ULONG flags, NDDispatcher::Handler handler, bool last = false);
+    HRESULT WriteSelective(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags,
+        NDDispatcher::Handler handler, bool last = false);
+    HRESULT ReadSelective(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags,
+        NDDispatcher::Handler handler, bool last = false);
+    // Silent requests still waiting for a signaled one to complete.
+    size_t SilentOutstanding() const { return m_Silent.size(); }
+
+    // Harvests a batch and runs the handlers of the requests it completes.
+    // Stops at the first completion posted with a plain context and leaves it
+    // for WaitForCompletion. Returns the number of tracked completions
+    // consumed, stale ones included.
+    ULONG DispatchCompletions(CompletionWait mode = CompletionWait::Block);
+
+    // Awaitable forms of the handler operations, for coroutines driven by the
+    // NDEventLoop the session is attached to. Each is posted before it returns
+    // and resumes the awaiting coroutine from the loop; see NDCompletion.
+    NDCompletion PostReceiveAsync(const ND2_SGE* Sge, const DWORD nSge) {
+        return NDCompletion([&](NDDispatcher::Handler handler) { return PostReceive(Sge, nSge, std::move(handler)); });
+    }
+    NDCompletion SendAsync(const ND2_SGE* Sge, const ULONG nSge, ULONG flags) {
+        return NDCompletion([&](NDDispatcher::Handler handler) { return Send(Sge, nSge, flags, std::move(handler)); });
+    }
+    NDCompletion WriteAsync(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags) {
+        return NDCompletion([&](NDDispatcher::Handler handler) {
+            return Write(Sge, nSge, remoteAddr, remoteToken, flags, std::move(handler));
+        });
+    }
+    NDCompletion ReadAsync(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags) {
+        return NDCompletion([&](NDDispatcher::Handler handler) {
+            return Read(Sge, nSge, remoteAddr, remoteToken, flags, std::move(handler));
+        });
+    }
+    NDCompletion BindAsync(const void* pBuf, SIZE_T bufferLength, ULONG flags) {
+        return NDCompletion([&](NDDispatcher::Handler handler) { return Bind(pBuf, bufferLength, flags, std::move(handler)); });
+    }
+
+    // Transfers of any length, split into pieces of at most m_MaxPerTransfer
+    // bytes with up to `depth` of them in flight. onComplete runs once, after
+    // the last piece, with the first failing status if any piece failed;
+    // BytesTransferred saturates at 4GB. Pieces complete through
+    // DispatchCompletions like any other handler request. SendLarge sends one
+    // message per piece, so the peer needs LargePieces(length) receives posted.
+    static constexpr ULONG DefaultLargeDepth = 8;
+    HRESULT WriteLarge(const void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+        NDDispatcher::Handler onComplete, ULONG depth = DefaultLargeDepth);
+    HRESULT ReadLarge(void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+        NDDispatcher::Handler onComplete, ULONG depth = DefaultLargeDepth);
+    HRESULT SendLarge(const void* pBuf, UINT64 length, UINT32 localToken, NDDispatcher::Handler onComplete,
+        ULONG depth = DefaultLargeDepth);
+    UINT64 LargePieces(UINT64 length) const;
+
+    // Striped transfers spread one Read or Write over extra queue pairs to the
+    // same peer, each with its own CQ, so a single transfer is not limited to
+    // what one QP can drive. Lanes come from CreateStripes and are connected
+    // with AcceptStripes or ConnectStripes after the main connection. When
+    // one lane fails to connect, the lanes before it are disconnected again.
+    enum class StripePolicy {
+        RoundRobin,     // piece i goes to lane i % lanes
+        BySize,         // each lane takes one contiguous share of the buffer
+    };
+    struct StripeOptions {
+        StripePolicy Policy = StripePolicy::RoundRobin;
+        UINT64 Unit = 0;        // bytes per piece; 0 gives every lane Depth pieces, at least MinStripeUnit each
+        ULONG Depth = DefaultLargeDepth;    // pieces in flight per lane
+        ULONG Lanes = 0;        // lanes to use; 0 uses all of them
+    };
+    static constexpr UINT64 MinStripeUnit = 4096;
+
+    HRESULT CreateStripes(ULONG count, DWORD queueDepth);
+    ULONG StripeCount() const { return static_cast<ULONG>(m_Stripes.size()); }
+    // onComplete runs once, as for the *Large operations. Pieces complete
+    // through DispatchStripes, not DispatchCompletions.
+    HRESULT WriteStriped(const void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+        NDDispatcher::Handler onComplete, const StripeOptions& options);
+    HRESULT ReadStriped(void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+        NDDispatcher::Handler onComplete, const StripeOptions& options);
+    HRESULT WriteStriped(const void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+        NDDispatcher::Handler onComplete) {
+        return WriteStriped(pBuf, length, localToken, remoteAddr, remoteToken, std::move(onComplete), StripeOptions());
+    }
+    HRESULT ReadStriped(void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+        NDDispatcher::Handler onComplete) {
+        return ReadStriped(pBuf, length, localToken, remoteAddr, remoteToken, std::move(onComplete), StripeOptions());
+    }
+    // Polls every lane's CQ once and, unless mode is Poll, waits on all of
+    // them until something completes. Returns the number of handlers run.
+    ULONG DispatchStripes(CompletionWait mode = CompletionWait::Block);
+
+    // Credit-based message channel over the main QP. Each side keeps Depth
+    // receives posted and sends only while the peer has one free for it, so a
+    // fast sender can never overrun a slow receiver. Credits for consumed
+    // receives go back in the header of every outgoing message, or in an
+    // explicit update once CreditBatch have built up with nothing to carry
+    // them. One credit is held back for those updates, so both sides can
+    // never run dry at once. ChannelSend copies the message into a registered
+    // slot; without credits the slot waits in a backlog of at most Backlog
+    // messages that drains as credits return, and once that is full
+    // ChannelSend fails with ND_INSUFFICIENT_RESOURCES until completions are
+    // dispatched. Everything completes through DispatchCompletions, and once
+    // the channel exists it must carry every message on the QP.
+    struct ChannelOptions {
+        ULONG Depth = 64;           // receives this side keeps posted, at least 3
+        ULONG PeerDepth = 0;        // receives the peer really keeps posted; 0 means the same as Depth
+        ULONG MessageSize = 4096;   // largest payload
+        ULONG CreditBatch = 0;      // credits owed before an explicit update, 2 to Depth - 1; 0 means Depth / 4
+        ULONG Backlog = 64;         // sends that may wait for credits; 0 refuses any send without one
+    };
+    struct ChannelStats {
+        UINT64 Sent = 0;
+        UINT64 Received = 0;
+        UINT64 Queued = 0;          // sends that had to wait for credits
+        UINT64 CreditUpdates = 0;   // explicit updates sent
+    };
+    using MessageHandler = std::function<void(const void* pData, ULONG length)>;
+
+    // Posts the receives, so it has to run before the peer can send: after
+    // GetConnectionRequest on a server, between Connect and CompleteConnect on
+    // a client. PeerDepth is typically the peer's NDHandshake::ReceiveCredits.
+    HRESULT CreateChannel(const ChannelOptions& options, MessageHandler onMessage);
+    HRESULT ChannelSend(const void* pData, ULONG length);
+    ULONG ChannelCredits() const { return m_ChannelCredits; }
+    ULONG ChannelBacklog() const { return m_ChannelBacklogCount; }
+    const ChannelStats& GetChannelStats() const { return m_ChannelStats; }
+
+    // Message ring written straight into the peer's memory. Each side owns an
+    // inbound ring that the other RDMA-Writes length-prefixed records into,
+    // whole cache lines at a time, each ending in a valid byte. PollRing finds
+    // arrivals by watching for that byte, so a message costs the receiver no
+    // receive, no completion and no event. Consumed records are zeroed and the
+    // head is written back to the sender lazily, once feedbackBatch bytes
+    // have been freed. The rings are advertised in the connection handshake,
+    // so CreateRing comes before connecting and AttachRing after the peer's
+    // handshake arrives. The writes, which complete unseen by the peer, are
+    // reaped by PollRing.
+    static constexpr ULONG DefaultRingSize = 64 * 1024;
+    static constexpr ULONG RingLine = 64;   // records are whole lines; one more follows the ring for the peer's head
+    struct RingStats {
+        UINT64 Sent = 0;
+        UINT64 Received = 0;
+        UINT64 Full = 0;            // sends refused because the peer's ring had no room
+        UINT64 FeedbackWrites = 0;  // head updates written back to the peer
+    };
+    // ringSize is a power of two of at least 1KB; feedbackBatch is capped at
+    // a quarter of it, which is also the default.
+    HRESULT CreateRing(ULONG ringSize = DefaultRingSize, ULONG feedbackBatch = 0);
+    // The handshake advertising the inbound ring.
+    NDHandshake RingHandshake() const;
+    HRESULT AttachRing(const NDHandshake& peer);
+    // Fails with ND_INSUFFICIENT_RESOURCES while the peer's ring is full.
+    HRESULT RingSend(const void* pData, ULONG length);
+    // Runs onMessage for every record that has arrived, with the payload in
+    // place in the ring, and returns how many there were.
+    ULONG PollRing(const MessageHandler& onMessage);
+    ULONG RingMaxMessage() const { return m_PeerRingSize / 4 - RingLine; }
+    const RingStats& GetRingStats() const { return m_RingStats; }
+
     void WaitForEventNotification(ULONG notifyFlag);
     
+    // Harvests up to results.size() completions in one provider call and
+    // returns how many were written. Only CompletionWait::Poll can return 0.
+    ULONG WaitForCompletions(std::span<ND2_RESULT> results, CompletionWait mode = CompletionWait::Block,
+        ULONG notifyFlag = ND_CQ_NOTIFY_ANY);
+
+    // Returns the next completion posted with a plain context; completions of
+    // tracked requests met on the way are dispatched to their handlers.
     ND2_RESULT WaitForCompletion(ULONG notifyFlag, bool bBlocking = true);
     HRESULT WaitForCompletion();
 
     bool WaitForCompletionAndCheckContext(void *expectedContext, ULONG notifyFlag = ND_CQ_NOTIFY_ANY);
 
-    std::variant<HRESULT, ND2_RESULT> Bind(DWORD bufferLength, ULONG type, void *context = nullptr);
-    std::variant<HRESULT, ND2_RESULT> Bind(const void *pBuf, DWORD BufferLength, ULONG type, void *context = nullptr);
+    std::variant<HRESULT, ND2_RESULT> Bind(SIZE_T bufferLength, ULONG type, void *context = nullptr);
+    std::variant<HRESULT, ND2_RESULT> Bind(const void *pBuf, SIZE_T BufferLength, ULONG type, void *context = nullptr);
+    // Binds the memory window without waiting; the handler gets the result.
+    HRESULT Bind(const void *pBuf, SIZE_T bufferLength, ULONG type, NDDispatcher::Handler handler);
 
     void Shutdown();
 
     HRESULT FlushQP();
 
     HRESULT Reject(const VOID *pPrivateData, DWORD cbPrivateData);
+
+    // The handshake for advertising [pBuf, pBuf + length) to the peer. A
+    // buffer advertised before connecting needs the MR's remote token, since
+    // memory windows can only be bound on a connected QP.
+    static NDHandshake MakeHandshake(const void* pBuf, UINT64 length, UINT32 token, ULONG receiveCredits = 0,
+        ULONG maxMessageSize = 0);
+    // Reads the peer's handshake from the connector's private data. Fails
+    // with ND_INVALID_BUFFER_SIZE when the peer sent none and ND_NOT_SUPPORTED
+    // when it speaks another version.
+    static HRESULT ReadHandshake(IND2Connector* pConnector, NDHandshake* pPeer);
+
+    // One extra connection to the peer, used only by striped transfers.
+    struct StripeLane {
+        IND2CompletionQueue* pCq = nullptr;
+        IND2QueuePair* pQp = nullptr;
+        IND2Connector* pConnector = nullptr;
+        OVERLAPPED NotifyOv = {};   // signals m_hStripeEvent
+        bool Armed = false;
+        bool Connected = false;
+    };
+    std::vector<StripeLane> m_Stripes;
+    HANDLE m_hStripeEvent = nullptr;
+    // Disconnects every connected lane, one at a time through m_Ov.
+    void DisconnectStripes();
+
+    private:
+    void OnSrqReceive(void* pData, const ND2_RESULT& result);
+
+    NDBufferPool m_SrqPool;
+    ReceiveHandler m_OnSrqReceive;
+    ULONG m_SrqDepth = 0;
+    ULONG m_SrqLowWater = 0;
+    ULONG m_SrqBufferSize = 0;
+    UINT32 m_SrqToken = 0;
+    ULONG m_SrqPosted = 0;
+
+    static constexpr UINT32 ChannelCreditOnly = 1;
+    HRESULT PostChannelReceive(void* pSlot);
+    void OnChannelReceive(void* pSlot, const ND2_RESULT& result);
+    HRESULT PostChannelSend(const void* pData, ULONG length, UINT32 flags);
+    HRESULT PostChannelSlot(void* pSlot, ULONG length, UINT32 flags);
+    void PumpChannel();
+
+    NDBufferPool m_ChannelPool;
+    MessageHandler m_OnChannelMessage;
+    ULONG m_ChannelSlotSize = 0;
+    ULONG m_ChannelMessageSize = 0;
+    ULONG m_ChannelCreditBatch = 0;
+    UINT32 m_ChannelToken = 0;
+    ULONG m_ChannelCredits = 0;     // receives the peer has posted for us
+    ULONG m_ChannelOwed = 0;        // receives reposted since our last credit return
+    // Slots already holding their payload, oldest at m_ChannelBacklogHead.
+    struct QueuedMessage {
+        void* pSlot;
+        ULONG Length;
+    };
+    std::vector<QueuedMessage> m_ChannelBacklog;
+    ULONG m_ChannelBacklogHead = 0;
+    ULONG m_ChannelBacklogCount = 0;
+    ChannelStats m_ChannelStats;
+
+    HRESULT RegisterRing(void* pBuf, SIZE_T length, ULONG flags, IND2MemoryRegion** ppMr);
+    HRESULT WriteRing(UINT64 offset, ULONG length);
+    void WriteRingFeedback();
+    void ReleaseRing();
+
+    // Inbound ring, then the line the peer writes its head for our ring into.
+    char* m_pRing = nullptr;
+    IND2MemoryRegion* m_pRingMr = nullptr;
+    // Mirror of the peer's ring that records are built in, then the line our
+    // head for the peer is written from.
+    char* m_pRingOut = nullptr;
+    IND2MemoryRegion* m_pRingOutMr = nullptr;
+    ULONG m_RingSize = 0;
+    ULONG m_RingFeedbackBatch = 0;
+    ULONG m_PeerRingSize = 0;
+    UINT64 m_PeerRingAddress = 0;
+    UINT32 m_PeerRingToken = 0;
+    UINT64 m_RingHead = 0;          // bytes consumed from our ring
+    UINT64 m_RingReported = 0;      // our head as the peer last saw it
+    UINT64 m_RingTail = 0;          // bytes written into the peer's ring
+    ULONG m_RingWritesOutstanding = 0;
+    bool m_RingFeedbackPending = false;
+    RingStats m_RingStats;
+
+    // A request posted silently, with what its handler is told on success.
+    struct SilentRequest {
+        void* Context;
+        UINT64 Sequence;
+        ND2_REQUEST_TYPE Type;
+        ULONG Bytes;
+    };
+    struct SignaledRequest {
+        void* Context;
+        UINT64 Sequence;
+    };
+    template <typename Post>
+    HRESULT PostSelective(NDDispatcher::Handler&& handler, ND2_REQUEST_TYPE type, const ND2_SGE* Sge, ULONG nSge, bool last,
+        Post post);
+    void RetireSilent(UINT64 sequence, const ND2_RESULT& result);
+    bool Dispatch(const ND2_RESULT& result);
+
+    ULONG m_SignalInterval = 1;
+    ULONG m_SilentSinceSignal = 0;
+    UINT64 m_SelectiveSequence = 0;
+    std::deque<SilentRequest> m_Silent;
+    std::deque<SignaledRequest> m_Signaled;
+
+    struct StripedTransfer;
+    struct StripeCursor;
+    HRESULT StartStriped(ND2_REQUEST_TYPE type, char* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr,
+        UINT32 remoteToken, NDDispatcher::Handler&& onComplete, const StripeOptions& options);
+    void PumpStripe(StripeCursor* pCursor);
+    void OnStripePiece(StripeCursor* pCursor, const ND2_RESULT& result);
+    ULONG PollStripes();
+    void ReleaseStripes();
+
+    struct LargeTransfer;
+    HRESULT StartLarge(LargeTransfer* pTransfer);
+    void PumpLarge(LargeTransfer* pTransfer);
+    void OnLargePiece(LargeTransfer* pTransfer, const ND2_RESULT& result);
+
+    ULONG InlineFlag(const ND2_SGE* Sge, ULONG nSge, ULONG flags) const;
+    ULONG HarvestCompletions(std::span<ND2_RESULT> results);
+    bool PopHarvested(ND2_RESULT* pResult);
+    void UnpopHarvested(const ND2_RESULT& result);
+    template <typename Post>
+    HRESULT PostTracked(NDDispatcher::Handler&& handler, Post post);
+    ULONG SpinForCompletions(std::span<ND2_RESULT> results, ULONG notifyFlag);
+    void LearnWait(std::chrono::nanoseconds waited, bool spinHit);
+
+    // Completions harvested in a batch but not yet handed to a single-result caller.
+    static constexpr ULONG CompletionBatch = 64;
+    std::array<ND2_RESULT, CompletionBatch> m_Harvested;
+    ULONG m_HarvestedHead = 0;
+    ULONG m_HarvestedCount = 0;
+
+    // The spin budget follows a moving average of how long recent waits took.
+    // When a spin runs out, it grows toward the wait if that was still within
+    // MaxSpinBudget and halves otherwise.
+    static constexpr std::chrono::nanoseconds MinSpinBudget{ 1000 };
+    static constexpr std::chrono::nanoseconds MaxSpinBudget{ 100000 };
+    std::chrono::nanoseconds m_AverageWait{ 0 };
+    std::chrono::nanoseconds m_SpinBudget{ MinSpinBudget };
+    UINT64 m_SpinHits = 0;
+    UINT64 m_EventWaits = 0;
+};
+
+// MARK: NDConnection
+// A client accepted by NDSessionServerBase::StartAccepting. Its QP is created
+// on the server's CQ, and on its SRQ if it has one, before the request arrives.
+// The connection is the QP's context, so one DispatchCompletions serves every
+// connection and FromResult tells their completions apart. Destroying it
+// disconnects.
+class NDConnection {
+    public:
+    ~NDConnection();
+    NDConnection(const NDConnection&) = delete;
+    NDConnection& operator=(const NDConnection&) = delete;
+
+    IND2QueuePair* QueuePair() const { return m_pQp; }
+    IND2Connector* Connector() const { return m_pConnector; }
+    const sockaddr_in& PeerAddress() const { return m_PeerAddr; }
+    // Only filled in when AcceptOptions::Handshake is set.
+    const NDHandshake& PeerHandshake() const { return m_PeerHandshake; }
+    HRESULT Disconnect();
+
+    static NDConnection* FromResult(const ND2_RESULT& result) {
+        return static_cast<NDConnection*>(result.QueuePairContext);
+    }
+
+    // Free for the application.
+    void* Context = nullptr;
+
+    private:
+    friend class NDSessionServerBase;
+    friend class NDShard;
+    NDConnection() = default;
+
+    IND2Connector* m_pConnector = nullptr;
+    IND2QueuePair* m_pQp = nullptr;
+    OVERLAPPED m_Ov = {};
+    sockaddr_in m_PeerAddr = {};
+    NDHandshake m_PeerHandshake;
+    bool m_Connected = false;
 };
 
 class NDSessionServerBase : public NDSessionBase {
@@ -95,15 +599,93 @@ class NDSessionServerBase : public NDSessionBase {
     ~NDSessionServerBase();
 
     HRESULT CreateListener();
-    HRESULT Listen(const char *localAddr);
+    // The backlog is how many connection requests the listener queues before refusing more.
+    HRESULT Listen(const char *localAddr, ULONG backlog = 1);
     HRESULT GetConnectionRequest();
     HRESULT Accept(DWORD inboundReadLimit, DWORD outboundReadLimit, const void *pPrivateData, DWORD cbPrivateData);
+    // The same, reading the client's handshake from its request and answering
+    // with the server's own. A request without a valid handshake is rejected.
+    HRESULT GetConnectionRequest(NDHandshake* pPeer);
+    HRESULT Accept(DWORD inboundReadLimit, DWORD outboundReadLimit, const NDHandshake& local);
+    // The same four as coroutines for a session attached to an NDEventLoop.
+    // Like any NDTask they start when awaited, so their pointers must still be
+    // valid then.
+    NDTask<HRESULT> GetConnectionRequestAsync();
+    NDTask<HRESULT> AcceptAsync(DWORD inboundReadLimit, DWORD outboundReadLimit, const void *pPrivateData, DWORD cbPrivateData);
+    NDTask<HRESULT> GetConnectionRequestAsync(NDHandshake* pPeer);
+    NDTask<HRESULT> AcceptAsync(DWORD inboundReadLimit, DWORD outboundReadLimit, NDHandshake local);
+    // Accepts one connection per lane, in the order the client makes them.
+    HRESULT AcceptStripes(DWORD inboundReadLimit, DWORD outboundReadLimit);
+
+    // Accepting many clients. Backlog connectors, each with its QP already
+    // created, wait on the listener at once, and each request is accepted as
+    // soon as it arrives rather than after the previous client finishes its
+    // handshake. DispatchAccepts hands established connections to onConnection
+    // and replaces their connectors, so Backlog stay ready; a connector that
+    // cannot be replaced is reported and tried again on the next dispatch.
+    // Listen with the same options first, so the listener queues as many
+    // requests as there are connectors.
+    struct AcceptOptions {
+        ULONG Backlog = 16;
+        DWORD ReceiveDepth = 64;        // ignored when the server has an SRQ
+        DWORD InitiatorDepth = 64;
+        DWORD nSge = 1;
+        DWORD InlineDataSize = AdapterInlineSize;
+        DWORD InboundReadLimit = 0;
+        DWORD OutboundReadLimit = 0;
+        // When set, every client must send a handshake and gets this one back.
+        std::optional<NDHandshake> Handshake;
+    };
+    using ConnectionHandler = std::function<void(std::unique_ptr<NDConnection> pConnection)>;
+
+    HRESULT Listen(const char* localAddr, const AcceptOptions& options);
+    // Fails when the listener's backlog is smaller than options.Backlog.
+    HRESULT StartAccepting(const AcceptOptions& options, ConnectionHandler onConnection);
+    // Advances every accept that is ready and, unless mode is Poll, waits
+    // until one is. Returns the number of connections handed over.
+    ULONG DispatchAccepts(CompletionWait mode = CompletionWait::Block);
+    // Cancels the waiting connectors and releases their QPs.
+    void StopAccepting();
+
+    private:
+    struct AcceptSlot {
+        std::unique_ptr<NDConnection> pConnection;
+        OVERLAPPED Ov = {};     // signals m_hAcceptEvent
+        bool Accepting = false;
+        bool Retry = false;     // PrepareAcceptSlot failed and runs again on the next dispatch
+    };
+
+    HRESULT PrepareAcceptSlot(AcceptSlot& slot);
+    ULONG AdvanceAcceptSlot(AcceptSlot& slot);
+
+    ULONG m_ListenBacklog = 0;
+    AcceptOptions m_AcceptOptions;
+    ConnectionHandler m_OnConnection;
+    std::vector<AcceptSlot> m_AcceptSlots;
+    HANDLE m_hAcceptEvent = nullptr;
 };
 
 class NDSessionClientBase : public NDSessionBase {
     public:
-    HRESULT Connect(const char *localAddr, const char *remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit, const void *pPrivateData = nullptr, DWORD cbPrivateData = 0);
+    // Binds localPort, or an ephemeral port when it is 0.
+    static constexpr USHORT DefaultLocalPort = 54322;
+    HRESULT Connect(const char *localAddr, const char *remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit, const void *pPrivateData = nullptr, DWORD cbPrivateData = 0,
+        USHORT localPort = DefaultLocalPort);
+    // Sends local with the request and reads the server's handshake from its
+    // reply into pPeer before returning.
+    HRESULT Connect(const char *localAddr, const char *remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit,
+        const NDHandshake& local, NDHandshake* pPeer, USHORT localPort = DefaultLocalPort);
     HRESULT CompleteConnect();
+    // The same as coroutines for a session attached to an NDEventLoop. Like
+    // any NDTask they start when awaited, so their pointers must still be
+    // valid then.
+    NDTask<HRESULT> ConnectAsync(const char *localAddr, const char *remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit,
+        const void *pPrivateData = nullptr, DWORD cbPrivateData = 0, USHORT localPort = DefaultLocalPort);
+    NDTask<HRESULT> ConnectAsync(const char *localAddr, const char *remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit,
+        NDHandshake local, NDHandshake* pPeer, USHORT localPort = DefaultLocalPort);
+    NDTask<HRESULT> CompleteConnectAsync();
+    // Connects every lane to the same server, each from an ephemeral local port.
+    HRESULT ConnectStripes(const char *localAddr, const char *remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit);
 };
 
 #endif // NDSESSION_HPP
\ No newline at end of file
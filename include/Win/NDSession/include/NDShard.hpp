@@ -0,0 +1,206 @@
+#ifndef NDSHARD_HPP
+#define NDSHARD_HPP
+#pragma once
+
+#include "NDSession.hpp"
+#include "NDSpscQueue.hpp"
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+class NDShardedServer;
+
+struct NDShardOptions {
+    ULONG Shards = 0;               // 0 runs one per core
+    bool Pin = true;                // shard i runs on core i modulo the core count
+    ULONG Backlog = 16;             // connection requests the acceptor keeps waiting
+    ULONG QueueDepth = 64;          // entries in each queue between two threads
+    ULONG CqDepth = 4096;           // per shard; covers the SRQ and every connection's sends
+    ULONG ReceiveDepth = 1024;      // receives each shard's SRQ keeps posted
+    ULONG MessageSize = 4096;       // size of every receive buffer and send pool buffer
+    ULONG SendBuffers = 1024;       // buffers in each shard's send pool
+    DWORD InitiatorDepth = 64;
+    DWORD InboundReadLimit = 0;
+    DWORD OutboundReadLimit = 0;
+    // When set, every client must send a handshake and gets this one back.
+    std::optional<NDHandshake> Handshake;
+};
+
+// MARK: NDShard
+// One shard of an NDShardedServer: a thread, normally pinned to its own core,
+// with its own adapter, CQ, SRQ, send pool and connections. Nothing in it is
+// shared with another shard, so its hot path takes no locks. Everything it
+// owns is created on its thread, after pinning, and every handler runs there.
+// The only ways in from other threads are bounded single-producer queues: one
+// from the acceptor carrying new connection requests, and one from every other
+// shard carrying tasks posted with Post. A shard polls while it has work and
+// sleeps on one event otherwise; producers set the event only while it sleeps.
+//
+// Every request posted on a shard must have a handler; it is driven by
+// DispatchCompletions like any session.
+class NDShard : public NDSessionBase {
+    public:
+    using ConnectionHandler = std::function<void(NDShard& shard, NDConnection& connection)>;
+    // buffer goes back to the SRQ when the handler returns.
+    using MessageHandler = std::function<void(NDShard& shard, NDConnection& connection, const ND2_RESULT& result,
+        const NDBuffer& buffer)>;
+    using Task = std::function<void(NDShard& shard)>;
+
+    struct Stats {
+        UINT64 Accepted = 0;
+        UINT64 Closed = 0;
+        UINT64 Messages = 0;
+        UINT64 Tasks = 0;       // tasks run from other shards
+        UINT64 Sleeps = 0;      // times the shard ran out of work and waited
+    };
+
+    ~NDShard();
+
+    ULONG Index() const { return m_Index; }
+    // Core the shard is pinned to, or -1 when it is not.
+    LONG Core() const { return m_Core; }
+    // Connections owned plus requests handed over but not yet accepted.
+    ULONG Load() const { return m_Load.load(std::memory_order_relaxed); }
+    // Only stable once the server has stopped.
+    const Stats& GetStats() const { return m_Stats; }
+
+    // The rest may only be called from the shard's own thread.
+
+    // Queues task to run on shard target. Fails when its queue from this
+    // shard is full, which leaves task untouched.
+    bool Post(ULONG target, Task&& task);
+
+    NDBuffer AllocateBuffer(ULONG size) { return m_BufferPool.Allocate(size); }
+    void FreeBuffer(const void* pData) { m_BufferPool.Free(pData); }
+    HRESULT Send(NDConnection& connection, const ND2_SGE* Sge, const ULONG nSge, ULONG flags, NDDispatcher::Handler handler) {
+        return NDSessionBase::Send(connection, Sge, nSge, flags, std::move(handler));
+    }
+    // Disconnects and forgets the connection once the current handler
+    // returns. Completions already queued for it are dispatched first, then
+    // onClose runs, and no handler sees it after that.
+    void Close(NDConnection& connection);
+    size_t Connections() const { return m_Connections.size(); }
+
+    // Free for the application.
+    void* Context = nullptr;
+
+    private:
+    friend class NDShardedServer;
+
+    // A connection request the acceptor has assigned to this shard. The
+    // acceptor created the connector on this shard's adapter, so the shard
+    // can accept it onto a QP of its own.
+    struct Handoff {
+        IND2Connector* pConnector = nullptr;
+        NDHandshake Peer;
+    };
+    struct Member {
+        std::unique_ptr<NDConnection> pConnection;
+        OVERLAPPED Ov = {};         // Accept, then NotifyDisconnect; signals m_hEvent
+        bool Accepting = true;
+        bool Closing = false;
+    };
+
+    // Control-plane overlapped requests are checked at least this often
+    // while the shard is busy, and every time it wakes.
+    static constexpr ULONG ControlInterval = 64;
+    // Empty polls before the shard goes to sleep.
+    static constexpr ULONG IdlePolls = 64;
+
+    NDShard(NDShardedServer& server, ULONG index, ULONG shards);
+
+    void ThreadMain(char* localAddr, std::promise<HRESULT>* pReady);
+    HRESULT Setup(char* localAddr);
+    void Run();
+    void Teardown();
+    void WaitForWork();
+    void Wake();
+    ULONG DrainInbox();
+    void Adopt(const Handoff& handoff);
+    ULONG AdvanceMembers();
+    void ReapClosed();
+    void Remove(Member& member);
+    void OnReceive(const ND2_RESULT& result, const NDBuffer& buffer);
+
+    NDShardedServer& m_Server;
+    const NDShardOptions& m_Options;
+    ULONG m_Index;
+    LONG m_Core = -1;
+    std::thread m_Thread;
+
+    // Members never move once their OVERLAPPEDs are posted.
+    std::vector<std::unique_ptr<Member>> m_Connections;
+    bool m_ClosePending = false;
+    OVERLAPPED m_NotifyOv = {};     // CQ Notify; signals m_hEvent
+    bool m_Armed = false;
+    HANDLE m_hEvent = nullptr;
+    ULONG m_InlineDataSize = 0;
+    Stats m_Stats;
+
+    // m_Inbox[i] carries tasks from shard i; m_Handoffs comes from the acceptor.
+    std::vector<std::unique_ptr<NDSpscQueue<Task>>> m_Inbox;
+    NDSpscQueue<Handoff> m_Handoffs;
+
+    alignas(64) std::atomic<bool> m_Sleeping{ false };
+    std::atomic<ULONG> m_Load{ 0 };
+};
+
+// MARK: NDShardedServer
+// A shared-nothing server: one NDShard per core and an acceptor thread that
+// owns the listener. NDv2 only accepts a connector onto a QP of the same
+// adapter, so every connector the acceptor keeps waiting is created on one
+// shard's adapter, that of the shard with the least load counting the
+// connectors already waiting for it. The acceptor reads each connection
+// request, checks its handshake and hands it to that shard; when its queue is
+// full, the request is rejected. From then on the connection lives on that
+// shard alone. Messages arrive on the shard's SRQ and go to
+// onMessage with the connection they came from.
+class NDShardedServer {
+    public:
+    NDShardedServer();
+    ~NDShardedServer();
+    NDShardedServer(const NDShardedServer&) = delete;
+    NDShardedServer& operator=(const NDShardedServer&) = delete;
+
+    // Starts the shards and then the acceptor, and returns once all of them
+    // are ready or the first has failed. onConnection runs on the owning
+    // shard after the connection is accepted, onClose just before it is
+    // destroyed, whether the peer disconnected or the shard closed it.
+    HRESULT Start(char* localAddr, USHORT port, const NDShardOptions& options, NDShard::ConnectionHandler onConnection,
+        NDShard::MessageHandler onMessage, NDShard::ConnectionHandler onClose = nullptr);
+    // Stops the acceptor, then each shard, which disconnects its connections.
+    // The shards stay until the next Start, so their stats can be read.
+    void Stop();
+
+    ULONG ShardCount() const { return static_cast<ULONG>(m_Shards.size()); }
+    NDShard& Shard(ULONG index) { return *m_Shards[index]; }
+    // Requests turned away because their shard's queue was full.
+    UINT64 Rejected() const { return m_Rejected.load(std::memory_order_relaxed); }
+
+    static ULONG CoreCount();
+
+    private:
+    friend class NDShard;
+    class Acceptor;
+
+    bool Stopping() const { return m_Stopping.load(std::memory_order_acquire); }
+    // Called by the acceptor thread.
+    bool Assign(ULONG shard, IND2Connector* pConnector, const NDHandshake& peer);
+
+    NDShardOptions m_Options;
+    NDShard::ConnectionHandler m_OnConnection;
+    NDShard::MessageHandler m_OnMessage;
+    NDShard::ConnectionHandler m_OnClose;
+    std::vector<std::unique_ptr<NDShard>> m_Shards;
+    std::unique_ptr<Acceptor> m_pAcceptor;
+    std::thread m_AcceptorThread;
+    bool m_Started = false;
+    std::atomic<bool> m_Stopping{ false };
+    std::atomic<UINT64> m_Rejected{ 0 };
+};
+
+#endif // NDSHARD_HPP
@@ -0,0 +1,71 @@
+#ifndef NDSPSCQUEUE_HPP
+#define NDSPSCQUEUE_HPP
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Bounded queue from exactly one producer thread to exactly one consumer
+// thread, without locks. Each side owns one index and keeps a cached copy of
+// the other's, so it only reads the other side's cache line when the queue
+// looks full (producer) or empty (consumer).
+template <typename T>
+class NDSpscQueue {
+    public:
+    // The capacity is rounded up to a power of two.
+    explicit NDSpscQueue(size_t capacity) {
+        size_t slots = 2;
+        while (slots < capacity) slots <<= 1;
+        m_Mask = slots - 1;
+        m_pSlots = std::make_unique<T[]>(slots);
+    }
+    NDSpscQueue(const NDSpscQueue&) = delete;
+    NDSpscQueue& operator=(const NDSpscQueue&) = delete;
+
+    // Producer only. Leaves value untouched and returns false when full.
+    bool TryPush(T&& value) {
+        size_t tail = m_Tail.load(std::memory_order_relaxed);
+        if (tail - m_CachedHead > m_Mask) {
+            m_CachedHead = m_Head.load(std::memory_order_acquire);
+            if (tail - m_CachedHead > m_Mask) return false;
+        }
+        m_pSlots[tail & m_Mask] = std::move(value);
+        m_Tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only.
+    bool TryPop(T* pValue) {
+        size_t head = m_Head.load(std::memory_order_relaxed);
+        if (head == m_CachedTail) {
+            m_CachedTail = m_Tail.load(std::memory_order_acquire);
+            if (head == m_CachedTail) return false;
+        }
+        *pValue = std::move(m_pSlots[head & m_Mask]);
+        m_Head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Either side; a hint, since the other side may be moving.
+    bool Empty() const {
+        return m_Head.load(std::memory_order_acquire) == m_Tail.load(std::memory_order_acquire);
+    }
+    size_t Capacity() const { return m_Mask + 1; }
+
+    private:
+    static constexpr size_t CacheLine = 64;
+
+    std::unique_ptr<T[]> m_pSlots;
+    size_t m_Mask = 0;
+
+    // Consumer's line.
+    alignas(CacheLine) std::atomic<size_t> m_Head{ 0 };
+    size_t m_CachedTail = 0;
+    // Producer's line.
+    alignas(CacheLine) std::atomic<size_t> m_Tail{ 0 };
+    size_t m_CachedHead = 0;
+};
+
+#endif // NDSPSCQUEUE_HPP
@@ -0,0 +1,114 @@
+#include "NDAsync.hpp"
+#include "NDSession.hpp"
+#include <algorithm>
+#include <iostream>
+
+// MARK: NDEventLoop
+NDEventLoop::NDEventLoop() {
+    m_hEvent = CreateEvent(nullptr, false, false, nullptr);
+}
+
+NDEventLoop::~NDEventLoop() {
+    while (!m_Sources.empty()) Detach(*m_Sources.back()->pSession);
+    if (m_hEvent) CloseHandle(m_hEvent);
+}
+
+HRESULT NDEventLoop::Attach(NDSessionBase& session) {
+    if (m_hEvent == nullptr) return E_OUTOFMEMORY;
+    if (session.m_pCq == nullptr || session.m_pLoop != nullptr || session.m_pReactor != nullptr) return ND_INVALID_DEVICE_STATE;
+
+    auto pSource = std::make_unique<Source>();
+    pSource->pSession = &session;
+    pSource->pCq = session.m_pCq;
+    pSource->NotifyOv.hEvent = m_hEvent;
+    m_Sources.push_back(std::move(pSource));
+    session.m_pLoop = this;
+    return ND_SUCCESS;
+}
+
+void NDEventLoop::Detach(NDSessionBase& session) {
+    auto it = std::find_if(m_Sources.begin(), m_Sources.end(), [&](const auto& p) { return p->pSession == &session; });
+    if (it == m_Sources.end()) return;
+
+    Source& source = **it;
+    if (source.Armed) {
+        // Cancelling completes the Notify, which still signals the event.
+        source.pCq->CancelOverlappedRequests();
+        source.pCq->GetOverlappedResult(&source.NotifyOv, true);
+    }
+    m_Sources.erase(it);
+    session.m_pLoop = nullptr;
+}
+
+ULONG NDEventLoop::Poll() {
+    ULONG resumed = 0;
+    // Indexed, since a resumed coroutine may attach another session.
+    for (size_t i = 0; i < m_Sources.size(); i++) {
+        resumed += m_Sources[i]->pSession->DispatchCompletions(NDSessionBase::CompletionWait::Poll);
+    }
+
+    for (size_t i = 0; i < m_Pending.size();) {
+        NDOverlappedRequest* pRequest = m_Pending[i];
+        if (!pRequest->Poll()) {
+            i++;
+            continue;
+        }
+        m_Pending[i] = m_Pending.back();
+        m_Pending.pop_back();
+        if (pRequest->m_Awaiting) {
+            pRequest->m_Awaiting.resume();
+            resumed++;
+        }
+    }
+    return resumed;
+}
+
+// Every CQ is armed against the one event that the connection requests also
+// signal, and polled once more before sleeping, so nothing that completes in
+// between is slept through.
+void NDEventLoop::Run() {
+    while (m_Tasks > 0) {
+        if (Poll() > 0) continue;
+        if (m_Sources.empty() && m_Pending.empty()) {
+            std::cerr << m_Tasks << " coroutines are waiting on nothing the loop drives." << std::endl;
+            return;
+        }
+
+        Arm();
+        if (Poll() > 0 || m_Tasks == 0) continue;
+        WaitForSingleObject(m_hEvent, INFINITE);
+    }
+}
+
+void NDEventLoop::Arm() {
+    for (auto& pSource : m_Sources) {
+        Source& source = *pSource;
+        if (source.Armed && source.pCq->GetOverlappedResult(&source.NotifyOv, false) != ND_PENDING) source.Armed = false;
+        if (!source.Armed) source.Armed = source.pCq->Notify(ND_CQ_NOTIFY_ANY, &source.NotifyOv) == ND_PENDING;
+    }
+}
+
+void NDEventLoop::Watch(NDOverlappedRequest* pRequest) {
+    m_Pending.push_back(pRequest);
+}
+
+void NDEventLoop::Unwatch(NDOverlappedRequest* pRequest) {
+    auto it = std::find(m_Pending.begin(), m_Pending.end(), pRequest);
+    if (it != m_Pending.end()) m_Pending.erase(it);
+}
+
+// MARK: NDOverlappedRequest
+NDOverlappedRequest::~NDOverlappedRequest() {
+    if (m_Result != ND_PENDING) return;
+
+    m_pLoop->Unwatch(this);
+    m_pObject->CancelOverlappedRequests();
+    m_pObject->GetOverlappedResult(&m_Ov, true);
+}
+
+bool NDOverlappedRequest::Poll() {
+    HRESULT hr = m_pObject->GetOverlappedResult(&m_Ov, false);
+    if (hr == ND_PENDING) return false;
+    m_Result = hr;
+    return true;
+}
@@ -0,0 +1,225 @@
+#include "NDBufferPool.hpp"
+#include "NDMemory.hpp"
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+
+// A cache holds at most 1/CacheShare of its class.
+static constexpr ULONG CacheShare = 8;
+
+// Open pools and the cache indices not held by a live thread. Only taken
+// when a thread first uses a pool, when it exits, and when a pool opens or closes.
+static std::mutex s_CacheLock;
+static std::vector<NDBufferPool*> s_OpenPools;
+static std::vector<ULONG> s_FreeIndices;
+static ULONG s_NextIndex = 0;
+
+// Threads take an index on first use; it picks their cache in every pool.
+// On exit the thread flushes that cache in every open pool, under the lock
+// so no pool can close meanwhile, and hands the index on.
+struct NDBufferPool::ThreadIndex {
+    static constexpr ULONG None = 0xFFFFFFFF;
+    ULONG Value = None;
+
+    ThreadIndex() {
+        std::lock_guard lock(s_CacheLock);
+        if (!s_FreeIndices.empty()) {
+            Value = s_FreeIndices.back();
+            s_FreeIndices.pop_back();
+        } else if (s_NextIndex < MaxThreadCaches) {
+            Value = s_NextIndex++;
+        }
+    }
+
+    ~ThreadIndex() {
+        if (Value == None) return;
+        std::lock_guard lock(s_CacheLock);
+        for (NDBufferPool* pPool : s_OpenPools) pPool->FlushThreadCache(Value);
+        s_FreeIndices.push_back(Value);
+    }
+};
+
+// MARK: NDBufferPool
+NDBufferPool::NDBufferPool() {
+    RtlZeroMemory(&m_Ov, sizeof(m_Ov));
+}
+
+NDBufferPool::~NDBufferPool() {
+    Close();
+}
+
+HRESULT NDBufferPool::Initialize(IND2Adapter* pAdapter, HANDLE hAdapterFile, ULONG flags, std::span<const SizeClass> classes,
+    LONG numaNode) {
+    if (IsInitialized() || classes.empty() || classes.size() > MaxClasses) return E_INVALIDARG;
+
+    m_Ov.hEvent = CreateEvent(nullptr, false, false, nullptr);
+    if (m_Ov.hEvent == nullptr) return E_OUTOFMEMORY;
+    m_ThreadCaches = std::make_unique<ThreadCache[]>(MaxThreadCaches);
+
+    for (const SizeClass& requested : classes) {
+        Class& sizeClass = m_Classes[m_ClassCount];
+        sizeClass.Size = (requested.Size + CacheLine - 1) / CacheLine * CacheLine;
+        sizeClass.Count = requested.Count;
+        sizeClass.CacheSlots = std::min(ThreadCacheSlots, sizeClass.Count / CacheShare);
+        size_t bytes = static_cast<size_t>(sizeClass.Size) * sizeClass.Count;
+        if (sizeClass.Size == 0 || sizeClass.Count == 0 || bytes > 0xFFFFFFFF) {
+            Close();
+            return E_INVALIDARG;
+        }
+
+        sizeClass.pBase = static_cast<char*>(NDMemory::Allocate(bytes, numaNode));
+        if (sizeClass.pBase == nullptr) {
+            std::cerr << "Failed to allocate " << bytes << " bytes for the buffer pool." << std::endl;
+            Close();
+            return E_OUTOFMEMORY;
+        }
+        m_ClassCount++;
+
+        HRESULT hr = pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion, hAdapterFile, reinterpret_cast<void**>(&sizeClass.pMr));
+        if (SUCCEEDED(hr)) {
+            hr = sizeClass.pMr->Register(sizeClass.pBase, bytes, flags, &m_Ov);
+            if (hr == ND_PENDING) hr = sizeClass.pMr->GetOverlappedResult(&m_Ov, true);
+        }
+        if (FAILED(hr)) {
+            std::cerr << "Failed to register buffer pool region: " << std::hex << hr << std::endl;
+            Close();
+            return hr;
+        }
+        sizeClass.Token = sizeClass.pMr->GetLocalToken();
+
+        sizeClass.pNext = std::make_unique<std::atomic<UINT32>[]>(sizeClass.Count);
+        for (UINT32 i = 0; i < sizeClass.Count; i++) {
+            sizeClass.pNext[i].store(i + 1 < sizeClass.Count ? i + 1 : NoSlot, std::memory_order_relaxed);
+        }
+        sizeClass.Head.store(0, std::memory_order_release);
+    }
+
+    std::lock_guard lock(s_CacheLock);
+    s_OpenPools.push_back(this);
+    return ND_SUCCESS;
+}
+
+void NDBufferPool::Close() {
+    {
+        std::lock_guard lock(s_CacheLock);
+        s_OpenPools.erase(std::remove(s_OpenPools.begin(), s_OpenPools.end(), this), s_OpenPools.end());
+    }
+    for (ULONG i = 0; i < m_ClassCount; i++) {
+        Class& sizeClass = m_Classes[i];
+        if (sizeClass.pMr != nullptr) {
+            HRESULT hr = sizeClass.pMr->Deregister(&m_Ov);
+            if (hr == ND_PENDING) sizeClass.pMr->GetOverlappedResult(&m_Ov, true);
+            sizeClass.pMr->Release();
+            sizeClass.pMr = nullptr;
+        }
+        NDMemory::Free(sizeClass.pBase, static_cast<size_t>(sizeClass.Size) * sizeClass.Count);
+        sizeClass.pBase = nullptr;
+        sizeClass.pNext.reset();
+        sizeClass.Head.store(NoSlot, std::memory_order_relaxed);
+    }
+    m_ClassCount = 0;
+    m_ThreadCaches.reset();
+    if (m_Ov.hEvent) {
+        CloseHandle(m_Ov.hEvent);
+        m_Ov.hEvent = nullptr;
+    }
+}
+
+NDBuffer NDBufferPool::Allocate(size_t size) {
+    for (ULONG i = 0; i < m_ClassCount; i++) {
+        if (m_Classes[i].Size < size) continue;
+
+        UINT32 slot;
+        if (Take(i, &slot)) {
+            Class& sizeClass = m_Classes[i];
+            return { sizeClass.pBase + static_cast<size_t>(slot) * sizeClass.Size, sizeClass.Size, sizeClass.Token };
+        }
+    }
+    return {};
+}
+
+void NDBufferPool::Free(const void* pData) {
+    if (pData == nullptr) return;
+
+    const char* p = static_cast<const char*>(pData);
+    for (ULONG i = 0; i < m_ClassCount; i++) {
+        Class& sizeClass = m_Classes[i];
+        size_t offset = static_cast<size_t>(p - sizeClass.pBase);
+        if (p < sizeClass.pBase || offset >= static_cast<size_t>(sizeClass.Size) * sizeClass.Count) continue;
+
+        UINT32 slot = static_cast<UINT32>(offset / sizeClass.Size);
+        ThreadCache* pCache = GetThreadCache();
+        if (pCache == nullptr || sizeClass.CacheSlots == 0) {
+            Push(sizeClass, slot);
+            return;
+        }
+
+        // Spill half when full, so alternating frees and allocations stay local.
+        ULONG& count = pCache->Count[i];
+        if (count == sizeClass.CacheSlots) {
+            while (count > sizeClass.CacheSlots / 2) Push(sizeClass, pCache->Slots[i][--count]);
+        }
+        pCache->Slots[i][count++] = slot;
+        return;
+    }
+    std::cerr << "NDBufferPool::Free called with a foreign pointer." << std::endl;
+}
+
+bool NDBufferPool::Take(ULONG classIndex, UINT32* pSlot) {
+    Class& sizeClass = m_Classes[classIndex];
+    ThreadCache* pCache = GetThreadCache();
+    if (pCache == nullptr || sizeClass.CacheSlots == 0) {
+        *pSlot = Pop(sizeClass);
+        return *pSlot != NoSlot;
+    }
+
+    ULONG& count = pCache->Count[classIndex];
+    if (count == 0) {
+        ULONG refill = std::max(sizeClass.CacheSlots / 2, 1u);
+        while (count < refill) {
+            UINT32 slot = Pop(sizeClass);
+            if (slot == NoSlot) break;
+            pCache->Slots[classIndex][count++] = slot;
+        }
+        if (count == 0) return false;
+    }
+    *pSlot = pCache->Slots[classIndex][--count];
+    return true;
+}
+
+NDBufferPool::ThreadCache* NDBufferPool::GetThreadCache() {
+    static thread_local ThreadIndex t_ThreadIndex;
+    ULONG index = t_ThreadIndex.Value;
+    return index < MaxThreadCaches ? &m_ThreadCaches[index] : nullptr;
+}
+
+void NDBufferPool::FlushThreadCache(ULONG index) {
+    ThreadCache& cache = m_ThreadCaches[index];
+    for (ULONG i = 0; i < m_ClassCount; i++) {
+        while (cache.Count[i] > 0) Push(m_Classes[i], cache.Slots[i][--cache.Count[i]]);
+    }
+}
+
+UINT32 NDBufferPool::Pop(Class& sizeClass) {
+    UINT64 head = sizeClass.Head.load(std::memory_order_acquire);
+    for (;;) {
+        UINT32 slot = static_cast<UINT32>(head);
+        if (slot == NoSlot) return NoSlot;
+        UINT32 next = sizeClass.pNext[slot].load(std::memory_order_relaxed);
+        UINT64 newHead = ((head >> 32) + 1) << 32 | next;
+        if (sizeClass.Head.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire)) {
+            return slot;
+        }
+    }
+}
+
+void NDBufferPool::Push(Class& sizeClass, UINT32 slot) {
+    UINT64 head = sizeClass.Head.load(std::memory_order_relaxed);
+    for (;;) {
+        sizeClass.pNext[slot].store(static_cast<UINT32>(head), std::memory_order_relaxed);
+        UINT64 newHead = ((head >> 32) + 1) << 32 | slot;
+        if (sizeClass.Head.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed)) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#include "NDDispatcher.hpp"
+
+// RequestContext layout: the top bit marks a dispatcher context, the next 31
+// bits carry the record's generation and the low 32 bits its index. Sentinel
+// contexts such as ((void*)0x1000) never have the top bit set.
+static_assert(sizeof(void*) == sizeof(UINT64), "request contexts carry 64 bits");
+
+constexpr UINT64 TrackedBit = 1ULL << 63;
+constexpr UINT32 GenerationMask = 0x7FFFFFFF;
+
+static void* EncodeContext(UINT32 index, UINT32 generation) {
+    return reinterpret_cast<void*>(TrackedBit | (static_cast<UINT64>(generation & GenerationMask) << 32) | index);
+}
+
+// MARK: NDDispatcher
+NDDispatcher::NDDispatcher(ULONG capacity) : m_Records(capacity) {
+    for (UINT32 i = 0; i < capacity; i++) {
+        m_Records[i].NextFree = (i + 1 < capacity) ? i + 1 : NoRecord;
+    }
+    m_FreeHead = capacity > 0 ? 0 : NoRecord;
+}
+
+void* NDDispatcher::Track(Handler handler) {
+    if (m_FreeHead == NoRecord) return nullptr;
+
+    UINT32 index = m_FreeHead;
+    Record& record = m_Records[index];
+    m_FreeHead = record.NextFree;
+    record.OnComplete = std::move(handler);
+    record.InUse = true;
+    m_Outstanding++;
+    return EncodeContext(index, record.Generation);
+}
+
+void NDDispatcher::Cancel(void* requestContext) {
+    UINT32 index;
+    if (Find(requestContext, &index) != nullptr) Release(index);
+}
+
+bool NDDispatcher::Dispatch(const ND2_RESULT& result) {
+    if (!IsTracked(result.RequestContext)) return false;
+
+    UINT32 index;
+    Record* pRecord = Find(result.RequestContext, &index);
+    if (pRecord == nullptr) {
+        // Handing it back would stall whoever drains the CQ behind it.
+        m_StaleCompletions++;
+        return true;
+    }
+
+    // Free the record first so the handler can post into it again.
+    Handler onComplete = std::move(pRecord->OnComplete);
+    Release(index);
+    if (onComplete) onComplete(result);
+    return true;
+}
+
+bool NDDispatcher::IsTracked(const void* requestContext) {
+    return (reinterpret_cast<UINT64>(requestContext) & TrackedBit) != 0;
+}
+
+bool NDDispatcher::IsOutstanding(const void* requestContext) const {
+    UINT32 index;
+    return const_cast<NDDispatcher*>(this)->Find(requestContext, &index) != nullptr;
+}
+
+NDDispatcher::Record* NDDispatcher::Find(const void* requestContext, UINT32* pIndex) {
+    UINT64 value = reinterpret_cast<UINT64>(requestContext);
+    if ((value & TrackedBit) == 0) return nullptr;
+
+    UINT32 index = static_cast<UINT32>(value);
+    UINT32 generation = static_cast<UINT32>(value >> 32) & GenerationMask;
+    if (index >= m_Records.size()) return nullptr;
+
+    Record& record = m_Records[index];
+    if (!record.InUse || (record.Generation & GenerationMask) != generation) return nullptr;
+    *pIndex = index;
+    return &record;
+}
+
+void NDDispatcher::Release(UINT32 index) {
+    Record& record = m_Records[index];
+    record.OnComplete = nullptr;
+    record.InUse = false;
+    record.Generation++;
+    record.NextFree = m_FreeHead;
+    m_FreeHead = index;
+    m_Outstanding--;
+}
@@ -0,0 +1,303 @@
+#include "NDMemory.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <iphlpapi.h>
+#include <setupapi.h>
+#else
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Touching one byte per page is enough to fault it in; smaller pages than
+// this do not exist on any platform ND runs on.
+static constexpr SIZE_T SmallPage = 4096;
+// Each prefault thread gets at least this much, so small buffers use one.
+static constexpr SIZE_T PrefaultPiece = 64 * 1024 * 1024;
+
+static void TouchPages(char* pBuffer, SIZE_T length, SIZE_T stride) {
+    volatile char* p = pBuffer;
+    for (SIZE_T offset = 0; offset < length; offset += stride) p[offset] = 0;
+}
+
+// Faulting is bound by the kernel's page-fault path, not by memory
+// bandwidth, so a large buffer is split into one piece per core. The pages
+// go to the buffer's node whichever thread faults them.
+static void PrefaultPages(void* pBuffer, SIZE_T length, SIZE_T stride) {
+    char* pBase = static_cast<char*>(pBuffer);
+    SIZE_T threads = std::min<SIZE_T>(std::max(1u, std::thread::hardware_concurrency()), length / PrefaultPiece);
+    if (threads <= 1) {
+        TouchPages(pBase, length, stride);
+        return;
+    }
+
+    // A thread that cannot be started leaves its piece and the rest to the
+    // calling thread.
+    SIZE_T piece = (length / threads + stride - 1) / stride * stride;
+    SIZE_T offset = piece;
+    std::vector<std::thread> workers;
+    try {
+        for (; offset < length; offset += piece) {
+            workers.emplace_back(TouchPages, pBase + offset, std::min(piece, length - offset), stride);
+        }
+    } catch (const std::system_error&) {
+        TouchPages(pBase + offset, length - offset, stride);
+    }
+    TouchPages(pBase, piece, stride);
+    for (std::thread& worker : workers) worker.join();
+}
+
+// Large pages only pay off once the buffer covers at least one of them.
+static bool WantsLargePages(SIZE_T length, ULONG flags) {
+    SIZE_T pageSize = NDMemory::LargePageSize();
+    return (flags & NDMemory::LargePages) && pageSize != 0 && length >= pageSize;
+}
+
+static SIZE_T RoundUp(SIZE_T length, SIZE_T granularity) {
+    return (length + granularity - 1) / granularity * granularity;
+}
+
+#ifdef _WIN32
+// GUID_DEVCLASS_NET and DEVPKEY_Device_Numa_Node, spelled out so this file
+// does not have to instantiate every GUID in devguid.h and devpkey.h.
+static const GUID NetClassGuid = { 0x4d36e972, 0xe325, 0x11ce, { 0xbf, 0xc1, 0x08, 0x00, 0x2b, 0xe1, 0x03, 0x18 } };
+static const DEVPROPKEY NumaNodeKey = { { 0x540b947e, 0x8b40, 0x45bc, { 0xa8, 0xa2, 0x6a, 0x0b, 0x89, 0x4c, 0xbd, 0xa2 } }, 3 };
+
+// The network device whose NetCfgInstanceId is the interface's GUID name.
+static LONG NumaNodeOfInterface(const char* adapterName) {
+    HDEVINFO devices = SetupDiGetClassDevsW(&NetClassGuid, nullptr, nullptr, DIGCF_PRESENT);
+    if (devices == INVALID_HANDLE_VALUE) return -1;
+
+    LONG node = -1;
+    SP_DEVINFO_DATA device = { sizeof(SP_DEVINFO_DATA) };
+    for (DWORD i = 0; node < 0 && SetupDiEnumDeviceInfo(devices, i, &device); i++) {
+        HKEY key = SetupDiOpenDevRegKey(devices, &device, DICS_FLAG_GLOBAL, 0, DIREG_DRV, KEY_READ);
+        if (key == INVALID_HANDLE_VALUE) continue;
+        char instanceId[64] = {};
+        DWORD cbInstanceId = sizeof(instanceId) - 1;
+        bool match = RegQueryValueExA(key, "NetCfgInstanceId", nullptr, nullptr, reinterpret_cast<BYTE*>(instanceId), &cbInstanceId) == ERROR_SUCCESS &&
+            _stricmp(instanceId, adapterName) == 0;
+        RegCloseKey(key);
+        if (!match) continue;
+
+        DEVPROPTYPE type;
+        UINT32 value;
+        if (SetupDiGetDevicePropertyW(devices, &device, &NumaNodeKey, &type, reinterpret_cast<BYTE*>(&value), sizeof(value), nullptr, 0)) {
+            node = static_cast<LONG>(value);
+        }
+        break;
+    }
+    SetupDiDestroyDeviceInfoList(devices);
+    return node;
+}
+
+NDLocality NDMemory::QueryLocality(const sockaddr_in& address) {
+    NDLocality locality;
+    ULONG size = 16 * 1024;
+    std::vector<char> buffer;
+    ULONG result;
+    do {
+        buffer.resize(size);
+        result = GetAdaptersAddresses(AF_INET, GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER, nullptr,
+            reinterpret_cast<IP_ADAPTER_ADDRESSES*>(buffer.data()), &size);
+    } while (result == ERROR_BUFFER_OVERFLOW);
+    if (result != NO_ERROR) return locality;
+
+    for (auto* pAdapter = reinterpret_cast<IP_ADAPTER_ADDRESSES*>(buffer.data()); pAdapter; pAdapter = pAdapter->Next) {
+        for (auto* pUnicast = pAdapter->FirstUnicastAddress; pUnicast; pUnicast = pUnicast->Next) {
+            const sockaddr_in* pAddr = reinterpret_cast<const sockaddr_in*>(pUnicast->Address.lpSockaddr);
+            if (pAddr->sin_family != AF_INET || pAddr->sin_addr.s_addr != address.sin_addr.s_addr) continue;
+
+            locality.NumaNode = NumaNodeOfInterface(pAdapter->AdapterName);
+            GROUP_AFFINITY cores = {};
+            if (locality.IsKnown() && GetNumaNodeProcessorMaskEx(static_cast<USHORT>(locality.NumaNode), &cores)) {
+                locality.Group = cores.Group;
+                locality.Affinity = cores.Mask;
+            }
+            return locality;
+        }
+    }
+    return locality;
+}
+
+// Large pages need SeLockMemoryPrivilege, which an account can hold but a
+// process never has enabled to begin with.
+static bool EnableLockMemoryPrivilege() {
+    static const bool enabled = []() {
+        HANDLE hToken;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken)) return false;
+        TOKEN_PRIVILEGES privileges = {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        // AdjustTokenPrivileges succeeds without the privilege; only the last error says.
+        bool ok = LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(hToken, FALSE, &privileges, 0, nullptr, nullptr) && GetLastError() == ERROR_SUCCESS;
+        CloseHandle(hToken);
+        return ok;
+    }();
+    return enabled;
+}
+
+static void* Reserve(SIZE_T length, DWORD type, LONG numaNode) {
+    return numaNode >= 0
+        ? VirtualAllocExNuma(GetCurrentProcess(), nullptr, length, type, PAGE_READWRITE, static_cast<DWORD>(numaNode))
+        : VirtualAlloc(nullptr, length, type, PAGE_READWRITE);
+}
+
+SIZE_T NDMemory::LargePageSize() {
+    return GetLargePageMinimum();
+}
+
+void* NDMemory::Allocate(SIZE_T length, LONG numaNode, ULONG flags) {
+    // Large pages are committed locked and zeroed, so there is nothing to prefault.
+    if (WantsLargePages(length, flags) && EnableLockMemoryPrivilege()) {
+        void* pBuffer = Reserve(RoundUp(length, LargePageSize()), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, numaNode);
+        if (pBuffer != nullptr) return pBuffer;
+    }
+
+    void* pBuffer = Reserve(length, MEM_RESERVE | MEM_COMMIT, numaNode);
+    if (pBuffer == nullptr) return nullptr;
+    if (flags & Prefault) PrefaultPages(pBuffer, length, SmallPage);
+    return pBuffer;
+}
+
+void NDMemory::Free(void* pBuffer, SIZE_T, ULONG) {
+    if (pBuffer != nullptr) VirtualFree(pBuffer, 0, MEM_RELEASE);
+}
+
+bool NDMemory::BindCurrentThread(const NDLocality& locality) {
+    if (locality.Affinity == 0) return false;
+    GROUP_AFFINITY cores = {};
+    cores.Group = locality.Group;
+    cores.Mask = locality.Affinity;
+    return SetThreadGroupAffinity(GetCurrentThread(), &cores, nullptr) != 0;
+}
+#else
+// The node's cores as a mask; only the first 64 fit, as in one Windows group.
+static KAFFINITY ReadNodeCores(LONG node) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list)) return 0;
+
+    // A comma-separated list of cores and ranges, such as "0-7,16-23".
+    KAFFINITY mask = 0;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        unsigned long first = std::stoul(range.substr(0, dash));
+        unsigned long last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+        for (unsigned long core = first; core <= last && core < sizeof(KAFFINITY) * 8; core++) mask |= KAFFINITY(1) << core;
+        pos = end + 1;
+    }
+    return mask;
+}
+
+NDLocality NDMemory::QueryLocality(const sockaddr_in& address) {
+    NDLocality locality;
+    ifaddrs* pList = nullptr;
+    if (getifaddrs(&pList) != 0) return locality;
+
+    for (ifaddrs* pIf = pList; pIf; pIf = pIf->ifa_next) {
+        if (pIf->ifa_addr == nullptr || pIf->ifa_addr->sa_family != AF_INET) continue;
+        if (reinterpret_cast<const sockaddr_in*>(pIf->ifa_addr)->sin_addr.s_addr != address.sin_addr.s_addr) continue;
+
+        // Virtual interfaces, loopback among them, have no device and so no node.
+        std::ifstream file(std::string("/sys/class/net/") + pIf->ifa_name + "/device/numa_node");
+        LONG node = -1;
+        if (file >> node && node >= 0) {
+            locality.NumaNode = node;
+            locality.Affinity = ReadNodeCores(node);
+        }
+        break;
+    }
+    freeifaddrs(pList);
+    return locality;
+}
+
+SIZE_T NDMemory::LargePageSize() {
+    static const SIZE_T size = []() {
+        std::ifstream file("/proc/meminfo");
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.rfind("Hugepagesize:", 0) == 0) return static_cast<SIZE_T>(std::stoull(line.substr(13))) * 1024;
+        }
+        return SIZE_T(0);
+    }();
+    return size;
+}
+
+// Transparent huge pages need the mapping aligned to the huge page size,
+// which mmap does not promise: map one page more and trim both ends.
+static void* MapAligned(SIZE_T length, SIZE_T alignment) {
+    SIZE_T padded = length + alignment;
+    void* pMapping = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pMapping == MAP_FAILED) return MAP_FAILED;
+
+    char* pBase = static_cast<char*>(pMapping);
+    char* pAligned = reinterpret_cast<char*>(RoundUp(reinterpret_cast<SIZE_T>(pBase), alignment));
+    if (pAligned != pBase) munmap(pBase, pAligned - pBase);
+    SIZE_T tail = padded - (pAligned - pBase) - length;
+    if (tail != 0) munmap(pAligned + length, tail);
+    return pAligned;
+}
+
+void* NDMemory::Allocate(SIZE_T length, LONG numaNode, ULONG flags) {
+    bool large = WantsLargePages(length, flags);
+    SIZE_T mapped = large ? RoundUp(length, LargePageSize()) : length;
+    SIZE_T stride = SmallPage;
+
+    void* pBuffer = MAP_FAILED;
+    if (large) {
+        // Reserved huge pages first; they are only there if an administrator set some aside.
+        pBuffer = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (pBuffer != MAP_FAILED) {
+            stride = LargePageSize();
+        } else {
+            pBuffer = MapAligned(mapped, LargePageSize());
+            if (pBuffer != MAP_FAILED) madvise(pBuffer, mapped, MADV_HUGEPAGE);
+        }
+    } else {
+        pBuffer = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (pBuffer == MAP_FAILED) return nullptr;
+
+    // MPOL_PREFERRED, called directly so there is no dependency on libnuma.
+    // It only fails where the kernel has no NUMA support, and then there is
+    // only the one node anyway.
+    constexpr int PreferredPolicy = 1;
+    if (numaNode >= 0 && numaNode < static_cast<LONG>(sizeof(unsigned long) * 8)) {
+        unsigned long nodeMask = 1UL << numaNode;
+        syscall(SYS_mbind, pBuffer, mapped, PreferredPolicy, &nodeMask, sizeof(nodeMask) * 8 + 1, 0);
+    }
+    if (flags & Prefault) PrefaultPages(pBuffer, mapped, stride);
+    return pBuffer;
+}
+
+void NDMemory::Free(void* pBuffer, SIZE_T length, ULONG flags) {
+    if (pBuffer != nullptr) munmap(pBuffer, WantsLargePages(length, flags) ? RoundUp(length, LargePageSize()) : length);
+}
+
+bool NDMemory::BindCurrentThread(const NDLocality& locality) {
+    if (locality.Affinity == 0) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (ULONG core = 0; core < sizeof(KAFFINITY) * 8; core++) {
+        if (locality.Affinity & (KAFFINITY(1) << core)) CPU_SET(core, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+#endif
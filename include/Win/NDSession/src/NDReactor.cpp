@@ -0,0 +1,208 @@
+#include "NDReactor.hpp"
+#include "NDSession.hpp"
+#include <algorithm>
+#include <array>
+#include <iostream>
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+// MARK: NDReactor
+NDReactor::NDReactor() {
+    #ifdef _WIN32
+    m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+    #else
+    m_Epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_hWake = CreateEvent(nullptr, false, false, nullptr);
+    if (m_Epoll >= 0 && m_hWake != nullptr) {
+        // The wake event is the one entry without an OVERLAPPED.
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(m_Epoll, EPOLL_CTL_ADD, Win32Compat::GetEventFd(m_hWake), &ev);
+    }
+    #endif
+}
+
+NDReactor::~NDReactor() {
+    while (!m_Sources.empty()) Unregister(*m_Sources.back()->pSession);
+    #ifdef _WIN32
+    if (m_hPort) CloseHandle(m_hPort);
+    #else
+    if (m_Epoll >= 0) close(m_Epoll);
+    if (m_hWake) CloseHandle(m_hWake);
+    #endif
+}
+
+bool NDReactor::IsInitialized() const {
+    #ifdef _WIN32
+    return m_hPort != nullptr;
+    #else
+    return m_Epoll >= 0 && m_hWake != nullptr;
+    #endif
+}
+
+HRESULT NDReactor::Register(NDSessionBase& session, CompletionHandler onCompletions) {
+    if (!IsInitialized()) return E_OUTOFMEMORY;
+    if (session.m_pCq == nullptr || session.m_pReactor != nullptr || session.m_pLoop != nullptr) return ND_INVALID_DEVICE_STATE;
+
+    auto pSource = std::make_unique<Source>();
+    pSource->pSession = &session;
+    pSource->pCq = session.m_pCq;
+    pSource->OnCompletions = std::move(onCompletions);
+
+    #ifdef _WIN32
+    // Notify completes through the port, since its OVERLAPPED has no event.
+    // The file is bound once; a second CreateIoCompletionPort would fail.
+    if (session.m_hAdapterPort != nullptr && session.m_hAdapterPort != m_hPort) {
+        std::cerr << "The session's adapter file is bound to another reactor's completion port." << std::endl;
+        return ND_INVALID_DEVICE_STATE;
+    }
+    if (session.m_hAdapterPort == nullptr) {
+        if (CreateIoCompletionPort(session.m_hAdapterFile, m_hPort, 0, 0) == nullptr) {
+            HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+            std::cerr << "Failed to bind the adapter file to the completion port: " << std::hex << hr << std::endl;
+            return hr;
+        }
+        session.m_hAdapterPort = m_hPort;
+    }
+    #else
+    pSource->NotifyOv.hEvent = CreateEvent(nullptr, false, false, nullptr);
+    if (pSource->NotifyOv.hEvent == nullptr) return E_OUTOFMEMORY;
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pSource->NotifyOv;
+    if (epoll_ctl(m_Epoll, EPOLL_CTL_ADD, Win32Compat::GetEventFd(pSource->NotifyOv.hEvent), &ev) != 0) {
+        std::cerr << "Failed to add a CQ to epoll: " << errno << std::endl;
+        CloseHandle(pSource->NotifyOv.hEvent);
+        return E_FAIL;
+    }
+    #endif
+
+    Source& source = *pSource;
+    m_ByOverlapped.emplace(&source.NotifyOv, &source);
+    m_Sources.push_back(std::move(pSource));
+    session.m_pReactor = this;
+
+    // Anything already queued is handled at once and the CQ is left armed.
+    m_Stats.Completions += Service(source);
+    return ND_SUCCESS;
+}
+
+void NDReactor::Unregister(NDSessionBase& session) {
+    auto it = std::find_if(m_Sources.begin(), m_Sources.end(), [&](const auto& p) { return p->pSession == &session; });
+    if (it == m_Sources.end()) return;
+
+    Source& source = **it;
+    Disarm(source);
+    m_ByOverlapped.erase(&source.NotifyOv);
+    #ifndef _WIN32
+    epoll_ctl(m_Epoll, EPOLL_CTL_DEL, Win32Compat::GetEventFd(source.NotifyOv.hEvent), nullptr);
+    CloseHandle(source.NotifyOv.hEvent);
+    #endif
+    m_Sources.erase(it);
+    session.m_pReactor = nullptr;
+}
+
+// Cancelling completes the Notify, so its OVERLAPPED is free once this returns.
+void NDReactor::Disarm(Source& source) {
+    if (!source.Armed) return;
+    source.pCq->CancelOverlappedRequests();
+    source.pCq->GetOverlappedResult(&source.NotifyOv, true);
+    source.Armed = false;
+}
+
+ULONG NDReactor::RunOnce(DWORD timeoutMs) {
+    std::array<OVERLAPPED*, MaxEvents> ready;
+    ULONG nReady = 0;
+
+    #ifdef _WIN32
+    std::array<OVERLAPPED_ENTRY, MaxEvents> entries;
+    ULONG nEntries = 0;
+    if (!GetQueuedCompletionStatusEx(m_hPort, entries.data(), MaxEvents, &nEntries, timeoutMs, false)) return 0;
+    for (ULONG i = 0; i < nEntries; i++) {
+        // Stop posts a packet without an OVERLAPPED; it only ends the wait.
+        if (entries[i].lpOverlapped != nullptr) ready[nReady++] = entries[i].lpOverlapped;
+    }
+    #else
+    std::array<epoll_event, MaxEvents> events;
+    int timeout = timeoutMs == INFINITE ? -1 : static_cast<int>(timeoutMs);
+    int nEvents = epoll_wait(m_Epoll, events.data(), MaxEvents, timeout);
+    if (nEvents < 0) return 0;
+    for (int i = 0; i < nEvents; i++) {
+        OVERLAPPED* pOv = static_cast<OVERLAPPED*>(events[i].data.ptr);
+        if (pOv == nullptr) {
+            ResetEvent(m_hWake);
+            continue;
+        }
+        // The events are auto-reset, but epoll only looks at them; consume
+        // the signal here or the next wait returns at once.
+        ResetEvent(pOv->hEvent);
+        ready[nReady++] = pOv;
+    }
+    #endif
+
+    if (nReady > 0) m_Stats.Wakeups++;
+    ULONG handled = 0;
+    for (ULONG i = 0; i < nReady; i++) {
+        auto it = m_ByOverlapped.find(ready[i]);
+        if (it == m_ByOverlapped.end()) continue;
+
+        Source& source = *it->second;
+        // Only a completed Notify counts; anything else is a stale signal.
+        if (source.Armed && source.pCq->GetOverlappedResult(&source.NotifyOv, false) == ND_PENDING) continue;
+        source.Armed = false;
+        handled += Service(source);
+    }
+    m_Stats.Completions += handled;
+    return handled;
+}
+
+void NDReactor::Run() {
+    while (!m_Stopping.load(std::memory_order_acquire)) RunOnce(INFINITE);
+    m_Stopping.store(false, std::memory_order_release);
+}
+
+void NDReactor::Stop() {
+    m_Stopping.store(true, std::memory_order_release);
+    #ifdef _WIN32
+    PostQueuedCompletionStatus(m_hPort, 0, 0, nullptr);
+    #else
+    SetEvent(m_hWake);
+    #endif
+}
+
+// Drains the CQ, arms it and drains once more: a completion landing between
+// the first drain and Notify would otherwise never signal.
+ULONG NDReactor::Service(Source& source) {
+    m_Stats.Services++;
+    ULONG handled = Drain(source);
+    if (!source.Armed) {
+        HRESULT hr = source.pCq->Notify(ND_CQ_NOTIFY_ANY, &source.NotifyOv);
+        source.Armed = hr == ND_PENDING;
+        if (!source.Armed) std::cerr << "Failed to arm a CQ for the reactor: " << std::hex << hr << std::endl;
+    }
+    return handled + Drain(source);
+}
+
+ULONG NDReactor::Drain(Source& source) {
+    NDSessionBase& session = *source.pSession;
+    std::array<ND2_RESULT, Batch> results;
+    ULONG handled = 0;
+    ULONG n;
+    do {
+        n = session.WaitForCompletions(results, NDSessionBase::CompletionWait::Poll);
+        // Plain completions are packed to the front as tracked ones are dispatched.
+        ULONG unclaimed = 0;
+        for (ULONG i = 0; i < n; i++) {
+            if (!session.Dispatch(results[i])) results[unclaimed++] = results[i];
+        }
+        if (unclaimed > 0 && source.OnCompletions) {
+            source.OnCompletions(session, std::span<const ND2_RESULT>(results.data(), unclaimed));
+        }
+        handled += n;
+    } while (n == Batch);
+    return handled;
+}
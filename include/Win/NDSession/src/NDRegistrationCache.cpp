@@ -0,0 +1,181 @@
+#include "NDRegistrationCache.hpp"
+#include <algorithm>
+#include <iostream>
+
+// Pinning works on whole pages, so registering whole pages costs nothing extra
+// and lets neighbouring buffers hit.
+constexpr UINT64 PageSize = 4096;
+
+// MARK: NDRegistrationCache
+NDRegistrationCache::~NDRegistrationCache() {
+    Close();
+}
+
+HRESULT NDRegistrationCache::Initialize(IND2Adapter* pAdapter, HANDLE hAdapterFile, ULONG flags, UINT64 byteBudget) {
+    if (IsInitialized() || pAdapter == nullptr) return E_INVALIDARG;
+
+    m_Ov.hEvent = CreateEvent(nullptr, false, false, nullptr);
+    if (m_Ov.hEvent == nullptr) return E_OUTOFMEMORY;
+
+    m_pAdapter = pAdapter;
+    m_hAdapterFile = hAdapterFile;
+    m_Flags = flags;
+    m_ByteBudget = byteBudget;
+    return ND_SUCCESS;
+}
+
+void NDRegistrationCache::Close() {
+    for (auto& [start, pRegion] : m_Index) Deregister(*pRegion);
+    for (auto& pRegion : m_Retired) Deregister(*pRegion);
+    m_Index.clear();
+    m_Retired.clear();
+    m_Lru.clear();
+    if (m_Ov.hEvent) {
+        CloseHandle(m_Ov.hEvent);
+        m_Ov.hEvent = nullptr;
+    }
+    m_pAdapter = nullptr;
+}
+
+HRESULT NDRegistrationCache::Acquire(const void* pBuf, SIZE_T length, Handle* pHandle) {
+    if (!IsInitialized() || pBuf == nullptr || length == 0) return E_INVALIDARG;
+
+    UINT64 start = reinterpret_cast<UINT64>(pBuf);
+    UINT64 end = start + length;
+
+    // The only region that can cover start is the last one beginning at or before it.
+    auto it = m_Index.upper_bound(start);
+    if (it != m_Index.begin()) {
+        Region& region = *std::prev(it)->second;
+        if (region.End >= end) {
+            if (region.References++ == 0) m_Lru.erase(region.Unused);
+            m_Stats.Hits++;
+            *pHandle = Handle(&region, region.Token);
+            return ND_SUCCESS;
+        }
+    }
+    m_Stats.Misses++;
+
+    // Grow the page-aligned request over every region it overlaps or touches.
+    UINT64 mergedStart = start & ~(PageSize - 1);
+    UINT64 mergedEnd = (end + PageSize - 1) & ~(PageSize - 1);
+    auto first = m_Index.upper_bound(mergedStart);
+    if (first != m_Index.begin() && std::prev(first)->second->End >= mergedStart) first = std::prev(first);
+    auto last = first;
+    while (last != m_Index.end() && last->second->Start <= mergedEnd) {
+        mergedStart = std::min(mergedStart, last->second->Start);
+        mergedEnd = std::max(mergedEnd, last->second->End);
+        ++last;
+    }
+
+    std::unique_ptr<Region> pMerged;
+    HRESULT hr = Register(mergedStart, mergedEnd, &pMerged);
+    if (FAILED(hr)) return hr;
+
+    for (auto merged = first; merged != last; ++merged) {
+        Region& region = *merged->second;
+        m_Stats.Merges++;
+        if (region.References == 0) {
+            m_Lru.erase(region.Unused);
+            Deregister(region);
+        } else {
+            region.Retired = true;
+            m_Retired.push_back(std::move(merged->second));
+        }
+    }
+    m_Index.erase(first, last);
+
+    Region& region = *pMerged;
+    region.References = 1;
+    m_Index.emplace(region.Start, std::move(pMerged));
+    *pHandle = Handle(&region, region.Token);
+
+    Evict();
+    return ND_SUCCESS;
+}
+
+void NDRegistrationCache::Release(Handle& handle) {
+    Region* pRegion = handle.m_pRegion;
+    handle = Handle();
+    if (pRegion == nullptr || --pRegion->References != 0) return;
+
+    if (pRegion->Retired) {
+        Deregister(*pRegion);
+        auto retired = std::find_if(m_Retired.begin(), m_Retired.end(), [pRegion](const auto& p) { return p.get() == pRegion; });
+        if (retired != m_Retired.end()) m_Retired.erase(retired);
+        return;
+    }
+
+    pRegion->Unused = m_Lru.insert(m_Lru.end(), pRegion);
+    Evict();
+}
+
+void NDRegistrationCache::Invalidate(const void* pBuf, SIZE_T length) {
+    if (!IsInitialized() || pBuf == nullptr || length == 0) return;
+
+    UINT64 start = reinterpret_cast<UINT64>(pBuf);
+    UINT64 end = start + length;
+    auto first = m_Index.upper_bound(start);
+    if (first != m_Index.begin() && std::prev(first)->second->End > start) first = std::prev(first);
+    auto last = first;
+    for (; last != m_Index.end() && last->second->Start < end; ++last) {
+        Region& region = *last->second;
+        m_Stats.Invalidations++;
+        if (region.References == 0) {
+            m_Lru.erase(region.Unused);
+            Deregister(region);
+        } else {
+            region.Retired = true;
+            m_Retired.push_back(std::move(last->second));
+        }
+    }
+    m_Index.erase(first, last);
+}
+
+NDRegistrationCache::Handle NDRegistrationCache::FromContext(void* requestContext) {
+    Region* pRegion = static_cast<Region*>(requestContext);
+    return pRegion != nullptr ? Handle(pRegion, pRegion->Token) : Handle();
+}
+
+HRESULT NDRegistrationCache::Register(UINT64 start, UINT64 end, std::unique_ptr<Region>* ppRegion) {
+    auto pRegion = std::make_unique<Region>();
+    pRegion->Start = start;
+    pRegion->End = end;
+
+    HRESULT hr = m_pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion, m_hAdapterFile, reinterpret_cast<void**>(&pRegion->pMr));
+    if (FAILED(hr)) return hr;
+
+    hr = pRegion->pMr->Register(reinterpret_cast<void*>(start), static_cast<SIZE_T>(end - start), m_Flags, &m_Ov);
+    if (hr == ND_PENDING) hr = pRegion->pMr->GetOverlappedResult(&m_Ov, true);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to register " << (end - start) << " bytes for the registration cache: " << std::hex << hr << std::endl;
+        pRegion->pMr->Release();
+        pRegion->pMr = nullptr;
+        return hr;
+    }
+
+    pRegion->Token = pRegion->pMr->GetLocalToken();
+    m_Stats.RegisteredBytes += end - start;
+    *ppRegion = std::move(pRegion);
+    return ND_SUCCESS;
+}
+
+void NDRegistrationCache::Deregister(Region& region) {
+    if (region.pMr == nullptr) return;
+
+    HRESULT hr = region.pMr->Deregister(&m_Ov);
+    if (hr == ND_PENDING) region.pMr->GetOverlappedResult(&m_Ov, true);
+    region.pMr->Release();
+    region.pMr = nullptr;
+    m_Stats.RegisteredBytes -= region.End - region.Start;
+}
+
+void NDRegistrationCache::Evict() {
+    while (m_Stats.RegisteredBytes > m_ByteBudget && !m_Lru.empty()) {
+        Region* pRegion = m_Lru.front();
+        m_Lru.pop_front();
+        Deregister(*pRegion);
+        m_Index.erase(pRegion->Start);
+        m_Stats.Evictions++;
+    }
+}
@@ -0,0 +1,159 @@
+#include "NDSegmentedRegion.hpp"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Largest segment an ND2_SGE can still describe whole.
+static constexpr SIZE_T MaxSegmentSize = 0xFFFFFFFF / NDSegmentedRegion::SegmentAlignment * NDSegmentedRegion::SegmentAlignment;
+
+// MARK: NDSegmentedRegion
+NDSegmentedRegion::~NDSegmentedRegion() {
+    Deregister();
+}
+
+template <typename Work>
+HRESULT NDSegmentedRegion::ForEachSegment(ULONG threads, Work work) {
+    std::atomic<ULONG> next{ 0 };
+    std::atomic<HRESULT> failure{ ND_SUCCESS };
+    auto fail = [&failure](HRESULT hr) {
+        HRESULT expected = ND_SUCCESS;
+        failure.compare_exchange_strong(expected, hr);
+    };
+
+    auto worker = [&]() {
+        OVERLAPPED ov = {};
+        ov.hEvent = CreateEvent(nullptr, false, false, nullptr);
+        if (ov.hEvent == nullptr) {
+            fail(E_OUTOFMEMORY);
+            return;
+        }
+        for (ULONG i = next.fetch_add(1); i < m_SegmentCount && failure.load() == ND_SUCCESS; i = next.fetch_add(1)) {
+            HRESULT hr = work(m_Segments[i], &ov);
+            if (FAILED(hr)) fail(hr);
+        }
+        CloseHandle(ov.hEvent);
+    };
+
+    // The calling thread is one of the workers.
+    std::vector<std::thread> workers;
+    for (ULONG i = 1; i < threads; i++) workers.emplace_back(worker);
+    worker();
+    for (std::thread& thread : workers) thread.join();
+    return failure.load();
+}
+
+HRESULT NDSegmentedRegion::Register(IND2Adapter* pAdapter, HANDLE hAdapterFile, void* pBuffer, UINT64 length, ULONG flags,
+    SIZE_T segmentSize, ULONG threads) {
+    if (IsRegistered() || pAdapter == nullptr || pBuffer == nullptr || length == 0) return E_INVALIDARG;
+
+    ND2_ADAPTER_INFO info = { 0 };
+    info.InfoVersion = ND_VERSION_2;
+    ULONG infoSize = sizeof(info);
+    HRESULT hr = pAdapter->Query(&info, &infoSize);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to query adapter info: " << std::hex << hr << std::endl;
+        return hr;
+    }
+
+    SIZE_T size = segmentSize != 0 ? segmentSize : DefaultSegmentSize;
+    size = (size + SegmentAlignment - 1) / SegmentAlignment * SegmentAlignment;
+    size = std::min({ size, MaxSegmentSize, static_cast<SIZE_T>(info.MaxRegistrationSize) / SegmentAlignment * SegmentAlignment });
+    if (size == 0) return E_INVALIDARG;
+    UINT64 count = (length + size - 1) / size;
+    if (count > 0xFFFFFFFF) return E_INVALIDARG;
+
+    m_pBase = static_cast<char*>(pBuffer);
+    m_Length = length;
+    m_SegmentSize = size;
+    m_SegmentCount = static_cast<ULONG>(count);
+    m_Segments = std::make_unique<Segment[]>(m_SegmentCount);
+    for (ULONG i = 0; i < m_SegmentCount; i++) {
+        UINT64 offset = static_cast<UINT64>(i) * size;
+        m_Segments[i].pBase = m_pBase + offset;
+        m_Segments[i].Length = static_cast<SIZE_T>(std::min<UINT64>(size, length - offset));
+    }
+
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    m_Threads = std::min(threads, m_SegmentCount);
+
+    hr = ForEachSegment(m_Threads, [pAdapter, hAdapterFile, flags](Segment& segment, OVERLAPPED* pOv) {
+        HRESULT hr = pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion, hAdapterFile, reinterpret_cast<void**>(&segment.pMr));
+        if (FAILED(hr)) return hr;
+        hr = segment.pMr->Register(segment.pBase, segment.Length, flags, pOv);
+        if (hr == ND_PENDING) hr = segment.pMr->GetOverlappedResult(pOv, true);
+        if (FAILED(hr)) return hr;
+        segment.Registered = true;
+        segment.LocalToken = segment.pMr->GetLocalToken();
+        segment.RemoteToken = segment.pMr->GetRemoteToken();
+        return ND_SUCCESS;
+    });
+    if (FAILED(hr)) {
+        std::cerr << "Failed to register a segment: " << std::hex << hr << std::endl;
+        Deregister();
+    }
+    return hr;
+}
+
+void NDSegmentedRegion::Deregister() {
+    if (!IsRegistered()) return;
+
+    // Regions created but never registered are only released.
+    ForEachSegment(m_Threads, [](Segment& segment, OVERLAPPED* pOv) {
+        if (segment.pMr == nullptr) return ND_SUCCESS;
+        if (segment.Registered) {
+            HRESULT hr = segment.pMr->Deregister(pOv);
+            if (hr == ND_PENDING) segment.pMr->GetOverlappedResult(pOv, true);
+            segment.Registered = false;
+        }
+        segment.pMr->Release();
+        segment.pMr = nullptr;
+        return ND_SUCCESS;
+    });
+
+    m_Segments.reset();
+    m_SegmentCount = 0;
+    m_pBase = nullptr;
+    m_Length = 0;
+    m_SegmentSize = 0;
+    m_Threads = 1;
+}
+
+bool NDSegmentedRegion::Span(UINT64 offset, UINT64 length, ULONG maxPieces, ULONG* pFirst, ULONG* pLast) const {
+    if (length == 0 || offset > m_Length || length > m_Length - offset) return false;
+    *pFirst = static_cast<ULONG>(offset / m_SegmentSize);
+    *pLast = static_cast<ULONG>((offset + length - 1) / m_SegmentSize);
+    return *pLast - *pFirst < maxPieces;
+}
+
+NDSegmentedRegion::Piece NDSegmentedRegion::Slice(ULONG index, UINT64 offset, UINT64 end) const {
+    const Segment& segment = m_Segments[index];
+    UINT64 segmentStart = static_cast<UINT64>(index) * m_SegmentSize;
+    UINT64 start = std::max(offset, segmentStart);
+    end = std::min<UINT64>(end, segmentStart + segment.Length);
+
+    Piece piece;
+    piece.pAddress = m_pBase + start;
+    piece.Length = static_cast<ULONG>(end - start);
+    piece.LocalToken = segment.LocalToken;
+    piece.RemoteToken = segment.RemoteToken;
+    return piece;
+}
+
+ULONG NDSegmentedRegion::Map(UINT64 offset, UINT64 length, Piece* pPieces, ULONG maxPieces) const {
+    ULONG first, last;
+    if (!Span(offset, length, maxPieces, &first, &last)) return 0;
+    for (ULONG i = first; i <= last; i++) pPieces[i - first] = Slice(i, offset, offset + length);
+    return last - first + 1;
+}
+
+ULONG NDSegmentedRegion::BuildSges(UINT64 offset, UINT64 length, ND2_SGE* pSges, ULONG maxSge) const {
+    ULONG first, last;
+    if (!Span(offset, length, maxSge, &first, &last)) return 0;
+    for (ULONG i = first; i <= last; i++) {
+        Piece piece = Slice(i, offset, offset + length);
+        pSges[i - first] = { piece.pAddress, piece.Length, piece.LocalToken };
+    }
+    return last - first + 1;
+}
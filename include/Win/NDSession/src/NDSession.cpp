@@ -1,6 +1,10 @@
 #include "NDSession.hpp"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <iostream>
+#include <new>
+#include <thread>
 
 
 template<typename T>
@@ -20,17 +24,25 @@ NDSessionBase::NDSessionBase() :
 }
 
 NDSessionBase::~NDSessionBase() {
+    if (m_pLoop) m_pLoop->Detach(*this);
+    if (m_pReactor) m_pReactor->Unregister(*this);
+    ReleaseStripes();
+    m_BufferPool.Close();
+    m_RegistrationCache.Close();
     SafeRelease(m_pMr);
     SafeRelease(m_pMw);
     SafeRelease(m_pCq);
     SafeRelease(m_pQp);
+    SafeRelease(m_pSrq);
+    m_SrqPool.Close();
+    m_ChannelPool.Close();
+    ReleaseRing();
     SafeRelease(m_pConnector);
     if (m_hAdapterFile) CloseHandle(m_hAdapterFile);
+    if (m_Ov.hEvent) CloseHandle(m_Ov.hEvent);
     SafeRelease(m_pAdapter);
-    if (m_Buf) {
-        HeapFree(GetProcessHeap(), 0, m_Buf);
-        m_Buf = nullptr;
-    }
+    NDMemory::Free(m_Buf, m_Buf_Len, m_Buf_Flags);
+    m_Buf = nullptr;
 }
 
 HRESULT NDSessionBase::CreateMR() {
@@ -38,7 +50,7 @@ HRESULT NDSessionBase::CreateMR() {
     return hr;
 }
 
-HRESULT NDSessionBase::RegisterDataBuffer(DWORD bufferLength, ULONG type) {
+HRESULT NDSessionBase::RegisterDataBuffer(SIZE_T bufferLength, ULONG type, ULONG allocation) {
     if (m_Buf) {
         HRESULT hr = m_pMr->Deregister(&m_Ov);
         if (hr == ND_PENDING) {
@@ -50,12 +62,13 @@ HRESULT NDSessionBase::RegisterDataBuffer(DWORD bufferLength, ULONG type) {
             #endif
             return hr;
         }
-        HeapFree(GetProcessHeap(), 0, m_Buf);
+        NDMemory::Free(m_Buf, m_Buf_Len, m_Buf_Flags);
         m_Buf = nullptr;
     }
 
     m_Buf_Len = bufferLength;
-    m_Buf = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, m_Buf_Len);
+    m_Buf_Flags = allocation;
+    m_Buf = NDMemory::Allocate(m_Buf_Len, m_Locality.NumaNode, m_Buf_Flags);
     if (!m_Buf) {
         std::cerr << "Failed to allocate memory for buffer." << std::endl;
         return E_OUTOFMEMORY;
@@ -64,7 +77,7 @@ HRESULT NDSessionBase::RegisterDataBuffer(DWORD bufferLength, ULONG type) {
     return RegisterDataBuffer(m_Buf, m_Buf_Len, type);
 }
 
-HRESULT NDSessionBase::RegisterDataBuffer(void *pBuf, DWORD bufferLength, ULONG type) {
+HRESULT NDSessionBase::RegisterDataBuffer(void *pBuf, SIZE_T bufferLength, ULONG type) {
     HRESULT hr = m_pMr->Register(pBuf, bufferLength, type, &m_Ov);
     if (hr == ND_PENDING) {
         hr = m_pMr->GetOverlappedResult(&m_Ov, true);
@@ -72,6 +85,19 @@ HRESULT NDSessionBase::RegisterDataBuffer(void *pBuf, DWORD bufferLength, ULONG
     return hr;
 }
 
+HRESULT NDSessionBase::CreateBufferPool(ULONG type, std::span<const NDBufferPool::SizeClass> classes) {
+    return m_BufferPool.Initialize(m_pAdapter, m_hAdapterFile, type, classes, m_Locality.NumaNode);
+}
+
+HRESULT NDSessionBase::CreateRegistrationCache(UINT64 byteBudget, ULONG type) {
+    return m_RegistrationCache.Initialize(m_pAdapter, m_hAdapterFile, type, byteBudget);
+}
+
+HRESULT NDSessionBase::RegisterSegmented(NDSegmentedRegion* pRegion, void* pBuffer, UINT64 length, ULONG type,
+    SIZE_T segmentSize, ULONG threads) {
+    return pRegion->Register(m_pAdapter, m_hAdapterFile, pBuffer, length, type, segmentSize, threads);
+}
+
 HRESULT NDSessionBase::CreateMW() {
     HRESULT hr = m_pAdapter->CreateMemoryWindow(IID_IND2MemoryWindow, reinterpret_cast<void**>(&m_pMw));
     return hr;
@@ -82,11 +108,11 @@ HRESULT NDSessionBase::InvalidateMW() {
     return hr;
 }
 
-std::variant<HRESULT, ND2_RESULT> NDSessionBase::Bind(DWORD bufferLength, ULONG flags, void *context) {
+std::variant<HRESULT, ND2_RESULT> NDSessionBase::Bind(SIZE_T bufferLength, ULONG flags, void *context) {
     return Bind(m_Buf, bufferLength, flags, context);
 }
 
-std::variant<HRESULT, ND2_RESULT> NDSessionBase::Bind(const void *pBuf, DWORD bufferLength, ULONG flags, void *context) {
+std::variant<HRESULT, ND2_RESULT> NDSessionBase::Bind(const void *pBuf, SIZE_T bufferLength, ULONG flags, void *context) {
     HRESULT hr = m_pQp->Bind(context, m_pMr, m_pMw, pBuf, bufferLength, flags);
     if (hr != ND_SUCCESS) {
         return hr;
@@ -100,33 +126,140 @@ std::variant<HRESULT, ND2_RESULT> NDSessionBase::Bind(const void *pBuf, DWORD bu
     return ndRes;
 }
 
+HRESULT NDSessionBase::Bind(const void *pBuf, SIZE_T bufferLength, ULONG flags, NDDispatcher::Handler handler) {
+    return PostTracked(std::move(handler), [&](void* requestContext) {
+        return m_pQp->Bind(requestContext, m_pMr, m_pMw, pBuf, bufferLength, flags);
+    });
+}
+
 HRESULT NDSessionBase::CreateCQ(DWORD depth) {
-    HRESULT hr = m_pAdapter->CreateCompletionQueue(IID_IND2CompletionQueue, m_hAdapterFile, depth, 0, 0, reinterpret_cast<void**>(&m_pCq));
-    return hr;
+    return CreateCQ(&m_pCq, depth);
 }
 
+// An affinity of 0 leaves the choice of cores to the provider.
 HRESULT NDSessionBase::CreateCQ(IND2CompletionQueue **pCq, DWORD depth) {
-    HRESULT hr = m_pAdapter->CreateCompletionQueue(IID_IND2CompletionQueue, m_hAdapterFile, depth, 0, 0, reinterpret_cast<void**>(pCq));
+    HRESULT hr = m_pAdapter->CreateCompletionQueue(IID_IND2CompletionQueue, m_hAdapterFile, depth, m_Locality.Group, m_Locality.Affinity,
+        reinterpret_cast<void**>(pCq));
     return hr;
 }
 
+HRESULT NDSessionBase::GetNotifyAffinity(USHORT* pGroup, KAFFINITY* pAffinity) {
+    if (m_pCq == nullptr) return ND_INVALID_DEVICE_STATE;
+    return m_pCq->GetNotifyAffinity(pGroup, pAffinity);
+}
+
 HRESULT NDSessionBase::CreateConnector() {
     HRESULT hr = m_pAdapter->CreateConnector(IID_IND2Connector, m_hAdapterFile, reinterpret_cast<void**>(&m_pConnector));
     return hr;
 }
 
 HRESULT NDSessionBase::CreateQP(DWORD queueDepth, DWORD nSge, DWORD inlineDataSize) {
-    HRESULT hr = m_pAdapter->CreateQueuePair(IID_IND2QueuePair, m_pCq, m_pCq, nullptr, queueDepth, queueDepth,
-        nSge, nSge, inlineDataSize, reinterpret_cast<void**>(&m_pQp));
+    return CreateQP(queueDepth, queueDepth, nSge, nSge, inlineDataSize);
+}
+
+HRESULT NDSessionBase::CreateQP(DWORD receiveQueueDepth, DWORD initiatorQueueDepth, DWORD maxReceiveRequestSge, DWORD maxInitiatorRequestSge,
+    DWORD inlineDataSize) {
+    inlineDataSize = ResolveInlineSize(inlineDataSize);
+    HRESULT hr = m_pAdapter->CreateQueuePair(IID_IND2QueuePair, m_pCq, m_pCq, nullptr, receiveQueueDepth, initiatorQueueDepth,
+        maxReceiveRequestSge, maxInitiatorRequestSge, inlineDataSize, reinterpret_cast<void**>(&m_pQp));
+    if (FAILED(hr)) return hr;
+
+    SetInlineThreshold(inlineDataSize);
     return hr;
 }
 
-HRESULT NDSessionBase::CreateQP(DWORD receiveQueueDepth, DWORD initiatorQueueDepth, DWORD maxReceiveRequestSge, DWORD maxInitiatorRequestSge) {
-    HRESULT hr = m_pAdapter->CreateQueuePair(IID_IND2QueuePair, m_pCq, m_pCq, nullptr, maxReceiveRequestSge, initiatorQueueDepth,
-        maxReceiveRequestSge, maxInitiatorRequestSge, 0, reinterpret_cast<void**>(&m_pQp));
+HRESULT NDSessionBase::CreateSRQ(ULONG depth, ULONG bufferSize, ULONG lowWater, ReceiveHandler onReceive) {
+    if (m_pSrq != nullptr || depth == 0 || bufferSize == 0 || lowWater > depth) return ND_INVALID_PARAMETER;
+
+    HRESULT hr = m_pAdapter->CreateSharedReceiveQueue(IID_IND2SharedReceiveQueue, m_hAdapterFile, depth, 1, lowWater,
+        m_Locality.Group, m_Locality.Affinity, reinterpret_cast<void**>(&m_pSrq));
+    if (FAILED(hr)) {
+        std::cerr << "Failed to create shared receive queue: " << std::hex << hr << std::endl;
+        return hr;
+    }
+
+    const NDBufferPool::SizeClass classes[] = { { bufferSize, depth } };
+    hr = m_SrqPool.Initialize(m_pAdapter, m_hAdapterFile, ND_MR_FLAG_ALLOW_LOCAL_WRITE, classes, m_Locality.NumaNode);
+    if (FAILED(hr)) {
+        SafeRelease(m_pSrq);
+        return hr;
+    }
+
+    m_OnSrqReceive = std::move(onReceive);
+    m_SrqDepth = depth;
+    // 0 refills after every completion rather than never.
+    m_SrqLowWater = lowWater != 0 ? lowWater : depth;
+    m_SrqBufferSize = m_SrqPool.ClassSize(0);
+    m_SrqPosted = 0;
+    return RefillSRQ();
+}
+
+HRESULT NDSessionBase::CreateQPWithSrq(DWORD initiatorQueueDepth, DWORD nSge, DWORD inlineDataSize) {
+    return CreateQPWithSrq(&m_pQp, initiatorQueueDepth, nSge, inlineDataSize);
+}
+
+HRESULT NDSessionBase::CreateQPWithSrq(IND2QueuePair** ppQp, DWORD initiatorQueueDepth, DWORD nSge, DWORD inlineDataSize) {
+    if (m_pSrq == nullptr) return ND_INVALID_DEVICE_REQUEST;
+
+    inlineDataSize = ResolveInlineSize(inlineDataSize);
+    HRESULT hr = m_pAdapter->CreateQueuePairWithSrq(IID_IND2QueuePair, m_pCq, m_pCq, m_pSrq, nullptr, initiatorQueueDepth,
+        nSge, inlineDataSize, reinterpret_cast<void**>(ppQp));
+    if (FAILED(hr)) return hr;
+
+    SetInlineThreshold(inlineDataSize);
     return hr;
 }
 
+HRESULT NDSessionBase::RefillSRQ() {
+    while (m_SrqPosted < m_SrqDepth) {
+        NDBuffer buffer = m_SrqPool.Allocate(m_SrqBufferSize);
+        if (!buffer) return ND_INSUFFICIENT_RESOURCES;
+        m_SrqToken = buffer.Token;
+
+        ND2_SGE sge = buffer.Sge();
+        HRESULT hr = PostTracked([this, pData = buffer.Data](const ND2_RESULT& result) { OnSrqReceive(pData, result); },
+            [&](void* requestContext) {
+                return m_pSrq->Receive(requestContext, &sge, 1);
+            });
+        if (FAILED(hr)) {
+            m_SrqPool.Free(buffer);
+            return hr;
+        }
+        m_SrqPosted++;
+    }
+    return ND_SUCCESS;
+}
+
+void NDSessionBase::OnSrqReceive(void* pData, const ND2_RESULT& result) {
+    m_SrqPosted--;
+    if (m_OnSrqReceive) m_OnSrqReceive(result, NDBuffer{ pData, m_SrqBufferSize, m_SrqToken });
+    m_SrqPool.Free(pData);
+
+    // Flushed receives are not replaced; the SRQ is going away.
+    if (result.Status == ND_CANCELED || m_SrqPosted >= m_SrqLowWater) return;
+    HRESULT hr = RefillSRQ();
+    if (FAILED(hr)) std::cerr << "Failed to refill shared receive queue: " << std::hex << hr << std::endl;
+}
+
+DWORD NDSessionBase::ResolveInlineSize(DWORD inlineDataSize) {
+    if (inlineDataSize != AdapterInlineSize) return inlineDataSize;
+    return GetAdapterInfo().MaxInlineDataSize;
+}
+
+// Past the adapter's InlineRequestThreshold copying costs more than the DMA read it saves.
+void NDSessionBase::SetInlineThreshold(DWORD inlineDataSize) {
+    ND2_ADAPTER_INFO info = GetAdapterInfo();
+    m_InlineThreshold = info.InlineRequestThreshold != 0 ? std::min<ULONG>(inlineDataSize, info.InlineRequestThreshold) : inlineDataSize;
+}
+
+ULONG NDSessionBase::InlineFlag(const ND2_SGE* Sge, ULONG nSge, ULONG flags) const {
+    if (!m_AutoInline || (flags & ND_OP_FLAG_INLINE) != 0 || m_InlineThreshold == 0) return flags;
+
+    UINT64 length = 0;
+    for (ULONG i = 0; i < nSge; i++) length += Sge[i].BufferLength;
+    return (length != 0 && length <= m_InlineThreshold) ? (flags | ND_OP_FLAG_INLINE) : flags;
+}
+
 bool NDSessionBase::Initialize(char* localAddr) {
     struct sockaddr_in addr = { 0 };
     int len = sizeof(addr);
@@ -154,6 +287,7 @@ bool NDSessionBase::Initialize(char* localAddr) {
     }
 
     m_MaxPerTransfer = info.MaxTransferLength;
+    m_Locality = NDMemory::QueryLocality(addr);
 
     m_Ov.hEvent = CreateEvent(nullptr, false, false, nullptr);
     if (m_Ov.hEvent == nullptr) {
@@ -222,6 +356,7 @@ HRESULT NDSessionBase::GetResult() {
 }
 
 void NDSessionBase::Shutdown() {
+    DisconnectStripes();
     DisconnectConnector();
     DeregisterMemory();
 }
@@ -232,7 +367,7 @@ HRESULT NDSessionBase::PostReceive(const ND2_SGE* Sge, const DWORD nSge, void *r
 }
 
 HRESULT NDSessionBase::Write(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags, void *requestContext) {
-    HRESULT hr = m_pQp->Write(requestContext, Sge, nSge, remoteAddr, remoteToken, flags);
+    HRESULT hr = m_pQp->Write(requestContext, Sge, nSge, remoteAddr, remoteToken, InlineFlag(Sge, nSge, flags));
     return hr;
 }
 
@@ -242,10 +377,825 @@ HRESULT NDSessionBase::Read(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteA
 }
 
 HRESULT NDSessionBase::Send(const ND2_SGE* Sge, const ULONG nSge, ULONG flags, void* requestContext) {
-    HRESULT hr = m_pQp->Send(requestContext, Sge, nSge, flags);
+    HRESULT hr = m_pQp->Send(requestContext, Sge, nSge, InlineFlag(Sge, nSge, flags));
+    return hr;
+}
+
+template <typename Post>
+HRESULT NDSessionBase::PostTracked(NDDispatcher::Handler&& handler, Post post) {
+    void* requestContext = m_Dispatcher.Track(std::move(handler));
+    if (requestContext == nullptr) return ND_INSUFFICIENT_RESOURCES;
+
+    HRESULT hr = post(requestContext);
+    if (FAILED(hr)) m_Dispatcher.Cancel(requestContext);
+    return hr;
+}
+
+HRESULT NDSessionBase::PostReceive(const ND2_SGE* Sge, const DWORD nSge, NDDispatcher::Handler handler) {
+    return PostTracked(std::move(handler), [&](void* requestContext) {
+        return m_pQp->Receive(requestContext, Sge, nSge);
+    });
+}
+
+HRESULT NDSessionBase::Send(const ND2_SGE* Sge, const ULONG nSge, ULONG flags, NDDispatcher::Handler handler) {
+    return PostTracked(std::move(handler), [&](void* requestContext) {
+        return m_pQp->Send(requestContext, Sge, nSge, InlineFlag(Sge, nSge, flags));
+    });
+}
+
+HRESULT NDSessionBase::PostReceive(NDConnection& connection, const ND2_SGE* Sge, const DWORD nSge, NDDispatcher::Handler handler) {
+    return PostTracked(std::move(handler), [&](void* requestContext) {
+        return connection.QueuePair()->Receive(requestContext, Sge, nSge);
+    });
+}
+
+HRESULT NDSessionBase::Send(NDConnection& connection, const ND2_SGE* Sge, const ULONG nSge, ULONG flags, NDDispatcher::Handler handler) {
+    return PostTracked(std::move(handler), [&](void* requestContext) {
+        return connection.QueuePair()->Send(requestContext, Sge, nSge, InlineFlag(Sge, nSge, flags));
+    });
+}
+
+HRESULT NDSessionBase::Write(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags,
+    NDDispatcher::Handler handler) {
+    return PostTracked(std::move(handler), [&](void* requestContext) {
+        return m_pQp->Write(requestContext, Sge, nSge, remoteAddr, remoteToken, InlineFlag(Sge, nSge, flags));
+    });
+}
+
+HRESULT NDSessionBase::Read(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags,
+    NDDispatcher::Handler handler) {
+    return PostTracked(std::move(handler), [&](void* requestContext) {
+        return m_pQp->Read(requestContext, Sge, nSge, remoteAddr, remoteToken, flags);
+    });
+}
+
+// MARK: Selective signaling
+template <typename Post>
+HRESULT NDSessionBase::PostSelective(NDDispatcher::Handler&& handler, ND2_REQUEST_TYPE type, const ND2_SGE* Sge, ULONG nSge,
+    bool last, Post post) {
+    bool signal = last || m_SilentSinceSignal + 1 >= m_SignalInterval;
+    void* context = nullptr;
+    HRESULT hr = PostTracked(std::move(handler), [&](void* requestContext) {
+        context = requestContext;
+        return post(requestContext, signal ? 0 : ND_OP_FLAG_SILENT_SUCCESS);
+    });
+    if (FAILED(hr)) return hr;
+
+    UINT64 sequence = m_SelectiveSequence++;
+    if (signal) {
+        m_Signaled.push_back({ context, sequence });
+        m_SilentSinceSignal = 0;
+    } else {
+        ULONG bytes = 0;
+        for (ULONG i = 0; i < nSge; i++) bytes += Sge[i].BufferLength;
+        m_Silent.push_back({ context, sequence, type, bytes });
+        m_SilentSinceSignal++;
+    }
+    return hr;
+}
+
+HRESULT NDSessionBase::SendSelective(const ND2_SGE* Sge, const ULONG nSge, ULONG flags, NDDispatcher::Handler handler, bool last) {
+    return PostSelective(std::move(handler), Nd2RequestTypeSend, Sge, nSge, last, [&](void* requestContext, ULONG silent) {
+        return m_pQp->Send(requestContext, Sge, nSge, InlineFlag(Sge, nSge, flags) | silent);
+    });
+}
+
+HRESULT NDSessionBase::WriteSelective(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags,
+    NDDispatcher::Handler handler, bool last) {
+    return PostSelective(std::move(handler), Nd2RequestTypeWrite, Sge, nSge, last, [&](void* requestContext, ULONG silent) {
+        return m_pQp->Write(requestContext, Sge, nSge, remoteAddr, remoteToken, InlineFlag(Sge, nSge, flags) | silent);
+    });
+}
+
+HRESULT NDSessionBase::ReadSelective(const ND2_SGE* Sge, const ULONG nSge, UINT64 remoteAddr, UINT32 remoteToken, DWORD flags,
+    NDDispatcher::Handler handler, bool last) {
+    return PostSelective(std::move(handler), Nd2RequestTypeRead, Sge, nSge, last, [&](void* requestContext, ULONG silent) {
+        return m_pQp->Read(requestContext, Sge, nSge, remoteAddr, remoteToken, flags | silent);
+    });
+}
+
+// Completes the silent requests posted before sequence, which a completion
+// posted later proves have succeeded. Those that failed completed on their own.
+void NDSessionBase::RetireSilent(UINT64 sequence, const ND2_RESULT& result) {
+    while (!m_Silent.empty() && m_Silent.front().Sequence < sequence) {
+        SilentRequest request = m_Silent.front();
+        m_Silent.pop_front();
+        if (!m_Dispatcher.IsOutstanding(request.Context)) continue;
+
+        ND2_RESULT silent = {};
+        silent.Status = ND_SUCCESS;
+        silent.BytesTransferred = request.Bytes;
+        silent.QueuePairContext = result.QueuePairContext;
+        silent.RequestContext = request.Context;
+        silent.RequestType = request.Type;
+        m_Dispatcher.Dispatch(silent);
+    }
+}
+
+// Runs a tracked request's handler, after those of the silent requests its
+// completion retires, so handlers always run in posting order.
+bool NDSessionBase::Dispatch(const ND2_RESULT& result) {
+    if (!m_Signaled.empty() && m_Signaled.front().Context == result.RequestContext) {
+        RetireSilent(m_Signaled.front().Sequence, result);
+        m_Signaled.pop_front();
+    } else if (FAILED(result.Status) && !m_Silent.empty()) {
+        // A silent request that failed; rare enough to look for.
+        auto failed = std::find_if(m_Silent.begin(), m_Silent.end(),
+            [&result](const SilentRequest& request) { return request.Context == result.RequestContext; });
+        if (failed != m_Silent.end()) {
+            RetireSilent(failed->Sequence, result);
+            m_Silent.pop_front();
+        }
+    }
+    return m_Dispatcher.Dispatch(result);
+}
+
+// MARK: Large transfers
+// One user-level request. Freed by the completion of its last piece.
+struct NDSessionBase::LargeTransfer {
+    ND2_REQUEST_TYPE Type;
+    char* pBuf;
+    UINT64 Length;
+    UINT64 Posted = 0;      // bytes handed to the QP so far
+    UINT32 LocalToken;
+    UINT64 RemoteAddr = 0;
+    UINT32 RemoteToken = 0;
+    ULONG Depth;
+    ULONG InFlight = 0;
+    HRESULT Status = ND_SUCCESS;
+    NDDispatcher::Handler OnComplete;
+};
+
+HRESULT NDSessionBase::WriteLarge(const void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+    NDDispatcher::Handler onComplete, ULONG depth) {
+    return StartLarge(new LargeTransfer{ Nd2RequestTypeWrite, static_cast<char*>(const_cast<void*>(pBuf)), length, 0, localToken,
+        remoteAddr, remoteToken, depth, 0, ND_SUCCESS, std::move(onComplete) });
+}
+
+HRESULT NDSessionBase::ReadLarge(void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+    NDDispatcher::Handler onComplete, ULONG depth) {
+    return StartLarge(new LargeTransfer{ Nd2RequestTypeRead, static_cast<char*>(pBuf), length, 0, localToken,
+        remoteAddr, remoteToken, depth, 0, ND_SUCCESS, std::move(onComplete) });
+}
+
+HRESULT NDSessionBase::SendLarge(const void* pBuf, UINT64 length, UINT32 localToken, NDDispatcher::Handler onComplete, ULONG depth) {
+    return StartLarge(new LargeTransfer{ Nd2RequestTypeSend, static_cast<char*>(const_cast<void*>(pBuf)), length, 0, localToken,
+        0, 0, depth, 0, ND_SUCCESS, std::move(onComplete) });
+}
+
+UINT64 NDSessionBase::LargePieces(UINT64 length) const {
+    UINT64 piece = std::max<UINT64>(1, std::min<UINT64>(m_MaxPerTransfer, 0xFFFFFFFF));
+    return (length + piece - 1) / piece;
+}
+
+HRESULT NDSessionBase::StartLarge(LargeTransfer* pTransfer) {
+    if (pTransfer->Length == 0 || pTransfer->Depth == 0) {
+        delete pTransfer;
+        return ND_INVALID_PARAMETER;
+    }
+
+    PumpLarge(pTransfer);
+    if (pTransfer->InFlight == 0) {
+        // Nothing was posted, so no completion will report the failure.
+        HRESULT hr = pTransfer->Status;
+        delete pTransfer;
+        return hr;
+    }
+    return ND_SUCCESS;
+}
+
+void NDSessionBase::PumpLarge(LargeTransfer* pTransfer) {
+    UINT64 maxPiece = std::max<UINT64>(1, std::min<UINT64>(m_MaxPerTransfer, 0xFFFFFFFF));
+    while (pTransfer->InFlight < pTransfer->Depth && pTransfer->Posted < pTransfer->Length && SUCCEEDED(pTransfer->Status)) {
+        UINT64 offset = pTransfer->Posted;
+        ULONG piece = static_cast<ULONG>(std::min(maxPiece, pTransfer->Length - offset));
+        ND2_SGE sge = { pTransfer->pBuf + offset, piece, pTransfer->LocalToken };
+        auto onPiece = [this, pTransfer](const ND2_RESULT& result) { OnLargePiece(pTransfer, result); };
+
+        HRESULT hr;
+        switch (pTransfer->Type) {
+            case Nd2RequestTypeWrite:
+                hr = Write(&sge, 1, pTransfer->RemoteAddr + offset, pTransfer->RemoteToken, 0, onPiece);
+                break;
+            case Nd2RequestTypeRead:
+                hr = Read(&sge, 1, pTransfer->RemoteAddr + offset, pTransfer->RemoteToken, 0, onPiece);
+                break;
+            default:
+                hr = Send(&sge, 1, 0, onPiece);
+                break;
+        }
+        if (FAILED(hr)) {
+            pTransfer->Status = hr;
+            break;
+        }
+        pTransfer->Posted += piece;
+        pTransfer->InFlight++;
+    }
+}
+
+void NDSessionBase::OnLargePiece(LargeTransfer* pTransfer, const ND2_RESULT& result) {
+    pTransfer->InFlight--;
+    if (FAILED(result.Status) && SUCCEEDED(pTransfer->Status)) pTransfer->Status = result.Status;
+
+    PumpLarge(pTransfer);
+    if (pTransfer->InFlight != 0) return;
+
+    ND2_RESULT done = result;
+    done.Status = pTransfer->Status;
+    done.BytesTransferred = static_cast<ULONG>(std::min<UINT64>(SUCCEEDED(pTransfer->Status) ? pTransfer->Length : 0, 0xFFFFFFFF));
+    done.RequestContext = nullptr;
+    done.RequestType = pTransfer->Type;
+    NDDispatcher::Handler onComplete = std::move(pTransfer->OnComplete);
+    delete pTransfer;
+    if (onComplete) onComplete(done);
+}
+
+// MARK: Striped transfers
+// Where one lane is in a striped transfer. Pieces of a lane start at Next and
+// step by Stride until End.
+struct NDSessionBase::StripeCursor {
+    StripedTransfer* pTransfer;
+    ULONG Lane;
+    UINT64 Next;
+    UINT64 End;
+    UINT64 Stride;
+    ULONG InFlight = 0;
+};
+
+// Freed by the completion of its last piece, on whichever lane that is.
+struct NDSessionBase::StripedTransfer {
+    ND2_REQUEST_TYPE Type;
+    char* pBuf;
+    UINT64 Length;
+    UINT32 LocalToken;
+    UINT64 RemoteAddr;
+    UINT32 RemoteToken;
+    UINT64 Unit;
+    ULONG Depth;
+    ULONG InFlight = 0;
+    HRESULT Status = ND_SUCCESS;
+    NDDispatcher::Handler OnComplete;
+    std::vector<StripeCursor> Cursors;
+};
+
+HRESULT NDSessionBase::CreateStripes(ULONG count, DWORD queueDepth) {
+    if (!m_Stripes.empty() || count == 0 || queueDepth == 0) return ND_INVALID_PARAMETER;
+
+    m_hStripeEvent = CreateEvent(nullptr, false, false, nullptr);
+    if (m_hStripeEvent == nullptr) return E_OUTOFMEMORY;
+
+    m_Stripes.resize(count);
+    for (StripeLane& lane : m_Stripes) {
+        lane.NotifyOv.hEvent = m_hStripeEvent;
+        HRESULT hr = CreateCQ(&lane.pCq, queueDepth);
+        if (SUCCEEDED(hr)) {
+            // Lanes only initiate single-SGE pieces, so one receive and no inline data.
+            hr = m_pAdapter->CreateQueuePair(IID_IND2QueuePair, lane.pCq, lane.pCq, nullptr, 1, queueDepth, 1, 1, 0,
+                reinterpret_cast<void**>(&lane.pQp));
+        }
+        if (SUCCEEDED(hr)) {
+            hr = m_pAdapter->CreateConnector(IID_IND2Connector, m_hAdapterFile, reinterpret_cast<void**>(&lane.pConnector));
+        }
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create stripe lane: " << std::hex << hr << std::endl;
+            ReleaseStripes();
+            return hr;
+        }
+    }
+    return ND_SUCCESS;
+}
+
+void NDSessionBase::DisconnectStripes() {
+    for (StripeLane& lane : m_Stripes) {
+        if (!lane.Connected) continue;
+        HRESULT hr = lane.pConnector->Disconnect(&m_Ov);
+        if (hr == ND_PENDING) hr = lane.pConnector->GetOverlappedResult(&m_Ov, true);
+        if (FAILED(hr)) std::cerr << "Failed to disconnect stripe lane: " << std::hex << hr << std::endl;
+        lane.Connected = false;
+    }
+}
+
+void NDSessionBase::ReleaseStripes() {
+    for (StripeLane& lane : m_Stripes) {
+        SafeRelease(lane.pConnector);
+        SafeRelease(lane.pQp);
+        // Cancels an armed Notify, which still signals the event.
+        SafeRelease(lane.pCq);
+    }
+    m_Stripes.clear();
+    if (m_hStripeEvent) {
+        CloseHandle(m_hStripeEvent);
+        m_hStripeEvent = nullptr;
+    }
+}
+
+HRESULT NDSessionBase::WriteStriped(const void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+    NDDispatcher::Handler onComplete, const StripeOptions& options) {
+    return StartStriped(Nd2RequestTypeWrite, static_cast<char*>(const_cast<void*>(pBuf)), length, localToken, remoteAddr,
+        remoteToken, std::move(onComplete), options);
+}
+
+HRESULT NDSessionBase::ReadStriped(void* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr, UINT32 remoteToken,
+    NDDispatcher::Handler onComplete, const StripeOptions& options) {
+    return StartStriped(Nd2RequestTypeRead, static_cast<char*>(pBuf), length, localToken, remoteAddr,
+        remoteToken, std::move(onComplete), options);
+}
+
+HRESULT NDSessionBase::StartStriped(ND2_REQUEST_TYPE type, char* pBuf, UINT64 length, UINT32 localToken, UINT64 remoteAddr,
+    UINT32 remoteToken, NDDispatcher::Handler&& onComplete, const StripeOptions& options) {
+    ULONG lanes = options.Lanes == 0 ? StripeCount() : options.Lanes;
+    if (length == 0 || options.Depth == 0 || lanes == 0 || lanes > StripeCount()) return ND_INVALID_PARAMETER;
+
+    UINT64 maxPiece = std::max<UINT64>(1, std::min<UINT64>(m_MaxPerTransfer, 0xFFFFFFFF));
+    UINT64 unit = options.Unit;
+    if (unit == 0) {
+        UINT64 pieces = static_cast<UINT64>(lanes) * options.Depth;
+        unit = std::max(MinStripeUnit, (length + pieces - 1) / pieces);
+    }
+    unit = std::min(unit, maxPiece);
+
+    auto pTransfer = new StripedTransfer{ type, pBuf, length, localToken, remoteAddr, remoteToken, unit, options.Depth,
+        0, ND_SUCCESS, std::move(onComplete), {} };
+    pTransfer->Cursors.reserve(lanes);
+    UINT64 share = length / lanes;
+    UINT64 remainder = length % lanes;
+    for (ULONG i = 0; i < lanes; i++) {
+        if (options.Policy == StripePolicy::RoundRobin) {
+            pTransfer->Cursors.push_back({ pTransfer, i, unit * i, length, unit * lanes });
+        } else {
+            UINT64 start = share * i + std::min<UINT64>(i, remainder);
+            UINT64 end = start + share + (i < remainder ? 1 : 0);
+            pTransfer->Cursors.push_back({ pTransfer, i, start, end, unit });
+        }
+    }
+
+    for (StripeCursor& cursor : pTransfer->Cursors) PumpStripe(&cursor);
+    if (pTransfer->InFlight == 0) {
+        // Nothing was posted, so no completion will report the failure.
+        HRESULT hr = pTransfer->Status;
+        delete pTransfer;
+        return hr;
+    }
+    return ND_SUCCESS;
+}
+
+void NDSessionBase::PumpStripe(StripeCursor* pCursor) {
+    StripedTransfer* pTransfer = pCursor->pTransfer;
+    IND2QueuePair* pQp = m_Stripes[pCursor->Lane].pQp;
+    while (pCursor->InFlight < pTransfer->Depth && pCursor->Next < pCursor->End && SUCCEEDED(pTransfer->Status)) {
+        UINT64 offset = pCursor->Next;
+        ULONG piece = static_cast<ULONG>(std::min(pTransfer->Unit, pCursor->End - offset));
+        ND2_SGE sge = { pTransfer->pBuf + offset, piece, pTransfer->LocalToken };
+        UINT64 remoteAddr = pTransfer->RemoteAddr + offset;
+
+        HRESULT hr = PostTracked([this, pCursor](const ND2_RESULT& result) { OnStripePiece(pCursor, result); },
+            [&](void* requestContext) {
+                return pTransfer->Type == Nd2RequestTypeWrite
+                    ? pQp->Write(requestContext, &sge, 1, remoteAddr, pTransfer->RemoteToken, 0)
+                    : pQp->Read(requestContext, &sge, 1, remoteAddr, pTransfer->RemoteToken, 0);
+            });
+        if (FAILED(hr)) {
+            pTransfer->Status = hr;
+            break;
+        }
+        pCursor->Next += pCursor->Stride;
+        pCursor->InFlight++;
+        pTransfer->InFlight++;
+    }
+}
+
+void NDSessionBase::OnStripePiece(StripeCursor* pCursor, const ND2_RESULT& result) {
+    StripedTransfer* pTransfer = pCursor->pTransfer;
+    pCursor->InFlight--;
+    pTransfer->InFlight--;
+    if (FAILED(result.Status) && SUCCEEDED(pTransfer->Status)) pTransfer->Status = result.Status;
+
+    PumpStripe(pCursor);
+    if (pTransfer->InFlight != 0) return;
+
+    ND2_RESULT done = result;
+    done.Status = pTransfer->Status;
+    done.BytesTransferred = static_cast<ULONG>(std::min<UINT64>(SUCCEEDED(pTransfer->Status) ? pTransfer->Length : 0, 0xFFFFFFFF));
+    done.RequestContext = nullptr;
+    done.RequestType = pTransfer->Type;
+    NDDispatcher::Handler onComplete = std::move(pTransfer->OnComplete);
+    delete pTransfer;
+    if (onComplete) onComplete(done);
+}
+
+ULONG NDSessionBase::PollStripes() {
+    std::array<ND2_RESULT, CompletionBatch> results;
+    ULONG dispatched = 0;
+    for (StripeLane& lane : m_Stripes) {
+        ULONG n = lane.pCq->GetResults(results.data(), CompletionBatch);
+        for (ULONG i = 0; i < n; i++) {
+            // Lanes only carry tracked pieces.
+            if (m_Dispatcher.Dispatch(results[i])) dispatched++;
+        }
+    }
+    return dispatched;
+}
+
+// Every idle lane is armed against the one shared event, so a completion on
+// any of them ends the wait.
+ULONG NDSessionBase::DispatchStripes(CompletionWait mode) {
+    ULONG dispatched = PollStripes();
+    if (dispatched > 0 || mode == CompletionWait::Poll || m_Stripes.empty()) return dispatched;
+
+    static const bool canSpin = std::thread::hardware_concurrency() > 1;
+    if (mode == CompletionWait::SpinThenBlock && canSpin) {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point deadline = Clock::now() + m_SpinBudget;
+        do {
+            dispatched = PollStripes();
+            if (dispatched > 0) {
+                m_SpinHits++;
+                return dispatched;
+            }
+            _mm_pause();
+        } while (Clock::now() < deadline);
+    }
+
+    m_EventWaits++;
+    for (;;) {
+        for (StripeLane& lane : m_Stripes) {
+            if (lane.Armed && lane.pCq->GetOverlappedResult(&lane.NotifyOv, false) != ND_PENDING) lane.Armed = false;
+            if (!lane.Armed) lane.Armed = lane.pCq->Notify(ND_CQ_NOTIFY_ANY, &lane.NotifyOv) == ND_PENDING;
+        }
+        dispatched = PollStripes();
+        if (dispatched > 0) return dispatched;
+        WaitForSingleObject(m_hStripeEvent, INFINITE);
+    }
+}
+
+// MARK: Credit channel
+// Leads every channel message; Credits returns that many of the sender's
+// reposted receives.
+struct ChannelHeader {
+    UINT32 Credits;
+    UINT32 Flags;
+};
+
+HRESULT NDSessionBase::CreateChannel(const ChannelOptions& options, MessageHandler onMessage) {
+    if (m_pQp == nullptr || m_pSrq != nullptr || m_ChannelPool.IsInitialized()) return ND_INVALID_DEVICE_STATE;
+    ULONG peerDepth = options.PeerDepth != 0 ? options.PeerDepth : options.Depth;
+    if (options.Depth < 3 || peerDepth < 3 || options.MessageSize == 0 || !onMessage) return ND_INVALID_PARAMETER;
+
+    // Receives stay with their slot for the life of the channel; sends take
+    // one per credit in flight or queued message.
+    m_ChannelSlotSize = sizeof(ChannelHeader) + options.MessageSize;
+    const NDBufferPool::SizeClass classes[] = { { m_ChannelSlotSize, options.Depth + peerDepth + options.Backlog } };
+    HRESULT hr = m_ChannelPool.Initialize(m_pAdapter, m_hAdapterFile, ND_MR_FLAG_ALLOW_LOCAL_WRITE, classes, m_Locality.NumaNode);
+    if (FAILED(hr)) return hr;
+
+    m_OnChannelMessage = std::move(onMessage);
+    m_ChannelMessageSize = options.MessageSize;
+    // Below Depth, so a peer down to its spare credit is always owed a batch.
+    // At least 2, since every update costs the peer a receive: with a batch
+    // of 1 that alone would call for an update back, forever.
+    m_ChannelCreditBatch = std::clamp<ULONG>(options.CreditBatch != 0 ? options.CreditBatch : options.Depth / 4, 2, options.Depth - 1);
+    m_ChannelCredits = peerDepth;
+    m_ChannelOwed = 0;
+    m_ChannelBacklog.assign(options.Backlog, QueuedMessage{});
+    m_ChannelBacklogHead = 0;
+    m_ChannelBacklogCount = 0;
+    m_ChannelStats = {};
+
+    for (ULONG i = 0; i < options.Depth; i++) {
+        NDBuffer slot = m_ChannelPool.Allocate(m_ChannelSlotSize);
+        if (!slot) return ND_INSUFFICIENT_RESOURCES;
+        m_ChannelToken = slot.Token;
+        hr = PostChannelReceive(slot.Data);
+        if (FAILED(hr)) {
+            m_ChannelPool.Free(slot);
+            return hr;
+        }
+    }
+    return ND_SUCCESS;
+}
+
+HRESULT NDSessionBase::ChannelSend(const void* pData, ULONG length) {
+    if (!m_ChannelPool.IsInitialized()) return ND_INVALID_DEVICE_STATE;
+    if (length > m_ChannelMessageSize) return ND_INVALID_BUFFER_SIZE;
+
+    // The last credit is kept for credit updates.
+    if (m_ChannelBacklogCount == 0 && m_ChannelCredits > 1) return PostChannelSend(pData, length, 0);
+    if (m_ChannelBacklogCount == m_ChannelBacklog.size()) return ND_INSUFFICIENT_RESOURCES;
+
+    NDBuffer slot = m_ChannelPool.Allocate(m_ChannelSlotSize);
+    if (!slot) return ND_INSUFFICIENT_RESOURCES;
+    memcpy(static_cast<char*>(slot.Data) + sizeof(ChannelHeader), pData, length);
+    ULONG tail = (m_ChannelBacklogHead + m_ChannelBacklogCount) % m_ChannelBacklog.size();
+    m_ChannelBacklog[tail] = { slot.Data, length };
+    m_ChannelBacklogCount++;
+    m_ChannelStats.Queued++;
+    return ND_SUCCESS;
+}
+
+HRESULT NDSessionBase::PostChannelReceive(void* pSlot) {
+    ND2_SGE sge = { pSlot, m_ChannelSlotSize, m_ChannelToken };
+    return PostTracked([this, pSlot](const ND2_RESULT& result) { OnChannelReceive(pSlot, result); },
+        [&](void* requestContext) {
+            return m_pQp->Receive(requestContext, &sge, 1);
+        });
+}
+
+void NDSessionBase::OnChannelReceive(void* pSlot, const ND2_RESULT& result) {
+    if (FAILED(result.Status) || result.BytesTransferred < sizeof(ChannelHeader)) {
+        if (result.Status != ND_CANCELED) std::cerr << "Channel receive failed: " << std::hex << result.Status << std::endl;
+        m_ChannelPool.Free(pSlot);
+        return;
+    }
+
+    ChannelHeader header;
+    memcpy(&header, pSlot, sizeof(header));
+    m_ChannelCredits += header.Credits;
+    if ((header.Flags & ChannelCreditOnly) == 0) {
+        m_ChannelStats.Received++;
+        m_OnChannelMessage(static_cast<char*>(pSlot) + sizeof(header), result.BytesTransferred - sizeof(header));
+    }
+
+    // Only a reposted receive can be handed back as a credit.
+    HRESULT hr = PostChannelReceive(pSlot);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to repost a channel receive: " << std::hex << hr << std::endl;
+        m_ChannelPool.Free(pSlot);
+    } else {
+        m_ChannelOwed++;
+    }
+    PumpChannel();
+}
+
+HRESULT NDSessionBase::PostChannelSend(const void* pData, ULONG length, UINT32 flags) {
+    NDBuffer slot = m_ChannelPool.Allocate(m_ChannelSlotSize);
+    if (!slot) return ND_INSUFFICIENT_RESOURCES;
+
+    if (length > 0) memcpy(static_cast<char*>(slot.Data) + sizeof(ChannelHeader), pData, length);
+    HRESULT hr = PostChannelSlot(slot.Data, length, flags);
+    if (FAILED(hr)) m_ChannelPool.Free(slot);
     return hr;
 }
 
+// Sends a slot whose payload is already in place, filling in the header
+// last so it carries every credit owed up to now. The slot returns to the
+// pool when the send completes; on failure it stays with the caller.
+HRESULT NDSessionBase::PostChannelSlot(void* pSlot, ULONG length, UINT32 flags) {
+    ChannelHeader header = { m_ChannelOwed, flags };
+    memcpy(pSlot, &header, sizeof(header));
+
+    ND2_SGE sge = { pSlot, static_cast<ULONG>(sizeof(header)) + length, m_ChannelToken };
+    HRESULT hr = PostTracked([this, pSlot](const ND2_RESULT& result) {
+        if (FAILED(result.Status) && result.Status != ND_CANCELED) {
+            std::cerr << "Channel send failed: " << std::hex << result.Status << std::endl;
+        }
+        m_ChannelPool.Free(pSlot);
+    }, [&](void* requestContext) {
+        return m_pQp->Send(requestContext, &sge, 1, InlineFlag(&sge, 1, 0));
+    });
+    if (FAILED(hr)) return hr;
+
+    m_ChannelCredits--;
+    m_ChannelOwed = 0;
+    (flags & ChannelCreditOnly) ? m_ChannelStats.CreditUpdates++ : m_ChannelStats.Sent++;
+    return ND_SUCCESS;
+}
+
+// Sends what the returned credits allow, then hands back our own credits if
+// nothing else carried them.
+void NDSessionBase::PumpChannel() {
+    while (m_ChannelBacklogCount > 0 && m_ChannelCredits > 1) {
+        const QueuedMessage& message = m_ChannelBacklog[m_ChannelBacklogHead];
+        HRESULT hr = PostChannelSlot(message.pSlot, message.Length, 0);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to send a queued channel message: " << std::hex << hr << std::endl;
+            return;
+        }
+        m_ChannelBacklogHead = (m_ChannelBacklogHead + 1) % m_ChannelBacklog.size();
+        m_ChannelBacklogCount--;
+    }
+
+    if (m_ChannelOwed >= m_ChannelCreditBatch && m_ChannelCredits > 0) {
+        // After the peer disconnects there is nobody left to tell.
+        HRESULT hr = PostChannelSend(nullptr, 0, ChannelCreditOnly);
+        if (FAILED(hr) && hr != ND_CONNECTION_INVALID) std::cerr << "Failed to send a credit update: " << std::hex << hr << std::endl;
+    }
+}
+
+// MARK: Ring channel
+// Leads every ring record. Flags is never zero, so a header that reads as zero
+// means nothing has arrived there yet.
+struct RingRecordHeader {
+    UINT32 Length;
+    UINT32 Flags;
+};
+constexpr UINT32 RingMessage = 1;
+constexpr UINT32 RingWrap = 2;      // one line; the next record is at the start of the ring
+constexpr char RingValid = 1;
+constexpr ULONG MinRingSize = 1024;
+
+// Header, payload and valid byte, rounded up to whole lines.
+static UINT64 RingRecordSize(ULONG length, ULONG line) {
+    return (sizeof(RingRecordHeader) + length + 1 + line - 1) & ~UINT64(line - 1);
+}
+
+static UINT64* RingWord(char* p) {
+    return reinterpret_cast<UINT64*>(p);
+}
+
+HRESULT NDSessionBase::CreateRing(ULONG ringSize, ULONG feedbackBatch) {
+    if (m_pAdapter == nullptr || m_pRing != nullptr) return ND_INVALID_DEVICE_STATE;
+    if (ringSize < MinRingSize || (ringSize & (ringSize - 1)) != 0) return ND_INVALID_PARAMETER;
+
+    SIZE_T length = static_cast<SIZE_T>(ringSize) + RingLine;
+    m_pRing = static_cast<char*>(NDMemory::Allocate(length, m_Locality.NumaNode));
+    if (m_pRing == nullptr) return E_OUTOFMEMORY;
+    m_RingSize = ringSize;
+    HRESULT hr = RegisterRing(m_pRing, length, ND_MR_FLAG_ALLOW_LOCAL_WRITE | ND_MR_FLAG_ALLOW_REMOTE_WRITE, &m_pRingMr);
+    if (FAILED(hr)) {
+        ReleaseRing();
+        return hr;
+    }
+
+    // Held to a quarter of the ring, so a sender that finds it full always
+    // has most of it coming back.
+    m_RingFeedbackBatch = std::clamp<ULONG>(feedbackBatch != 0 ? feedbackBatch : ringSize / 4, RingLine, ringSize / 4);
+    m_RingHead = 0;
+    m_RingReported = 0;
+    m_RingStats = {};
+    return ND_SUCCESS;
+}
+
+NDHandshake NDSessionBase::RingHandshake() const {
+    if (m_pRing == nullptr) return MakeHandshake(nullptr, 0, 0);
+    return MakeHandshake(m_pRing, static_cast<UINT64>(m_RingSize) + RingLine, m_pRingMr->GetRemoteToken(), 0,
+        m_RingSize / 4 - RingLine);
+}
+
+HRESULT NDSessionBase::AttachRing(const NDHandshake& peer) {
+    if (m_pRing == nullptr || m_pRingOut != nullptr) return ND_INVALID_DEVICE_STATE;
+    if (peer.BufferLength < static_cast<UINT64>(MinRingSize) + RingLine || peer.BufferAddress % RingLine != 0) {
+        return ND_INVALID_PARAMETER;
+    }
+    UINT64 peerSize = peer.BufferLength - RingLine;
+    if (peerSize > UINT32_MAX || (peerSize & (peerSize - 1)) != 0) return ND_INVALID_PARAMETER;
+
+    SIZE_T length = static_cast<SIZE_T>(peer.BufferLength);
+    m_pRingOut = static_cast<char*>(NDMemory::Allocate(length, m_Locality.NumaNode));
+    if (m_pRingOut == nullptr) return E_OUTOFMEMORY;
+    HRESULT hr = RegisterRing(m_pRingOut, length, ND_MR_FLAG_ALLOW_LOCAL_WRITE, &m_pRingOutMr);
+    if (FAILED(hr)) {
+        NDMemory::Free(m_pRingOut, length);
+        m_pRingOut = nullptr;
+        return hr;
+    }
+
+    m_PeerRingSize = static_cast<ULONG>(peerSize);
+    m_PeerRingAddress = peer.BufferAddress;
+    m_PeerRingToken = peer.BufferToken;
+    m_RingTail = 0;
+    return ND_SUCCESS;
+}
+
+HRESULT NDSessionBase::RingSend(const void* pData, ULONG length) {
+    if (m_pRingOut == nullptr) return ND_INVALID_DEVICE_STATE;
+    if (length > RingMaxMessage()) return ND_INVALID_BUFFER_SIZE;
+
+    // A record never runs past the end of the ring; what is left there is skipped.
+    UINT64 recordSize = RingRecordSize(length, RingLine);
+    UINT64 offset = m_RingTail & (m_PeerRingSize - 1);
+    UINT64 skip = offset + recordSize > m_PeerRingSize ? m_PeerRingSize - offset : 0;
+    UINT64 peerHead = std::atomic_ref<UINT64>(*RingWord(m_pRing + m_RingSize)).load(std::memory_order_acquire);
+    if (m_RingTail + skip + recordSize - peerHead > m_PeerRingSize) {
+        m_RingStats.Full++;
+        return ND_INSUFFICIENT_RESOURCES;
+    }
+
+    if (skip != 0) {
+        RingRecordHeader wrap = { 0, RingWrap };
+        memcpy(m_pRingOut + offset, &wrap, sizeof(wrap));
+        m_pRingOut[offset + RingLine - 1] = RingValid;
+        HRESULT hr = WriteRing(offset, RingLine);
+        if (FAILED(hr)) return hr;
+        m_RingTail += skip;
+        offset = 0;
+    }
+
+    char* pRecord = m_pRingOut + offset;
+    RingRecordHeader header = { length, RingMessage };
+    memcpy(pRecord, &header, sizeof(header));
+    if (length > 0) memcpy(pRecord + sizeof(header), pData, length);
+    pRecord[recordSize - 1] = RingValid;
+    HRESULT hr = WriteRing(offset, static_cast<ULONG>(recordSize));
+    if (FAILED(hr)) return hr;
+
+    m_RingTail += recordSize;
+    m_RingStats.Sent++;
+    return ND_SUCCESS;
+}
+
+ULONG NDSessionBase::PollRing(const MessageHandler& onMessage) {
+    if (m_pRingOut == nullptr) return 0;
+    if (m_RingWritesOutstanding > 0) DispatchCompletions(CompletionWait::Poll);
+
+    ULONG delivered = 0;
+    for (;;) {
+        UINT64 offset = m_RingHead & (m_RingSize - 1);
+        char* pRecord = m_pRing + offset;
+        std::atomic_ref<UINT64> word(*RingWord(pRecord));
+        UINT64 first = word.load(std::memory_order_acquire);
+        if (first == 0) break;
+
+        RingRecordHeader header;
+        memcpy(&header, &first, sizeof(header));
+        UINT64 recordSize = (header.Flags & RingWrap) ? RingLine : RingRecordSize(header.Length, RingLine);
+        if (offset + recordSize > m_RingSize) break;
+        if (std::atomic_ref<char>(pRecord[recordSize - 1]).load(std::memory_order_acquire) != RingValid) break;
+        // The header is only certain once the valid byte shows the record is
+        // complete; one read while it was still landing starts over.
+        if (word.load(std::memory_order_relaxed) != first) continue;
+
+        if (header.Flags & RingWrap) {
+            memset(pRecord, 0, RingLine);
+            m_RingHead += m_RingSize - offset;
+            continue;
+        }
+        onMessage(pRecord + sizeof(header), header.Length);
+        // Zeroed, so the next lap's records are not mistaken for this one.
+        memset(pRecord, 0, static_cast<size_t>(recordSize));
+        m_RingHead += recordSize;
+        m_RingStats.Received++;
+        delivered++;
+    }
+
+    if (!m_RingFeedbackPending && m_RingHead - m_RingReported >= m_RingFeedbackBatch) WriteRingFeedback();
+    return delivered;
+}
+
+HRESULT NDSessionBase::RegisterRing(void* pBuf, SIZE_T length, ULONG flags, IND2MemoryRegion** ppMr) {
+    IND2MemoryRegion* pMr = nullptr;
+    HRESULT hr = m_pAdapter->CreateMemoryRegion(IID_IND2MemoryRegion, m_hAdapterFile, reinterpret_cast<void**>(&pMr));
+    if (FAILED(hr)) return hr;
+
+    hr = pMr->Register(pBuf, length, flags, &m_Ov);
+    if (hr == ND_PENDING) hr = pMr->GetOverlappedResult(&m_Ov, true);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to register " << length << " bytes for the ring: " << std::hex << hr << std::endl;
+        pMr->Release();
+        return hr;
+    }
+    *ppMr = pMr;
+    return ND_SUCCESS;
+}
+
+// Writes [offset, offset + length) of the mirror to the same place in the peer's ring.
+HRESULT NDSessionBase::WriteRing(UINT64 offset, ULONG length) {
+    ND2_SGE sge = { m_pRingOut + offset, length, m_pRingOutMr->GetLocalToken() };
+    HRESULT hr = Write(&sge, 1, m_PeerRingAddress + offset, m_PeerRingToken, 0, [this](const ND2_RESULT& result) {
+        m_RingWritesOutstanding--;
+        if (FAILED(result.Status) && result.Status != ND_CANCELED) {
+            std::cerr << "Ring write failed: " << std::hex << result.Status << std::endl;
+        }
+    });
+    if (SUCCEEDED(hr)) m_RingWritesOutstanding++;
+    return hr;
+}
+
+// Tells the peer how far we have consumed, into the line after its ring. One
+// head update is in flight at a time, so the line it is written from is free.
+void NDSessionBase::WriteRingFeedback() {
+    char* pLine = m_pRingOut + m_PeerRingSize;
+    memcpy(pLine, &m_RingHead, sizeof(m_RingHead));
+    ND2_SGE sge = { pLine, sizeof(m_RingHead), m_pRingOutMr->GetLocalToken() };
+    HRESULT hr = Write(&sge, 1, m_PeerRingAddress + m_PeerRingSize, m_PeerRingToken, 0, [this](const ND2_RESULT& result) {
+        m_RingWritesOutstanding--;
+        m_RingFeedbackPending = false;
+        if (FAILED(result.Status) && result.Status != ND_CANCELED) {
+            std::cerr << "Ring head update failed: " << std::hex << result.Status << std::endl;
+        }
+    });
+    // After the peer disconnects there is nobody left to tell.
+    if (FAILED(hr)) {
+        if (hr != ND_CONNECTION_INVALID) std::cerr << "Failed to write the ring head: " << std::hex << hr << std::endl;
+        return;
+    }
+    m_RingWritesOutstanding++;
+    m_RingFeedbackPending = true;
+    m_RingReported = m_RingHead;
+    m_RingStats.FeedbackWrites++;
+}
+
+void NDSessionBase::ReleaseRing() {
+    for (IND2MemoryRegion** ppMr : { &m_pRingMr, &m_pRingOutMr }) {
+        if (*ppMr == nullptr) continue;
+        if ((*ppMr)->Deregister(&m_Ov) == ND_PENDING) (*ppMr)->GetOverlappedResult(&m_Ov, true);
+        SafeRelease(*ppMr);
+    }
+    NDMemory::Free(m_pRing, static_cast<SIZE_T>(m_RingSize) + RingLine);
+    NDMemory::Free(m_pRingOut, static_cast<SIZE_T>(m_PeerRingSize) + RingLine);
+    m_pRing = nullptr;
+    m_pRingOut = nullptr;
+}
+
 void NDSessionBase::WaitForEventNotification(ULONG notifyFlag) {
     HRESULT hr = m_pCq->Notify(notifyFlag, &m_Ov);
     if (hr == ND_PENDING) {
@@ -253,26 +1203,138 @@ void NDSessionBase::WaitForEventNotification(ULONG notifyFlag) {
     }
 }
 
-ND2_RESULT NDSessionBase::WaitForCompletion(ULONG notifyFlag, bool bBlocking) {
-    ND2_RESULT ndRes;
+// Hands out completions left over from an earlier batch before asking the CQ,
+// so results reach callers in the order the provider reported them.
+ULONG NDSessionBase::HarvestCompletions(std::span<ND2_RESULT> results) {
+    ULONG n = 0;
+    while (n < results.size() && m_HarvestedCount > 0) {
+        results[n++] = m_Harvested[m_HarvestedHead];
+        m_HarvestedHead = (m_HarvestedHead + 1) % CompletionBatch;
+        m_HarvestedCount--;
+    }
+    if (n < results.size()) {
+        n += m_pCq->GetResults(results.data() + n, static_cast<ULONG>(results.size() - n));
+    }
+    return n;
+}
 
-    ULONG numRes = m_pCq->GetResults(&ndRes, 1);
+ULONG NDSessionBase::WaitForCompletions(std::span<ND2_RESULT> results, CompletionWait mode, ULONG notifyFlag) {
+    if (results.empty()) return 0;
 
-    if (numRes == 1) {
-        return ndRes;
-    }
-    else if (numRes > 1) abort();
+    ULONG n = HarvestCompletions(results);
+    if (n > 0 || mode == CompletionWait::Poll) return n;
+
+    // Spinning only pays off when the peer can make progress on another core.
+    static const bool canSpin = std::thread::hardware_concurrency() > 1;
+    if (mode == CompletionWait::SpinThenBlock && canSpin) return SpinForCompletions(results, notifyFlag);
+
+    m_EventWaits++;
+    do {
+        WaitForEventNotification(notifyFlag);
+        n = m_pCq->GetResults(results.data(), static_cast<ULONG>(results.size()));
+    } while (n == 0);
+
+    return n;
+}
 
-    if (!bBlocking) {
-        ndRes.Status = ND_PENDING;
-        return ndRes;
+// Busy-polls with exponential pause backoff for the current budget, then arms
+// the CQ. Either way the time waited feeds the next budget.
+ULONG NDSessionBase::SpinForCompletions(std::span<ND2_RESULT> results, ULONG notifyFlag) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + m_SpinBudget;
+    ULONG pauses = 1;
+    ULONG n;
+
+    for (;;) {
+        n = m_pCq->GetResults(results.data(), static_cast<ULONG>(results.size()));
+        if (n > 0) {
+            m_SpinHits++;
+            LearnWait(Clock::now() - start, true);
+            return n;
+        }
+        Clock::time_point now = Clock::now();
+        if (now >= deadline) break;
+        for (ULONG i = 0; i < pauses; i++) _mm_pause();
+        if (pauses < 64) pauses <<= 1;
     }
 
+    m_EventWaits++;
     do {
         WaitForEventNotification(notifyFlag);
-    } while (m_pCq->GetResults(&ndRes, 1) == 0);
+        n = m_pCq->GetResults(results.data(), static_cast<ULONG>(results.size()));
+    } while (n == 0);
+    LearnWait(Clock::now() - start, false);
+    return n;
+}
 
-    return ndRes;
+void NDSessionBase::LearnWait(std::chrono::nanoseconds waited, bool spinHit) {
+    // 1/8 weight for the newest sample, as TCP does for its RTT estimate.
+    m_AverageWait += (waited - m_AverageWait) / 8;
+    if (spinHit) {
+        // Spin twice the typical wait so most completions land inside the budget.
+        m_SpinBudget = std::clamp(m_AverageWait * 2, MinSpinBudget, MaxSpinBudget);
+    } else if (waited <= MaxSpinBudget) {
+        // A near miss: the completion came within what we are willing to spin,
+        // so move halfway toward the wait that would have caught it.
+        m_SpinBudget = std::clamp(m_SpinBudget + (waited - m_SpinBudget) / 2, MinSpinBudget, MaxSpinBudget);
+    } else {
+        // A wasted spin costs the whole budget, so back off quickly.
+        m_SpinBudget = std::max(MinSpinBudget, m_SpinBudget / 2);
+    }
+}
+
+bool NDSessionBase::PopHarvested(ND2_RESULT* pResult) {
+    if (m_HarvestedCount == 0) return false;
+    *pResult = m_Harvested[m_HarvestedHead];
+    m_HarvestedHead = (m_HarvestedHead + 1) % CompletionBatch;
+    m_HarvestedCount--;
+    return true;
+}
+
+// Puts back the result PopHarvested just returned.
+void NDSessionBase::UnpopHarvested(const ND2_RESULT& result) {
+    m_HarvestedHead = (m_HarvestedHead + CompletionBatch - 1) % CompletionBatch;
+    m_Harvested[m_HarvestedHead] = result;
+    m_HarvestedCount++;
+}
+
+ND2_RESULT NDSessionBase::WaitForCompletion(ULONG notifyFlag, bool bBlocking) {
+    ND2_RESULT ndRes;
+
+    for (;;) {
+        if (m_HarvestedCount == 0) {
+            // Refill the whole batch so the next callers are served without a provider call.
+            m_HarvestedHead = 0;
+            m_HarvestedCount = WaitForCompletions(m_Harvested, bBlocking ? m_BlockingWait : CompletionWait::Poll,
+                notifyFlag);
+            if (m_HarvestedCount == 0) {
+                ndRes.Status = ND_PENDING;
+                return ndRes;
+            }
+        }
+
+        PopHarvested(&ndRes);
+        if (!Dispatch(ndRes)) return ndRes;
+    }
+}
+
+ULONG NDSessionBase::DispatchCompletions(CompletionWait mode) {
+    if (m_HarvestedCount == 0) {
+        m_HarvestedHead = 0;
+        m_HarvestedCount = WaitForCompletions(m_Harvested, mode);
+    }
+
+    ULONG dispatched = 0;
+    ND2_RESULT ndRes;
+    while (PopHarvested(&ndRes)) {
+        if (!Dispatch(ndRes)) {
+            UnpopHarvested(ndRes);
+            break;
+        }
+        dispatched++;
+    }
+    return dispatched;
 }
 
 bool NDSessionBase::WaitForCompletionAndCheckContext(void *expectedContext, ULONG notifyFlag) {
@@ -316,6 +1378,36 @@ HRESULT NDSessionBase::Reject(const void *pPrivateData, DWORD cbPrivateData) {
     return hr;
 }
 
+NDHandshake NDSessionBase::MakeHandshake(const void* pBuf, UINT64 length, UINT32 token, ULONG receiveCredits,
+    ULONG maxMessageSize) {
+    NDHandshake handshake;
+    handshake.BufferAddress = reinterpret_cast<UINT64>(pBuf);
+    handshake.BufferLength = length;
+    handshake.BufferToken = token;
+    handshake.ReceiveCredits = receiveCredits;
+    handshake.MaxMessageSize = maxMessageSize;
+    return handshake;
+}
+
+HRESULT NDSessionBase::ReadHandshake(IND2Connector* pConnector, NDHandshake* pPeer) {
+    // Room for a newer peer's longer handshake; only the known prefix is read.
+    char data[128] = {};
+    ULONG cbData = sizeof(data);
+    HRESULT hr = pConnector->GetPrivateData(data, &cbData);
+    if (FAILED(hr) && hr != ND_BUFFER_OVERFLOW) return hr;
+
+    NDHandshake peer;
+    if (cbData < sizeof(peer)) return ND_INVALID_BUFFER_SIZE;
+    memcpy(&peer, data, sizeof(peer));
+    if (peer.Signature != NDHandshake::Magic) return ND_INVALID_BUFFER_SIZE;
+    if (peer.Version != NDHandshake::CurrentVersion) {
+        std::cerr << "Peer handshake version " << peer.Version << " is not supported." << std::endl;
+        return ND_NOT_SUPPORTED;
+    }
+    *pPeer = peer;
+    return ND_SUCCESS;
+}
+
 void NDSessionBase::ClearOPs() {
     FlushQP();
     while (true) {
@@ -324,9 +1416,26 @@ void NDSessionBase::ClearOPs() {
     }
 }
 
+// MARK: NDConnection
+NDConnection::~NDConnection() {
+    Disconnect();
+    SafeRelease(m_pQp);
+    SafeRelease(m_pConnector);
+    if (m_Ov.hEvent) CloseHandle(m_Ov.hEvent);
+}
+
+HRESULT NDConnection::Disconnect() {
+    if (!m_Connected) return ND_SUCCESS;
+    m_Connected = false;
+    HRESULT hr = m_pConnector->Disconnect(&m_Ov);
+    if (hr == ND_PENDING) hr = m_pConnector->GetOverlappedResult(&m_Ov, true);
+    return hr;
+}
+
 // MARK: NDSessionServerBase
 NDSessionServerBase::NDSessionServerBase() : m_pListen(nullptr) {}
 NDSessionServerBase::~NDSessionServerBase() {
+    StopAccepting();
     SafeRelease(m_pListen);
 }
 
@@ -335,7 +1444,7 @@ HRESULT NDSessionServerBase::CreateListener() {
     return hr;
 }
 
-HRESULT NDSessionServerBase::Listen(const char* localAddr) {
+HRESULT NDSessionServerBase::Listen(const char* localAddr, ULONG backlog) {
     struct sockaddr_in addr = { 0 };
     int len = sizeof(addr);
     WSAStringToAddress(const_cast<char*>(localAddr), AF_INET, nullptr, reinterpret_cast<struct sockaddr*>(&addr), &len);
@@ -345,15 +1454,20 @@ HRESULT NDSessionServerBase::Listen(const char* localAddr) {
         std::cerr << "Failed to bind listener: " << std::hex << hr << std::endl;
         return hr;
     }
-    hr = m_pListen->Listen(1);
+    hr = m_pListen->Listen(backlog);
     if (FAILED(hr)) {
         std::cerr << "Failed to start listening: " << std::hex << hr << std::endl;
         return hr;
     }
 
+    m_ListenBacklog = backlog;
     return hr;
 }
 
+HRESULT NDSessionServerBase::Listen(const char* localAddr, const AcceptOptions& options) {
+    return Listen(localAddr, options.Backlog);
+}
+
 HRESULT NDSessionServerBase::GetConnectionRequest() {
     HRESULT hr = m_pListen->GetConnectionRequest(m_pConnector, &m_Ov);
     if (hr == ND_PENDING) {
@@ -371,13 +1485,222 @@ HRESULT NDSessionServerBase::Accept(DWORD inboundReadLimit, DWORD outboundReadLi
     return hr;
 }
 
+HRESULT NDSessionServerBase::GetConnectionRequest(NDHandshake* pPeer) {
+    HRESULT hr = GetConnectionRequest();
+    if (FAILED(hr)) return hr;
+
+    hr = ReadHandshake(m_pConnector, pPeer);
+    if (FAILED(hr)) {
+        std::cerr << "Rejecting a connection request without a valid handshake: " << std::hex << hr << std::endl;
+        Reject(nullptr, 0);
+    }
+    return hr;
+}
+
+HRESULT NDSessionServerBase::Accept(DWORD inboundReadLimit, DWORD outboundReadLimit, const NDHandshake& local) {
+    return Accept(inboundReadLimit, outboundReadLimit, &local, sizeof(local));
+}
+
+NDTask<HRESULT> NDSessionServerBase::GetConnectionRequestAsync() {
+    co_return co_await NDOverlappedRequest(m_pLoop, m_pListen, [this](OVERLAPPED* pOv) {
+        return m_pListen->GetConnectionRequest(m_pConnector, pOv);
+    });
+}
+
+NDTask<HRESULT> NDSessionServerBase::AcceptAsync(DWORD inboundReadLimit, DWORD outboundReadLimit, const void *pPrivateData,
+    DWORD cbPrivateData) {
+    co_return co_await NDOverlappedRequest(m_pLoop, m_pConnector, [&](OVERLAPPED* pOv) {
+        return m_pConnector->Accept(m_pQp, inboundReadLimit, outboundReadLimit, pPrivateData, cbPrivateData, pOv);
+    });
+}
+
+NDTask<HRESULT> NDSessionServerBase::GetConnectionRequestAsync(NDHandshake* pPeer) {
+    HRESULT hr = co_await GetConnectionRequestAsync();
+    if (FAILED(hr)) co_return hr;
+
+    hr = ReadHandshake(m_pConnector, pPeer);
+    if (FAILED(hr)) {
+        std::cerr << "Rejecting a connection request without a valid handshake: " << std::hex << hr << std::endl;
+        Reject(nullptr, 0);
+    }
+    co_return hr;
+}
+
+NDTask<HRESULT> NDSessionServerBase::AcceptAsync(DWORD inboundReadLimit, DWORD outboundReadLimit, NDHandshake local) {
+    co_return co_await AcceptAsync(inboundReadLimit, outboundReadLimit, &local, sizeof(local));
+}
+
+HRESULT NDSessionServerBase::AcceptStripes(DWORD inboundReadLimit, DWORD outboundReadLimit) {
+    for (StripeLane& lane : m_Stripes) {
+        HRESULT hr = m_pListen->GetConnectionRequest(lane.pConnector, &m_Ov);
+        if (hr == ND_PENDING) hr = m_pListen->GetOverlappedResult(&m_Ov, true);
+        if (SUCCEEDED(hr)) {
+            hr = lane.pConnector->Accept(lane.pQp, inboundReadLimit, outboundReadLimit, nullptr, 0, &m_Ov);
+            if (hr == ND_PENDING) hr = lane.pConnector->GetOverlappedResult(&m_Ov, true);
+        }
+        if (FAILED(hr)) {
+            std::cerr << "Failed to accept stripe lane: " << std::hex << hr << std::endl;
+            DisconnectStripes();
+            return hr;
+        }
+        lane.Connected = true;
+    }
+    return ND_SUCCESS;
+}
+
+HRESULT NDSessionServerBase::StartAccepting(const AcceptOptions& options, ConnectionHandler onConnection) {
+    if (m_pListen == nullptr || m_pCq == nullptr || !m_AcceptSlots.empty()) return ND_INVALID_DEVICE_STATE;
+    if (options.Backlog == 0 || !onConnection) return ND_INVALID_PARAMETER;
+    if (options.Backlog > m_ListenBacklog) {
+        std::cerr << "Listening with a backlog of " << m_ListenBacklog << " for " << options.Backlog << " connectors." << std::endl;
+        return ND_INVALID_PARAMETER;
+    }
+
+    m_hAcceptEvent = CreateEvent(nullptr, false, false, nullptr);
+    if (m_hAcceptEvent == nullptr) return E_OUTOFMEMORY;
+
+    m_AcceptOptions = options;
+    m_AcceptOptions.InlineDataSize = ResolveInlineSize(options.InlineDataSize);
+    m_OnConnection = std::move(onConnection);
+    SetInlineThreshold(m_AcceptOptions.InlineDataSize);
+
+    // Slots never move once their OVERLAPPEDs are posted.
+    m_AcceptSlots = std::vector<AcceptSlot>(options.Backlog);
+    for (AcceptSlot& slot : m_AcceptSlots) {
+        slot.Ov.hEvent = m_hAcceptEvent;
+        HRESULT hr = PrepareAcceptSlot(slot);
+        if (FAILED(hr)) {
+            StopAccepting();
+            return hr;
+        }
+    }
+    return ND_SUCCESS;
+}
+
+// Replaces the slot's connection with a fresh connector and QP and queues it
+// for the next connection request. Leaves the slot empty and marked for a
+// retry on failure.
+HRESULT NDSessionServerBase::PrepareAcceptSlot(AcceptSlot& slot) {
+    slot.pConnection.reset();
+    slot.Accepting = false;
+    slot.Retry = true;
+
+    std::unique_ptr<NDConnection> pConnection(new NDConnection());
+    pConnection->m_Ov.hEvent = CreateEvent(nullptr, false, false, nullptr);
+    if (pConnection->m_Ov.hEvent == nullptr) return E_OUTOFMEMORY;
+
+    const AcceptOptions& options = m_AcceptOptions;
+    HRESULT hr = m_pAdapter->CreateConnector(IID_IND2Connector, m_hAdapterFile, reinterpret_cast<void**>(&pConnection->m_pConnector));
+    if (SUCCEEDED(hr) && m_pSrq != nullptr) {
+        hr = m_pAdapter->CreateQueuePairWithSrq(IID_IND2QueuePair, m_pCq, m_pCq, m_pSrq, pConnection.get(), options.InitiatorDepth,
+            options.nSge, options.InlineDataSize, reinterpret_cast<void**>(&pConnection->m_pQp));
+    } else if (SUCCEEDED(hr)) {
+        hr = m_pAdapter->CreateQueuePair(IID_IND2QueuePair, m_pCq, m_pCq, pConnection.get(), options.ReceiveDepth,
+            options.InitiatorDepth, options.nSge, options.nSge, options.InlineDataSize, reinterpret_cast<void**>(&pConnection->m_pQp));
+    }
+    if (FAILED(hr)) {
+        std::cerr << "Failed to prepare a connector for accepting: " << std::hex << hr << std::endl;
+        return hr;
+    }
+
+    hr = m_pListen->GetConnectionRequest(pConnection->m_pConnector, &slot.Ov);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to wait for a connection request: " << std::hex << hr << std::endl;
+        return hr;
+    }
+    slot.pConnection = std::move(pConnection);
+    slot.Retry = false;
+    return ND_SUCCESS;
+}
+
+ULONG NDSessionServerBase::AdvanceAcceptSlot(AcceptSlot& slot) {
+    if (slot.Retry && FAILED(PrepareAcceptSlot(slot))) return 0;
+    while (slot.pConnection) {
+        NDConnection& connection = *slot.pConnection;
+        HRESULT hr = slot.Accepting ? connection.m_pConnector->GetOverlappedResult(&slot.Ov, false)
+            : m_pListen->GetOverlappedResult(&slot.Ov, false);
+        if (hr == ND_PENDING) return 0;
+
+        if (SUCCEEDED(hr) && !slot.Accepting) {
+            const std::optional<NDHandshake>& handshake = m_AcceptOptions.Handshake;
+            if (handshake) {
+                hr = ReadHandshake(connection.m_pConnector, &connection.m_PeerHandshake);
+                if (FAILED(hr)) connection.m_pConnector->Reject(nullptr, 0);
+            }
+            if (SUCCEEDED(hr)) {
+                slot.Accepting = true;
+                hr = connection.m_pConnector->Accept(connection.m_pQp, m_AcceptOptions.InboundReadLimit,
+                    m_AcceptOptions.OutboundReadLimit, handshake ? &*handshake : nullptr,
+                    handshake ? sizeof(NDHandshake) : 0, &slot.Ov);
+                if (SUCCEEDED(hr)) continue;
+            }
+        }
+
+        if (FAILED(hr)) {
+            // The listener is gone; nothing more will arrive.
+            if (hr == ND_CANCELED) {
+                slot.pConnection.reset();
+                slot.Retry = false;
+                return 0;
+            }
+            // A client that went away mid-handshake costs only its connector.
+            std::cerr << "Failed to accept a connection: " << std::hex << hr << std::endl;
+            PrepareAcceptSlot(slot);
+            continue;
+        }
+
+        connection.m_Connected = true;
+        ULONG cbPeerAddr = sizeof(connection.m_PeerAddr);
+        connection.m_pConnector->GetPeerAddress(reinterpret_cast<sockaddr*>(&connection.m_PeerAddr), &cbPeerAddr);
+
+        std::unique_ptr<NDConnection> pConnection = std::move(slot.pConnection);
+        PrepareAcceptSlot(slot);
+        m_OnConnection(std::move(pConnection));
+        return 1;
+    }
+    return 0;
+}
+
+ULONG NDSessionServerBase::DispatchAccepts(CompletionWait mode) {
+    for (;;) {
+        ULONG accepted = 0;
+        bool waiting = false;
+        for (AcceptSlot& slot : m_AcceptSlots) {
+            accepted += AdvanceAcceptSlot(slot);
+            waiting = waiting || slot.pConnection != nullptr;
+        }
+        if (accepted != 0 || mode == CompletionWait::Poll || !waiting) return accepted;
+        WaitForSingleObject(m_hAcceptEvent, INFINITE);
+    }
+}
+
+void NDSessionServerBase::StopAccepting() {
+    if (m_AcceptSlots.empty()) return;
+
+    m_pListen->CancelOverlappedRequests();
+    for (AcceptSlot& slot : m_AcceptSlots) {
+        if (!slot.pConnection) continue;
+        if (slot.Accepting) {
+            slot.pConnection->m_pConnector->CancelOverlappedRequests();
+            slot.pConnection->m_pConnector->GetOverlappedResult(&slot.Ov, true);
+        } else {
+            m_pListen->GetOverlappedResult(&slot.Ov, true);
+        }
+    }
+    m_AcceptSlots.clear();
+    m_OnConnection = nullptr;
+    CloseHandle(m_hAcceptEvent);
+    m_hAcceptEvent = nullptr;
+}
+
 // MARK: NDSessionClientBase
 
-HRESULT NDSessionClientBase::Connect(const char* localAddr, const char* remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit, const void *pPrivateData, DWORD cbPrivateData) {
+HRESULT NDSessionClientBase::Connect(const char* localAddr, const char* remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit, const void *pPrivateData, DWORD cbPrivateData,
+    USHORT localPort) {
     struct sockaddr_in local = { 0 };
     int len = sizeof(local);
     WSAStringToAddress(const_cast<char*>(localAddr), AF_INET, nullptr, reinterpret_cast<struct sockaddr*>(&local), &len);
-    local.sin_port = htons(54322);
+    local.sin_port = htons(localPort);
 
 
     struct sockaddr_in remote = { 0 };
@@ -409,10 +1732,104 @@ HRESULT NDSessionClientBase::Connect(const char* localAddr, const char* remoteAd
     return hr;
 }
 
+HRESULT NDSessionClientBase::Connect(const char* localAddr, const char* remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit,
+    const NDHandshake& local, NDHandshake* pPeer, USHORT localPort) {
+    HRESULT hr = Connect(localAddr, remoteAddr, inboundReadLimit, outboundReadLimit, &local, sizeof(local), localPort);
+    if (FAILED(hr)) return hr;
+
+    hr = ReadHandshake(m_pConnector, pPeer);
+    if (FAILED(hr)) {
+        std::cerr << "Server did not answer with a valid handshake: " << std::hex << hr << std::endl;
+        // The server has already accepted; close the connection instead of leaving it half-open.
+        HRESULT hrDisconnect = m_pConnector->Disconnect(&m_Ov);
+        if (hrDisconnect == ND_PENDING) m_pConnector->GetOverlappedResult(&m_Ov, true);
+    }
+    return hr;
+}
+
 HRESULT NDSessionClientBase::CompleteConnect() {
     HRESULT hr = m_pConnector->CompleteConnect(&m_Ov);
     if (hr == ND_PENDING) {
         hr = m_pConnector->GetOverlappedResult(&m_Ov, true);
     }
     return hr;
-}
\ No newline at end of file
+}
+
+NDTask<HRESULT> NDSessionClientBase::ConnectAsync(const char* localAddr, const char* remoteAddr, DWORD inboundReadLimit,
+    DWORD outboundReadLimit, const void *pPrivateData, DWORD cbPrivateData, USHORT localPort) {
+    struct sockaddr_in local = { 0 };
+    int len = sizeof(local);
+    WSAStringToAddress(const_cast<char*>(localAddr), AF_INET, nullptr, reinterpret_cast<struct sockaddr*>(&local), &len);
+    local.sin_port = htons(localPort);
+
+    struct sockaddr_in remote = { 0 };
+    len = sizeof(remote);
+    WSAStringToAddress(const_cast<char*>(remoteAddr), AF_INET, nullptr, reinterpret_cast<struct sockaddr*>(&remote), &len);
+
+    // Binding a connector never waits.
+    HRESULT hr = m_pConnector->Bind(reinterpret_cast<const sockaddr*>(&local), sizeof(local));
+    if (FAILED(hr)) {
+        std::cerr << "Failed to bind connector: " << std::hex << hr << std::endl;
+        co_return hr;
+    }
+
+    co_return co_await NDOverlappedRequest(m_pLoop, m_pConnector, [&](OVERLAPPED* pOv) {
+        return m_pConnector->Connect(m_pQp, reinterpret_cast<const sockaddr*>(&remote), sizeof(remote), inboundReadLimit,
+            outboundReadLimit, pPrivateData, cbPrivateData, pOv);
+    });
+}
+
+NDTask<HRESULT> NDSessionClientBase::ConnectAsync(const char* localAddr, const char* remoteAddr, DWORD inboundReadLimit,
+    DWORD outboundReadLimit, NDHandshake local, NDHandshake* pPeer, USHORT localPort) {
+    HRESULT hr = co_await ConnectAsync(localAddr, remoteAddr, inboundReadLimit, outboundReadLimit, &local, sizeof(local), localPort);
+    if (FAILED(hr)) co_return hr;
+
+    hr = ReadHandshake(m_pConnector, pPeer);
+    if (FAILED(hr)) {
+        std::cerr << "Server did not answer with a valid handshake: " << std::hex << hr << std::endl;
+        // The server has already accepted; close the connection instead of leaving it half-open.
+        co_await NDOverlappedRequest(m_pLoop, m_pConnector, [this](OVERLAPPED* pOv) {
+            return m_pConnector->Disconnect(pOv);
+        });
+    }
+    co_return hr;
+}
+
+NDTask<HRESULT> NDSessionClientBase::CompleteConnectAsync() {
+    co_return co_await NDOverlappedRequest(m_pLoop, m_pConnector, [this](OVERLAPPED* pOv) {
+        return m_pConnector->CompleteConnect(pOv);
+    });
+}
+
+HRESULT NDSessionClientBase::ConnectStripes(const char* localAddr, const char* remoteAddr, DWORD inboundReadLimit, DWORD outboundReadLimit) {
+    struct sockaddr_in local = { 0 };
+    int len = sizeof(local);
+    WSAStringToAddress(const_cast<char*>(localAddr), AF_INET, nullptr, reinterpret_cast<struct sockaddr*>(&local), &len);
+    local.sin_port = 0;
+
+    struct sockaddr_in remote = { 0 };
+    len = sizeof(remote);
+    WSAStringToAddress(const_cast<char*>(remoteAddr), AF_INET, nullptr, reinterpret_cast<struct sockaddr*>(&remote), &len);
+
+    for (StripeLane& lane : m_Stripes) {
+        HRESULT hr = lane.pConnector->Bind(reinterpret_cast<const sockaddr*>(&local), sizeof(local));
+        if (hr == ND_PENDING) hr = lane.pConnector->GetOverlappedResult(&m_Ov, true);
+        if (SUCCEEDED(hr)) {
+            hr = lane.pConnector->Connect(lane.pQp, reinterpret_cast<const sockaddr*>(&remote), sizeof(remote),
+                inboundReadLimit, outboundReadLimit, nullptr, 0, &m_Ov);
+            if (hr == ND_PENDING) hr = lane.pConnector->GetOverlappedResult(&m_Ov, true);
+            // The server has accepted this lane, so it must be disconnected too.
+            lane.Connected = SUCCEEDED(hr);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = lane.pConnector->CompleteConnect(&m_Ov);
+            if (hr == ND_PENDING) hr = lane.pConnector->GetOverlappedResult(&m_Ov, true);
+        }
+        if (FAILED(hr)) {
+            std::cerr << "Failed to connect stripe lane: " << std::hex << hr << std::endl;
+            DisconnectStripes();
+            return hr;
+        }
+    }
+    return ND_SUCCESS;
+}
@@ -0,0 +1,532 @@
+#include "NDShard.hpp"
+#include <algorithm>
+#include <iostream>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+template<typename T>
+static void SafeRelease(T*& p) {
+    if (p != nullptr) {
+        p->Release();
+        p = nullptr;
+    }
+}
+
+static bool PinCurrentThread(ULONG core) {
+    #ifdef _WIN32
+    if (core >= sizeof(DWORD_PTR) * 8) return false;
+    return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << core) != 0;
+    #else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    #endif
+}
+
+// MARK: Acceptor
+// Owns the listener, on an adapter of its own, and keeps Backlog connectors
+// waiting on it, each created on the adapter of the shard it is meant for.
+// Each request is only read and handed over; that shard accepts it.
+class NDShardedServer::Acceptor : public NDSessionServerBase {
+    public:
+    explicit Acceptor(NDShardedServer& server) : m_Server(server), m_Waiting(server.ShardCount()) {}
+    ~Acceptor() {
+        if (m_hEvent) CloseHandle(m_hEvent);
+    }
+
+    HRESULT Setup(char* localAddr, USHORT port, ULONG backlog) {
+        if (!Initialize(localAddr)) return ND_INVALID_ADDRESS;
+        HRESULT hr = CreateListener();
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create listener: " << std::hex << hr << std::endl;
+            return hr;
+        }
+
+        char fullAddress[INET_ADDRSTRLEN + 6];
+        sprintf_s(fullAddress, "%s:%u", localAddr, port);
+        hr = Listen(fullAddress, backlog);
+        if (FAILED(hr)) return hr;
+
+        m_hEvent = CreateEvent(nullptr, false, false, nullptr);
+        if (m_hEvent == nullptr) return E_OUTOFMEMORY;
+
+        // Slots never move once their OVERLAPPEDs are posted.
+        m_Slots = std::vector<Slot>(backlog);
+        for (Slot& slot : m_Slots) {
+            slot.Ov.hEvent = m_hEvent;
+            hr = Prepare(slot);
+            if (FAILED(hr)) {
+                Shutdown();
+                return hr;
+            }
+        }
+        return ND_SUCCESS;
+    }
+
+    void Run() {
+        while (!m_Server.Stopping()) {
+            WaitForSingleObject(m_hEvent, INFINITE);
+            for (Slot& slot : m_Slots) {
+                if (slot.pConnector != nullptr) Advance(slot);
+            }
+        }
+        Shutdown();
+    }
+
+    void Wake() {
+        SetEvent(m_hEvent);
+    }
+
+    private:
+    struct Slot {
+        IND2Connector* pConnector = nullptr;
+        ULONG Shard = 0;        // whose adapter pConnector was created on
+        OVERLAPPED Ov = {};     // signals m_hEvent
+    };
+
+    // The shard with the least load, counting the requests its waiting
+    // connectors will bring.
+    ULONG PickShard() const {
+        ULONG best = 0;
+        for (ULONG i = 1; i < m_Server.ShardCount(); i++) {
+            if (m_Server.Shard(i).Load() + m_Waiting[i] < m_Server.Shard(best).Load() + m_Waiting[best]) best = i;
+        }
+        return best;
+    }
+
+    HRESULT Prepare(Slot& slot) {
+        slot.Shard = PickShard();
+        NDShard& shard = m_Server.Shard(slot.Shard);
+        HRESULT hr = shard.m_pAdapter->CreateConnector(IID_IND2Connector, shard.m_hAdapterFile, reinterpret_cast<void**>(&slot.pConnector));
+        if (SUCCEEDED(hr)) hr = m_pListen->GetConnectionRequest(slot.pConnector, &slot.Ov);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to wait for a connection request: " << std::hex << hr << std::endl;
+            SafeRelease(slot.pConnector);
+            return hr;
+        }
+        m_Waiting[slot.Shard]++;
+        return hr;
+    }
+
+    void Advance(Slot& slot) {
+        HRESULT hr = m_pListen->GetOverlappedResult(&slot.Ov, false);
+        if (hr == ND_PENDING) return;
+
+        m_Waiting[slot.Shard]--;
+        // The listener is gone; nothing more will arrive.
+        if (hr == ND_CANCELED) {
+            SafeRelease(slot.pConnector);
+            return;
+        }
+
+        if (SUCCEEDED(hr)) {
+            NDHandshake peer;
+            if (m_Server.m_Options.Handshake) {
+                hr = ReadHandshake(slot.pConnector, &peer);
+                if (FAILED(hr)) std::cerr << "Rejecting a connection request without a valid handshake: " << std::hex << hr << std::endl;
+            }
+            if (SUCCEEDED(hr) && m_Server.Assign(slot.Shard, slot.pConnector, peer)) {
+                // The shard holds the connector now.
+                slot.pConnector = nullptr;
+            } else {
+                slot.pConnector->Reject(nullptr, 0);
+            }
+        } else {
+            std::cerr << "Failed to get a connection request: " << std::hex << hr << std::endl;
+        }
+
+        SafeRelease(slot.pConnector);
+        Prepare(slot);
+    }
+
+    void Shutdown() {
+        if (m_pListen) m_pListen->CancelOverlappedRequests();
+        for (Slot& slot : m_Slots) {
+            if (slot.pConnector == nullptr) continue;
+            m_pListen->GetOverlappedResult(&slot.Ov, true);
+            SafeRelease(slot.pConnector);
+        }
+        m_Slots.clear();
+    }
+
+    NDShardedServer& m_Server;
+    std::vector<Slot> m_Slots;
+    std::vector<ULONG> m_Waiting;   // connectors waiting per shard
+    HANDLE m_hEvent = nullptr;
+};
+
+// MARK: NDShard
+NDShard::NDShard(NDShardedServer& server, ULONG index, ULONG shards) :
+    m_Server(server), m_Options(server.m_Options), m_Index(index), m_Handoffs(server.m_Options.QueueDepth)
+{
+    m_hEvent = CreateEvent(nullptr, false, false, nullptr);
+    m_Inbox.resize(shards);
+    for (ULONG i = 0; i < shards; i++) {
+        if (i != index) m_Inbox[i] = std::make_unique<NDSpscQueue<Task>>(m_Options.QueueDepth);
+    }
+}
+
+NDShard::~NDShard() {
+    if (m_Thread.joinable()) m_Thread.join();
+    if (m_hEvent) CloseHandle(m_hEvent);
+}
+
+void NDShard::ThreadMain(char* localAddr, std::promise<HRESULT>* pReady) {
+    if (m_Options.Pin) {
+        ULONG core = m_Index % NDShardedServer::CoreCount();
+        if (PinCurrentThread(core)) {
+            m_Core = static_cast<LONG>(core);
+        } else {
+            std::cerr << "Failed to pin shard " << m_Index << " to core " << core << std::endl;
+        }
+    }
+
+    HRESULT hr = Setup(localAddr);
+    pReady->set_value(hr);
+    if (FAILED(hr)) return;
+
+    Run();
+    Teardown();
+}
+
+// Runs on the shard's thread after pinning, so the memory it registers is
+// first touched there.
+HRESULT NDShard::Setup(char* localAddr) {
+    if (m_hEvent == nullptr) return E_OUTOFMEMORY;
+    if (!Initialize(localAddr)) return ND_INVALID_ADDRESS;
+
+    HRESULT hr = CreateCQ(m_Options.CqDepth);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to create a shard's CQ: " << std::hex << hr << std::endl;
+        return hr;
+    }
+    if (m_Options.SendBuffers != 0) {
+        const NDBufferPool::SizeClass classes[] = { { m_Options.MessageSize, m_Options.SendBuffers } };
+        hr = CreateBufferPool(ND_MR_FLAG_ALLOW_LOCAL_WRITE, classes);
+        if (FAILED(hr)) return hr;
+    }
+    hr = CreateSRQ(m_Options.ReceiveDepth, m_Options.MessageSize, m_Options.ReceiveDepth / 2,
+        [this](const ND2_RESULT& result, const NDBuffer& buffer) { OnReceive(result, buffer); });
+    if (FAILED(hr)) return hr;
+
+    m_InlineDataSize = ResolveInlineSize(AdapterInlineSize);
+    SetInlineThreshold(m_InlineDataSize);
+    m_NotifyOv.hEvent = m_hEvent;
+    return ND_SUCCESS;
+}
+
+void NDShard::Run() {
+    ULONG idle = 0;
+    ULONG sinceControl = 0;
+    while (!m_Server.Stopping()) {
+        ULONG work = DrainInbox() + DispatchCompletions(CompletionWait::Poll);
+        if (++sinceControl >= ControlInterval) {
+            sinceControl = 0;
+            work += AdvanceMembers();
+        }
+        if (m_ClosePending) ReapClosed();
+
+        if (work != 0) {
+            idle = 0;
+        } else if (++idle >= IdlePolls) {
+            WaitForWork();
+            idle = 0;
+            sinceControl = 0;
+            AdvanceMembers();
+        }
+    }
+}
+
+// Arms the CQ, raises m_Sleeping and checks every source once more before
+// waiting: a producer either sees the flag and sets the event, or pushed
+// early enough for the check to find its entry.
+void NDShard::WaitForWork() {
+    if (!m_Armed) {
+        HRESULT hr = m_pCq->Notify(ND_CQ_NOTIFY_ANY, &m_NotifyOv);
+        m_Armed = hr == ND_PENDING;
+        if (FAILED(hr)) std::cerr << "Failed to arm a shard's CQ: " << std::hex << hr << std::endl;
+    }
+
+    m_Sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool idle = !m_Server.Stopping() && m_Handoffs.Empty() && DispatchCompletions(CompletionWait::Poll) == 0;
+    for (const auto& pQueue : m_Inbox) idle = idle && (!pQueue || pQueue->Empty());
+    if (idle) {
+        m_Stats.Sleeps++;
+        WaitForSingleObject(m_hEvent, INFINITE);
+    }
+    m_Sleeping.store(false, std::memory_order_relaxed);
+
+    if (m_Armed && m_pCq->GetOverlappedResult(&m_NotifyOv, false) != ND_PENDING) m_Armed = false;
+}
+
+void NDShard::Wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_Sleeping.load(std::memory_order_relaxed)) SetEvent(m_hEvent);
+}
+
+bool NDShard::Post(ULONG target, Task&& task) {
+    if (target >= m_Server.ShardCount() || target == m_Index) return false;
+    NDShard& shard = m_Server.Shard(target);
+    if (!shard.m_Inbox[m_Index]->TryPush(std::move(task))) return false;
+    shard.Wake();
+    return true;
+}
+
+ULONG NDShard::DrainInbox() {
+    ULONG handled = 0;
+    Handoff handoff;
+    while (m_Handoffs.TryPop(&handoff)) {
+        Adopt(handoff);
+        handled++;
+    }
+
+    Task task;
+    for (const auto& pQueue : m_Inbox) {
+        if (!pQueue) continue;
+        while (pQueue->TryPop(&task)) {
+            task(*this);
+            m_Stats.Tasks++;
+            handled++;
+        }
+    }
+    return handled;
+}
+
+// Takes over the connector and accepts it onto a QP on this shard's CQ and SRQ.
+void NDShard::Adopt(const Handoff& handoff) {
+    auto pMember = std::make_unique<Member>();
+    pMember->pConnection.reset(new NDConnection());
+    pMember->Ov.hEvent = m_hEvent;
+    NDConnection& connection = *pMember->pConnection;
+    connection.m_pConnector = handoff.pConnector;
+    connection.m_PeerHandshake = handoff.Peer;
+
+    HRESULT hr = E_OUTOFMEMORY;
+    connection.m_Ov.hEvent = CreateEvent(nullptr, false, false, nullptr);
+    if (connection.m_Ov.hEvent != nullptr) {
+        hr = m_pAdapter->CreateQueuePairWithSrq(IID_IND2QueuePair, m_pCq, m_pCq, m_pSrq, &connection, m_Options.InitiatorDepth,
+            1, m_InlineDataSize, reinterpret_cast<void**>(&connection.m_pQp));
+    }
+    if (SUCCEEDED(hr)) {
+        const std::optional<NDHandshake>& handshake = m_Options.Handshake;
+        hr = connection.m_pConnector->Accept(connection.m_pQp, m_Options.InboundReadLimit, m_Options.OutboundReadLimit,
+            handshake ? &*handshake : nullptr, handshake ? sizeof(NDHandshake) : 0, &pMember->Ov);
+    }
+    if (FAILED(hr)) {
+        std::cerr << "Shard " << m_Index << " failed to accept a connection: " << std::hex << hr << std::dec << std::endl;
+        connection.m_pConnector->Reject(nullptr, 0);
+        m_Load.fetch_sub(1, std::memory_order_relaxed);
+        return;
+    }
+    m_Connections.push_back(std::move(pMember));
+}
+
+// Finishes accepts and notices disconnects. Backwards, so a handler that
+// closes a connection never makes it skip one.
+ULONG NDShard::AdvanceMembers() {
+    ULONG advanced = 0;
+    for (size_t i = m_Connections.size(); i-- > 0;) {
+        Member& member = *m_Connections[i];
+        if (member.Closing) continue;
+
+        NDConnection& connection = *member.pConnection;
+        HRESULT hr = connection.m_pConnector->GetOverlappedResult(&member.Ov, false);
+        if (hr == ND_PENDING) continue;
+        advanced++;
+
+        if (!member.Accepting || FAILED(hr)) {
+            if (member.Accepting) std::cerr << "Shard " << m_Index << " failed to accept a connection: " << std::hex << hr << std::dec << std::endl;
+            member.Closing = true;
+            m_ClosePending = true;
+            continue;
+        }
+
+        member.Accepting = false;
+        connection.m_Connected = true;
+        ULONG cbPeerAddr = sizeof(connection.m_PeerAddr);
+        connection.m_pConnector->GetPeerAddress(reinterpret_cast<sockaddr*>(&connection.m_PeerAddr), &cbPeerAddr);
+        m_Stats.Accepted++;
+
+        hr = connection.m_pConnector->NotifyDisconnect(&member.Ov);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to watch a connection for disconnects: " << std::hex << hr << std::endl;
+            member.Closing = true;
+            m_ClosePending = true;
+            continue;
+        }
+        if (m_Server.m_OnConnection) m_Server.m_OnConnection(*this, connection);
+    }
+    return advanced;
+}
+
+void NDShard::Close(NDConnection& connection) {
+    for (const auto& pMember : m_Connections) {
+        if (pMember->pConnection.get() != &connection) continue;
+        pMember->Closing = true;
+        m_ClosePending = true;
+        return;
+    }
+}
+
+void NDShard::ReapClosed() {
+    m_ClosePending = false;
+    for (size_t i = m_Connections.size(); i-- > 0;) {
+        if (i >= m_Connections.size() || !m_Connections[i]->Closing) continue;
+        std::unique_ptr<Member> pMember = std::move(m_Connections[i]);
+        m_Connections[i] = std::move(m_Connections.back());
+        m_Connections.pop_back();
+        Remove(*pMember);
+    }
+}
+
+// Once the QP is disconnected nothing new completes for it, and the CQ holds
+// at most CqDepth entries, so dispatching that many flushes out every one
+// still naming the connection.
+void NDShard::Remove(Member& member) {
+    NDConnection& connection = *member.pConnection;
+    if (connection.m_pConnector->GetOverlappedResult(&member.Ov, false) == ND_PENDING) {
+        connection.m_pConnector->CancelOverlappedRequests();
+        connection.m_pConnector->GetOverlappedResult(&member.Ov, true);
+    }
+
+    bool connected = connection.m_Connected;
+    connection.Disconnect();
+    if (connected) {
+        connection.m_pQp->Flush();
+        ULONG dispatched = 0;
+        ULONG n;
+        do {
+            n = DispatchCompletions(CompletionWait::Poll);
+            dispatched += n;
+        } while (n != 0 && dispatched < m_Options.CqDepth);
+
+        m_Stats.Closed++;
+        if (m_Server.m_OnClose) m_Server.m_OnClose(*this, connection);
+    }
+    member.pConnection.reset();
+    m_Load.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void NDShard::OnReceive(const ND2_RESULT& result, const NDBuffer& buffer) {
+    // Flushed receives belong to no connection.
+    NDConnection* pConnection = NDConnection::FromResult(result);
+    if (pConnection == nullptr) return;
+    if (SUCCEEDED(result.Status)) m_Stats.Messages++;
+    m_Server.m_OnMessage(*this, *pConnection, result, buffer);
+}
+
+// Hands back requests that never got accepted and closes every connection.
+void NDShard::Teardown() {
+    Handoff handoff;
+    while (m_Handoffs.TryPop(&handoff)) {
+        handoff.pConnector->Reject(nullptr, 0);
+        SafeRelease(handoff.pConnector);
+        m_Load.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    for (const auto& pMember : m_Connections) pMember->Closing = true;
+    ReapClosed();
+
+    if (m_Armed) {
+        m_pCq->CancelOverlappedRequests();
+        m_pCq->GetOverlappedResult(&m_NotifyOv, true);
+        m_Armed = false;
+    }
+}
+
+// MARK: NDShardedServer
+NDShardedServer::NDShardedServer() = default;
+
+NDShardedServer::~NDShardedServer() {
+    Stop();
+}
+
+ULONG NDShardedServer::CoreCount() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+HRESULT NDShardedServer::Start(char* localAddr, USHORT port, const NDShardOptions& options, NDShard::ConnectionHandler onConnection,
+    NDShard::MessageHandler onMessage, NDShard::ConnectionHandler onClose) {
+    if (m_Started) return ND_INVALID_DEVICE_STATE;
+    if (!onMessage || options.Backlog == 0 || options.QueueDepth == 0 || options.ReceiveDepth == 0 || options.MessageSize == 0) {
+        return ND_INVALID_PARAMETER;
+    }
+
+    m_Options = options;
+    if (m_Options.Shards == 0) m_Options.Shards = CoreCount();
+    m_OnConnection = std::move(onConnection);
+    m_OnMessage = std::move(onMessage);
+    m_OnClose = std::move(onClose);
+    m_Stopping.store(false, std::memory_order_release);
+    m_Rejected.store(0, std::memory_order_relaxed);
+
+    // Every shard exists before any thread starts, since they post to each other.
+    m_Shards.clear();
+    m_Started = true;
+    for (ULONG i = 0; i < m_Options.Shards; i++) {
+        m_Shards.push_back(std::unique_ptr<NDShard>(new NDShard(*this, i, m_Options.Shards)));
+    }
+    std::vector<std::promise<HRESULT>> ready(m_Options.Shards);
+    for (ULONG i = 0; i < m_Options.Shards; i++) {
+        NDShard* pShard = m_Shards[i].get();
+        std::promise<HRESULT>* pReady = &ready[i];
+        pShard->m_Thread = std::thread([pShard, localAddr, pReady] { pShard->ThreadMain(localAddr, pReady); });
+    }
+
+    HRESULT hr = ND_SUCCESS;
+    for (auto& promise : ready) {
+        HRESULT shardHr = promise.get_future().get();
+        if (SUCCEEDED(hr) && FAILED(shardHr)) hr = shardHr;
+    }
+
+    if (SUCCEEDED(hr)) {
+        m_pAcceptor = std::make_unique<Acceptor>(*this);
+        hr = m_pAcceptor->Setup(localAddr, port, m_Options.Backlog);
+    }
+    if (FAILED(hr)) {
+        std::cerr << "Failed to start the sharded server: " << std::hex << hr << std::endl;
+        Stop();
+        return hr;
+    }
+
+    m_AcceptorThread = std::thread([this] { m_pAcceptor->Run(); });
+    return ND_SUCCESS;
+}
+
+void NDShardedServer::Stop() {
+    if (!m_Started) return;
+
+    m_Stopping.store(true, std::memory_order_release);
+    if (m_AcceptorThread.joinable()) {
+        m_pAcceptor->Wake();
+        m_AcceptorThread.join();
+    }
+    for (const auto& pShard : m_Shards) {
+        SetEvent(pShard->m_hEvent);
+        if (pShard->m_Thread.joinable()) pShard->m_Thread.join();
+    }
+
+    // The acceptor has released its waiting connectors, and the shards the
+    // ones they were handed. They stay, idle, so their stats can still be read.
+    m_pAcceptor.reset();
+    m_Stopping.store(false, std::memory_order_release);
+    m_Started = false;
+}
+
+// The connector belongs to the shard's adapter, so no other shard can take
+// the request.
+bool NDShardedServer::Assign(ULONG index, IND2Connector* pConnector, const NDHandshake& peer) {
+    NDShard& shard = *m_Shards[index];
+    shard.m_Load.fetch_add(1, std::memory_order_relaxed);
+    if (shard.m_Handoffs.TryPush(NDShard::Handoff{ pConnector, peer })) {
+        shard.Wake();
+        return true;
+    }
+    shard.m_Load.fetch_sub(1, std::memory_order_relaxed);
+    m_Rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
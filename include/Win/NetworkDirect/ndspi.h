@@ -1340,4 +1340,10 @@ DECLARE_INTERFACE_(INDProvider, IUnknown)
 #define ND_LOCAL_LENGTH         ND_DATA_OVERRUN
 #define ND_INVALIDATION_ERROR   ND_INVALID_DEVICE_REQUEST
 
+#ifndef _WIN32
+// See the POSIX unknwn.h shim.
+#undef __in
+#undef __out
+#endif
+
 #endif // _NDSPI_H_